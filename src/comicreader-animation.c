@@ -0,0 +1,411 @@
+/* comicreader-animation.c
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "comicreader-animation.h"
+#include "comicreader-debug.h"
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <string.h>
+
+/* decoded frames kept ahead of the one shown */
+#define RING_SIZE 4
+/* browsers also slow down frames that claim to take no time at all */
+#define MIN_FRAME_DELAY_MS 20
+/* further behind than this, skip ahead rather than rush to catch up */
+#define MAX_LAG (250 * 1000)
+
+struct Frame {
+	GdkTexture *texture;
+	/* milliseconds, -1 for the last frame of an animation that ends */
+	int delay;
+};
+
+/* Decodes the next frame, and is pushed again while there's room in the
+ * ring.  There's only ever one, so frames are decoded in order. */
+struct FrameJob {
+	struct ComicReaderDecodeTask task;
+	ComicReaderAnimation *self;
+};
+
+struct _ComicReaderAnimation {
+	GObject parent_instance;
+
+	GBytes *bytes;
+	GdkTexture *current;
+	int width;
+	int height;
+	/* when to show the next frame, 0 as soon as one is decoded */
+	gint64 next_frame_time;
+
+	struct ComicReaderDecodeScheduler *scheduler;
+	struct FrameJob job;
+	/* only used by the job, NULL until it first runs */
+	GdkPixbufAnimation *animation;
+	GdkPixbufAnimationIter *iter;
+	/* the animation's own clock, which only moves on once there's room in
+	 * the ring for another frame */
+	gint64 time;
+
+	GMutex lock;
+	GCond cond;
+	struct Frame ring[RING_SIZE];
+	size_t first_frame;
+	size_t num_frames;
+	/* the job is queued or running */
+	bool stepping;
+	/* the last frame is in the ring, or the animation can't be played */
+	bool done;
+	bool quit;
+};
+
+static void comicreader_animation_paintable_init(GdkPaintableInterface *iface);
+
+G_DEFINE_FINAL_TYPE_WITH_CODE(
+	ComicReaderAnimation,
+	comicreader_animation,
+	G_TYPE_OBJECT,
+	G_IMPLEMENT_INTERFACE(GDK_TYPE_PAINTABLE, comicreader_animation_paintable_init))
+
+static void comicreader_animation_snapshot(
+	GdkPaintable *paintable,
+	GdkSnapshot *snapshot,
+	double width,
+	double height);
+static int comicreader_animation_get_intrinsic_width(GdkPaintable *paintable);
+static int comicreader_animation_get_intrinsic_height(GdkPaintable *paintable);
+static void comicreader_animation_dispose(GObject *object);
+static void comicreader_animation_finalize(GObject *object);
+static void push_job(ComicReaderAnimation *self);
+static void step_frame(struct ComicReaderDecodeTask *task);
+static bool start_animation(ComicReaderAnimation *self);
+static bool is_animated_gif(const guchar *data, gsize size);
+static bool is_animated_png(const guchar *data, gsize size);
+static bool is_animated_webp(const guchar *data, gsize size);
+static guint32 read_be32(const guchar *data);
+
+static void comicreader_animation_class_init(ComicReaderAnimationClass *klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS(klass);
+	object_class->dispose = comicreader_animation_dispose;
+	object_class->finalize = comicreader_animation_finalize;
+}
+
+static void comicreader_animation_paintable_init(GdkPaintableInterface *iface)
+{
+	iface->snapshot = comicreader_animation_snapshot;
+	iface->get_intrinsic_width = comicreader_animation_get_intrinsic_width;
+	iface->get_intrinsic_height = comicreader_animation_get_intrinsic_height;
+}
+
+static void comicreader_animation_init(ComicReaderAnimation *self)
+{
+	debug_init("ComicReaderAnimation", self);
+	g_mutex_init(&self->lock);
+	g_cond_init(&self->cond);
+}
+
+ComicReaderAnimation *comicreader_animation_new(
+	GBytes *bytes,
+	GdkTexture *first_frame,
+	struct ComicReaderDecodeScheduler *scheduler)
+{
+	ComicReaderAnimation *self = g_object_new(COMICREADER_TYPE_ANIMATION, NULL);
+
+	self->bytes = g_bytes_ref(bytes);
+	self->current = g_object_ref(first_frame);
+	self->width = gdk_texture_get_width(first_frame);
+	self->height = gdk_texture_get_height(first_frame);
+	self->scheduler = scheduler;
+	self->job.task.run = step_frame;
+	self->job.task.owner = self;
+	self->job.self = self;
+
+	g_mutex_lock(&self->lock);
+	push_job(self);
+	g_mutex_unlock(&self->lock);
+
+	return self;
+}
+
+bool comicreader_animation_sniff(GBytes *bytes)
+{
+	gsize size;
+	const guchar *data = g_bytes_get_data(bytes, &size);
+
+	return is_animated_gif(data, size) || is_animated_png(data, size) ||
+	       is_animated_webp(data, size);
+}
+
+bool comicreader_animation_advance(ComicReaderAnimation *self, gint64 frame_time)
+{
+	if (self->next_frame_time == G_MAXINT64)
+		return false;
+	if (frame_time < self->next_frame_time)
+		return true;
+
+	g_mutex_lock(&self->lock);
+	if (self->num_frames == 0) {
+		/* the frame is late, so it's wanted like the page on screen */
+		if (self->stepping)
+			comicreader_decode_scheduler_promote(self->scheduler, &self->job.task);
+		g_mutex_unlock(&self->lock);
+		return true;
+	}
+	struct Frame frame = self->ring[self->first_frame];
+	self->first_frame = (self->first_frame + 1) % RING_SIZE;
+	--self->num_frames;
+	if (!self->stepping && !self->done)
+		push_job(self);
+	g_mutex_unlock(&self->lock);
+
+	g_object_unref(self->current);
+	self->current = frame.texture;
+
+	if (frame.delay < 0) {
+		self->next_frame_time = G_MAXINT64;
+	} else {
+		/* keep the animation's own pace, unless it fell far behind */
+		gint64 base = self->next_frame_time;
+		if (base == 0 || frame_time - base > MAX_LAG)
+			base = frame_time;
+		self->next_frame_time = base + MAX(frame.delay, MIN_FRAME_DELAY_MS) * 1000;
+	}
+
+	gdk_paintable_invalidate_contents(GDK_PAINTABLE(self));
+	return self->next_frame_time != G_MAXINT64;
+}
+
+static void comicreader_animation_snapshot(
+	GdkPaintable *paintable,
+	GdkSnapshot *snapshot,
+	double width,
+	double height)
+{
+	ComicReaderAnimation *self = COMICREADER_ANIMATION(paintable);
+	gdk_paintable_snapshot(GDK_PAINTABLE(self->current), snapshot, width, height);
+}
+
+static int comicreader_animation_get_intrinsic_width(GdkPaintable *paintable)
+{
+	return COMICREADER_ANIMATION(paintable)->width;
+}
+
+static int comicreader_animation_get_intrinsic_height(GdkPaintable *paintable)
+{
+	return COMICREADER_ANIMATION(paintable)->height;
+}
+
+static void comicreader_animation_dispose(GObject *object)
+{
+	ComicReaderAnimation *self = COMICREADER_ANIMATION(object);
+
+	/* a job that has started gets to finish its frame */
+	g_mutex_lock(&self->lock);
+	self->quit = true;
+	if (self->stepping && comicreader_decode_scheduler_cancel(self->scheduler, &self->job.task))
+		self->stepping = false;
+	while (self->stepping)
+		g_cond_wait(&self->cond, &self->lock);
+	g_mutex_unlock(&self->lock);
+
+	G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+	g_clear_object(&self->iter);
+	G_GNUC_END_IGNORE_DEPRECATIONS
+	g_clear_object(&self->animation);
+
+	for (size_t i = 0; i < self->num_frames; ++i)
+		g_object_unref(self->ring[(self->first_frame + i) % RING_SIZE].texture);
+	self->num_frames = 0;
+	g_clear_object(&self->current);
+	g_clear_pointer(&self->bytes, g_bytes_unref);
+
+	debug_free("ComicReaderAnimation", self);
+	G_OBJECT_CLASS(comicreader_animation_parent_class)->dispose(object);
+}
+
+static void comicreader_animation_finalize(GObject *object)
+{
+	ComicReaderAnimation *self = COMICREADER_ANIMATION(object);
+
+	g_mutex_clear(&self->lock);
+	g_cond_clear(&self->cond);
+
+	G_OBJECT_CLASS(comicreader_animation_parent_class)->finalize(object);
+}
+
+/* Frames ahead of the one shown are read ahead, until one is late.
+ * called with the lock held */
+static void push_job(ComicReaderAnimation *self)
+{
+	self->stepping = true;
+	self->job.task.qos = COMICREADER_QOS_NORMAL;
+	comicreader_decode_scheduler_push(self->scheduler, &self->job.task);
+}
+
+/* Adds the animation's current frame to the ring, then moves its clock on
+ * to the next.
+ * called on background thread */
+static void step_frame(struct ComicReaderDecodeTask *task)
+{
+	ComicReaderAnimation *self = ((struct FrameJob *)task)->self;
+
+	if (!self->iter && !start_animation(self)) {
+		g_mutex_lock(&self->lock);
+		self->done = true;
+		self->stepping = false;
+		g_cond_broadcast(&self->cond);
+		g_mutex_unlock(&self->lock);
+		return;
+	}
+
+	G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+	int delay = gdk_pixbuf_animation_iter_get_delay_time(self->iter);
+	/* the iterator composites every frame into the same buffer */
+	GdkPixbuf *pixbuf = gdk_pixbuf_copy(gdk_pixbuf_animation_iter_get_pixbuf(self->iter));
+	GdkTexture *texture = gdk_texture_new_for_pixbuf(pixbuf);
+	g_object_unref(pixbuf);
+
+	if (delay >= 0) {
+		self->time += (gint64)MAX(delay, 1) * 1000;
+		GTimeVal time = {self->time / G_USEC_PER_SEC, self->time % G_USEC_PER_SEC};
+		gdk_pixbuf_animation_iter_advance(self->iter, &time);
+	}
+	G_GNUC_END_IGNORE_DEPRECATIONS
+
+	g_mutex_lock(&self->lock);
+	if (self->quit) {
+		g_object_unref(texture);
+	} else {
+		/* it was only pushed with room for the frame */
+		size_t last = (self->first_frame + self->num_frames) % RING_SIZE;
+		struct Frame *frame = &self->ring[last];
+		frame->texture = texture;
+		frame->delay = delay;
+		++self->num_frames;
+		self->done = delay < 0;
+	}
+
+	if (!self->quit && !self->done && self->num_frames < RING_SIZE) {
+		push_job(self);
+	} else {
+		self->stepping = false;
+		g_cond_broadcast(&self->cond);
+	}
+	g_mutex_unlock(&self->lock);
+}
+
+/* Returns false if the animation can't be played, which leaves the first
+ * frame shown.
+ * called on background thread */
+static bool start_animation(ComicReaderAnimation *self)
+{
+	GError *error = NULL;
+	GInputStream *stream = g_memory_input_stream_new_from_bytes(self->bytes);
+	self->animation = gdk_pixbuf_animation_new_from_stream(stream, NULL, &error);
+	g_object_unref(stream);
+	if (!self->animation) {
+		debug_printf("cannot animate: %s\n", error->message);
+		g_clear_error(&error);
+		return false;
+	}
+	/* no loader for this format's animations, keep the first frame */
+	if (gdk_pixbuf_animation_is_static_image(self->animation))
+		return false;
+
+	G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+	GTimeVal time = {0, 0};
+	self->iter = gdk_pixbuf_animation_get_iter(self->animation, &time);
+	G_GNUC_END_IGNORE_DEPRECATIONS
+	return true;
+}
+
+static bool is_animated_gif(const guchar *data, gsize size)
+{
+	if (size < 13 || memcmp(data, "GIF8", 4) != 0)
+		return false;
+
+	/* skip the header and global colour table, then count images */
+	gsize pos = 13;
+	if (data[10] & 0x80)
+		pos += 3 << ((data[10] & 7) + 1);
+
+	int num_images = 0;
+	while (pos < size) {
+		if (data[pos] == 0x21) {
+			/* extension: introducer and label */
+			pos += 2;
+		} else if (data[pos] == 0x2c) {
+			if (++num_images > 1)
+				return true;
+			if (pos + 10 > size)
+				return false;
+			guchar flags = data[pos + 9];
+			pos += 10;
+			if (flags & 0x80)
+				pos += 3 << ((flags & 7) + 1);
+			/* LZW minimum code size */
+			pos += 1;
+		} else {
+			/* trailer */
+			return false;
+		}
+
+		/* data sub-blocks up to the empty terminator */
+		while (pos < size && data[pos] != 0)
+			pos += data[pos] + 1;
+		pos += 1;
+	}
+
+	return false;
+}
+
+/* an animation control chunk before the image data */
+static bool is_animated_png(const guchar *data, gsize size)
+{
+	static const guchar signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+	if (size < sizeof(signature) || memcmp(data, signature, sizeof(signature)) != 0)
+		return false;
+
+	gsize pos = sizeof(signature);
+	while (pos + 8 <= size) {
+		guint32 length = read_be32(data + pos);
+		const guchar *type = data + pos + 4;
+		if (memcmp(type, "IDAT", 4) == 0)
+			return false;
+		if (memcmp(type, "acTL", 4) == 0)
+			return pos + 12 <= size && read_be32(data + pos + 8) > 1;
+		/* length, type, data and CRC */
+		pos += (gsize)length + 12;
+	}
+
+	return false;
+}
+
+/* the animation flag of an extended format header */
+static bool is_animated_webp(const guchar *data, gsize size)
+{
+	return size >= 21 && memcmp(data, "RIFF", 4) == 0 && memcmp(data + 8, "WEBP", 4) == 0 &&
+	       memcmp(data + 12, "VP8X", 4) == 0 && (data[20] & 0x02);
+}
+
+static guint32 read_be32(const guchar *data)
+{
+	return (guint32)data[0] << 24 | (guint32)data[1] << 16 | (guint32)data[2] << 8 | data[3];
+}
@@ -0,0 +1,50 @@
+/* comicreader-animation.h
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gdk/gdk.h>
+#include <stdbool.h>
+
+#include "comicreader-decodescheduler.h"
+
+G_BEGIN_DECLS
+
+#define COMICREADER_TYPE_ANIMATION (comicreader_animation_get_type())
+
+G_DECLARE_FINAL_TYPE(ComicReaderAnimation, comicreader_animation, COMICREADER, ANIMATION, GObject)
+
+G_END_DECLS
+
+/* Returns true if bytes hold a GIF, APNG or WebP with more than one frame. */
+bool comicreader_animation_sniff(GBytes *bytes);
+
+/* A paintable that plays the animation in bytes.  Frames are decoded one
+ * task at a time on scheduler, only a few ahead of the one shown, so memory
+ * use doesn't grow with the number of frames.  first_frame is shown until
+ * they catch up. */
+ComicReaderAnimation *comicreader_animation_new(
+	GBytes *bytes,
+	GdkTexture *first_frame,
+	struct ComicReaderDecodeScheduler *scheduler);
+
+/* Shows whichever frame is due at frame_time, a GdkFrameClock frame time.
+ * Returns false once the last frame of an animation that ends is shown. */
+bool comicreader_animation_advance(ComicReaderAnimation *self, gint64 frame_time);
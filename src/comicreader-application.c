@@ -21,15 +21,72 @@
 #include "config.h"
 
 #include "comicreader-application.h"
+#include "comicreader-backgroundimageloader.h"
+#include "comicreader-cropimageloader.h"
+#include "comicreader-directoryimageloader.h"
+#include "comicreader-filterimageloader.h"
+#include "comicreader-optimizer.h"
+#include "comicreader-pdfimageloader.h"
+#include "comicreader-upscaleimageloader.h"
 #include "comicreader-window.h"
 
+#include <glib/gi18n.h>
+#include <math.h>
+#include <stdio.h>
+
+/* what --optimize shrinks pages to if --height isn't given, a 4K display */
+#define DEFAULT_OPTIMIZE_HEIGHT 2160
+
 struct _ComicReaderApplication {
 	AdwApplication parent_instance;
+
+	GSettings *settings;
+	struct ComicReaderDecodeScheduler *scheduler;
+	struct ComicReaderLibrary *library;
 };
 
 G_DEFINE_FINAL_TYPE(ComicReaderApplication, comicreader_application, ADW_TYPE_APPLICATION)
 
+static int comicreader_application_handle_local_options(
+	GApplication *app,
+	GVariantDict *options);
+static void comicreader_application_startup(GApplication *app);
 static void comicreader_application_activate(GApplication *app);
+static void comicreader_application_open(
+	GApplication *app,
+	GFile **files,
+	int n_files,
+	const char *hint);
+static void comicreader_application_shutdown(GApplication *app);
+static void comicreader_application_dispose(GObject *object);
+static struct ComicReaderImageLoader *comicreader_application_restore_comic(
+	ComicReaderApplication *self,
+	GFile **comic,
+	size_t *page);
+static void comicreader_application_open_file(ComicReaderApplication *self, GFile *file);
+static int optimize_comic(const char *comic_path, const char *output_path, int height);
+static bool is_pdf(GFile *file);
+static struct ComicReaderImageLoader *open_comic(
+	ComicReaderApplication *self,
+	GFile *directory,
+	int display_height);
+static struct ComicReaderImageLoader *finish_loading(
+	ComicReaderApplication *self,
+	struct ComicReaderImageLoader *loader,
+	size_t page);
+static void open_comic_in_thread(
+	GTask *task,
+	gpointer source_object,
+	gpointer task_data,
+	GCancellable *cancellable);
+static void free_loader(void *p);
+static char *get_crop_cache_path(GFile *directory);
+static int get_display_height(void);
+static void scan_library(ComicReaderApplication *self);
+static void comicreader_application_rescan_library_action(
+	GSimpleAction *action,
+	GVariant *parameter,
+	gpointer user_data);
 static void comicreader_application_about_action(
 	GSimpleAction *action,
 	GVariant *parameter,
@@ -39,9 +96,20 @@ static void comicreader_application_quit_action(
 	GVariant *parameter,
 	gpointer user_data);
 
+static const GOptionEntry option_entries[] = {
+	{"optimize", 0, 0, G_OPTION_ARG_FILENAME, NULL,
+	 N_("Write a copy of COMIC that's quicker to read, then exit"), N_("COMIC")},
+	{"output", 0, 0, G_OPTION_ARG_FILENAME, NULL,
+	 N_("Directory for --optimize to write to, COMIC-optimized by default"), N_("DIRECTORY")},
+	{"height", 0, 0, G_OPTION_ARG_INT, NULL,
+	 N_("Height for --optimize to shrink pages to, 2160 by default"), N_("PIXELS")},
+	G_OPTION_ENTRY_NULL,
+};
+
 static const GActionEntry app_actions[] = {
 	{"quit", comicreader_application_quit_action},
 	{"about", comicreader_application_about_action},
+	{"rescan-library", comicreader_application_rescan_library_action},
 };
 
 ComicReaderApplication *comicreader_application_new(
@@ -57,14 +125,38 @@ ComicReaderApplication *comicreader_application_new(
 		NULL);
 }
 
+GSettings *comicreader_application_get_settings(ComicReaderApplication *self)
+{
+	return self->settings;
+}
+
+struct ComicReaderLibrary *comicreader_application_get_library(ComicReaderApplication *self)
+{
+	return self->library;
+}
+
+struct ComicReaderDecodeScheduler *comicreader_application_get_scheduler(
+	ComicReaderApplication *self)
+{
+	return self->scheduler;
+}
+
 static void comicreader_application_class_init(ComicReaderApplicationClass *klass)
 {
+	GObjectClass *object_class = G_OBJECT_CLASS(klass);
+	object_class->dispose = comicreader_application_dispose;
+
 	GApplicationClass *app_class = G_APPLICATION_CLASS(klass);
+	app_class->handle_local_options = comicreader_application_handle_local_options;
+	app_class->startup = comicreader_application_startup;
 	app_class->activate = comicreader_application_activate;
+	app_class->open = comicreader_application_open;
+	app_class->shutdown = comicreader_application_shutdown;
 }
 
 static void comicreader_application_init(ComicReaderApplication *self)
 {
+	g_application_add_main_option_entries(G_APPLICATION(self), option_entries);
 	g_action_map_add_action_entries(
 		G_ACTION_MAP(self),
 		app_actions,
@@ -74,10 +166,74 @@ static void comicreader_application_init(ComicReaderApplication *self)
 		GTK_APPLICATION(self),
 		"app.quit",
 		(const char *[]){"<primary>q", NULL});
+	gtk_application_set_accels_for_action(
+		GTK_APPLICATION(self),
+		"win.show-help-overlay",
+		(const char *[]){"<primary>question", NULL});
+	gtk_application_set_accels_for_action(
+		GTK_APPLICATION(self),
+		"win.toggle-hud",
+		(const char *[]){"F12", NULL});
+}
+
+/* --optimize runs here, before a display or another instance is needed */
+static int comicreader_application_handle_local_options(
+	GApplication *app,
+	GVariantDict *options)
+{
+	const char *comic_path;
+	if (!g_variant_dict_lookup(options, "optimize", "^&ay", &comic_path)) {
+		return G_APPLICATION_CLASS(comicreader_application_parent_class)
+			->handle_local_options(app, options);
+	}
+
+	const char *output_path = NULL;
+	g_variant_dict_lookup(options, "output", "^&ay", &output_path);
+	int height = DEFAULT_OPTIMIZE_HEIGHT;
+	g_variant_dict_lookup(options, "height", "i", &height);
+	if (height <= 0) {
+		fprintf(stderr, "--height must be positive\n");
+		return EXIT_FAILURE;
+	}
+
+	return optimize_comic(comic_path, output_path, height);
+}
+
+static void comicreader_application_startup(GApplication *app)
+{
+	ComicReaderApplication *self = COMICREADER_APPLICATION(app);
+
+	G_APPLICATION_CLASS(comicreader_application_parent_class)->startup(app);
+
+	self->settings = g_settings_new("name.mbekkema.ComicReader");
+	self->scheduler = comicreader_decode_scheduler_new();
+
+	/* take effect for comics opened afterwards */
+	GAction *crop_action = g_settings_create_action(self->settings, "crop-margins");
+	g_action_map_add_action(G_ACTION_MAP(self), crop_action);
+	g_object_unref(crop_action);
+	GAction *upscale_action = g_settings_create_action(self->settings, "upscale-pages");
+	g_action_map_add_action(G_ACTION_MAP(self), upscale_action);
+	g_object_unref(upscale_action);
+	GAction *series_action = g_settings_create_action(self->settings, "series-mode");
+	g_action_map_add_action(G_ACTION_MAP(self), series_action);
+	g_object_unref(series_action);
+
+	char *db_path =
+		g_build_filename(g_get_user_cache_dir(), "comicreader", "library.sqlite", NULL);
+	self->library = comicreader_library_new(db_path);
+	g_free(db_path);
+	g_signal_connect_swapped(
+		self->settings,
+		"changed::library-roots",
+		G_CALLBACK(scan_library),
+		self);
+	scan_library(self);
 }
 
 static void comicreader_application_activate(GApplication *app)
 {
+	ComicReaderApplication *self = COMICREADER_APPLICATION(app);
 	GtkWindow *window;
 
 	g_assert(COMICREADER_IS_APPLICATION(app));
@@ -85,15 +241,416 @@ static void comicreader_application_activate(GApplication *app)
 	window = gtk_application_get_active_window(GTK_APPLICATION(app));
 
 	if (!window) {
+		/* start decoding the last viewed page before building the window
+		 * so that the two happen in parallel */
+		GFile *comic = NULL;
+		size_t page = 0;
+		struct ComicReaderImageLoader *loader =
+			comicreader_application_restore_comic(self, &comic, &page);
+
 		window = g_object_new(
 			COMICREADER_TYPE_WINDOW,
 			"application", app,
 			NULL);
+
+		if (loader) {
+			comicreader_window_open_comic(COMICREADER_WINDOW(window), comic, loader, page);
+			comicreader_window_restore_view(
+				COMICREADER_WINDOW(window),
+				g_settings_get_double(self->settings, "zoom"),
+				g_settings_get_double(self->settings, "scroll-x"),
+				g_settings_get_double(self->settings, "scroll-y"));
+		}
+		g_clear_object(&comic);
 	}
 
 	gtk_window_present(window);
 }
 
+/* Also handles opens forwarded from other instances over D-Bus, which
+ * then share this process's warm caches. */
+static void comicreader_application_open(
+	GApplication *app,
+	GFile **files,
+	int n_files,
+	const char *hint)
+{
+	ComicReaderApplication *self = COMICREADER_APPLICATION(app);
+
+	for (int i = 0; i < n_files; ++i)
+		comicreader_application_open_file(self, files[i]);
+}
+
+static void comicreader_application_open_file(ComicReaderApplication *self, GFile *file)
+{
+	GFile *directory = NULL;
+	char *page_name = NULL;
+
+	GFileType type = g_file_query_file_type(file, G_FILE_QUERY_INFO_NONE, NULL);
+	if (type == G_FILE_TYPE_DIRECTORY || (type == G_FILE_TYPE_REGULAR && is_pdf(file))) {
+		directory = g_object_ref(file);
+	} else if (type == G_FILE_TYPE_REGULAR) {
+		directory = g_file_get_parent(file);
+		page_name = g_file_get_basename(file);
+	}
+
+	if (!directory) {
+		char *uri = g_file_get_uri(file);
+		fprintf(stderr, "Cannot open %s\n", uri);
+		g_free(uri);
+		return;
+	}
+
+	/* a window already showing the comic has its pages cached */
+	GtkWindow *window = NULL;
+	for (GList *l = gtk_application_get_windows(GTK_APPLICATION(self)); l; l = l->next) {
+		if (!COMICREADER_IS_WINDOW(l->data))
+			continue;
+		GFile *comic = comicreader_window_get_comic(COMICREADER_WINDOW(l->data));
+		if (comic && g_file_equal(comic, directory)) {
+			window = l->data;
+			break;
+		}
+	}
+
+	if (window) {
+		size_t page;
+		struct ComicReaderImageLoader *loader =
+			comicreader_window_get_image_loader(COMICREADER_WINDOW(window));
+		if (page_name && comicreader_image_loader_find(loader, page_name, &page))
+			comicreader_window_go_to_page(COMICREADER_WINDOW(window), page);
+	} else {
+		size_t page = 0;
+		struct ComicReaderImageLoader *loader = comicreader_application_load_comic(
+			self,
+			directory,
+			page_name,
+			&page);
+		if (!loader) {
+			g_clear_object(&directory);
+			g_free(page_name);
+			return;
+		}
+
+		/* reuse an empty window, otherwise open a new one */
+		window = gtk_application_get_active_window(GTK_APPLICATION(self));
+		if (window && comicreader_window_get_comic(COMICREADER_WINDOW(window)))
+			window = NULL;
+		if (!window) {
+			window = g_object_new(
+				COMICREADER_TYPE_WINDOW,
+				"application", self,
+				NULL);
+		}
+
+		comicreader_window_open_comic(COMICREADER_WINDOW(window), directory, loader, page);
+	}
+
+	gtk_window_present(window);
+
+	g_clear_object(&directory);
+	g_free(page_name);
+}
+
+static void comicreader_application_shutdown(GApplication *app)
+{
+	ComicReaderApplication *self = COMICREADER_APPLICATION(app);
+
+	/* windows still open on quit don't receive close-request */
+	for (GList *l = gtk_application_get_windows(GTK_APPLICATION(app)); l; l = l->next) {
+		if (COMICREADER_IS_WINDOW(l->data))
+			comicreader_window_save_session(COMICREADER_WINDOW(l->data), self->settings);
+	}
+
+	G_APPLICATION_CLASS(comicreader_application_parent_class)->shutdown(app);
+}
+
+static void comicreader_application_dispose(GObject *object)
+{
+	ComicReaderApplication *self = COMICREADER_APPLICATION(object);
+
+	if (self->settings)
+		g_signal_handlers_disconnect_by_data(self->settings, self);
+	g_clear_object(&self->settings);
+	g_clear_pointer(&self->library, comicreader_library_free);
+	/* windows hold a reference to the application, so their loaders are
+	 * gone by now */
+	g_clear_pointer(&self->scheduler, comicreader_decode_scheduler_free);
+
+	G_OBJECT_CLASS(comicreader_application_parent_class)->dispose(object);
+}
+
+static struct ComicReaderImageLoader *comicreader_application_restore_comic(
+	ComicReaderApplication *self,
+	GFile **comic,
+	size_t *page)
+{
+	char *uri = g_settings_get_string(self->settings, "last-comic");
+	if (uri[0] == '\0') {
+		g_free(uri);
+		return NULL;
+	}
+
+	GFile *directory = g_file_new_for_uri(uri);
+	g_free(uri);
+
+	GFileType type = g_file_query_file_type(directory, G_FILE_QUERY_INFO_NONE, NULL);
+	if (type != G_FILE_TYPE_DIRECTORY && !(type == G_FILE_TYPE_REGULAR && is_pdf(directory))) {
+		g_clear_object(&directory);
+		return NULL;
+	}
+
+	*page = g_settings_get_uint(self->settings, "last-page");
+	struct ComicReaderImageLoader *loader =
+		comicreader_application_load_comic(self, directory, NULL, page);
+	if (!loader) {
+		g_clear_object(&directory);
+		return NULL;
+	}
+
+	*comic = directory;
+	return loader;
+}
+
+/* Creates the loader for a comic and starts loading the page that will be
+ * shown first, either the page named page_name or the one at *page. */
+struct ComicReaderImageLoader *comicreader_application_load_comic(
+	ComicReaderApplication *self,
+	GFile *directory,
+	const char *page_name,
+	size_t *page)
+{
+	struct ComicReaderImageLoader *loader =
+		open_comic(self, directory, get_display_height());
+	if (!loader)
+		return NULL;
+
+	size_t num_images = loader->get_num_images(loader);
+	if (page_name && !comicreader_image_loader_find(loader, page_name, page))
+		*page = 0;
+	if (*page >= num_images)
+		*page = 0;
+
+	return finish_loading(self, loader, *page);
+}
+
+void comicreader_application_load_comic_async(
+	ComicReaderApplication *self,
+	GFile *directory,
+	GCancellable *cancellable,
+	GAsyncReadyCallback callback,
+	gpointer user_data)
+{
+	GTask *task = g_task_new(self, cancellable, callback, user_data);
+	g_task_set_source_tag(task, comicreader_application_load_comic_async);
+	g_task_set_task_data(task, g_object_ref(directory), g_object_unref);
+	/* the monitors can only be asked on this thread */
+	g_object_set_data(G_OBJECT(task), "display-height", GINT_TO_POINTER(get_display_height()));
+	g_task_run_in_thread(task, open_comic_in_thread);
+	g_object_unref(task);
+}
+
+struct ComicReaderImageLoader *comicreader_application_load_comic_finish(
+	ComicReaderApplication *self,
+	GAsyncResult *result,
+	GError **error)
+{
+	struct ComicReaderImageLoader *loader = g_task_propagate_pointer(G_TASK(result), error);
+	if (!loader)
+		return NULL;
+	return finish_loading(self, loader, 0);
+}
+
+/* The loaders below the background one, which list the pages and so may
+ * take a while.  Returns NULL if the comic can't be opened or has no
+ * pages.
+ * called on any thread */
+static struct ComicReaderImageLoader *open_comic(
+	ComicReaderApplication *self,
+	GFile *directory,
+	int display_height)
+{
+	struct ComicReaderImageLoader *loader;
+	if (is_pdf(directory))
+		loader = comicreader_pdf_image_loader_new(g_object_ref(directory), display_height);
+	else
+		loader = comicreader_directory_image_loader_new(
+			g_object_ref(directory),
+			self->scheduler);
+	if (!loader)
+		return NULL;
+	if (loader->get_num_images(loader) == 0) {
+		comicreader_image_loader_clear(&loader);
+		return NULL;
+	}
+
+	if (g_settings_get_boolean(self->settings, "crop-margins")) {
+		char *cache_path = get_crop_cache_path(directory);
+		loader = comicreader_crop_image_loader_new(loader, cache_path);
+		g_free(cache_path);
+	}
+
+	/* before upscaling, so that there are fewer pixels to filter */
+	loader = comicreader_filter_image_loader_new(loader, self->settings);
+
+	if (g_settings_get_boolean(self->settings, "upscale-pages") && display_height > 0)
+		loader = comicreader_upscale_image_loader_new(loader, display_height);
+
+	return loader;
+}
+
+/* Adds the background loader and starts loading page. */
+static struct ComicReaderImageLoader *finish_loading(
+	ComicReaderApplication *self,
+	struct ComicReaderImageLoader *loader,
+	size_t page)
+{
+	loader = comicreader_background_image_loader_new(loader, self->scheduler, self->settings);
+	comicreader_image_loader_prefetch(loader, page);
+	return loader;
+}
+
+/* called on background thread */
+static void open_comic_in_thread(
+	GTask *task,
+	gpointer source_object,
+	gpointer task_data,
+	GCancellable *cancellable)
+{
+	ComicReaderApplication *self = source_object;
+	GFile *directory = task_data;
+	int display_height = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(task), "display-height"));
+
+	struct ComicReaderImageLoader *loader = open_comic(self, directory, display_height);
+	if (loader) {
+		g_task_return_pointer(task, loader, free_loader);
+	} else {
+		char *name = g_file_get_parse_name(directory);
+		g_task_return_new_error(
+			task,
+			G_IO_ERROR,
+			G_IO_ERROR_FAILED,
+			"Cannot open %s, or it has no pages",
+			name);
+		g_free(name);
+	}
+}
+
+static void free_loader(void *p)
+{
+	struct ComicReaderImageLoader *loader = p;
+	comicreader_image_loader_clear(&loader);
+}
+
+/* The same loaders as for reading, without the settings dependent ones,
+ * upscaling to height like the reader would. */
+static int optimize_comic(const char *comic_path, const char *output_path, int height)
+{
+	GFile *comic = g_file_new_for_commandline_arg(comic_path);
+	GFileType type = g_file_query_file_type(comic, G_FILE_QUERY_INFO_NONE, NULL);
+	bool pdf = type == G_FILE_TYPE_REGULAR && is_pdf(comic);
+	if (type != G_FILE_TYPE_DIRECTORY && !pdf) {
+		fprintf(stderr, "%s is not a directory or PDF\n", comic_path);
+		g_object_unref(comic);
+		return EXIT_FAILURE;
+	}
+
+	GFile *output;
+	if (output_path) {
+		output = g_file_new_for_commandline_arg(output_path);
+	} else {
+		char *path = g_strconcat(g_file_peek_path(comic), "-optimized", NULL);
+		output = g_file_new_for_path(path);
+		g_free(path);
+	}
+
+	struct ComicReaderImageLoader *loader;
+	if (pdf) {
+		loader = comicreader_pdf_image_loader_new(g_object_ref(comic), height);
+	} else {
+		/* the optimizer already has a page on every core */
+		loader = comicreader_directory_image_loader_new(g_object_ref(comic), NULL);
+		comicreader_directory_image_loader_list_chapters(loader);
+	}
+
+	int ret = EXIT_FAILURE;
+	if (loader) {
+		loader = comicreader_upscale_image_loader_new(loader, height);
+		if (comicreader_optimize_comic(loader, output, height))
+			ret = EXIT_SUCCESS;
+		comicreader_image_loader_clear(&loader);
+	} else {
+		fprintf(stderr, "Cannot open %s\n", comic_path);
+	}
+
+	g_object_unref(output);
+	g_object_unref(comic);
+	return ret;
+}
+
+static bool is_pdf(GFile *file)
+{
+	GFileInfo *info = g_file_query_info(
+		file,
+		G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE,
+		G_FILE_QUERY_INFO_NONE,
+		NULL,
+		NULL);
+	if (!info)
+		return false;
+
+	const char *content_type = g_file_info_get_content_type(info);
+	bool ret = content_type && g_content_type_is_a(content_type, "application/pdf");
+	g_object_unref(info);
+	return ret;
+}
+
+static char *get_crop_cache_path(GFile *directory)
+{
+	char *uri = g_file_get_uri(directory);
+	char *checksum = g_compute_checksum_for_string(G_CHECKSUM_SHA1, uri, -1);
+	char *ret = g_build_filename(g_get_user_cache_dir(), "comicreader", "crops", checksum, NULL);
+	g_free(checksum);
+	g_free(uri);
+	return ret;
+}
+
+/* the height of the tallest monitor at its native resolution, which pages
+ * are rendered or upscaled to fill */
+static int get_display_height(void)
+{
+	GdkDisplay *display = gdk_display_get_default();
+	if (!display)
+		return 0;
+
+	GListModel *monitors = gdk_display_get_monitors(display);
+	int height = 0;
+	for (guint i = 0; i < g_list_model_get_n_items(monitors); ++i) {
+		GdkMonitor *monitor = g_list_model_get_item(monitors, i);
+		GdkRectangle geometry;
+		gdk_monitor_get_geometry(monitor, &geometry);
+		height = MAX(height, (int)ceil(geometry.height * gdk_monitor_get_scale(monitor)));
+		g_object_unref(monitor);
+	}
+
+	return height;
+}
+
+static void scan_library(ComicReaderApplication *self)
+{
+	char **roots = g_settings_get_strv(self->settings, "library-roots");
+	comicreader_library_scan(self->library, (const char *const *)roots);
+	g_strfreev(roots);
+}
+
+static void comicreader_application_rescan_library_action(
+	GSimpleAction *action,
+	GVariant *parameter,
+	gpointer user_data)
+{
+	scan_library(COMICREADER_APPLICATION(user_data));
+}
+
 static void comicreader_application_about_action(
 	GSimpleAction *action,
 	GVariant *parameter,
@@ -22,6 +22,10 @@
 
 #include <adwaita.h>
 
+#include "comicreader-decodescheduler.h"
+#include "comicreader-imageloader.h"
+#include "comicreader-library.h"
+
 G_BEGIN_DECLS
 
 #define COMICREADER_TYPE_APPLICATION (comicreader_application_get_type())
@@ -36,5 +40,32 @@ G_DECLARE_FINAL_TYPE(
 ComicReaderApplication *comicreader_application_new(
 	const char *application_id,
 	GApplicationFlags flags);
+GSettings *comicreader_application_get_settings(ComicReaderApplication *self);
+struct ComicReaderLibrary *comicreader_application_get_library(ComicReaderApplication *self);
+/* shared by every window, from startup on */
+struct ComicReaderDecodeScheduler *comicreader_application_get_scheduler(
+	ComicReaderApplication *self);
+
+/* Creates a loader for the comic in directory, which may also be a PDF, or
+ * returns NULL if it has no pages.  *page is set to the index of page_name,
+ * or 0 if not found. */
+struct ComicReaderImageLoader *comicreader_application_load_comic(
+	ComicReaderApplication *self,
+	GFile *directory,
+	const char *page_name,
+	size_t *page);
+
+/* Like comicreader_application_load_comic from the first page, but lists
+ * the pages on a background thread.  Fails if there are none. */
+void comicreader_application_load_comic_async(
+	ComicReaderApplication *self,
+	GFile *directory,
+	GCancellable *cancellable,
+	GAsyncReadyCallback callback,
+	gpointer user_data);
+struct ComicReaderImageLoader *comicreader_application_load_comic_finish(
+	ComicReaderApplication *self,
+	GAsyncResult *result,
+	GError **error);
 
 G_END_DECLS
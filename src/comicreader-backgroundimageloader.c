@@ -20,27 +20,129 @@
 
 #include "comicreader-backgroundimageloader.h"
 #include "comicreader-debug.h"
+#include "comicreader-decodescheduler.h"
+#include "comicreader-qoi.h"
 
 #include <stdbool.h>
 
+/* enough room for the current page, its neighbours, the pinned pages and
+ * a few recently visited pages */
+#define CACHE_SIZE 8
+#define PREVIEW_CACHE_SIZE 16
+#define MAX_PINNED 2
+
+/* On slow storage I/O rather than decoding dominates, so compressed pages
+ * are read much further ahead than decoded pages are kept. */
+#define READ_AHEAD 32
+#define READ_BEHIND 4
+#define BYTES_CACHE_SIZE (READ_AHEAD + READ_BEHIND + CACHE_SIZE)
+#define BYTES_CACHE_BUDGET (256 * 1024 * 1024)
+
+/* Pages evicted from the decoded cache are kept QOI compressed, a fraction
+ * of their decoded size, which expands again far faster than the original
+ * file decodes. */
+#define PACKED_CACHE_SIZE 64
+#define PACKED_CACHE_BUDGET (128 * 1024 * 1024)
+#define MAX_READS_IN_FLIGHT 4
+/* a batch costs one submission however many files it covers */
+#define MAX_BATCHED_READS_IN_FLIGHT 32
+
 struct CacheItem {
 	struct ComicReaderImage *image;
 	size_t index;
+	guint64 last_used;
+};
+
+struct BytesCacheItem {
+	GBytes *bytes;
+	char *name;
+	size_t index;
+};
+
+struct PackedCacheItem {
+	GBytes *packed;
+	char *name;
+	size_t index;
+	int width;
+	int height;
+	guint64 last_used;
 };
 
+struct BackgroundLoadData;
+struct ReadAheadData;
+
 struct ComicReaderBackgroundImageLoader {
 	struct ComicReaderImageLoader parent;
 	struct ComicReaderImageLoader *inner_loader;
-	GThreadPool *thread_pool;
-	struct CacheItem cache[3];
+	struct ComicReaderDecodeScheduler *scheduler;
+	GSettings *settings;
+	/* whether the last page leads back to the first, as it does outside
+	 * series mode */
+	bool wrap;
+	GThreadPool *io_thread_pool;
+	struct CacheItem cache[CACHE_SIZE];
+	struct CacheItem preview_cache[PREVIEW_CACHE_SIZE];
+	struct BytesCacheItem bytes_cache[BYTES_CACHE_SIZE];
+	size_t bytes_cached;
+	struct PackedCacheItem packed_cache[PACKED_CACHE_SIZE];
+	size_t packed_bytes;
+	/* packing started before a page or filter changed is thrown away */
+	int packed_generation;
+	size_t pinned[MAX_PINNED];
+	size_t num_pinned;
 	size_t current_index;
+	guint64 use_count;
+	int preview_generation;
 	int ref_count;
-	bool loading;
+	bool disposed;
+
+	/* full loads that have been queued but not yet added to the cache */
+	struct BackgroundLoadData *in_flight;
+	/* reads that have been queued but not yet added to the bytes cache */
+	struct ReadAheadData *reading;
+	size_t num_reading;
+	GMutex lock;
+	GCond cond;
 };
 
 struct BackgroundLoadData {
+	/* must be first, the scheduler hands it back to load_in_background */
+	struct ComicReaderDecodeTask task;
 	struct ComicReaderBackgroundImageLoader *self;
+	struct BackgroundLoadData *next;
 	struct CacheItem item;
+	/* compressed image to decode, if it was already read ahead */
+	GBytes *bytes;
+	char *name;
+	/* or the decoded image packed, to expand instead */
+	GBytes *packed;
+	int packed_width;
+	int packed_height;
+	int generation;
+	bool started;
+	bool done;
+	/* the image changed or was removed while loading */
+	bool stale;
+	/* the reader moved on before a worker got to it, so it's skipped */
+	bool dropped;
+};
+
+struct PackData {
+	/* must be first, the scheduler hands it back to pack_in_background */
+	struct ComicReaderDecodeTask task;
+	struct ComicReaderBackgroundImageLoader *self;
+	struct ComicReaderImage *image;
+	GBytes *packed;
+	int generation;
+};
+
+struct ReadAheadData {
+	/* must be first, read_images hands it back to read_done */
+	struct ComicReaderReadRequest request;
+	struct ComicReaderBackgroundImageLoader *self;
+	struct ReadAheadData *next;
+	struct BytesCacheItem item;
+	bool stale;
 };
 
 /* interface implementations */
@@ -48,18 +150,118 @@ static size_t impl_get_num_images(struct ComicReaderImageLoader *image_loader);
 static struct ComicReaderImage *impl_get_image(
 	struct ComicReaderImageLoader *image_loader,
 	size_t index);
+static struct ComicReaderImage *impl_get_preview(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index);
+static void impl_set_pinned(struct ComicReaderImageLoader *image_loader, size_t index, bool pinned);
+static void impl_prefetch(struct ComicReaderImageLoader *image_loader, size_t index);
+static bool impl_find_image(
+	struct ComicReaderImageLoader *image_loader,
+	const char *name,
+	size_t *index);
+static char *impl_get_image_name(struct ComicReaderImageLoader *image_loader, size_t index);
+static char *impl_get_image_key(struct ComicReaderImageLoader *image_loader, const char *name);
+static void impl_set_focused(struct ComicReaderImageLoader *image_loader, bool focused);
+static void impl_get_cache_stats(
+	struct ComicReaderImageLoader *image_loader,
+	struct ComicReaderCacheStats *stats);
 static void impl_free(struct ComicReaderImageLoader *image_loader);
 
 /* helper functions */
+static void unref(struct ComicReaderBackgroundImageLoader *self);
+static void series_mode_changed(GSettings *settings, const char *key, gpointer user_data);
+static void inner_loader_event(
+	void *user_data,
+	enum ComicReaderImageLoaderEvent event,
+	size_t index);
+static void update_indices(
+	struct ComicReaderBackgroundImageLoader *self,
+	enum ComicReaderImageLoaderEvent event,
+	size_t index);
+static void evict(struct ComicReaderBackgroundImageLoader *self, size_t index);
+static void evict_decoded(struct ComicReaderBackgroundImageLoader *self);
+static void drop_unwanted_loads(struct ComicReaderBackgroundImageLoader *self);
+static bool resolve_index(
+	struct ComicReaderBackgroundImageLoader *self,
+	bool stale,
+	const char *name,
+	size_t *index);
+static struct CacheItem *lookup(
+	struct ComicReaderBackgroundImageLoader *self,
+	struct CacheItem *cache,
+	size_t cache_size,
+	size_t index);
+static bool is_cached(struct ComicReaderBackgroundImageLoader *self, size_t index);
+static bool is_wanted(struct ComicReaderBackgroundImageLoader *self, size_t index);
 static void add_to_cache(struct ComicReaderBackgroundImageLoader *self, struct CacheItem item);
+static void add_to_preview_cache(
+	struct ComicReaderBackgroundImageLoader *self,
+	struct CacheItem item);
+static struct ComicReaderImage *load_image(
+	struct ComicReaderBackgroundImageLoader *self,
+	size_t index,
+	GBytes *bytes,
+	const char *name);
+static struct ComicReaderImage *decode_image(
+	struct ComicReaderBackgroundImageLoader *self,
+	size_t index,
+	GBytes *bytes,
+	const char *name,
+	const char *key);
+static struct BytesCacheItem *lookup_bytes(
+	struct ComicReaderBackgroundImageLoader *self,
+	size_t index);
+static size_t read_ahead_distance(struct ComicReaderBackgroundImageLoader *self, size_t index);
+static void add_to_bytes_cache(
+	struct ComicReaderBackgroundImageLoader *self,
+	struct BytesCacheItem item);
+static void clear_bytes_item(
+	struct ComicReaderBackgroundImageLoader *self,
+	struct BytesCacheItem *item);
+static struct PackedCacheItem *lookup_packed(
+	struct ComicReaderBackgroundImageLoader *self,
+	size_t index);
+static bool is_packed(struct ComicReaderBackgroundImageLoader *self, size_t index);
+static void clear_packed_item(
+	struct ComicReaderBackgroundImageLoader *self,
+	struct PackedCacheItem *item);
+static void push_pack(
+	struct ComicReaderBackgroundImageLoader *self,
+	struct ComicReaderImage *image);
+static void pack_in_background(struct ComicReaderDecodeTask *task);
+static gboolean finish_pack_in_background(void *p);
+static void add_to_packed_cache(
+	struct ComicReaderBackgroundImageLoader *self,
+	struct PackedCacheItem item);
+static struct ComicReaderImage *unpack_image(
+	GBytes *packed,
+	const char *name,
+	int width,
+	int height);
+static void start_read_ahead(struct ComicReaderBackgroundImageLoader *self);
+static struct ReadAheadData *push_read(struct ComicReaderBackgroundImageLoader *self, size_t index);
+static void read_done(struct ComicReaderReadRequest *request);
+static void read_in_background(void *p, void *unused);
+static gboolean finish_read_in_background(void *p);
 static void start_load_in_background(struct ComicReaderBackgroundImageLoader *self);
-static void load_in_background(void *p, void *unused);
+static void push_load(struct ComicReaderBackgroundImageLoader *self, size_t index);
+static struct BackgroundLoadData *find_in_flight(
+	struct ComicReaderBackgroundImageLoader *self,
+	size_t index);
+static struct ComicReaderImage *wait_for_load(
+	struct ComicReaderBackgroundImageLoader *self,
+	struct BackgroundLoadData *data);
+static void load_in_background(struct ComicReaderDecodeTask *task);
 static gboolean finish_load_in_background(void *p);
+static void load_preview_in_background(struct ComicReaderDecodeTask *task);
+static gboolean finish_load_preview_in_background(void *p);
 static size_t get_prev_index(struct ComicReaderBackgroundImageLoader *self);
 static size_t get_next_index(struct ComicReaderBackgroundImageLoader *self);
 
 struct ComicReaderImageLoader *comicreader_background_image_loader_new(
-	struct ComicReaderImageLoader *inner_loader)
+	struct ComicReaderImageLoader *inner_loader,
+	struct ComicReaderDecodeScheduler *scheduler,
+	GSettings *settings)
 {
 	struct ComicReaderBackgroundImageLoader *ret;
 	ret = calloc(1, sizeof(struct ComicReaderBackgroundImageLoader));
@@ -68,12 +270,29 @@ struct ComicReaderImageLoader *comicreader_background_image_loader_new(
 	ret->parent.free = impl_free;
 	ret->parent.get_num_images = impl_get_num_images;
 	ret->parent.get_image = impl_get_image;
+	ret->parent.get_preview = impl_get_preview;
+	ret->parent.set_pinned = impl_set_pinned;
+	ret->parent.prefetch = impl_prefetch;
+	ret->parent.find_image = impl_find_image;
+	ret->parent.get_image_name = impl_get_image_name;
+	ret->parent.get_image_key = impl_get_image_key;
+	ret->parent.set_focused = impl_set_focused;
+	ret->parent.get_cache_stats = impl_get_cache_stats;
 
 	ret->inner_loader = inner_loader;
-	ret->thread_pool = g_thread_pool_new(&load_in_background, NULL, 1, FALSE, NULL);
+	comicreader_image_loader_set_listener(inner_loader, inner_loader_event, ret);
+	ret->scheduler = scheduler;
+	ret->settings = g_object_ref(settings);
+	ret->wrap = !g_settings_get_boolean(settings, "series-mode");
+	g_signal_connect(settings, "changed::series-mode", G_CALLBACK(series_mode_changed), ret);
+	/* created when first needed, loaders that read in batches never do */
+	ret->io_thread_pool = NULL;
 
 	ret->ref_count = 1;
-	ret->loading = false;
+	ret->disposed = false;
+	ret->in_flight = NULL;
+	g_mutex_init(&ret->lock);
+	g_cond_init(&ret->cond);
 
 	g_assert((void *)ret == (void *)&ret->parent);
 	return &ret->parent;
@@ -96,89 +315,1009 @@ static struct ComicReaderImage *impl_get_image(
 	struct ComicReaderImage *image = NULL;
 
 	self->current_index = index;
+	drop_unwanted_loads(self);
 
-	for (size_t i = 0; i < sizeof(self->cache) / sizeof(self->cache[0]); ++i) {
-		if (self->cache[i].index == index && self->cache[i].image) {
-			image = comicreader_image_dup(self->cache[i].image);
-			break;
+	struct CacheItem *cached = lookup(self, self->cache, CACHE_SIZE, index);
+	if (cached)
+		image = comicreader_image_dup(cached->image);
+
+	/* don't decode twice if the image is already being loaded */
+	if (!image) {
+		struct BackgroundLoadData *data = find_in_flight(self, index);
+		if (data) {
+			gint64 start = g_get_monotonic_time();
+			image = wait_for_load(self, data);
+			if (image)
+				image->decode_time = g_get_monotonic_time() - start;
 		}
 	}
 
 	if (!image) {
-		debug_printf("cache miss for image index %zu\n", index);
-		image = self->inner_loader->get_image(self->inner_loader, index);
+		struct PackedCacheItem *packed = lookup_packed(self, index);
+		if (packed)
+			image = unpack_image(
+				packed->packed,
+				packed->name,
+				packed->width,
+				packed->height);
+		if (!image) {
+			debug_printf("cache miss for image index %zu\n", index);
+			struct BytesCacheItem *bytes = lookup_bytes(self, index);
+			if (bytes)
+				image = load_image(self, index, bytes->bytes, bytes->name);
+			else
+				image = load_image(self, index, NULL, NULL);
+		}
 		struct CacheItem item;
 		item.index = index;
 		item.image = comicreader_image_dup(image);
 		add_to_cache(self, item);
 	}
 
-	if (!self->loading)
+	if (!self->in_flight)
 		start_load_in_background(self);
+	start_read_ahead(self);
 
 	return image;
 }
 
+static struct ComicReaderImage *impl_get_preview(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index)
+{
+	struct ComicReaderBackgroundImageLoader *self =
+		(struct ComicReaderBackgroundImageLoader *)image_loader;
+
+	/* a fully loaded image makes a fine preview */
+	struct CacheItem *cached = lookup(self, self->cache, CACHE_SIZE, index);
+	if (!cached)
+		cached = lookup(self, self->preview_cache, PREVIEW_CACHE_SIZE, index);
+	if (cached)
+		return comicreader_image_dup(cached->image);
+
+	if (!self->inner_loader->get_preview)
+		return NULL;
+
+	/* only the most recently requested preview is worth loading */
+	struct BackgroundLoadData *data = calloc(1, sizeof(*data));
+	data->self = self;
+	++self->ref_count;
+	data->item.index = index;
+	data->generation = g_atomic_int_add(&self->preview_generation, 1) + 1;
+	data->task.run = load_preview_in_background;
+	data->task.owner = self;
+
+	comicreader_decode_scheduler_push_preview(self->scheduler, &data->task);
+
+	return NULL;
+}
+
+static void impl_set_pinned(struct ComicReaderImageLoader *image_loader, size_t index, bool pinned)
+{
+	struct ComicReaderBackgroundImageLoader *self =
+		(struct ComicReaderBackgroundImageLoader *)image_loader;
+
+	for (size_t i = 0; i < self->num_pinned; ++i) {
+		if (self->pinned[i] == index) {
+			if (!pinned) {
+				--self->num_pinned;
+				self->pinned[i] = self->pinned[self->num_pinned];
+			}
+			return;
+		}
+	}
+
+	if (!pinned)
+		return;
+
+	/* unpin the oldest pin to make room */
+	if (self->num_pinned == MAX_PINNED) {
+		for (size_t i = 1; i < MAX_PINNED; ++i)
+			self->pinned[i - 1] = self->pinned[i];
+		--self->num_pinned;
+	}
+
+	debug_printf("pinning index %zu\n", index);
+	self->pinned[self->num_pinned] = index;
+	++self->num_pinned;
+}
+
+static void impl_prefetch(struct ComicReaderImageLoader *image_loader, size_t index)
+{
+	struct ComicReaderBackgroundImageLoader *self =
+		(struct ComicReaderBackgroundImageLoader *)image_loader;
+
+	self->current_index = index;
+	drop_unwanted_loads(self);
+
+	/* queued in order of importance, workers take them in turn without
+	 * waiting for the main loop */
+	size_t indices[] = {index, get_next_index(self), get_prev_index(self)};
+	for (size_t i = 0; i < sizeof(indices) / sizeof(indices[0]); ++i) {
+		if (lookup(self, self->cache, CACHE_SIZE, indices[i]))
+			continue;
+		if (find_in_flight(self, indices[i]))
+			continue;
+		push_load(self, indices[i]);
+	}
+
+	start_read_ahead(self);
+}
+
+static bool impl_find_image(
+	struct ComicReaderImageLoader *image_loader,
+	const char *name,
+	size_t *index)
+{
+	struct ComicReaderBackgroundImageLoader *self =
+		(struct ComicReaderBackgroundImageLoader *)image_loader;
+
+	return comicreader_image_loader_find(self->inner_loader, name, index);
+}
+
+static char *impl_get_image_name(struct ComicReaderImageLoader *image_loader, size_t index)
+{
+	struct ComicReaderBackgroundImageLoader *self =
+		(struct ComicReaderBackgroundImageLoader *)image_loader;
+
+	return comicreader_image_loader_get_name(self->inner_loader, index);
+}
+
+static char *impl_get_image_key(struct ComicReaderImageLoader *image_loader, const char *name)
+{
+	struct ComicReaderBackgroundImageLoader *self =
+		(struct ComicReaderBackgroundImageLoader *)image_loader;
+
+	return comicreader_image_loader_get_key(self->inner_loader, name);
+}
+
+static void impl_set_focused(struct ComicReaderImageLoader *image_loader, bool focused)
+{
+	struct ComicReaderBackgroundImageLoader *self =
+		(struct ComicReaderBackgroundImageLoader *)image_loader;
+
+	comicreader_decode_scheduler_set_focused(self->scheduler, self, focused);
+}
+
+static void impl_get_cache_stats(
+	struct ComicReaderImageLoader *image_loader,
+	struct ComicReaderCacheStats *stats)
+{
+	struct ComicReaderBackgroundImageLoader *self =
+		(struct ComicReaderBackgroundImageLoader *)image_loader;
+
+	for (size_t i = 0; i < CACHE_SIZE; ++i) {
+		if (self->cache[i].image) {
+			++stats->decoded;
+			stats->decoded_bytes += comicreader_image_get_size(self->cache[i].image);
+		}
+	}
+	stats->decoded_capacity = CACHE_SIZE;
+	for (size_t i = 0; i < PREVIEW_CACHE_SIZE; ++i)
+		stats->previews += self->preview_cache[i].image != NULL;
+	stats->previews_capacity = PREVIEW_CACHE_SIZE;
+	stats->compressed_bytes = self->bytes_cached;
+	stats->compressed_budget = BYTES_CACHE_BUDGET;
+	for (size_t i = 0; i < PACKED_CACHE_SIZE; ++i)
+		stats->packed += self->packed_cache[i].packed != NULL;
+	stats->packed_bytes = self->packed_bytes;
+	stats->packed_budget = PACKED_CACHE_BUDGET;
+	stats->reads_in_flight = self->num_reading;
+	for (struct BackgroundLoadData *data = self->in_flight; data; data = data->next)
+		++stats->decodes_in_flight;
+	comicreader_decode_scheduler_get_usage(
+		self->scheduler,
+		&stats->shared_bytes,
+		&stats->shared_budget);
+}
+
 static void impl_free(struct ComicReaderImageLoader *image_loader)
 {
 	struct ComicReaderBackgroundImageLoader *self =
 		(struct ComicReaderBackgroundImageLoader *)image_loader;
 
+	/* background loads still in flight hold their own reference */
+	self->disposed = true;
+	g_signal_handlers_disconnect_by_data(self->settings, self);
+	g_clear_object(&self->settings);
+	comicreader_decode_scheduler_set_focused(self->scheduler, self, false);
+	comicreader_image_loader_set_listener(&self->parent, NULL, NULL);
+	unref(self);
+}
+
+static void series_mode_changed(GSettings *settings, const char *key, gpointer user_data)
+{
+	struct ComicReaderBackgroundImageLoader *self = user_data;
+	self->wrap = !g_settings_get_boolean(settings, key);
+	drop_unwanted_loads(self);
+}
+
+static void unref(struct ComicReaderBackgroundImageLoader *self)
+{
 	--self->ref_count;
 	g_assert(self->ref_count >= 0);
 	if (self->ref_count > 0)
 		return;
 
-	for (size_t i = 0; i < sizeof(self->cache) / sizeof(self->cache[0]); ++i) {
+	for (size_t i = 0; i < CACHE_SIZE; ++i) {
 		comicreader_image_clear(&self->cache[i].image);
 	}
+	for (size_t i = 0; i < PREVIEW_CACHE_SIZE; ++i) {
+		comicreader_image_clear(&self->preview_cache[i].image);
+	}
+	for (size_t i = 0; i < BYTES_CACHE_SIZE; ++i) {
+		clear_bytes_item(self, &self->bytes_cache[i]);
+	}
+	for (size_t i = 0; i < PACKED_CACHE_SIZE; ++i) {
+		clear_packed_item(self, &self->packed_cache[i]);
+	}
 	comicreader_image_loader_clear(&self->inner_loader);
 
-	g_assert(g_thread_pool_unprocessed(self->thread_pool) == 0);
-	g_thread_pool_free(self->thread_pool, TRUE, FALSE);
+	if (self->io_thread_pool) {
+		g_assert(g_thread_pool_unprocessed(self->io_thread_pool) == 0);
+		g_thread_pool_free(self->io_thread_pool, TRUE, FALSE);
+	}
+	g_mutex_clear(&self->lock);
+	g_cond_clear(&self->cond);
 
 	debug_free("ComicReaderBackgroundImageLoader", self);
-	free(image_loader);
+	free(self);
 }
 
-static void add_to_cache(struct ComicReaderBackgroundImageLoader *self, struct CacheItem item)
+static void inner_loader_event(
+	void *user_data,
+	enum ComicReaderImageLoaderEvent event,
+	size_t index)
 {
-	struct CacheItem *dest = NULL;
+	struct ComicReaderBackgroundImageLoader *self = user_data;
 
-	size_t current = self->current_index;
-	size_t next = get_next_index(self);
-	size_t prev = get_prev_index(self);
-
-	if (item.index != current && item.index != next && item.index != prev) {
-		debug_printf("not caching index %zu\n", item.index);
-		comicreader_image_clear(&item.image);
+	switch (event) {
+	case COMICREADER_IMAGE_LOADER_IMAGE_INSERTED:
+	case COMICREADER_IMAGE_LOADER_IMAGE_REMOVED:
+		update_indices(self, event, index);
+		break;
+	case COMICREADER_IMAGE_LOADER_IMAGE_CHANGED:
+		evict(self, index);
+		break;
+	case COMICREADER_IMAGE_LOADER_ALL_CHANGED:
+		evict_decoded(self);
+		break;
+	case COMICREADER_IMAGE_LOADER_PREVIEW_READY:
+	default:
 		return;
 	}
 
-	/* search for an unused or unwanted slot */
-	for (size_t i = 0; i < sizeof(self->cache) / sizeof(self->cache[0]); ++i) {
-		size_t index = self->cache[i].index;
-		int wanted = index == current || index == next || index == prev;
-		if (!self->cache[i].image || !wanted) {
-			dest = &self->cache[i];
-			break;
+	comicreader_image_loader_notify(&self->parent, event, index);
+}
+
+/* Shifts cached images along with the inner loader's indices instead of
+ * reloading them. */
+static void update_indices(
+	struct ComicReaderBackgroundImageLoader *self,
+	enum ComicReaderImageLoaderEvent event,
+	size_t index)
+{
+	for (size_t i = 0; i < CACHE_SIZE; ++i) {
+		if (!comicreader_image_loader_update_index(event, index, &self->cache[i].index))
+			comicreader_image_clear(&self->cache[i].image);
+	}
+	for (size_t i = 0; i < PREVIEW_CACHE_SIZE; ++i) {
+		if (!comicreader_image_loader_update_index(
+			    event,
+			    index,
+			    &self->preview_cache[i].index))
+			comicreader_image_clear(&self->preview_cache[i].image);
+	}
+
+	for (size_t i = 0; i < self->num_pinned;) {
+		if (comicreader_image_loader_update_index(event, index, &self->pinned[i])) {
+			++i;
+		} else {
+			--self->num_pinned;
+			self->pinned[i] = self->pinned[self->num_pinned];
 		}
 	}
 
+	for (size_t i = 0; i < BYTES_CACHE_SIZE; ++i) {
+		if (!comicreader_image_loader_update_index(
+			    event,
+			    index,
+			    &self->bytes_cache[i].index))
+			clear_bytes_item(self, &self->bytes_cache[i]);
+	}
+	for (size_t i = 0; i < PACKED_CACHE_SIZE; ++i) {
+		if (!comicreader_image_loader_update_index(
+			    event,
+			    index,
+			    &self->packed_cache[i].index))
+			clear_packed_item(self, &self->packed_cache[i]);
+	}
+
+	comicreader_image_loader_update_index(event, index, &self->current_index);
+
+	g_mutex_lock(&self->lock);
+	for (struct BackgroundLoadData *data = self->in_flight; data; data = data->next) {
+		if (!comicreader_image_loader_update_index(event, index, &data->item.index))
+			data->stale = true;
+	}
+	for (struct ReadAheadData *data = self->reading; data; data = data->next) {
+		if (!comicreader_image_loader_update_index(event, index, &data->item.index))
+			data->stale = true;
+	}
+	g_mutex_unlock(&self->lock);
+}
+
+static void evict(struct ComicReaderBackgroundImageLoader *self, size_t index)
+{
+	/* other windows may have decoded the old file too */
+	char *name = comicreader_image_loader_get_name(self->inner_loader, index);
+	char *key = name ? comicreader_image_loader_get_key(self->inner_loader, name) : NULL;
+	if (key)
+		comicreader_decode_scheduler_forget(self->scheduler, key);
+	g_free(key);
+	free(name);
+
+	for (size_t i = 0; i < CACHE_SIZE; ++i) {
+		if (self->cache[i].index == index)
+			comicreader_image_clear(&self->cache[i].image);
+	}
+	for (size_t i = 0; i < PREVIEW_CACHE_SIZE; ++i) {
+		if (self->preview_cache[i].index == index)
+			comicreader_image_clear(&self->preview_cache[i].image);
+	}
+
+	for (size_t i = 0; i < BYTES_CACHE_SIZE; ++i) {
+		if (self->bytes_cache[i].index == index)
+			clear_bytes_item(self, &self->bytes_cache[i]);
+	}
+	for (size_t i = 0; i < PACKED_CACHE_SIZE; ++i) {
+		if (self->packed_cache[i].index == index)
+			clear_packed_item(self, &self->packed_cache[i]);
+	}
+	++self->packed_generation;
+
+	for (struct BackgroundLoadData *data = self->in_flight; data; data = data->next) {
+		if (data->item.index == index)
+			data->stale = true;
+	}
+	for (struct ReadAheadData *data = self->reading; data; data = data->next) {
+		if (data->item.index == index)
+			data->stale = true;
+	}
+}
+
+/* compressed images are still valid, only their decoded form changed */
+static void evict_decoded(struct ComicReaderBackgroundImageLoader *self)
+{
+	for (size_t i = 0; i < CACHE_SIZE; ++i)
+		comicreader_image_clear(&self->cache[i].image);
+	for (size_t i = 0; i < PREVIEW_CACHE_SIZE; ++i)
+		comicreader_image_clear(&self->preview_cache[i].image);
+	for (size_t i = 0; i < PACKED_CACHE_SIZE; ++i)
+		clear_packed_item(self, &self->packed_cache[i]);
+	++self->packed_generation;
+
+	for (struct BackgroundLoadData *data = self->in_flight; data; data = data->next)
+		data->stale = true;
+}
+
+/* Pages skipped over on the way to the current one are no longer worth
+ * decoding, but a load that already started is left to finish. */
+static void drop_unwanted_loads(struct ComicReaderBackgroundImageLoader *self)
+{
+	g_mutex_lock(&self->lock);
+	for (struct BackgroundLoadData *data = self->in_flight; data; data = data->next) {
+		if (!data->started && !data->dropped && !is_wanted(self, data->item.index)) {
+			debug_printf("dropping load of index %zu\n", data->item.index);
+			data->dropped = true;
+		}
+	}
+	g_mutex_unlock(&self->lock);
+}
+
+/* The inner loader may have changed between the worker picking up the
+ * index and loading the file, so check by name where possible. */
+static bool resolve_index(
+	struct ComicReaderBackgroundImageLoader *self,
+	bool stale,
+	const char *name,
+	size_t *index)
+{
+	if (stale)
+		return false;
+	if (!self->inner_loader->find_image)
+		return true;
+	if (!name)
+		return false;
+
+	return comicreader_image_loader_find(self->inner_loader, name, index);
+}
+
+static struct CacheItem *lookup(
+	struct ComicReaderBackgroundImageLoader *self,
+	struct CacheItem *cache,
+	size_t cache_size,
+	size_t index)
+{
+	for (size_t i = 0; i < cache_size; ++i) {
+		if (cache[i].index == index && cache[i].image) {
+			cache[i].last_used = ++self->use_count;
+			return &cache[i];
+		}
+	}
+
+	return NULL;
+}
+
+static bool is_cached(struct ComicReaderBackgroundImageLoader *self, size_t index)
+{
+	for (size_t i = 0; i < CACHE_SIZE; ++i) {
+		if (self->cache[i].index == index && self->cache[i].image)
+			return true;
+	}
+
+	return false;
+}
+
+static bool is_wanted(struct ComicReaderBackgroundImageLoader *self, size_t index)
+{
+	if (index == self->current_index || index == get_next_index(self) ||
+	    index == get_prev_index(self))
+		return true;
+
+	for (size_t i = 0; i < self->num_pinned; ++i) {
+		if (self->pinned[i] == index)
+			return true;
+	}
+
+	return false;
+}
+
+static void add_to_cache(struct ComicReaderBackgroundImageLoader *self, struct CacheItem item)
+{
+	struct CacheItem *dest = NULL;
+
 	/* search for a slot with same index */
-	for (size_t i = 0; i < sizeof(self->cache) / sizeof(self->cache[0]); ++i) {
+	for (size_t i = 0; i < CACHE_SIZE; ++i) {
 		if (self->cache[i].index == item.index && self->cache[i].image) {
 			dest = &self->cache[i];
 			break;
 		}
 	}
 
-	g_assert(dest);
+	/* search for an unused slot */
+	for (size_t i = 0; !dest && i < CACHE_SIZE; ++i) {
+		if (!self->cache[i].image)
+			dest = &self->cache[i];
+	}
+
+	/* evict the least recently used unwanted slot, so that the
+	 * neighbourhood of recently visited pages survives a jump */
+	if (!dest) {
+		for (size_t i = 0; i < CACHE_SIZE; ++i) {
+			if (is_wanted(self, self->cache[i].index))
+				continue;
+			if (!dest || self->cache[i].last_used < dest->last_used)
+				dest = &self->cache[i];
+		}
+	}
+
+	if (!dest) {
+		debug_printf("not caching index %zu\n", item.index);
+		comicreader_image_clear(&item.image);
+		return;
+	}
 
 	debug_printf("caching index %zu\n", item.index);
+	/* a page pushed out moves down to the packed cache */
+	if (dest->image && dest->index != item.index && !is_packed(self, dest->index))
+		push_pack(self, dest->image);
+	else
+		comicreader_image_clear(&dest->image);
+	dest->image = item.image;
+	dest->index = item.index;
+	dest->last_used = ++self->use_count;
+}
+
+static void add_to_preview_cache(
+	struct ComicReaderBackgroundImageLoader *self,
+	struct CacheItem item)
+{
+	struct CacheItem *dest = NULL;
+
+	/* search for a slot with same index */
+	for (size_t i = 0; i < PREVIEW_CACHE_SIZE; ++i) {
+		if (self->preview_cache[i].index == item.index && self->preview_cache[i].image) {
+			dest = &self->preview_cache[i];
+			break;
+		}
+	}
+
+	/* search for an unused slot */
+	for (size_t i = 0; !dest && i < PREVIEW_CACHE_SIZE; ++i) {
+		if (!self->preview_cache[i].image)
+			dest = &self->preview_cache[i];
+	}
+
+	/* evict the least recently used slot */
+	if (!dest) {
+		dest = &self->preview_cache[0];
+		for (size_t i = 1; i < PREVIEW_CACHE_SIZE; ++i) {
+			if (self->preview_cache[i].last_used < dest->last_used)
+				dest = &self->preview_cache[i];
+		}
+	}
+
 	comicreader_image_clear(&dest->image);
 	dest->image = item.image;
 	dest->index = item.index;
+	dest->last_used = ++self->use_count;
+}
+
+/* Decodes the image through the scheduler's cache, so that other loaders
+ * showing the same comic don't decode it again.
+ * called on any thread */
+static struct ComicReaderImage *load_image(
+	struct ComicReaderBackgroundImageLoader *self,
+	size_t index,
+	GBytes *bytes,
+	const char *name)
+{
+	char *page_name =
+		name ? strdup(name) : comicreader_image_loader_get_name(self->inner_loader, index);
+	char *key = page_name ? comicreader_image_loader_get_key(self->inner_loader, page_name)
+			      : NULL;
+	if (!key) {
+		free(page_name);
+		return decode_image(self, index, bytes, name, NULL);
+	}
+
+	struct ComicReaderImage *image = comicreader_decode_scheduler_claim(self->scheduler, key);
+	if (!image) {
+		image = decode_image(self, index, bytes, name, key);
+		/* the image at index may have been replaced since its name was
+		 * looked up, don't share it under the wrong key */
+		bool matches = image && !image->error && image->name &&
+			       strcmp(image->name, page_name) == 0;
+		/* when it falls back to get_image the image is decoded with
+		 * the current settings, which may no longer match the key */
+		if (matches) {
+			char *current_key =
+				comicreader_image_loader_get_key(self->inner_loader, page_name);
+			matches = current_key && strcmp(current_key, key) == 0;
+			g_free(current_key);
+		}
+		comicreader_decode_scheduler_release(self->scheduler, key, matches ? image : NULL);
+	}
+
+	g_free(key);
+	free(page_name);
+	return image;
+}
+
+/* key, if not NULL, is the key the image will be shared under
+ * called on any thread */
+static struct ComicReaderImage *decode_image(
+	struct ComicReaderBackgroundImageLoader *self,
+	size_t index,
+	GBytes *bytes,
+	const char *name,
+	const char *key)
+{
+	struct ComicReaderImageLoader *inner = self->inner_loader;
+	gint64 start = g_get_monotonic_time();
+	gint64 read_time = 0;
+	struct ComicReaderImage *image = NULL;
+
+	/* read separately where possible to tell I/O from decoding */
+	if (bytes) {
+		image = inner->decode_image(inner, name, bytes, key);
+	} else if (inner->read_image) {
+		char *read_name = NULL;
+		GBytes *read_bytes = inner->read_image(inner, index, &read_name);
+		read_time = g_get_monotonic_time() - start;
+		if (read_bytes) {
+			image = inner->decode_image(inner, read_name, read_bytes, key);
+			g_bytes_unref(read_bytes);
+		}
+		free(read_name);
+	}
+	if (!image)
+		image = inner->get_image(inner, index);
+
+	if (image) {
+		/* counted as decoding, while the worker still has the pixels hot */
+		comicreader_image_compact(image);
+		image->read_time = read_time;
+		image->decode_time = g_get_monotonic_time() - start - read_time;
+	}
+	return image;
+}
+
+static struct BytesCacheItem *lookup_bytes(
+	struct ComicReaderBackgroundImageLoader *self,
+	size_t index)
+{
+	for (size_t i = 0; i < BYTES_CACHE_SIZE; ++i) {
+		if (self->bytes_cache[i].index == index && self->bytes_cache[i].bytes)
+			return &self->bytes_cache[i];
+	}
+
+	return NULL;
+}
+
+/* how far the reader is from reaching index, pages behind count for more
+ * since readers mostly move forwards */
+static size_t read_ahead_distance(struct ComicReaderBackgroundImageLoader *self, size_t index)
+{
+	size_t num_images = impl_get_num_images(&self->parent);
+	if (num_images == 0)
+		return 0;
+
+	size_t current = self->current_index % num_images;
+	size_t ahead = (index + num_images - current) % num_images;
+	size_t behind = (current + num_images - index) % num_images;
+	/* the other way round leads past the end */
+	if (!self->wrap && index < current)
+		ahead = num_images;
+	if (!self->wrap && index > current)
+		behind = num_images;
+
+	return MIN(ahead, behind * (READ_AHEAD / READ_BEHIND));
+}
+
+static void add_to_bytes_cache(
+	struct ComicReaderBackgroundImageLoader *self,
+	struct BytesCacheItem item)
+{
+	size_t size = g_bytes_get_size(item.bytes);
+	size_t distance = read_ahead_distance(self, item.index);
+
+	struct BytesCacheItem *existing = lookup_bytes(self, item.index);
+	if (existing)
+		clear_bytes_item(self, existing);
+
+	/* make room by evicting the pages furthest from the reader */
+	for (;;) {
+		struct BytesCacheItem *dest = NULL;
+		struct BytesCacheItem *furthest = NULL;
+		for (size_t i = 0; i < BYTES_CACHE_SIZE; ++i) {
+			struct BytesCacheItem *slot = &self->bytes_cache[i];
+			if (!slot->bytes) {
+				dest = slot;
+				continue;
+			}
+			if (!furthest || read_ahead_distance(self, slot->index) >
+						 read_ahead_distance(self, furthest->index))
+				furthest = slot;
+		}
+
+		if (dest && self->bytes_cached + size <= BYTES_CACHE_BUDGET) {
+			debug_printf("read ahead index %zu (%zu bytes)\n", item.index, size);
+			*dest = item;
+			self->bytes_cached += size;
+			return;
+		}
+
+		if (!furthest || read_ahead_distance(self, furthest->index) <= distance) {
+			g_bytes_unref(item.bytes);
+			free(item.name);
+			return;
+		}
+
+		clear_bytes_item(self, furthest);
+	}
+}
+
+static void clear_bytes_item(
+	struct ComicReaderBackgroundImageLoader *self,
+	struct BytesCacheItem *item)
+{
+	if (!item->bytes)
+		return;
+
+	self->bytes_cached -= g_bytes_get_size(item->bytes);
+	g_clear_pointer(&item->bytes, g_bytes_unref);
+	free(item->name);
+	item->name = NULL;
+}
+
+static struct PackedCacheItem *lookup_packed(
+	struct ComicReaderBackgroundImageLoader *self,
+	size_t index)
+{
+	for (size_t i = 0; i < PACKED_CACHE_SIZE; ++i) {
+		if (self->packed_cache[i].index == index && self->packed_cache[i].packed) {
+			self->packed_cache[i].last_used = ++self->use_count;
+			return &self->packed_cache[i];
+		}
+	}
+
+	return NULL;
+}
+
+static bool is_packed(struct ComicReaderBackgroundImageLoader *self, size_t index)
+{
+	for (size_t i = 0; i < PACKED_CACHE_SIZE; ++i) {
+		if (self->packed_cache[i].index == index && self->packed_cache[i].packed)
+			return true;
+	}
+
+	return false;
+}
+
+static void clear_packed_item(
+	struct ComicReaderBackgroundImageLoader *self,
+	struct PackedCacheItem *item)
+{
+	if (!item->packed)
+		return;
+
+	self->packed_bytes -= g_bytes_get_size(item->packed);
+	g_clear_pointer(&item->packed, g_bytes_unref);
+	free(item->name);
+	item->name = NULL;
+}
+
+/* Compresses image, which is taken, on a decode worker.  Only still
+ * images decoded whole are worth it. */
+static void push_pack(
+	struct ComicReaderBackgroundImageLoader *self,
+	struct ComicReaderImage *image)
+{
+	if (self->disposed || !image->texture || !image->name || image->error ||
+	    image->animation || image->sliced) {
+		comicreader_image_clear(&image);
+		return;
+	}
+
+	struct PackData *data = calloc(1, sizeof(*data));
+	data->self = self;
+	++self->ref_count;
+	data->image = image;
+	data->generation = self->packed_generation;
+	data->task.run = pack_in_background;
+	data->task.owner = self;
+	data->task.qos = COMICREADER_QOS_IDLE;
+
+	comicreader_decode_scheduler_push(self->scheduler, &data->task);
+}
+
+/* called on background thread */
+static void pack_in_background(struct ComicReaderDecodeTask *task)
+{
+	struct PackData *data = (struct PackData *)task;
+
+	gint64 start = g_get_monotonic_time();
+	data->packed = comicreader_qoi_encode(data->image->texture);
+	debug_printf(
+		"packed %s into %zu bytes in %" G_GINT64_FORMAT " us\n",
+		data->image->name,
+		data->packed ? g_bytes_get_size(data->packed) : 0,
+		g_get_monotonic_time() - start);
+
+	g_idle_add(&finish_pack_in_background, data);
+}
+
+static gboolean finish_pack_in_background(void *p)
+{
+	struct PackData *data = p;
+	struct ComicReaderBackgroundImageLoader *self = data->self;
+
+	struct PackedCacheItem item = {0};
+	bool keep = data->packed && !self->disposed &&
+		    data->generation == self->packed_generation &&
+		    resolve_index(self, false, data->image->name, &item.index);
+	if (keep) {
+		item.packed = data->packed;
+		item.name = strdup(data->image->name);
+		item.width = data->image->width;
+		item.height = data->image->height;
+		add_to_packed_cache(self, item);
+	} else if (data->packed) {
+		g_bytes_unref(data->packed);
+	}
+
+	comicreader_image_clear(&data->image);
+	free(data);
+	unref(self);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void add_to_packed_cache(
+	struct ComicReaderBackgroundImageLoader *self,
+	struct PackedCacheItem item)
+{
+	size_t size = g_bytes_get_size(item.packed);
+
+	struct PackedCacheItem *existing = lookup_packed(self, item.index);
+	if (existing)
+		clear_packed_item(self, existing);
+
+	/* evict the least recently used pages until it fits */
+	for (;;) {
+		struct PackedCacheItem *dest = NULL;
+		struct PackedCacheItem *oldest = NULL;
+		for (size_t i = 0; i < PACKED_CACHE_SIZE; ++i) {
+			struct PackedCacheItem *slot = &self->packed_cache[i];
+			if (!slot->packed)
+				dest = slot;
+			else if (!oldest || slot->last_used < oldest->last_used)
+				oldest = slot;
+		}
+
+		if (dest && self->packed_bytes + size <= PACKED_CACHE_BUDGET) {
+			debug_printf("packed index %zu (%zu bytes)\n", item.index, size);
+			*dest = item;
+			dest->last_used = ++self->use_count;
+			self->packed_bytes += size;
+			return;
+		}
+
+		if (!oldest) {
+			g_bytes_unref(item.packed);
+			free(item.name);
+			return;
+		}
+
+		clear_packed_item(self, oldest);
+	}
+}
+
+/* called on any thread */
+static struct ComicReaderImage *unpack_image(
+	GBytes *packed,
+	const char *name,
+	int width,
+	int height)
+{
+	gint64 start = g_get_monotonic_time();
+	GdkTexture *texture = comicreader_qoi_decode(packed);
+	if (!texture)
+		return NULL;
+
+	struct ComicReaderImage *image = calloc(1, sizeof(*image));
+	image->name = strdup(name);
+	image->texture = texture;
+	image->width = width;
+	image->height = height;
+	/* packing always stores four channels */
+	comicreader_image_compact(image);
+	image->decode_time = g_get_monotonic_time() - start;
+
+	return image;
+}
+
+static void start_read_ahead(struct ComicReaderBackgroundImageLoader *self)
+{
+	if (self->disposed || !self->inner_loader->read_image)
+		return;
+
+	size_t num_images = impl_get_num_images(&self->parent);
+	if (num_images == 0)
+		return;
+
+	bool batched = self->inner_loader->read_images != NULL;
+	size_t max_reading = batched ? MAX_BATCHED_READS_IN_FLIGHT : MAX_READS_IN_FLIGHT;
+	struct ComicReaderReadRequest *batch[MAX_BATCHED_READS_IN_FLIGHT];
+	size_t batch_size = 0;
+
+	size_t current = self->current_index;
+	for (size_t d = 1; d <= READ_AHEAD && self->num_reading < max_reading; ++d) {
+		struct ReadAheadData *data = NULL;
+		if (self->wrap || current + d < num_images)
+			data = push_read(self, (current + d) % num_images);
+		if (data)
+			batch[batch_size++] = &data->request;
+		if (d > READ_BEHIND || self->num_reading >= max_reading)
+			continue;
+		if (!self->wrap && d > current)
+			continue;
+		data = push_read(self, (current + num_images - d % num_images) % num_images);
+		if (data)
+			batch[batch_size++] = &data->request;
+	}
+
+	if (batch_size == 0)
+		return;
+	if (batched) {
+		debug_printf("reading %zu images as one batch\n", batch_size);
+		self->inner_loader->read_images(self->inner_loader, batch, batch_size);
+	} else {
+		if (!self->io_thread_pool)
+			self->io_thread_pool = g_thread_pool_new(
+				&read_in_background,
+				NULL,
+				MAX_READS_IN_FLIGHT,
+				FALSE,
+				NULL);
+		for (size_t i = 0; i < batch_size; ++i)
+			g_thread_pool_push(self->io_thread_pool, batch[i], NULL);
+	}
+}
+
+static struct ReadAheadData *push_read(struct ComicReaderBackgroundImageLoader *self, size_t index)
+{
+	if (is_cached(self, index) || is_packed(self, index) || lookup_bytes(self, index) ||
+	    find_in_flight(self, index))
+		return NULL;
+	for (struct ReadAheadData *data = self->reading; data; data = data->next) {
+		if (data->item.index == index && !data->stale)
+			return NULL;
+	}
+
+	struct ReadAheadData *data = calloc(1, sizeof(*data));
+	data->self = self;
+	++self->ref_count;
+	data->item.index = index;
+	data->request.index = index;
+	data->request.done = &read_done;
+
+	data->next = self->reading;
+	self->reading = data;
+	++self->num_reading;
+
+	return data;
+}
+
+/* called on any thread */
+static void read_done(struct ComicReaderReadRequest *request)
+{
+	struct ReadAheadData *data = (struct ReadAheadData *)request;
+
+	data->item.bytes = request->bytes;
+	data->item.name = request->name;
+	g_idle_add(&finish_read_in_background, data);
+}
+
+/* called on background thread */
+static void read_in_background(void *p, void *unused)
+{
+	struct ReadAheadData *data = p;
+	struct ComicReaderBackgroundImageLoader *self = data->self;
+	comicreader_qos_begin_task(COMICREADER_QOS_NORMAL);
+
+	g_mutex_lock(&self->lock);
+	size_t index = data->item.index;
+	g_mutex_unlock(&self->lock);
+
+	data->request.bytes =
+		self->inner_loader->read_image(self->inner_loader, index, &data->request.name);
+	comicreader_qos_end_task();
+	read_done(&data->request);
+}
+
+static gboolean finish_read_in_background(void *p)
+{
+	struct ReadAheadData *data = p;
+	struct ComicReaderBackgroundImageLoader *self = data->self;
+
+	struct ReadAheadData **link = &self->reading;
+	while (*link != data)
+		link = &(*link)->next;
+	*link = data->next;
+	--self->num_reading;
+
+	/* no need to keep the bytes of a page that has already been decoded */
+	bool keep = data->item.bytes &&
+		    resolve_index(self, data->stale, data->item.name, &data->item.index) &&
+		    !is_cached(self, data->item.index);
+	if (keep) {
+		add_to_bytes_cache(self, data->item);
+	} else {
+		if (data->item.bytes)
+			g_bytes_unref(data->item.bytes);
+		free(data->item.name);
+	}
+
+	free(data);
+
+	start_read_ahead(self);
+
+	unref(self);
+
+	return G_SOURCE_REMOVE;
 }
 
 static void start_load_in_background(struct ComicReaderBackgroundImageLoader *self)
@@ -186,10 +1325,11 @@ static void start_load_in_background(struct ComicReaderBackgroundImageLoader *se
 	size_t next_index = get_next_index(self);
 	size_t prev_index = get_prev_index(self);
 
-	bool have_next = false;
-	bool have_prev = false;
+	/* at an end there's nothing to load on that side */
+	bool have_next = next_index == self->current_index;
+	bool have_prev = prev_index == self->current_index;
 
-	for (size_t i = 0; i < sizeof(self->cache) / sizeof(self->cache[0]); ++i) {
+	for (size_t i = 0; i < CACHE_SIZE; ++i) {
 		if (!self->cache[i].image)
 			continue;
 		size_t cindex = self->cache[i].index;
@@ -202,24 +1342,109 @@ static void start_load_in_background(struct ComicReaderBackgroundImageLoader *se
 	if (have_next && have_prev)
 		return;
 
+	push_load(self, have_next ? prev_index : next_index);
+}
+
+static void push_load(struct ComicReaderBackgroundImageLoader *self, size_t index)
+{
 	struct BackgroundLoadData *data = calloc(1, sizeof(*data));
 	data->self = self;
 	++self->ref_count;
-	data->item.index = have_next ? prev_index : next_index;
+	data->item.index = index;
+	data->done = false;
+	data->task.run = load_in_background;
+	data->task.owner = self;
+	/* the page on screen goes ahead of everything being prefetched */
+	data->task.qos = COMICREADER_QOS_NORMAL;
+	if (index == self->current_index)
+		data->task.qos = COMICREADER_QOS_HIGH;
+
+	struct PackedCacheItem *packed = lookup_packed(self, index);
+	struct BytesCacheItem *bytes = lookup_bytes(self, index);
+	if (packed) {
+		data->packed = g_bytes_ref(packed->packed);
+		data->name = strdup(packed->name);
+		data->packed_width = packed->width;
+		data->packed_height = packed->height;
+	} else if (bytes) {
+		data->bytes = g_bytes_ref(bytes->bytes);
+		data->name = strdup(bytes->name);
+	}
+
+	/* append so that the list stays in queue order */
+	struct BackgroundLoadData **tail = &self->in_flight;
+	while (*tail)
+		tail = &(*tail)->next;
+	*tail = data;
+
+	comicreader_decode_scheduler_push(self->scheduler, &data->task);
+}
 
-	self->loading = true;
-	g_thread_pool_push(self->thread_pool, data, NULL);
+static struct BackgroundLoadData *find_in_flight(
+	struct ComicReaderBackgroundImageLoader *self,
+	size_t index)
+{
+	for (struct BackgroundLoadData *data = self->in_flight; data; data = data->next) {
+		if (data->item.index == index && !data->stale && !data->dropped)
+			return data;
+	}
+
+	return NULL;
+}
+
+static struct ComicReaderImage *wait_for_load(
+	struct ComicReaderBackgroundImageLoader *self,
+	struct BackgroundLoadData *data)
+{
+	debug_printf("waiting for index %zu\n", data->item.index);
+	/* it may have been queued as a prefetch */
+	comicreader_decode_scheduler_promote(self->scheduler, &data->task);
+
+	g_mutex_lock(&self->lock);
+	while (!data->done)
+		g_cond_wait(&self->cond, &self->lock);
+	g_mutex_unlock(&self->lock);
+
+	if (data->stale)
+		return NULL;
+
+	return comicreader_image_dup(data->item.image);
 }
 
 /* called on background thread */
-static void load_in_background(void *p, void *unused)
+static void load_in_background(struct ComicReaderDecodeTask *task)
 {
-	struct BackgroundLoadData *data = p;
+	struct BackgroundLoadData *data = (struct BackgroundLoadData *)task;
 	struct ComicReaderBackgroundImageLoader *self = data->self;
 
 	debug_printf("loading index %zu in bg\n", data->item.index);
 
-	data->item.image = self->inner_loader->get_image(self->inner_loader, data->item.index);
+	g_mutex_lock(&self->lock);
+	size_t index = data->item.index;
+	bool dropped = data->dropped;
+	data->started = true;
+	g_mutex_unlock(&self->lock);
+
+	struct ComicReaderImage *image = NULL;
+	if (dropped) {
+		debug_printf("skipping dropped index %zu\n", index);
+	} else {
+		if (data->packed)
+			image = unpack_image(
+				data->packed,
+				data->name,
+				data->packed_width,
+				data->packed_height);
+		if (!image)
+			image = load_image(self, index, data->bytes, data->name);
+	}
+
+	g_mutex_lock(&self->lock);
+	data->item.image = image;
+	data->done = true;
+	g_cond_broadcast(&self->cond);
+	g_mutex_unlock(&self->lock);
+
 	g_idle_add(&finish_load_in_background, data);
 }
 
@@ -228,32 +1453,98 @@ static gboolean finish_load_in_background(void *p)
 	struct BackgroundLoadData *data = p;
 	struct ComicReaderBackgroundImageLoader *self = data->self;
 
-	self->loading = false;
-	add_to_cache(self, data->item);
+	struct BackgroundLoadData **link = &self->in_flight;
+	while (*link != data)
+		link = &(*link)->next;
+	*link = data->next;
 
+	if (data->item.image && resolve_index(
+					     self,
+					     data->stale,
+					     data->item.image->name,
+					     &data->item.index))
+		add_to_cache(self, data->item);
+	else
+		comicreader_image_clear(&data->item.image);
+
+	if (data->bytes)
+		g_bytes_unref(data->bytes);
+	if (data->packed)
+		g_bytes_unref(data->packed);
+	free(data->name);
 	free(data);
 
 	/* skip background load if disposing */
-	if (self->ref_count >= 2)
+	if (!self->disposed && !self->in_flight)
 		start_load_in_background(self);
+	start_read_ahead(self);
+
+	unref(self);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* called on background thread */
+static void load_preview_in_background(struct ComicReaderDecodeTask *task)
+{
+	struct BackgroundLoadData *data = (struct BackgroundLoadData *)task;
+	struct ComicReaderBackgroundImageLoader *self = data->self;
+
+	if (data->generation == g_atomic_int_get(&self->preview_generation)) {
+		debug_printf("loading preview %zu in bg\n", data->item.index);
+		data->item.image =
+			self->inner_loader->get_preview(self->inner_loader, data->item.index);
+	}
+
+	g_idle_add(&finish_load_preview_in_background, data);
+}
+
+static gboolean finish_load_preview_in_background(void *p)
+{
+	struct BackgroundLoadData *data = p;
+	struct ComicReaderBackgroundImageLoader *self = data->self;
+	bool loaded = data->item.image &&
+		      resolve_index(self, false, data->item.image->name, &data->item.index);
+	size_t index = data->item.index;
+
+	if (loaded)
+		add_to_preview_cache(self, data->item);
+	else
+		comicreader_image_clear(&data->item.image);
+
+	free(data);
+
+	if (loaded)
+		comicreader_image_loader_notify(
+			&self->parent,
+			COMICREADER_IMAGE_LOADER_PREVIEW_READY,
+			index);
 
-	impl_free(&self->parent);
+	unref(self);
 
 	return G_SOURCE_REMOVE;
 }
 
+/* current_index itself if it's the first page and that doesn't wrap */
 static size_t get_prev_index(struct ComicReaderBackgroundImageLoader *self)
 {
 	size_t current = self->current_index;
 	size_t num_images = impl_get_num_images(&self->parent);
+	if (num_images == 0)
+		return 0;
 	if (current == 0)
-		return num_images - 1;
+		return self->wrap ? num_images - 1 : current;
 	else
 		return (current - 1) % num_images;
 }
 
+/* current_index itself if it's the last page and that doesn't wrap */
 static size_t get_next_index(struct ComicReaderBackgroundImageLoader *self)
 {
 	size_t num_images = impl_get_num_images(&self->parent);
+	if (num_images == 0)
+		return 0;
+	if (!self->wrap && self->current_index + 1 >= num_images)
+		return self->current_index;
 	return (self->current_index + 1) % num_images;
 }
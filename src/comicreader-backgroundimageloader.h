@@ -20,7 +20,15 @@
 
 #pragma once
 
+#include "comicreader-decodescheduler.h"
 #include "comicreader-imageloader.h"
 
+#include <gio/gio.h>
+
+/* In series mode, read from settings, the last page leads on to the next
+ * volume rather than back to the first, so neighbours and read-ahead stop
+ * at the ends. */
 struct ComicReaderImageLoader *comicreader_background_image_loader_new(
-	struct ComicReaderImageLoader *inner_loader);
+	struct ComicReaderImageLoader *inner_loader,
+	struct ComicReaderDecodeScheduler *scheduler,
+	GSettings *settings);
@@ -0,0 +1,297 @@
+/* comicreader-bulkreader.c
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include "comicreader-bulkreader.h"
+#include "comicreader-debug.h"
+#include "comicreader-qos.h"
+
+#include <stdbool.h>
+
+#ifdef HAVE_LIBURING
+#include <errno.h>
+#include <fcntl.h>
+#include <liburing.h>
+#include <sys/stat.h>
+#endif
+
+/* reads taken from the queue and issued together */
+#define BATCH_SIZE 32
+/* each read in a batch needs an open, a read and a close */
+#define RING_ENTRIES (BATCH_SIZE * 4)
+#define FALLBACK_THREADS 4
+
+struct ComicReaderBulkReader {
+	enum ComicReaderQos qos;
+	GThread *thread;
+	GAsyncQueue *queue;
+	GThreadPool *fallback_pool;
+#ifdef HAVE_LIBURING
+	struct io_uring ring;
+#endif
+};
+
+/* pushed to the queue to stop the ring thread */
+static struct ComicReaderBulkRead quit_marker;
+
+/* helper functions */
+static void read_with_gio(void *p, void *user_data);
+static void finish_read(struct ComicReaderBulkRead *read, void *buffer, gssize length);
+#ifdef HAVE_LIBURING
+static bool setup_ring(struct ComicReaderBulkReader *self);
+static gpointer ring_thread(gpointer p);
+static void read_batch(
+	struct ComicReaderBulkReader *self,
+	struct ComicReaderBulkRead **batch,
+	size_t n_batch);
+static void wait_for_completions(
+	struct ComicReaderBulkReader *self,
+	size_t n_completions,
+	int *results);
+#endif
+
+struct ComicReaderBulkReader *comicreader_bulk_reader_new(enum ComicReaderQos qos)
+{
+	struct ComicReaderBulkReader *ret;
+	ret = calloc(1, sizeof(struct ComicReaderBulkReader));
+	debug_init("ComicReaderBulkReader", ret);
+	ret->qos = qos;
+
+#ifdef HAVE_LIBURING
+	if (setup_ring(ret)) {
+		ret->queue = g_async_queue_new();
+		ret->thread = g_thread_new("comicreader-io", ring_thread, ret);
+		return ret;
+	}
+#endif
+
+	/* one blocking open, read and close per file, on threads of our own
+	 * since they're reniced */
+	ret->fallback_pool = g_thread_pool_new(&read_with_gio, ret, FALLBACK_THREADS, TRUE, NULL);
+
+	return ret;
+}
+
+void comicreader_bulk_reader_submit(
+	struct ComicReaderBulkReader *self,
+	struct ComicReaderBulkRead **reads,
+	size_t n_reads)
+{
+	for (size_t i = 0; i < n_reads; ++i) {
+		reads[i]->bytes = NULL;
+		if (self->queue)
+			g_async_queue_push(self->queue, reads[i]);
+		else
+			g_thread_pool_push(self->fallback_pool, reads[i], NULL);
+	}
+}
+
+/* Outstanding reads are completed before this returns. */
+void comicreader_bulk_reader_free(struct ComicReaderBulkReader *self)
+{
+	if (self->thread) {
+		g_async_queue_push(self->queue, &quit_marker);
+		g_thread_join(self->thread);
+		g_async_queue_unref(self->queue);
+#ifdef HAVE_LIBURING
+		io_uring_queue_exit(&self->ring);
+#endif
+	}
+	if (self->fallback_pool)
+		g_thread_pool_free(self->fallback_pool, FALSE, TRUE);
+
+	debug_free("ComicReaderBulkReader", self);
+	free(self);
+}
+
+/* called on background thread */
+static void read_with_gio(void *p, void *user_data)
+{
+	struct ComicReaderBulkRead *read = p;
+	struct ComicReaderBulkReader *self = user_data;
+	char *contents = NULL;
+	gsize length = 0;
+
+	comicreader_qos_apply(self->qos);
+
+	if (g_file_get_contents(read->path, &contents, &length, NULL))
+		finish_read(read, contents, length);
+	else
+		finish_read(read, NULL, -1);
+}
+
+/* takes ownership of buffer, a negative length means the read failed */
+static void finish_read(struct ComicReaderBulkRead *read, void *buffer, gssize length)
+{
+	if (length >= 0) {
+		read->bytes = g_bytes_new_take(buffer, length);
+	} else {
+		g_free(buffer);
+		read->bytes = NULL;
+	}
+	read->done(read);
+}
+
+#ifdef HAVE_LIBURING
+
+static bool setup_ring(struct ComicReaderBulkReader *self)
+{
+	int ret = io_uring_queue_init(RING_ENTRIES, &self->ring, 0);
+	if (ret < 0) {
+		debug_printf("io_uring unavailable: %s\n", g_strerror(-ret));
+		return false;
+	}
+
+	/* files are opened straight into the fixed file table so that the
+	 * open, read and close of a file can be linked */
+	ret = io_uring_register_files_sparse(&self->ring, BATCH_SIZE);
+	if (ret < 0) {
+		debug_printf("io_uring fixed files unavailable: %s\n", g_strerror(-ret));
+		io_uring_queue_exit(&self->ring);
+		return false;
+	}
+
+	return true;
+}
+
+static gpointer ring_thread(gpointer p)
+{
+	struct ComicReaderBulkReader *self = p;
+	struct ComicReaderBulkRead *batch[BATCH_SIZE];
+	bool quit = false;
+
+	/* the ring's reads take the I/O priority of the thread submitting them */
+	comicreader_qos_apply(self->qos);
+
+	while (!quit) {
+		size_t n_batch = 0;
+		struct ComicReaderBulkRead *read = g_async_queue_pop(self->queue);
+
+		/* gather whatever else has been queued meanwhile */
+		while (read) {
+			if (read == &quit_marker) {
+				quit = true;
+				break;
+			}
+			batch[n_batch++] = read;
+			if (n_batch == BATCH_SIZE)
+				break;
+			read = g_async_queue_try_pop(self->queue);
+		}
+
+		if (n_batch > 0)
+			read_batch(self, batch, n_batch);
+	}
+
+	return NULL;
+}
+
+/* Two submissions per batch: one to learn the file sizes, then one with a
+ * linked open, read and close for every file. */
+static void read_batch(
+	struct ComicReaderBulkReader *self,
+	struct ComicReaderBulkRead **batch,
+	size_t n_batch)
+{
+	struct statx stx[BATCH_SIZE];
+	int stat_results[BATCH_SIZE];
+	int read_results[BATCH_SIZE];
+	void *buffers[BATCH_SIZE] = {NULL};
+
+	debug_printf("reading batch of %zu files\n", n_batch);
+
+	for (size_t i = 0; i < n_batch; ++i) {
+		struct io_uring_sqe *sqe = io_uring_get_sqe(&self->ring);
+		io_uring_prep_statx(sqe, AT_FDCWD, batch[i]->path, 0, STATX_SIZE, &stx[i]);
+		io_uring_sqe_set_data64(sqe, i);
+	}
+	io_uring_submit(&self->ring);
+	wait_for_completions(self, n_batch, stat_results);
+
+	size_t n_submitted = 0;
+	for (size_t i = 0; i < n_batch; ++i) {
+		read_results[i] = -1;
+		if (stat_results[i] < 0)
+			continue;
+
+		size_t size = stx[i].stx_size;
+		buffers[i] = g_malloc(MAX(1, size));
+
+		struct io_uring_sqe *sqe = io_uring_get_sqe(&self->ring);
+		io_uring_prep_openat_direct(sqe, AT_FDCWD, batch[i]->path, O_RDONLY, 0, i);
+		io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+		io_uring_sqe_set_data64(sqe, BATCH_SIZE + i);
+
+		sqe = io_uring_get_sqe(&self->ring);
+		io_uring_prep_read(sqe, i, buffers[i], size, 0);
+		io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE | IOSQE_IO_LINK);
+		io_uring_sqe_set_data64(sqe, i);
+
+		sqe = io_uring_get_sqe(&self->ring);
+		io_uring_prep_close_direct(sqe, i);
+		io_uring_sqe_set_data64(sqe, BATCH_SIZE + i);
+
+		n_submitted += 3;
+	}
+	if (n_submitted > 0) {
+		io_uring_submit(&self->ring);
+		wait_for_completions(self, n_submitted, read_results);
+	}
+
+	for (size_t i = 0; i < n_batch; ++i) {
+		/* the file shrank since it was stat'd, or its filesystem returns
+		 * less than asked, so it's read again the usual way */
+		if (read_results[i] >= 0 && (size_t)read_results[i] < stx[i].stx_size) {
+			debug_printf("short read of %s, reading it again\n", batch[i]->path);
+			g_free(buffers[i]);
+			read_with_gio(batch[i], self);
+			continue;
+		}
+		finish_read(batch[i], buffers[i], read_results[i]);
+	}
+}
+
+/* results are indexed by the user data of each completion, those at or
+ * above BATCH_SIZE are only waited for */
+static void wait_for_completions(
+	struct ComicReaderBulkReader *self,
+	size_t n_completions,
+	int *results)
+{
+	for (size_t seen = 0; seen < n_completions; ++seen) {
+		struct io_uring_cqe *cqe;
+		int ret;
+		do {
+			ret = io_uring_wait_cqe(&self->ring, &cqe);
+		} while (ret == -EINTR);
+		if (ret < 0)
+			abort_printf("io_uring_wait_cqe: %s\n", g_strerror(-ret));
+
+		__u64 data = io_uring_cqe_get_data64(cqe);
+		if (data < BATCH_SIZE)
+			results[data] = cqe->res;
+		io_uring_cqe_seen(&self->ring, cqe);
+	}
+}
+
+#endif
@@ -0,0 +1,47 @@
+/* comicreader-bulkreader.h
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+#include "comicreader-qos.h"
+
+/* A whole-file read, submitted together with others so that they can be
+ * issued to the kernel in one batch. */
+struct ComicReaderBulkRead {
+	/* in: absolute path of the file to read */
+	char *path;
+	/* out: contents of the file, or NULL on failure */
+	GBytes *bytes;
+	/* called on a background thread once bytes is set */
+	void (*done)(struct ComicReaderBulkRead *read);
+};
+
+struct ComicReaderBulkReader;
+
+/* Reads at the I/O priority of qos, which is also the CPU priority of its
+ * threads. */
+struct ComicReaderBulkReader *comicreader_bulk_reader_new(enum ComicReaderQos qos);
+void comicreader_bulk_reader_submit(
+	struct ComicReaderBulkReader *self,
+	struct ComicReaderBulkRead **reads,
+	size_t n_reads);
+void comicreader_bulk_reader_free(struct ComicReaderBulkReader *self);
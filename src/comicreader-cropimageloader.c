@@ -0,0 +1,569 @@
+/* comicreader-cropimageloader.c
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "comicreader-cropimageloader.h"
+#include "comicreader-debug.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* how far, per channel, a pixel may stray from the margin colour */
+#define TOLERANCE 40
+/* rows and columns with at most 1 in NOISE_RATIO differing pixels are still
+ * margin, so that dust and JPEG artifacts don't stop the crop */
+#define NOISE_RATIO 100
+/* a page that would lose more than this is probably mostly blank, not
+ * surrounded by margins */
+#define MIN_KEPT_RATIO 0.5
+
+/* four RGBA pixels */
+typedef guint8 v16u8 __attribute__((vector_size(16)));
+typedef guint32 v4u32 __attribute__((vector_size(16)));
+
+struct ComicReaderCropImageLoader {
+	struct ComicReaderImageLoader parent;
+	struct ComicReaderImageLoader *inner_loader;
+
+	/* images are cropped on background threads */
+	GMutex lock;
+	/* page name to struct CropRect */
+	GHashTable *crops;
+	char *cache_path;
+	bool dirty;
+};
+
+struct CropRect {
+	/* size of the uncropped image, to notice when a page is replaced */
+	int image_width;
+	int image_height;
+	int x;
+	int y;
+	int width;
+	int height;
+};
+
+/* interface implementations */
+static size_t impl_get_num_images(struct ComicReaderImageLoader *image_loader);
+static struct ComicReaderImage *impl_get_image(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index);
+static struct ComicReaderImage *impl_get_preview(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index);
+static bool impl_find_image(
+	struct ComicReaderImageLoader *image_loader,
+	const char *name,
+	size_t *index);
+static GBytes *impl_read_image(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index,
+	char **name);
+static struct ComicReaderImage *impl_decode_image(
+	struct ComicReaderImageLoader *image_loader,
+	const char *name,
+	GBytes *bytes,
+	const char *key);
+static void impl_read_images(
+	struct ComicReaderImageLoader *image_loader,
+	struct ComicReaderReadRequest **requests,
+	size_t num_requests);
+static char *impl_get_image_name(struct ComicReaderImageLoader *image_loader, size_t index);
+static char *impl_get_image_key(struct ComicReaderImageLoader *image_loader, const char *name);
+static void impl_free(struct ComicReaderImageLoader *image_loader);
+
+/* helper functions */
+static void inner_loader_event(
+	void *user_data,
+	enum ComicReaderImageLoaderEvent event,
+	size_t index);
+static struct ComicReaderImage *crop_image(
+	struct ComicReaderCropImageLoader *self,
+	struct ComicReaderImage *image);
+static bool lookup_crop(
+	struct ComicReaderCropImageLoader *self,
+	const char *name,
+	int image_width,
+	int image_height,
+	struct CropRect *crop);
+static void store_crop(
+	struct ComicReaderCropImageLoader *self,
+	const char *name,
+	const struct CropRect *crop);
+static struct CropRect detect_crop(const guchar *pixels, int width, int height, gsize stride);
+static void count_content(
+	const guchar *pixels,
+	int width,
+	int height,
+	gsize stride,
+	guint32 *row_counts,
+	guint32 *col_counts);
+static int first_above(const guint32 *counts, int length, guint32 threshold);
+static int last_above(const guint32 *counts, int length, guint32 threshold);
+static GdkTexture *crop_texture(
+	const guchar *pixels,
+	gsize stride,
+	const struct CropRect *crop);
+static void load_crops(struct ComicReaderCropImageLoader *self);
+static void save_crops(struct ComicReaderCropImageLoader *self);
+
+struct ComicReaderImageLoader *comicreader_crop_image_loader_new(
+	struct ComicReaderImageLoader *inner_loader,
+	const char *cache_path)
+{
+	struct ComicReaderCropImageLoader *ret;
+	ret = calloc(1, sizeof(struct ComicReaderCropImageLoader));
+	debug_init("ComicReaderCropImageLoader", ret);
+
+	ret->parent.free = impl_free;
+	ret->parent.get_num_images = impl_get_num_images;
+	ret->parent.get_image = impl_get_image;
+	ret->parent.get_preview = impl_get_preview;
+	ret->parent.find_image = impl_find_image;
+	if (inner_loader->read_image) {
+		ret->parent.read_image = impl_read_image;
+		ret->parent.decode_image = impl_decode_image;
+	}
+	if (inner_loader->read_images)
+		ret->parent.read_images = impl_read_images;
+	ret->parent.get_image_name = impl_get_image_name;
+	ret->parent.get_image_key = impl_get_image_key;
+
+	ret->inner_loader = inner_loader;
+	comicreader_image_loader_set_listener(inner_loader, inner_loader_event, ret);
+
+	g_mutex_init(&ret->lock);
+	ret->crops = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+	if (cache_path) {
+		ret->cache_path = strdup(cache_path);
+		load_crops(ret);
+	}
+
+	g_assert((void *)ret == (void *)&ret->parent);
+	return &ret->parent;
+}
+
+static size_t impl_get_num_images(struct ComicReaderImageLoader *image_loader)
+{
+	struct ComicReaderCropImageLoader *self = (struct ComicReaderCropImageLoader *)image_loader;
+
+	return self->inner_loader->get_num_images(self->inner_loader);
+}
+
+static struct ComicReaderImage *impl_get_image(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index)
+{
+	struct ComicReaderCropImageLoader *self = (struct ComicReaderCropImageLoader *)image_loader;
+
+	return crop_image(self, self->inner_loader->get_image(self->inner_loader, index));
+}
+
+/* previews are only glanced at while scrubbing, leave them whole */
+static struct ComicReaderImage *impl_get_preview(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index)
+{
+	struct ComicReaderCropImageLoader *self = (struct ComicReaderCropImageLoader *)image_loader;
+
+	return comicreader_image_loader_get_preview(self->inner_loader, index);
+}
+
+static bool impl_find_image(
+	struct ComicReaderImageLoader *image_loader,
+	const char *name,
+	size_t *index)
+{
+	struct ComicReaderCropImageLoader *self = (struct ComicReaderCropImageLoader *)image_loader;
+
+	return comicreader_image_loader_find(self->inner_loader, name, index);
+}
+
+static GBytes *impl_read_image(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index,
+	char **name)
+{
+	struct ComicReaderCropImageLoader *self = (struct ComicReaderCropImageLoader *)image_loader;
+
+	return self->inner_loader->read_image(self->inner_loader, index, name);
+}
+
+static struct ComicReaderImage *impl_decode_image(
+	struct ComicReaderImageLoader *image_loader,
+	const char *name,
+	GBytes *bytes,
+	const char *key)
+{
+	struct ComicReaderCropImageLoader *self = (struct ComicReaderCropImageLoader *)image_loader;
+
+	return crop_image(
+		self,
+		self->inner_loader->decode_image(self->inner_loader, name, bytes, key));
+}
+
+static void impl_read_images(
+	struct ComicReaderImageLoader *image_loader,
+	struct ComicReaderReadRequest **requests,
+	size_t num_requests)
+{
+	struct ComicReaderCropImageLoader *self = (struct ComicReaderCropImageLoader *)image_loader;
+
+	self->inner_loader->read_images(self->inner_loader, requests, num_requests);
+}
+
+static char *impl_get_image_name(struct ComicReaderImageLoader *image_loader, size_t index)
+{
+	struct ComicReaderCropImageLoader *self = (struct ComicReaderCropImageLoader *)image_loader;
+
+	return comicreader_image_loader_get_name(self->inner_loader, index);
+}
+
+static char *impl_get_image_key(struct ComicReaderImageLoader *image_loader, const char *name)
+{
+	struct ComicReaderCropImageLoader *self = (struct ComicReaderCropImageLoader *)image_loader;
+
+	char *key = comicreader_image_loader_get_key(self->inner_loader, name);
+	if (!key)
+		return NULL;
+
+	char *ret = g_strdup_printf("%s#crop", key);
+	g_free(key);
+	return ret;
+}
+
+static void impl_free(struct ComicReaderImageLoader *image_loader)
+{
+	struct ComicReaderCropImageLoader *self = (struct ComicReaderCropImageLoader *)image_loader;
+
+	/* the inner loader may still be cropping on a background thread */
+	comicreader_image_loader_clear(&self->inner_loader);
+
+	if (self->dirty)
+		save_crops(self);
+	g_hash_table_unref(self->crops);
+	free(self->cache_path);
+	g_mutex_clear(&self->lock);
+	debug_free("ComicReaderCropImageLoader", self);
+	free(self);
+}
+
+static void inner_loader_event(
+	void *user_data,
+	enum ComicReaderImageLoaderEvent event,
+	size_t index)
+{
+	struct ComicReaderCropImageLoader *self = user_data;
+
+	comicreader_image_loader_notify(&self->parent, event, index);
+}
+
+/* called on background thread */
+static struct ComicReaderImage *crop_image(
+	struct ComicReaderCropImageLoader *self,
+	struct ComicReaderImage *image)
+{
+	/* frames of an animation may differ in margins */
+	if (!image || !image->texture || image->animation)
+		return image;
+
+	int width = gdk_texture_get_width(image->texture);
+	int height = gdk_texture_get_height(image->texture);
+	struct CropRect crop;
+	bool known = lookup_crop(self, image->name, width, height, &crop);
+	if (known && crop.width == width && crop.height == height)
+		return image;
+
+	GdkTextureDownloader *downloader = gdk_texture_downloader_new(image->texture);
+	gdk_texture_downloader_set_format(downloader, GDK_MEMORY_R8G8B8A8_PREMULTIPLIED);
+	gsize stride;
+	GBytes *bytes = gdk_texture_downloader_download_bytes(downloader, &stride);
+	gdk_texture_downloader_free(downloader);
+	const guchar *pixels = g_bytes_get_data(bytes, NULL);
+
+	if (!known) {
+		crop = detect_crop(pixels, width, height, stride);
+		store_crop(self, image->name, &crop);
+		debug_printf(
+			"%s: content at %ix%i+%i+%i of %ix%i\n",
+			image->name,
+			crop.width,
+			crop.height,
+			crop.x,
+			crop.y,
+			width,
+			height);
+	}
+
+	if (crop.width != width || crop.height != height) {
+		g_object_unref(image->texture);
+		image->texture = crop_texture(pixels, stride, &crop);
+		/* a page laid out at another size than its pixels loses the
+		 * same share of it */
+		if (image->width && image->height) {
+			double x_scale = (double)crop.width / width;
+			double y_scale = (double)crop.height / height;
+			image->width = MAX(1, lround(image->width * x_scale));
+			image->height = MAX(1, lround(image->height * y_scale));
+		}
+	}
+	g_bytes_unref(bytes);
+
+	return image;
+}
+
+static bool lookup_crop(
+	struct ComicReaderCropImageLoader *self,
+	const char *name,
+	int image_width,
+	int image_height,
+	struct CropRect *crop)
+{
+	if (!name)
+		return false;
+
+	g_mutex_lock(&self->lock);
+	struct CropRect *found = g_hash_table_lookup(self->crops, name);
+	bool ret = found && found->image_width == image_width &&
+		   found->image_height == image_height;
+	if (ret)
+		*crop = *found;
+	g_mutex_unlock(&self->lock);
+
+	return ret;
+}
+
+static void store_crop(
+	struct ComicReaderCropImageLoader *self,
+	const char *name,
+	const struct CropRect *crop)
+{
+	if (!name)
+		return;
+
+	struct CropRect *copy = malloc(sizeof(*copy));
+	*copy = *crop;
+
+	g_mutex_lock(&self->lock);
+	g_hash_table_replace(self->crops, strdup(name), copy);
+	self->dirty = true;
+	g_mutex_unlock(&self->lock);
+}
+
+static struct CropRect detect_crop(const guchar *pixels, int width, int height, gsize stride)
+{
+	struct CropRect ret = {width, height, 0, 0, width, height};
+
+	guint32 *row_counts = g_new0(guint32, height);
+	guint32 *col_counts = g_new0(guint32, width);
+	count_content(pixels, width, height, stride, row_counts, col_counts);
+
+	int top = first_above(row_counts, height, width / NOISE_RATIO);
+	int bottom = last_above(row_counts, height, width / NOISE_RATIO);
+	int left = first_above(col_counts, width, height / NOISE_RATIO);
+	int right = last_above(col_counts, width, height / NOISE_RATIO);
+
+	g_free(col_counts);
+	g_free(row_counts);
+
+	if (top < 0 || left < 0)
+		return ret;
+	if (right - left + 1 < width * MIN_KEPT_RATIO || bottom - top + 1 < height * MIN_KEPT_RATIO)
+		return ret;
+
+	ret.x = left;
+	ret.y = top;
+	ret.width = right - left + 1;
+	ret.height = bottom - top + 1;
+	return ret;
+}
+
+/* Counts, for every row and column, the pixels that differ from the margin
+ * colour.  The margin colour is taken from the top left corner; as margins
+ * surround the page, any corner would do.  Four pixels are compared at a
+ * time. */
+static void count_content(
+	const guchar *pixels,
+	int width,
+	int height,
+	gsize stride,
+	guint32 *row_counts,
+	guint32 *col_counts)
+{
+	const guchar *corner = pixels;
+	v16u8 margin;
+	for (int i = 0; i < 16; ++i)
+		margin[i] = corner[i % 4];
+	/* compare colour only */
+	const v16u8 channel_mask = {
+		0xff, 0xff, 0xff, 0, 0xff, 0xff, 0xff, 0, 0xff, 0xff, 0xff, 0, 0xff, 0xff, 0xff, 0};
+	const v16u8 tolerance = {
+		TOLERANCE, TOLERANCE, TOLERANCE, TOLERANCE, TOLERANCE, TOLERANCE,
+		TOLERANCE, TOLERANCE, TOLERANCE, TOLERANCE, TOLERANCE, TOLERANCE,
+		TOLERANCE, TOLERANCE, TOLERANCE, TOLERANCE};
+	int vector_width = width & ~3;
+
+	for (int y = 0; y < height; ++y) {
+		const guchar *row = pixels + y * stride;
+		v4u32 row_count = {0, 0, 0, 0};
+
+		for (int x = 0; x < vector_width; x += 4) {
+			v16u8 p;
+			memcpy(&p, row + 4 * x, sizeof(p));
+			v16u8 above = (v16u8)(p > margin);
+			v16u8 diff = ((p - margin) & above) | ((margin - p) & ~above);
+			v16u8 differs = (v16u8)(diff > tolerance) & channel_mask;
+			/* all ones for each pixel with any channel out of tolerance */
+			v4u32 content = (v4u32)((v4u32)differs != 0);
+
+			row_count -= content;
+			v4u32 col;
+			memcpy(&col, col_counts + x, sizeof(col));
+			col -= content;
+			memcpy(col_counts + x, &col, sizeof(col));
+		}
+		row_counts[y] = row_count[0] + row_count[1] + row_count[2] + row_count[3];
+
+		for (int x = vector_width; x < width; ++x) {
+			bool content = false;
+			for (int c = 0; c < 3; ++c)
+				content |= abs(row[4 * x + c] - corner[c]) > TOLERANCE;
+			row_counts[y] += content;
+			col_counts[x] += content;
+		}
+	}
+}
+
+static int first_above(const guint32 *counts, int length, guint32 threshold)
+{
+	for (int i = 0; i < length; ++i) {
+		if (counts[i] > threshold)
+			return i;
+	}
+	return -1;
+}
+
+static int last_above(const guint32 *counts, int length, guint32 threshold)
+{
+	for (int i = length - 1; i >= 0; --i) {
+		if (counts[i] > threshold)
+			return i;
+	}
+	return -1;
+}
+
+/* copies the crop out, so that the margins don't stay in memory */
+static GdkTexture *crop_texture(const guchar *pixels, gsize stride, const struct CropRect *crop)
+{
+	gsize dst_stride = (gsize)crop->width * 4;
+	guchar *dst = g_malloc_n(crop->height, dst_stride);
+	for (int y = 0; y < crop->height; ++y) {
+		memcpy(dst + y * dst_stride,
+		       pixels + (crop->y + y) * stride + crop->x * 4,
+		       dst_stride);
+	}
+
+	GBytes *bytes = g_bytes_new_take(dst, crop->height * dst_stride);
+	GdkTexture *ret = gdk_memory_texture_new(
+		crop->width,
+		crop->height,
+		GDK_MEMORY_R8G8B8A8_PREMULTIPLIED,
+		bytes,
+		dst_stride);
+	g_bytes_unref(bytes);
+
+	return ret;
+}
+
+/* The cache has one line per page: the uncropped size, the crop and the
+ * escaped page name, separated by spaces. */
+static void load_crops(struct ComicReaderCropImageLoader *self)
+{
+	char *contents = NULL;
+	GError *error = NULL;
+	if (!g_file_get_contents(self->cache_path, &contents, NULL, &error)) {
+		if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+			debug_printf("cannot read %s: %s\n", self->cache_path, error->message);
+		g_clear_error(&error);
+		return;
+	}
+
+	char **lines = g_strsplit(contents, "\n", -1);
+	for (char **line = lines; *line; ++line) {
+		struct CropRect crop;
+		int name_start = 0;
+		int n = sscanf(
+			*line,
+			"%d %d %d %d %d %d %n",
+			&crop.image_width,
+			&crop.image_height,
+			&crop.x,
+			&crop.y,
+			&crop.width,
+			&crop.height,
+			&name_start);
+		if (n != 6 || name_start == 0)
+			continue;
+
+		struct CropRect *copy = malloc(sizeof(*copy));
+		*copy = crop;
+		char *name = g_strcompress(*line + name_start);
+		g_hash_table_replace(self->crops, strdup(name), copy);
+		g_free(name);
+	}
+	g_strfreev(lines);
+	g_free(contents);
+}
+
+static void save_crops(struct ComicReaderCropImageLoader *self)
+{
+	GString *contents = g_string_new(NULL);
+	GHashTableIter iter;
+	const char *name;
+	const struct CropRect *crop;
+	g_hash_table_iter_init(&iter, self->crops);
+	while (g_hash_table_iter_next(&iter, (void **)&name, (void **)&crop)) {
+		char *escaped = g_strescape(name, NULL);
+		g_string_append_printf(
+			contents,
+			"%d %d %d %d %d %d %s\n",
+			crop->image_width,
+			crop->image_height,
+			crop->x,
+			crop->y,
+			crop->width,
+			crop->height,
+			escaped);
+		g_free(escaped);
+	}
+
+	char *dir = g_path_get_dirname(self->cache_path);
+	GError *error = NULL;
+	if (g_mkdir_with_parents(dir, 0700) != 0) {
+		debug_printf("cannot create %s: %s\n", dir, g_strerror(errno));
+	} else if (!g_file_set_contents(self->cache_path, contents->str, contents->len, &error)) {
+		debug_printf("cannot write %s: %s\n", self->cache_path, error->message);
+		g_clear_error(&error);
+	}
+	g_free(dir);
+	g_string_free(contents, TRUE);
+}
@@ -0,0 +1,430 @@
+/* comicreader-decodescheduler.c
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "comicreader-decodescheduler.h"
+#include "comicreader-debug.h"
+
+#include <string.h>
+
+/* leave a core for the main thread, counting every worker of every class */
+#define MAX_DECODE_THREADS 4
+#define CACHE_BUDGET (512 * 1024 * 1024)
+
+struct ComicReaderDecodeScheduler {
+	/* Each class has workers of its own, since a worker can't have its
+	 * priority raised again once lowered.  Pushing a task pushes a token
+	 * to the pool of its class, and the worker that takes the token runs
+	 * the best task of that class from queued, so that a promoted task can
+	 * move pools and one whose token comes first may still run later. */
+	GThreadPool *high_thread_pool;
+	GThreadPool *normal_thread_pool;
+	GThreadPool *idle_thread_pool;
+	GThreadPool *preview_thread_pool;
+	const void *focused;
+
+	/* also numbers the tasks of every class, which may be pushed from any
+	 * thread */
+	GMutex queue_lock;
+	guint64 sequence;
+	/* of struct ComicReaderDecodeTask, COMICREADER_QOS_HIGH and
+	 * COMICREADER_QOS_NORMAL only */
+	GQueue queued;
+
+	GMutex lock;
+	GCond cond;
+	/* key to struct CacheEntry */
+	GHashTable *cache;
+	size_t cached;
+	guint64 use_count;
+};
+
+struct CacheEntry {
+	/* NULL while being decoded */
+	struct ComicReaderImage *image;
+	size_t size;
+	guint64 last_used;
+	bool decoding;
+	/* forgotten while being decoded, drop the result */
+	bool stale;
+};
+
+static void run_high_task(void *p, void *user_data);
+static void run_normal_task(void *p, void *user_data);
+static void run_task(struct ComicReaderDecodeTask *task, enum ComicReaderQos qos);
+static void run_preview_task(void *p, void *user_data);
+static void run_idle_task(void *p, void *user_data);
+static gint compare_tasks(gconstpointer a, gconstpointer b, gpointer user_data);
+static void free_entry(void *p);
+static void evict(struct ComicReaderDecodeScheduler *self);
+
+struct ComicReaderDecodeScheduler *comicreader_decode_scheduler_new(void)
+{
+	struct ComicReaderDecodeScheduler *ret;
+	ret = calloc(1, sizeof(struct ComicReaderDecodeScheduler));
+	debug_init("ComicReaderDecodeScheduler", ret);
+
+	g_mutex_init(&ret->queue_lock);
+	g_queue_init(&ret->queued);
+
+	/* Prefetching and packing get a worker each and the page on screen
+	 * gets the rest, so every class together stays within the budget.
+	 * A machine too small to spare them still gets one of each, as those
+	 * two are niced and only take what the page on screen leaves. */
+	int num_threads = CLAMP((int)g_get_num_processors() - 1, 1, MAX_DECODE_THREADS);
+	ret->high_thread_pool = g_thread_pool_new(
+		&run_high_task,
+		ret,
+		MAX(num_threads - 2, 1),
+		FALSE,
+		NULL);
+	/* exclusive, since their workers are niced for good */
+	ret->normal_thread_pool = g_thread_pool_new(&run_normal_task, ret, 1, TRUE, NULL);
+	ret->idle_thread_pool = g_thread_pool_new(&run_idle_task, ret, 1, TRUE, NULL);
+	ret->preview_thread_pool = g_thread_pool_new(&run_preview_task, ret, 1, FALSE, NULL);
+	g_thread_pool_set_sort_function(ret->idle_thread_pool, compare_tasks, ret);
+	g_thread_pool_set_sort_function(ret->preview_thread_pool, compare_tasks, ret);
+
+	g_mutex_init(&ret->lock);
+	g_cond_init(&ret->cond);
+	ret->cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_entry);
+
+	return ret;
+}
+
+void comicreader_decode_scheduler_free(struct ComicReaderDecodeScheduler *self)
+{
+	/* queued tasks belong to loaders that are being torn down anyway */
+	g_thread_pool_free(self->high_thread_pool, TRUE, TRUE);
+	g_thread_pool_free(self->normal_thread_pool, TRUE, TRUE);
+	g_thread_pool_free(self->idle_thread_pool, TRUE, TRUE);
+	g_thread_pool_free(self->preview_thread_pool, TRUE, TRUE);
+	g_queue_clear(&self->queued);
+	g_mutex_clear(&self->queue_lock);
+
+	g_hash_table_unref(self->cache);
+	g_mutex_clear(&self->lock);
+	g_cond_clear(&self->cond);
+
+	debug_free("ComicReaderDecodeScheduler", self);
+	free(self);
+}
+
+void comicreader_decode_scheduler_push(
+	struct ComicReaderDecodeScheduler *self,
+	struct ComicReaderDecodeTask *task)
+{
+	task->thread = 0;
+	g_mutex_lock(&self->queue_lock);
+	task->sequence = ++self->sequence;
+	if (task->qos != COMICREADER_QOS_IDLE)
+		g_queue_push_tail(&self->queued, task);
+	g_mutex_unlock(&self->queue_lock);
+
+	switch (task->qos) {
+	case COMICREADER_QOS_HIGH:
+		g_thread_pool_push(self->high_thread_pool, self, NULL);
+		break;
+	case COMICREADER_QOS_NORMAL:
+		g_thread_pool_push(self->normal_thread_pool, self, NULL);
+		break;
+	case COMICREADER_QOS_IDLE:
+	default:
+		g_thread_pool_push(self->idle_thread_pool, task, NULL);
+		break;
+	}
+}
+
+void comicreader_decode_scheduler_push_preview(
+	struct ComicReaderDecodeScheduler *self,
+	struct ComicReaderDecodeTask *task)
+{
+	task->qos = COMICREADER_QOS_NORMAL;
+	task->thread = 0;
+	g_mutex_lock(&self->queue_lock);
+	task->sequence = ++self->sequence;
+	g_mutex_unlock(&self->queue_lock);
+	g_thread_pool_push(self->preview_thread_pool, task, NULL);
+}
+
+void comicreader_decode_scheduler_promote(
+	struct ComicReaderDecodeScheduler *self,
+	struct ComicReaderDecodeTask *task)
+{
+	if (g_atomic_int_get(&task->qos) != COMICREADER_QOS_NORMAL)
+		return;
+
+	/* a worker takes the task off the queue under the lock, then sets the
+	 * thread before it rechecks the class, so one of the two sees the
+	 * other */
+	g_mutex_lock(&self->queue_lock);
+	g_atomic_int_set(&task->qos, COMICREADER_QOS_HIGH);
+	bool queued = g_queue_find(&self->queued, task) != NULL;
+	g_mutex_unlock(&self->queue_lock);
+
+	if (queued) {
+		/* the prefetching worker will find nothing for its token */
+		debug_printf("promoting task %" G_GUINT64_FORMAT "\n", task->sequence);
+		g_thread_pool_push(self->high_thread_pool, self, NULL);
+	} else {
+		comicreader_qos_raise(g_atomic_int_get(&task->thread), COMICREADER_QOS_HIGH);
+	}
+}
+
+bool comicreader_decode_scheduler_cancel(
+	struct ComicReaderDecodeScheduler *self,
+	struct ComicReaderDecodeTask *task)
+{
+	/* its token finds nothing, like that of a promoted task */
+	g_mutex_lock(&self->queue_lock);
+	bool queued = g_queue_remove(&self->queued, task);
+	g_mutex_unlock(&self->queue_lock);
+
+	if (queued)
+		debug_printf("cancelled task %" G_GUINT64_FORMAT "\n", task->sequence);
+	return queued;
+}
+
+void comicreader_decode_scheduler_set_focused(
+	struct ComicReaderDecodeScheduler *self,
+	const void *owner,
+	bool focused)
+{
+	if (focused)
+		g_atomic_pointer_set(&self->focused, owner);
+	else
+		g_atomic_pointer_compare_and_exchange(&self->focused, owner, NULL);
+
+	/* setting the sort function again sorts what's already queued, which
+	 * the page and prefetching workers pick from as they go */
+	g_thread_pool_set_sort_function(self->idle_thread_pool, compare_tasks, self);
+	g_thread_pool_set_sort_function(self->preview_thread_pool, compare_tasks, self);
+}
+
+struct ComicReaderImage *comicreader_decode_scheduler_claim(
+	struct ComicReaderDecodeScheduler *self,
+	const char *key)
+{
+	struct ComicReaderImage *ret = NULL;
+
+	g_mutex_lock(&self->lock);
+	struct CacheEntry *entry;
+	while ((entry = g_hash_table_lookup(self->cache, key)) && entry->decoding) {
+		debug_printf("waiting for %s\n", key);
+		g_cond_wait(&self->cond, &self->lock);
+	}
+
+	if (entry) {
+		debug_printf("shared cache hit for %s\n", key);
+		entry->last_used = ++self->use_count;
+		ret = comicreader_image_dup(entry->image);
+	} else {
+		entry = calloc(1, sizeof(*entry));
+		entry->decoding = true;
+		g_hash_table_insert(self->cache, g_strdup(key), entry);
+	}
+	g_mutex_unlock(&self->lock);
+
+	return ret;
+}
+
+void comicreader_decode_scheduler_release(
+	struct ComicReaderDecodeScheduler *self,
+	const char *key,
+	struct ComicReaderImage *image)
+{
+	g_mutex_lock(&self->lock);
+	struct CacheEntry *entry = g_hash_table_lookup(self->cache, key);
+	g_assert(entry && entry->decoding);
+
+	if (image && !entry->stale) {
+		entry->image = comicreader_image_dup(image);
+		entry->size = comicreader_image_get_size(image);
+		entry->last_used = ++self->use_count;
+		entry->decoding = false;
+		self->cached += entry->size;
+		evict(self);
+	} else {
+		/* waiters will try to decode it themselves */
+		g_hash_table_remove(self->cache, key);
+	}
+
+	g_cond_broadcast(&self->cond);
+	g_mutex_unlock(&self->lock);
+}
+
+void comicreader_decode_scheduler_forget(
+	struct ComicReaderDecodeScheduler *self,
+	const char *key)
+{
+	g_mutex_lock(&self->lock);
+	struct CacheEntry *entry = g_hash_table_lookup(self->cache, key);
+	if (entry && entry->decoding) {
+		entry->stale = true;
+	} else if (entry) {
+		self->cached -= entry->size;
+		g_hash_table_remove(self->cache, key);
+	}
+	g_mutex_unlock(&self->lock);
+}
+
+void comicreader_decode_scheduler_get_usage(
+	struct ComicReaderDecodeScheduler *self,
+	size_t *cached,
+	size_t *budget)
+{
+	g_mutex_lock(&self->lock);
+	*cached = self->cached;
+	g_mutex_unlock(&self->lock);
+	*budget = CACHE_BUDGET;
+}
+
+/* Takes the first queued task of class qos, or returns NULL if another
+ * worker has already taken it or it has been promoted. */
+static struct ComicReaderDecodeTask *take_task(
+	struct ComicReaderDecodeScheduler *self,
+	enum ComicReaderQos qos)
+{
+	g_mutex_lock(&self->queue_lock);
+	GList *best = NULL;
+	for (GList *link = self->queued.head; link; link = link->next) {
+		struct ComicReaderDecodeTask *task = link->data;
+		if (g_atomic_int_get(&task->qos) != (int)qos)
+			continue;
+		if (!best || compare_tasks(task, best->data, self) < 0)
+			best = link;
+	}
+
+	struct ComicReaderDecodeTask *ret = NULL;
+	if (best) {
+		ret = best->data;
+		g_queue_delete_link(&self->queued, best);
+	}
+	g_mutex_unlock(&self->queue_lock);
+
+	return ret;
+}
+
+/* called on background thread */
+static void run_high_task(void *p, void *user_data)
+{
+	struct ComicReaderDecodeScheduler *self = user_data;
+	struct ComicReaderDecodeTask *task = take_task(self, COMICREADER_QOS_HIGH);
+	if (task)
+		run_task(task, COMICREADER_QOS_HIGH);
+}
+
+/* called on background thread */
+static void run_normal_task(void *p, void *user_data)
+{
+	struct ComicReaderDecodeScheduler *self = user_data;
+	comicreader_qos_apply(COMICREADER_QOS_NORMAL);
+	/* the page on screen can still be promoted past this meanwhile */
+	comicreader_qos_wait_while_interacting();
+	struct ComicReaderDecodeTask *task = take_task(self, COMICREADER_QOS_NORMAL);
+	if (task)
+		run_task(task, COMICREADER_QOS_NORMAL);
+}
+
+/* called on background thread */
+static void run_task(struct ComicReaderDecodeTask *task, enum ComicReaderQos qos)
+{
+	int thread = comicreader_qos_begin_task(qos);
+	g_atomic_int_set(&task->thread, thread);
+	if (g_atomic_int_get(&task->qos) != (int)qos)
+		comicreader_qos_raise(thread, COMICREADER_QOS_HIGH);
+
+	/* may free the task */
+	task->run(task);
+	comicreader_qos_end_task();
+}
+
+/* called on background thread */
+static void run_preview_task(void *p, void *user_data)
+{
+	run_task(p, COMICREADER_QOS_NORMAL);
+}
+
+/* called on background thread */
+static void run_idle_task(void *p, void *user_data)
+{
+	struct ComicReaderDecodeTask *task = p;
+	comicreader_qos_apply(COMICREADER_QOS_IDLE);
+	comicreader_qos_wait_while_interacting();
+	task->run(task);
+}
+
+static gint compare_tasks(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+	const struct ComicReaderDecodeTask *task_a = a;
+	const struct ComicReaderDecodeTask *task_b = b;
+	struct ComicReaderDecodeScheduler *self = user_data;
+	const void *focused = g_atomic_pointer_get(&self->focused);
+
+	/* the page on screen, then prefetching */
+	int qos_a = g_atomic_int_get(&task_a->qos);
+	int qos_b = g_atomic_int_get(&task_b->qos);
+	if (qos_a != qos_b)
+		return qos_a < qos_b ? -1 : 1;
+
+	bool focused_a = focused && task_a->owner == focused;
+	bool focused_b = focused && task_b->owner == focused;
+	if (focused_a != focused_b)
+		return focused_a ? -1 : 1;
+
+	if (task_a->sequence < task_b->sequence)
+		return -1;
+	return task_a->sequence > task_b->sequence;
+}
+
+static void free_entry(void *p)
+{
+	struct CacheEntry *entry = p;
+	comicreader_image_clear(&entry->image);
+	free(entry);
+}
+
+/* drops least recently used images until back within budget */
+static void evict(struct ComicReaderDecodeScheduler *self)
+{
+	while (self->cached > CACHE_BUDGET) {
+		const char *oldest_key = NULL;
+		struct CacheEntry *oldest = NULL;
+
+		GHashTableIter iter;
+		const char *key;
+		struct CacheEntry *entry;
+		g_hash_table_iter_init(&iter, self->cache);
+		while (g_hash_table_iter_next(&iter, (void **)&key, (void **)&entry)) {
+			if (entry->decoding)
+				continue;
+			if (!oldest || entry->last_used < oldest->last_used) {
+				oldest_key = key;
+				oldest = entry;
+			}
+		}
+
+		if (!oldest)
+			return;
+
+		debug_printf("shared cache evicting %s\n", oldest_key);
+		self->cached -= oldest->size;
+		g_hash_table_remove(self->cache, oldest_key);
+	}
+}
@@ -0,0 +1,93 @@
+/* comicreader-decodescheduler.h
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "comicreader-imageloader.h"
+#include "comicreader-qos.h"
+
+/* Decodes images for every loader of the application on one set of worker
+ * threads, and keeps decoded images that loaders can share by key. */
+struct ComicReaderDecodeScheduler;
+
+/* Queued work, embedded at the start of the caller's own data. */
+struct ComicReaderDecodeTask {
+	/* called on a worker thread */
+	void (*run)(struct ComicReaderDecodeTask *task);
+	/* tasks of the focused owner run first, then in the order queued */
+	const void *owner;
+	guint64 sequence;
+	/* each class runs on workers of its own: pages on screen at full
+	 * priority, prefetching niced and held while the reader interacts,
+	 * and packing in idle time only; access atomically once pushed */
+	enum ComicReaderQos qos;
+	/* of the worker running the task, for comicreader_qos_raise */
+	int thread;
+};
+
+/* Tasks may be pushed, promoted and cancelled from any thread. */
+struct ComicReaderDecodeScheduler *comicreader_decode_scheduler_new(void);
+void comicreader_decode_scheduler_free(struct ComicReaderDecodeScheduler *self);
+
+void comicreader_decode_scheduler_push(
+	struct ComicReaderDecodeScheduler *self,
+	struct ComicReaderDecodeTask *task);
+/* previews have their own worker, at COMICREADER_QOS_NORMAL, so that they
+ * never wait behind pages */
+void comicreader_decode_scheduler_push_preview(
+	struct ComicReaderDecodeScheduler *self,
+	struct ComicReaderDecodeTask *task);
+/* Moves a task pushed at COMICREADER_QOS_NORMAL up to COMICREADER_QOS_HIGH,
+ * or raises the I/O priority of its worker if it has already started, e.g.
+ * because somebody is about to wait for it.  The caller keeps the task
+ * alive. */
+void comicreader_decode_scheduler_promote(
+	struct ComicReaderDecodeScheduler *self,
+	struct ComicReaderDecodeTask *task);
+/* Takes a task pushed at COMICREADER_QOS_HIGH or COMICREADER_QOS_NORMAL
+ * back off the queue, e.g. because its result is no longer wanted.
+ * Returns false if a worker has already started it. */
+bool comicreader_decode_scheduler_cancel(
+	struct ComicReaderDecodeScheduler *self,
+	struct ComicReaderDecodeTask *task);
+void comicreader_decode_scheduler_set_focused(
+	struct ComicReaderDecodeScheduler *self,
+	const void *owner,
+	bool focused);
+
+/* Returns a copy of the image cached under key, waiting for it if another
+ * thread is decoding it.  Otherwise returns NULL and the caller must decode
+ * it and pass the result, or NULL on failure, to _release. */
+struct ComicReaderImage *comicreader_decode_scheduler_claim(
+	struct ComicReaderDecodeScheduler *self,
+	const char *key);
+void comicreader_decode_scheduler_release(
+	struct ComicReaderDecodeScheduler *self,
+	const char *key,
+	struct ComicReaderImage *image);
+/* bytes of decoded images cached, and how many may be */
+void comicreader_decode_scheduler_get_usage(
+	struct ComicReaderDecodeScheduler *self,
+	size_t *cached,
+	size_t *budget);
+/* drops the image cached under key, e.g. because its file changed */
+void comicreader_decode_scheduler_forget(
+	struct ComicReaderDecodeScheduler *self,
+	const char *key);
@@ -19,28 +19,199 @@
  */
 
 #include "comicreader-directoryimageloader.h"
+#include "comicreader-animation.h"
+#include "comicreader-bulkreader.h"
 #include "comicreader-debug.h"
+#include "comicreader-paralleljpeg.h"
+#include "comicreader-qoi.h"
+#include "comicreader-slicer.h"
+
+/* height, in pixels, that previews are decoded at */
+#define PREVIEW_HEIGHT 256
+
+/* chapter folders within this many entries of a requested page are listed
+ * in the background */
+#define CHAPTER_LOOKAHEAD 8
+#define CHAPTER_LOOKBEHIND 2
+
+/* what listing a directory queries about each child */
+#define LIST_ATTRIBUTES                                                    \
+	G_FILE_ATTRIBUTE_STANDARD_NAME "," G_FILE_ATTRIBUTE_STANDARD_TYPE "," \
+	G_FILE_ATTRIBUTE_TIME_MODIFIED "," G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC
 
 struct ComicReaderDirectoryImageLoader {
 	struct ComicReaderImageLoader parent;
 	GFile *directory;
+	GFileMonitor *monitor;
+	/* only for local directories, others are read through GIO */
+	char *directory_path;
+	struct ComicReaderBulkReader *bulk_reader;
+	/* runs the bands of huge scans, NULL to decode them on one thread */
+	struct ComicReaderDecodeScheduler *scheduler;
+
+	/* the monitor updates child_filenames on the main thread while
+	 * images are loaded on background threads */
+	GMutex lock;
 	char **child_filenames;
 	size_t child_filenames_length;
+	size_t child_filenames_capacity;
+	/* chapter folders being listed, by name */
+	GHashTable *expanding;
+	GCancellable *cancellable;
+	/* struct DecodeFailure by name, so known bad pages aren't read again */
+	GHashTable *failures;
+	/* gint64 modification time by name, as of when the file was listed or
+	 * last seen to change, i.e. from before it was read */
+	GHashTable *mtimes;
+	/* struct IndexSize by name, from COMICREADER_INDEX_NAME until the file
+	 * changes */
+	GHashTable *index_sizes;
+};
+
+/* what an optimized page is laid out at */
+struct IndexSize {
+	int width;
+	int height;
+};
+
+/* A page that was read but couldn't be decoded.  It's tried again once
+ * the file changes; failures to read it are always retried. */
+struct DecodeFailure {
+	gint64 mtime;
+	char *error;
+};
+
+/* Subfolders are chapters, named with a trailing '/'.  Each stands in for
+ * its pages until it's listed, which replaces it with them. */
+struct ChapterListing {
+	char **names;
+	size_t length;
+	size_t capacity;
+	/* as in struct ComicReaderDirectoryImageLoader, NULL if empty */
+	GHashTable *mtimes;
+	GHashTable *index_sizes;
+};
+
+struct DirectoryRead {
+	/* must be first, the bulk reader hands it back to directory_read_done */
+	struct ComicReaderBulkRead read;
+	struct ComicReaderReadRequest *request;
+	char *filename;
 };
 
 /* interface implementations */
 static size_t impl_get_num_images(struct ComicReaderImageLoader *image_loader);
+static bool impl_find_image(
+	struct ComicReaderImageLoader *image_loader,
+	const char *name,
+	size_t *index);
 static struct ComicReaderImage *impl_get_image(
 	struct ComicReaderImageLoader *image_loader,
 	size_t index);
+static struct ComicReaderImage *impl_get_preview(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index);
+static GBytes *impl_read_image(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index,
+	char **name);
+static struct ComicReaderImage *impl_decode_image(
+	struct ComicReaderImageLoader *image_loader,
+	const char *name,
+	GBytes *bytes,
+	const char *key);
+static void impl_read_images(
+	struct ComicReaderImageLoader *image_loader,
+	struct ComicReaderReadRequest **requests,
+	size_t num_requests);
+static char *impl_get_image_name(struct ComicReaderImageLoader *image_loader, size_t index);
+static char *impl_get_image_key(struct ComicReaderImageLoader *image_loader, const char *name);
 static void impl_free(struct ComicReaderImageLoader *image_loader);
 
 /* helper functions */
+static char *dup_child_filename(struct ComicReaderDirectoryImageLoader *self, size_t index);
+static GFile *get_child_file(struct ComicReaderDirectoryImageLoader *self, const char *name);
+static struct ComicReaderImage *missing_image(void);
+static struct ComicReaderImage *chapter_image(char *name);
+static gint64 get_mtime(GFile *file);
+static gint64 get_info_mtime(GFileInfo *info);
+static GHashTable *new_mtimes(void);
+static void set_mtime(GHashTable *mtimes, const char *name, gint64 mtime);
+static void set_listed_mtime(
+	struct ComicReaderDirectoryImageLoader *self,
+	const char *name,
+	gint64 mtime);
+static void apply_index_size(
+	struct ComicReaderDirectoryImageLoader *self,
+	struct ComicReaderImage *image);
+static bool is_known_failure(struct ComicReaderDirectoryImageLoader *self, const char *name);
+static struct ComicReaderImage *failure_image(
+	struct ComicReaderDirectoryImageLoader *self,
+	char *name);
+static void remember_failure(
+	struct ComicReaderDirectoryImageLoader *self,
+	const char *name,
+	const char *error);
+static void forget_failure(struct ComicReaderDirectoryImageLoader *self, const char *name);
+static void free_failure(void *p);
+static bool is_chapter(const char *name);
+static bool is_qoi(GBytes *bytes);
+static void list_chapter(struct ComicReaderDirectoryImageLoader *self, const char *chapter);
+static bool read_index(GFile *directory, struct ChapterListing *listing);
+static GHashTable *list_names(GFile *directory);
+static bool list_directory(
+	GFile *directory,
+	const char *prefix,
+	struct ChapterListing *listing,
+	GCancellable *cancellable,
+	GError **error);
+static void clear_listing(struct ChapterListing *listing);
+static void free_listing(void *p);
+static void expand_chapters_near(struct ComicReaderDirectoryImageLoader *self, size_t index);
+static void list_chapter_in_thread(
+	GTask *task,
+	gpointer source_object,
+	gpointer task_data,
+	GCancellable *cancellable);
+static void chapter_listed(GObject *source_object, GAsyncResult *result, gpointer data);
+static void expand_chapter(
+	struct ComicReaderDirectoryImageLoader *self,
+	const char *chapter,
+	struct ChapterListing *listing);
+static void decode_bytes(
+	struct ComicReaderDirectoryImageLoader *self,
+	struct ComicReaderImage *image,
+	GBytes *bytes);
+static void directory_read_done(struct ComicReaderBulkRead *read);
+static void directory_changed(
+	GFileMonitor *monitor,
+	GFile *file,
+	GFile *other_file,
+	GFileMonitorEvent event_type,
+	gpointer user_data);
+static void insert_child(struct ComicReaderDirectoryImageLoader *self, GFile *file);
+static void insert_at(struct ComicReaderDirectoryImageLoader *self, size_t index, char *name);
+static void remove_child(struct ComicReaderDirectoryImageLoader *self, GFile *file);
+static void change_child(struct ComicReaderDirectoryImageLoader *self, GFile *file);
+static size_t lower_bound(struct ComicReaderDirectoryImageLoader *self, const char *name);
 static void strarray_append(char ***strarray, size_t *length, size_t *capacity, char *str);
 static int strcmpp(const void *str1p, const void *str2p);
 
-struct ComicReaderImageLoader *comicreader_directory_image_loader_new(GFile *directory)
+struct ComicReaderImageLoader *comicreader_directory_image_loader_new(
+	GFile *directory,
+	struct ComicReaderDecodeScheduler *scheduler)
 {
+	GError *error = NULL;
+	struct ChapterListing listing = {0};
+	if (read_index(directory, &listing)) {
+		debug_printf("read %zu pages from index\n", listing.length);
+	} else if (!list_directory(directory, "", &listing, NULL, &error)) {
+		debug_printf("cannot list directory: %s\n", error->message);
+		g_clear_error(&error);
+		g_object_unref(directory);
+		return NULL;
+	}
+
 	struct ComicReaderDirectoryImageLoader *ret;
 	ret = calloc(1, sizeof(struct ComicReaderDirectoryImageLoader));
 	debug_init("ComicReaderDirectoryImageLoader", ret);
@@ -48,52 +219,114 @@ struct ComicReaderImageLoader *comicreader_directory_image_loader_new(GFile *dir
 	ret->parent.free = impl_free;
 	ret->parent.get_num_images = impl_get_num_images;
 	ret->parent.get_image = impl_get_image;
+	ret->parent.get_preview = impl_get_preview;
+	ret->parent.find_image = impl_find_image;
+	ret->parent.read_image = impl_read_image;
+	ret->parent.decode_image = impl_decode_image;
+	ret->parent.get_image_name = impl_get_image_name;
+	ret->parent.get_image_key = impl_get_image_key;
 
 	ret->directory = directory;
+	ret->scheduler = scheduler;
+	ret->directory_path = g_file_get_path(directory);
+	if (ret->directory_path) {
+		/* everything read in bulk is read ahead */
+		ret->bulk_reader = comicreader_bulk_reader_new(COMICREADER_QOS_NORMAL);
+		ret->parent.read_images = impl_read_images;
+	}
 
-	GError *error = NULL;
-	GFileEnumerator *direnum = g_file_enumerate_children(
-		directory,
-		G_FILE_ATTRIBUTE_STANDARD_NAME,
-		G_FILE_QUERY_INFO_NONE,
-		NULL,
-		&error);
+	g_mutex_init(&ret->lock);
+	ret->child_filenames = listing.names;
+	ret->child_filenames_length = listing.length;
+	ret->child_filenames_capacity = listing.capacity;
+	ret->expanding = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+	ret->cancellable = g_cancellable_new();
+	ret->failures = g_hash_table_new_full(g_str_hash, g_str_equal, free, free_failure);
+	ret->mtimes = listing.mtimes ? listing.mtimes : new_mtimes();
+	ret->index_sizes = listing.index_sizes;
+	listing.index_sizes = NULL;
+	if (!ret->index_sizes)
+		ret->index_sizes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	/* the first page is shown straight away, later chapters are only
+	 * listed as the reader gets close to them */
+	while (ret->child_filenames_length > 0 && is_chapter(ret->child_filenames[0])) {
+		char *chapter = strdup(ret->child_filenames[0]);
+		list_chapter(ret, chapter);
+		free(chapter);
+	}
+
+	/* pick up pages of a chapter that is still being downloaded */
+	ret->monitor =
+		g_file_monitor_directory(directory, G_FILE_MONITOR_WATCH_MOVES, NULL, &error);
 	if (error) {
-		abort_printf("Error: %i %s\n", error->code, error->message);
+		debug_printf("cannot monitor directory: %s\n", error->message);
+		g_clear_error(&error);
+	} else {
+		g_signal_connect(ret->monitor, "changed", G_CALLBACK(directory_changed), ret);
 	}
 
-	char **filenames = NULL;
-	size_t filenames_length = 0;
-	size_t filenames_capacity = 0;
+	g_assert((void *)ret == (void *)&ret->parent);
+	return &ret->parent;
+}
 
+void comicreader_directory_image_loader_list_chapters(struct ComicReaderImageLoader *image_loader)
+{
+	struct ComicReaderDirectoryImageLoader *self =
+		(struct ComicReaderDirectoryImageLoader *)image_loader;
+
+	/* a chapter's first page takes its index, and may be a chapter
+	 * itself, so only move on once index holds a page */
+	size_t index = 0;
 	for (;;) {
-		GFileInfo *info;
-		if (!g_file_enumerator_iterate(direnum, &info, NULL, NULL, &error)) {
-			abort_printf("Error: %i %s\n", error->code, error->message);
-		}
-		if (!info)
+		g_mutex_lock(&self->lock);
+		char *name = NULL;
+		if (index < self->child_filenames_length)
+			name = strdup(self->child_filenames[index]);
+		g_mutex_unlock(&self->lock);
+		if (!name)
 			break;
-		const char *name =
-			g_file_info_get_attribute_file_path(info, G_FILE_ATTRIBUTE_STANDARD_NAME);
-		strarray_append(&filenames, &filenames_length, &filenames_capacity, strdup(name));
-	}
 
-	filenames = reallocarray(filenames, filenames_length, sizeof(char *));
+		if (is_chapter(name))
+			list_chapter(self, name);
+		else
+			++index;
+		free(name);
+	}
+}
 
-	qsort(filenames, filenames_length, sizeof(char *), strcmpp);
+static bool impl_find_image(
+	struct ComicReaderImageLoader *image_loader,
+	const char *name,
+	size_t *index)
+{
+	struct ComicReaderDirectoryImageLoader *self =
+		(struct ComicReaderDirectoryImageLoader *)image_loader;
 
-	ret->child_filenames = filenames;
-	ret->child_filenames_length = filenames_length;
+	g_mutex_lock(&self->lock);
+	const char **found = bsearch(
+		&name,
+		self->child_filenames,
+		self->child_filenames_length,
+		sizeof(char *),
+		strcmpp);
+	if (found)
+		*index = (char **)found - self->child_filenames;
+	g_mutex_unlock(&self->lock);
 
-	g_assert((void *)ret == (void *)&ret->parent);
-	return &ret->parent;
+	return found != NULL;
 }
 
 static size_t impl_get_num_images(struct ComicReaderImageLoader *image_loader)
 {
 	struct ComicReaderDirectoryImageLoader *self =
 		(struct ComicReaderDirectoryImageLoader *)image_loader;
-	return self->child_filenames_length;
+
+	g_mutex_lock(&self->lock);
+	size_t length = self->child_filenames_length;
+	g_mutex_unlock(&self->lock);
+
+	return length;
 }
 
 static struct ComicReaderImage *impl_get_image(
@@ -103,23 +336,34 @@ static struct ComicReaderImage *impl_get_image(
 	struct ComicReaderDirectoryImageLoader *self =
 		(struct ComicReaderDirectoryImageLoader *)image_loader;
 
-	if (index >= self->child_filenames_length)
-		abort_printf("index out of range\n");
-
-	const char *filename = self->child_filenames[index];
+	expand_chapters_near(self, index);
+	char *filename = dup_child_filename(self, index);
+	if (!filename)
+		return missing_image();
+	if (is_chapter(filename))
+		return chapter_image(filename);
+	if (is_known_failure(self, filename))
+		return failure_image(self, filename);
 
 	struct ComicReaderImage *ret = calloc(1, sizeof(struct ComicReaderImage));
-	ret->name = strdup(filename);
+	ret->name = filename;
 	ret->texture = NULL;
 	ret->error = NULL;
 
-	GFile *file = g_file_get_child(self->directory, filename);
+	/* read whole to keep the bytes of animated images */
+	GFile *file = get_child_file(self, filename);
 	GError *error = NULL;
-	ret->texture = gdk_texture_new_from_file(file, &error);
+	GBytes *bytes = g_file_load_bytes(file, NULL, NULL, &error);
+	if (bytes) {
+		decode_bytes(self, ret, bytes);
+		g_bytes_unref(bytes);
+		if (ret->error)
+			remember_failure(self, filename, ret->error);
+		else
+			apply_index_size(self, ret);
+	}
 	if (error) {
-		size_t sz = snprintf(NULL, 0, "%s (%i)", error->message, error->code) + 1;
-		ret->error = calloc(sz, sizeof(char));
-		snprintf(ret->error, sz, "%s (%i)", error->message, error->code);
+		comicreader_image_set_error(ret, error);
 		g_error_free(error);
 	}
 	g_clear_object(&file);
@@ -127,19 +371,966 @@ static struct ComicReaderImage *impl_get_image(
 	return ret;
 }
 
+static struct ComicReaderImage *impl_get_preview(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index)
+{
+	struct ComicReaderDirectoryImageLoader *self =
+		(struct ComicReaderDirectoryImageLoader *)image_loader;
+
+	expand_chapters_near(self, index);
+	char *filename = dup_child_filename(self, index);
+	if (!filename)
+		return missing_image();
+	if (is_chapter(filename))
+		return chapter_image(filename);
+
+	struct ComicReaderImage *ret = calloc(1, sizeof(struct ComicReaderImage));
+	ret->name = filename;
+
+	GFile *file = get_child_file(self, filename);
+	GError *error = NULL;
+
+	/* GdkPixbuf can't read QOI, but it decodes quickly enough to shrink */
+	if (g_str_has_suffix(filename, ".qoi")) {
+		GBytes *bytes = g_file_load_bytes(file, NULL, NULL, &error);
+		GdkTexture *texture = bytes ? comicreader_qoi_decode(bytes) : NULL;
+		if (texture) {
+			int width = gdk_texture_get_width(texture);
+			int height = gdk_texture_get_height(texture);
+			ret->texture = comicreader_texture_scale(
+				texture,
+				MAX(1, width * PREVIEW_HEIGHT / height),
+				PREVIEW_HEIGHT);
+			g_object_unref(texture);
+		} else if (bytes) {
+			ret->error = strdup("Invalid QOI image");
+		}
+		if (bytes)
+			g_bytes_unref(bytes);
+		if (error) {
+			comicreader_image_set_error(ret, error);
+			g_error_free(error);
+		}
+		g_clear_object(&file);
+		return ret;
+	}
+
+	/* decoding at scale lets the JPEG loader skip most of the IDCT work */
+	GFileInputStream *stream = g_file_read(file, NULL, &error);
+	GdkPixbuf *pixbuf = NULL;
+	if (stream) {
+		pixbuf = gdk_pixbuf_new_from_stream_at_scale(
+			G_INPUT_STREAM(stream),
+			-1,
+			PREVIEW_HEIGHT,
+			TRUE,
+			NULL,
+			&error);
+		g_clear_object(&stream);
+	}
+	if (pixbuf) {
+		ret->texture = gdk_texture_new_for_pixbuf(pixbuf);
+		g_clear_object(&pixbuf);
+	}
+	if (error) {
+		comicreader_image_set_error(ret, error);
+		g_error_free(error);
+	}
+	g_clear_object(&file);
+
+	return ret;
+}
+
+static GBytes *impl_read_image(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index,
+	char **name)
+{
+	struct ComicReaderDirectoryImageLoader *self =
+		(struct ComicReaderDirectoryImageLoader *)image_loader;
+
+	expand_chapters_near(self, index);
+	char *filename = dup_child_filename(self, index);
+	if (!filename)
+		return NULL;
+	/* get_image gives chapters and known bad pages their placeholder */
+	if (is_chapter(filename) || is_known_failure(self, filename)) {
+		free(filename);
+		return NULL;
+	}
+
+	GFile *file = get_child_file(self, filename);
+	GBytes *bytes = g_file_load_bytes(file, NULL, NULL, NULL);
+	g_clear_object(&file);
+
+	if (!bytes) {
+		free(filename);
+		return NULL;
+	}
+
+	*name = filename;
+	return bytes;
+}
+
+static struct ComicReaderImage *impl_decode_image(
+	struct ComicReaderImageLoader *image_loader,
+	const char *name,
+	GBytes *bytes,
+	const char *key)
+{
+	struct ComicReaderDirectoryImageLoader *self =
+		(struct ComicReaderDirectoryImageLoader *)image_loader;
+
+	struct ComicReaderImage *ret = calloc(1, sizeof(struct ComicReaderImage));
+	ret->name = strdup(name);
+	decode_bytes(self, ret, bytes);
+	if (ret->error)
+		remember_failure(self, name, ret->error);
+	else
+		apply_index_size(self, ret);
+
+	return ret;
+}
+
+static void impl_read_images(
+	struct ComicReaderImageLoader *image_loader,
+	struct ComicReaderReadRequest **requests,
+	size_t num_requests)
+{
+	struct ComicReaderDirectoryImageLoader *self =
+		(struct ComicReaderDirectoryImageLoader *)image_loader;
+
+	struct ComicReaderBulkRead **reads = calloc(num_requests, sizeof(*reads));
+	size_t num_reads = 0;
+
+	for (size_t i = 0; i < num_requests; ++i) {
+		struct ComicReaderReadRequest *request = requests[i];
+		expand_chapters_near(self, request->index);
+		char *filename = dup_child_filename(self, request->index);
+		if (filename && (is_chapter(filename) || is_known_failure(self, filename))) {
+			free(filename);
+			filename = NULL;
+		}
+		if (!filename) {
+			request->bytes = NULL;
+			request->name = NULL;
+			request->done(request);
+			continue;
+		}
+
+		struct DirectoryRead *data = calloc(1, sizeof(*data));
+		data->read.path = g_build_filename(self->directory_path, filename, NULL);
+		data->read.done = directory_read_done;
+		data->request = request;
+		data->filename = filename;
+		reads[num_reads++] = &data->read;
+	}
+
+	comicreader_bulk_reader_submit(self->bulk_reader, reads, num_reads);
+	free(reads);
+}
+
+static char *impl_get_image_name(struct ComicReaderImageLoader *image_loader, size_t index)
+{
+	struct ComicReaderDirectoryImageLoader *self =
+		(struct ComicReaderDirectoryImageLoader *)image_loader;
+
+	return dup_child_filename(self, index);
+}
+
+static char *impl_get_image_key(struct ComicReaderImageLoader *image_loader, const char *name)
+{
+	struct ComicReaderDirectoryImageLoader *self =
+		(struct ComicReaderDirectoryImageLoader *)image_loader;
+
+	GFile *file = get_child_file(self, name);
+	char *ret = g_file_get_uri(file);
+	g_object_unref(file);
+	return ret;
+}
+
 static void impl_free(struct ComicReaderImageLoader *image_loader)
 {
 	struct ComicReaderDirectoryImageLoader *self =
 		(struct ComicReaderDirectoryImageLoader *)image_loader;
+	if (self->monitor) {
+		g_signal_handlers_disconnect_by_data(self->monitor, self);
+		g_file_monitor_cancel(self->monitor);
+		g_clear_object(&self->monitor);
+	}
+	/* listings still running drop their results */
+	g_cancellable_cancel(self->cancellable);
+	g_clear_object(&self->cancellable);
+	g_hash_table_destroy(self->expanding);
+	g_hash_table_destroy(self->failures);
+	g_hash_table_destroy(self->mtimes);
+	g_hash_table_destroy(self->index_sizes);
+	/* waits for outstanding reads */
+	if (self->bulk_reader)
+		comicreader_bulk_reader_free(self->bulk_reader);
+	g_free(self->directory_path);
 	g_clear_object(&self->directory);
 	for (size_t i = 0; i < self->child_filenames_length; ++i) {
 		free(self->child_filenames[i]);
 	}
 	free(self->child_filenames);
+	g_mutex_clear(&self->lock);
 	debug_free("ComicReaderDirectoryImageLoader", self);
 	free(image_loader);
 }
 
+static char *dup_child_filename(struct ComicReaderDirectoryImageLoader *self, size_t index)
+{
+	char *filename = NULL;
+
+	g_mutex_lock(&self->lock);
+	if (index < self->child_filenames_length)
+		filename = strdup(self->child_filenames[index]);
+	g_mutex_unlock(&self->lock);
+
+	return filename;
+}
+
+/* names may have a chapter folder in front */
+static GFile *get_child_file(struct ComicReaderDirectoryImageLoader *self, const char *name)
+{
+	return g_file_resolve_relative_path(self->directory, name);
+}
+
+/* the file was removed between choosing the index and loading it */
+static struct ComicReaderImage *missing_image(void)
+{
+	struct ComicReaderImage *ret = calloc(1, sizeof(struct ComicReaderImage));
+	ret->error = strdup("File no longer exists");
+	return ret;
+}
+
+/* shown if the reader reaches a chapter before it has been listed */
+static struct ComicReaderImage *chapter_image(char *name)
+{
+	struct ComicReaderImage *ret = calloc(1, sizeof(struct ComicReaderImage));
+	ret->name = name;
+	ret->error = strdup("Loading chapter");
+	return ret;
+}
+
+/* modification time in microseconds, or -1 if it can't be queried */
+static gint64 get_mtime(GFile *file)
+{
+	GFileInfo *info = g_file_query_info(
+		file,
+		G_FILE_ATTRIBUTE_TIME_MODIFIED "," G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC,
+		G_FILE_QUERY_INFO_NONE,
+		NULL,
+		NULL);
+	if (!info)
+		return -1;
+	gint64 ret = get_info_mtime(info);
+	g_object_unref(info);
+	return ret;
+}
+
+static gint64 get_info_mtime(GFileInfo *info)
+{
+	if (!g_file_info_has_attribute(info, G_FILE_ATTRIBUTE_TIME_MODIFIED))
+		return -1;
+	guint64 seconds = g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+	guint32 usec = g_file_info_get_attribute_uint32(info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+	return seconds * G_USEC_PER_SEC + usec;
+}
+
+static GHashTable *new_mtimes(void)
+{
+	return g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+}
+
+/* forgets name's if mtime is -1 */
+static void set_mtime(GHashTable *mtimes, const char *name, gint64 mtime)
+{
+	if (mtime < 0) {
+		g_hash_table_remove(mtimes, name);
+		return;
+	}
+	gint64 *value = g_new(gint64, 1);
+	*value = mtime;
+	g_hash_table_replace(mtimes, g_strdup(name), value);
+}
+
+/* also forgets what the index said about name, as it's changed since */
+static void set_listed_mtime(
+	struct ComicReaderDirectoryImageLoader *self,
+	const char *name,
+	gint64 mtime)
+{
+	g_mutex_lock(&self->lock);
+	set_mtime(self->mtimes, name, mtime);
+	g_hash_table_remove(self->index_sizes, name);
+	g_mutex_unlock(&self->lock);
+}
+
+/* Lays an optimized page out at the size the index gives, which is the
+ * size of the page it was made from if that was kept as it was read. */
+static void apply_index_size(
+	struct ComicReaderDirectoryImageLoader *self,
+	struct ComicReaderImage *image)
+{
+	g_mutex_lock(&self->lock);
+	struct IndexSize *size = g_hash_table_lookup(self->index_sizes, image->name);
+	if (size) {
+		image->width = size->width;
+		image->height = size->height;
+	}
+	g_mutex_unlock(&self->lock);
+}
+
+/* The monitor forgets failures of files that change, so they're trusted
+ * without touching the disk.  It doesn't see into chapter folders, so
+ * their pages, like those of unmonitored directories, check the mtime. */
+static bool is_known_failure(struct ComicReaderDirectoryImageLoader *self, const char *name)
+{
+	g_mutex_lock(&self->lock);
+	struct DecodeFailure *failure = g_hash_table_lookup(self->failures, name);
+	gint64 mtime = failure ? failure->mtime : -1;
+	g_mutex_unlock(&self->lock);
+	if (!failure)
+		return false;
+	if (self->monitor && !strchr(name, '/'))
+		return true;
+
+	GFile *file = get_child_file(self, name);
+	gint64 current = get_mtime(file);
+	g_object_unref(file);
+	if (current == mtime)
+		return true;
+
+	/* it's read again after this, so the new mtime is from before that */
+	forget_failure(self, name);
+	set_listed_mtime(self, name, current);
+	return false;
+}
+
+/* takes ownership of name */
+static struct ComicReaderImage *failure_image(
+	struct ComicReaderDirectoryImageLoader *self,
+	char *name)
+{
+	struct ComicReaderImage *ret = calloc(1, sizeof(struct ComicReaderImage));
+	ret->name = name;
+
+	g_mutex_lock(&self->lock);
+	struct DecodeFailure *failure = g_hash_table_lookup(self->failures, name);
+	ret->error = strdup(failure ? failure->error : "Cannot decode image");
+	g_mutex_unlock(&self->lock);
+
+	return ret;
+}
+
+static void remember_failure(
+	struct ComicReaderDirectoryImageLoader *self,
+	const char *name,
+	const char *error)
+{
+	debug_printf("cannot decode %s: %s\n", name, error);
+
+	/* an mtime from after the read could belong to a fixed file, and
+	 * without one a fixed file couldn't be told apart at all */
+	g_mutex_lock(&self->lock);
+	gint64 *mtime = g_hash_table_lookup(self->mtimes, name);
+	if (mtime) {
+		struct DecodeFailure *failure = calloc(1, sizeof(*failure));
+		failure->mtime = *mtime;
+		failure->error = strdup(error);
+		g_hash_table_replace(self->failures, strdup(name), failure);
+	}
+	g_mutex_unlock(&self->lock);
+}
+
+static void forget_failure(struct ComicReaderDirectoryImageLoader *self, const char *name)
+{
+	g_mutex_lock(&self->lock);
+	g_hash_table_remove(self->failures, name);
+	g_mutex_unlock(&self->lock);
+}
+
+static void free_failure(void *p)
+{
+	struct DecodeFailure *failure = p;
+	free(failure->error);
+	free(failure);
+}
+
+static bool is_chapter(const char *name)
+{
+	size_t length = strlen(name);
+	return length > 0 && name[length - 1] == '/';
+}
+
+static bool is_qoi(GBytes *bytes)
+{
+	gsize size;
+	const char *data = g_bytes_get_data(bytes, &size);
+	return size >= 4 && memcmp(data, "qoif", 4) == 0;
+}
+
+/* Lists chapter and replaces it with its pages before returning. */
+static void list_chapter(struct ComicReaderDirectoryImageLoader *self, const char *chapter)
+{
+	GFile *directory = get_child_file(self, chapter);
+	struct ChapterListing listing = {0};
+	GError *error = NULL;
+	if (!list_directory(directory, chapter, &listing, NULL, &error)) {
+		debug_printf("cannot list %s: %s\n", chapter, error->message);
+		g_error_free(error);
+	}
+	expand_chapter(self, chapter, &listing);
+	g_object_unref(directory);
+}
+
+/* Fills listing from the directory's COMICREADER_INDEX_NAME, one
+ * "width height name" line per page after a version line.  Returns false if there's no index or it
+ * doesn't name exactly the directory's children, e.g. because pages were
+ * added since it was written. */
+static bool read_index(GFile *directory, struct ChapterListing *listing)
+{
+	GFile *index_file = g_file_get_child(directory, COMICREADER_INDEX_NAME);
+	char *contents = NULL;
+	bool loaded = g_file_load_contents(index_file, NULL, &contents, NULL, NULL, NULL);
+	g_object_unref(index_file);
+	if (!loaded)
+		return false;
+
+	char **lines = g_strsplit(contents, "\n", -1);
+	g_free(contents);
+	bool ok = lines[0] && strcmp(lines[0], "comicreader-index 2") == 0;
+	if (ok)
+		listing->index_sizes =
+			g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	for (size_t i = 1; ok && lines[i]; ++i) {
+		if (lines[i][0] == '\0')
+			continue;
+		struct IndexSize size;
+		int name_offset = 0;
+		if (sscanf(lines[i], "%i %i %n", &size.width, &size.height, &name_offset) != 2 ||
+		    name_offset == 0 || lines[i][name_offset] == '\0' || size.width <= 0 ||
+		    size.height <= 0) {
+			ok = false;
+			break;
+		}
+		const char *name = lines[i] + name_offset;
+		strarray_append(
+			&listing->names,
+			&listing->length,
+			&listing->capacity,
+			strdup(name));
+		struct IndexSize *value = g_new(struct IndexSize, 1);
+		*value = size;
+		g_hash_table_replace(listing->index_sizes, g_strdup(name), value);
+	}
+	g_strfreev(lines);
+
+	/* which is much cheaper than sorting them */
+	GHashTable *children = NULL;
+	if (ok)
+		children = list_names(directory);
+	ok = children && g_hash_table_size(children) == listing->length;
+	if (ok)
+		listing->mtimes = new_mtimes();
+	for (size_t i = 0; ok && i < listing->length; ++i) {
+		void *name;
+		void *mtime;
+		ok = g_hash_table_steal_extended(children, listing->names[i], &name, &mtime);
+		if (ok)
+			g_hash_table_replace(listing->mtimes, name, mtime);
+	}
+	if (children)
+		g_hash_table_unref(children);
+
+	if (!ok)
+		clear_listing(listing);
+	return ok;
+}
+
+/* Returns the names list_directory would list, unsorted, with their
+ * mtimes, or NULL on failure. */
+static GHashTable *list_names(GFile *directory)
+{
+	GFileEnumerator *direnum = g_file_enumerate_children(
+		directory,
+		LIST_ATTRIBUTES,
+		G_FILE_QUERY_INFO_NONE,
+		NULL,
+		NULL);
+	if (!direnum)
+		return NULL;
+
+	GHashTable *ret = new_mtimes();
+	for (;;) {
+		GFileInfo *info;
+		if (!g_file_enumerator_iterate(direnum, &info, NULL, NULL, NULL)) {
+			g_hash_table_unref(ret);
+			ret = NULL;
+			break;
+		}
+		if (!info)
+			break;
+		const char *name =
+			g_file_info_get_attribute_file_path(info, G_FILE_ATTRIBUTE_STANDARD_NAME);
+		if (strcmp(name, COMICREADER_INDEX_NAME) == 0)
+			continue;
+		bool directory = g_file_info_get_file_type(info) == G_FILE_TYPE_DIRECTORY;
+		char *entry = g_strconcat(name, directory ? "/" : "", NULL);
+		set_mtime(ret, entry, get_info_mtime(info));
+		g_free(entry);
+	}
+	g_object_unref(direnum);
+
+	return ret;
+}
+
+/* Adds the children of directory to listing, sorted, with prefix in front
+ * of their names.  Leaves listing empty on failure. */
+static bool list_directory(
+	GFile *directory,
+	const char *prefix,
+	struct ChapterListing *listing,
+	GCancellable *cancellable,
+	GError **error)
+{
+	GFileEnumerator *direnum = g_file_enumerate_children(
+		directory,
+		LIST_ATTRIBUTES,
+		G_FILE_QUERY_INFO_NONE,
+		cancellable,
+		error);
+	if (!direnum)
+		return false;
+
+	for (;;) {
+		GFileInfo *info;
+		if (!g_file_enumerator_iterate(direnum, &info, NULL, cancellable, error)) {
+			g_object_unref(direnum);
+			clear_listing(listing);
+			return false;
+		}
+		if (!info)
+			break;
+		const char *name =
+			g_file_info_get_attribute_file_path(info, G_FILE_ATTRIBUTE_STANDARD_NAME);
+		if (strcmp(name, COMICREADER_INDEX_NAME) == 0)
+			continue;
+		bool directory = g_file_info_get_file_type(info) == G_FILE_TYPE_DIRECTORY;
+		size_t size = strlen(prefix) + strlen(name) + 2;
+		char *entry = malloc(size);
+		snprintf(entry, size, "%s%s%s", prefix, name, directory ? "/" : "");
+		strarray_append(&listing->names, &listing->length, &listing->capacity, entry);
+		if (!listing->mtimes)
+			listing->mtimes = new_mtimes();
+		set_mtime(listing->mtimes, entry, get_info_mtime(info));
+	}
+	g_object_unref(direnum);
+
+	qsort(listing->names, listing->length, sizeof(char *), strcmpp);
+	return true;
+}
+
+static void clear_listing(struct ChapterListing *listing)
+{
+	for (size_t i = 0; i < listing->length; ++i)
+		free(listing->names[i]);
+	free(listing->names);
+	listing->names = NULL;
+	listing->length = 0;
+	listing->capacity = 0;
+	g_clear_pointer(&listing->mtimes, g_hash_table_unref);
+	g_clear_pointer(&listing->index_sizes, g_hash_table_unref);
+}
+
+static void free_listing(void *p)
+{
+	clear_listing(p);
+	free(p);
+}
+
+/* Starts listing the chapters around index that aren't listed yet.
+ * called on any thread */
+static void expand_chapters_near(struct ComicReaderDirectoryImageLoader *self, size_t index)
+{
+	char *chapters[CHAPTER_LOOKBEHIND + CHAPTER_LOOKAHEAD + 1];
+	size_t num_chapters = 0;
+
+	g_mutex_lock(&self->lock);
+	size_t first = index > CHAPTER_LOOKBEHIND ? index - CHAPTER_LOOKBEHIND : 0;
+	size_t last = MIN(index + CHAPTER_LOOKAHEAD + 1, self->child_filenames_length);
+	for (size_t i = first; i < last; ++i) {
+		const char *name = self->child_filenames[i];
+		if (is_chapter(name) && !g_hash_table_contains(self->expanding, name)) {
+			g_hash_table_add(self->expanding, strdup(name));
+			chapters[num_chapters++] = strdup(name);
+		}
+	}
+	g_mutex_unlock(&self->lock);
+
+	/* results come back on the main thread, where the monitor also
+	 * changes the list */
+	for (size_t i = 0; i < num_chapters; ++i) {
+		debug_printf("listing chapter %s\n", chapters[i]);
+		GTask *task = g_task_new(NULL, self->cancellable, chapter_listed, self);
+		g_task_set_source_tag(task, expand_chapters_near);
+		g_task_set_task_data(task, chapters[i], free);
+		g_object_set_data_full(
+			G_OBJECT(task),
+			"directory",
+			get_child_file(self, chapters[i]),
+			g_object_unref);
+		g_task_run_in_thread(task, list_chapter_in_thread);
+		g_object_unref(task);
+	}
+}
+
+/* called on background thread */
+static void list_chapter_in_thread(
+	GTask *task,
+	gpointer source_object,
+	gpointer task_data,
+	GCancellable *cancellable)
+{
+	const char *chapter = task_data;
+	GFile *directory = g_object_get_data(G_OBJECT(task), "directory");
+
+	struct ChapterListing *listing = calloc(1, sizeof(*listing));
+	GError *error = NULL;
+	if (list_directory(directory, chapter, listing, cancellable, &error)) {
+		g_task_return_pointer(task, listing, free_listing);
+	} else {
+		free(listing);
+		g_task_return_error(task, error);
+	}
+}
+
+static void chapter_listed(GObject *source_object, GAsyncResult *result, gpointer data)
+{
+	GError *error = NULL;
+	struct ChapterListing *listing = g_task_propagate_pointer(G_TASK(result), &error);
+	if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		/* the loader has been freed */
+		g_error_free(error);
+		return;
+	}
+
+	struct ComicReaderDirectoryImageLoader *self = data;
+	const char *chapter = g_task_get_task_data(G_TASK(result));
+
+	g_mutex_lock(&self->lock);
+	g_hash_table_remove(self->expanding, chapter);
+	g_mutex_unlock(&self->lock);
+
+	/* a chapter that can't be listed is dropped rather than retried */
+	struct ChapterListing empty = {0};
+	if (error) {
+		debug_printf("cannot list %s: %s\n", chapter, error->message);
+		g_error_free(error);
+		listing = &empty;
+	}
+
+	expand_chapter(self, chapter, listing);
+	if (listing != &empty)
+		free(listing);
+}
+
+/* Replaces chapter with the pages in listing, taking ownership of them.
+ * Its first page takes its index, so whoever was showing the chapter
+ * carries on from there, and the list matches each event as it's sent. */
+static void expand_chapter(
+	struct ComicReaderDirectoryImageLoader *self,
+	const char *chapter,
+	struct ChapterListing *listing)
+{
+	size_t index = 0;
+	if (!impl_find_image(&self->parent, chapter, &index)) {
+		/* removed while it was being listed */
+		clear_listing(listing);
+		return;
+	}
+
+	if (listing->length == 0) {
+		g_mutex_lock(&self->lock);
+		free(self->child_filenames[index]);
+		memmove(
+			&self->child_filenames[index],
+			&self->child_filenames[index + 1],
+			(self->child_filenames_length - index - 1) * sizeof(char *));
+		--self->child_filenames_length;
+		g_mutex_unlock(&self->lock);
+
+		clear_listing(listing);
+		comicreader_image_loader_notify(
+			&self->parent,
+			COMICREADER_IMAGE_LOADER_IMAGE_REMOVED,
+			index);
+		return;
+	}
+
+	debug_printf("chapter %s has %zu pages\n", chapter, listing->length);
+
+	g_mutex_lock(&self->lock);
+	if (listing->mtimes) {
+		GHashTableIter iter;
+		void *name;
+		void *mtime;
+		g_hash_table_iter_init(&iter, listing->mtimes);
+		while (g_hash_table_iter_next(&iter, &name, &mtime)) {
+			g_hash_table_iter_steal(&iter);
+			g_hash_table_replace(self->mtimes, name, mtime);
+		}
+	}
+	free(self->child_filenames[index]);
+	self->child_filenames[index] = listing->names[0];
+	g_mutex_unlock(&self->lock);
+	comicreader_image_loader_notify(
+		&self->parent,
+		COMICREADER_IMAGE_LOADER_IMAGE_CHANGED,
+		index);
+
+	/* pages of one chapter sort next to each other */
+	for (size_t i = 1; i < listing->length; ++i) {
+		g_mutex_lock(&self->lock);
+		insert_at(self, index + i, listing->names[i]);
+		g_mutex_unlock(&self->lock);
+		comicreader_image_loader_notify(
+			&self->parent,
+			COMICREADER_IMAGE_LOADER_IMAGE_INSERTED,
+			index + i);
+	}
+
+	free(listing->names);
+	listing->names = NULL;
+	listing->length = 0;
+	listing->capacity = 0;
+	g_clear_pointer(&listing->mtimes, g_hash_table_unref);
+}
+
+/* The first frame is decoded now, any others as they're shown.  Images
+ * too large to decode whole are left to be decoded a slice at a time. */
+static void decode_bytes(
+	struct ComicReaderDirectoryImageLoader *self,
+	struct ComicReaderImage *image,
+	GBytes *bytes)
+{
+	if (comicreader_slicer_probe(bytes, &image->width, &image->height)) {
+		image->sliced = g_bytes_ref(bytes);
+		return;
+	}
+	image->width = 0;
+	image->height = 0;
+
+	/* pages of an optimized comic */
+	if (is_qoi(bytes)) {
+		image->texture = comicreader_qoi_decode(bytes);
+		if (!image->texture)
+			image->error = strdup("Invalid QOI image");
+		return;
+	}
+
+	/* huge scans are spread over several cores */
+	image->texture = comicreader_parallel_jpeg_decode(bytes, self->scheduler);
+	if (image->texture)
+		return;
+
+	GError *error = NULL;
+	image->texture = gdk_texture_new_from_bytes(bytes, &error);
+	if (error) {
+		comicreader_image_set_error(image, error);
+		g_error_free(error);
+		return;
+	}
+
+	if (comicreader_animation_sniff(bytes))
+		image->animation = g_bytes_ref(bytes);
+}
+
+/* called on background thread */
+static void directory_read_done(struct ComicReaderBulkRead *read)
+{
+	struct DirectoryRead *data = (struct DirectoryRead *)read;
+	struct ComicReaderReadRequest *request = data->request;
+
+	request->bytes = read->bytes;
+	if (read->bytes) {
+		request->name = data->filename;
+	} else {
+		request->name = NULL;
+		free(data->filename);
+	}
+
+	g_free(read->path);
+	free(data);
+	request->done(request);
+}
+
+static void directory_changed(
+	GFileMonitor *monitor,
+	GFile *file,
+	GFile *other_file,
+	GFileMonitorEvent event_type,
+	gpointer user_data)
+{
+	struct ComicReaderDirectoryImageLoader *self = user_data;
+
+	switch (event_type) {
+	case G_FILE_MONITOR_EVENT_CREATED:
+	case G_FILE_MONITOR_EVENT_MOVED_IN:
+		insert_child(self, file);
+		break;
+	case G_FILE_MONITOR_EVENT_DELETED:
+	case G_FILE_MONITOR_EVENT_MOVED_OUT:
+		remove_child(self, file);
+		break;
+	case G_FILE_MONITOR_EVENT_RENAMED:
+		remove_child(self, file);
+		insert_child(self, other_file);
+		break;
+	case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+		change_child(self, file);
+		break;
+	case G_FILE_MONITOR_EVENT_CHANGED:
+	case G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED:
+	case G_FILE_MONITOR_EVENT_PRE_UNMOUNT:
+	case G_FILE_MONITOR_EVENT_UNMOUNTED:
+	case G_FILE_MONITOR_EVENT_MOVED:
+	default:
+		break;
+	}
+}
+
+static void insert_child(struct ComicReaderDirectoryImageLoader *self, GFile *file)
+{
+	char *basename = g_file_get_basename(file);
+	if (strcmp(basename, COMICREADER_INDEX_NAME) == 0) {
+		g_free(basename);
+		return;
+	}
+	bool directory = g_file_query_file_type(file, G_FILE_QUERY_INFO_NONE, NULL) ==
+			 G_FILE_TYPE_DIRECTORY;
+	char *name = g_strconcat(basename, directory ? "/" : "", NULL);
+	g_free(basename);
+	/* a replaced page gets another chance */
+	forget_failure(self, name);
+	set_listed_mtime(self, name, get_mtime(file));
+
+	g_mutex_lock(&self->lock);
+	size_t index = lower_bound(self, name);
+	bool exists = index < self->child_filenames_length &&
+		      strcmp(self->child_filenames[index], name) == 0;
+	if (!exists)
+		insert_at(self, index, strdup(name));
+	g_mutex_unlock(&self->lock);
+
+	g_free(name);
+
+	if (exists) {
+		comicreader_image_loader_notify(
+			&self->parent,
+			COMICREADER_IMAGE_LOADER_IMAGE_CHANGED,
+			index);
+	} else {
+		debug_printf("page inserted at %zu\n", index);
+		comicreader_image_loader_notify(
+			&self->parent,
+			COMICREADER_IMAGE_LOADER_IMAGE_INSERTED,
+			index);
+	}
+}
+
+/* called with lock held */
+static void insert_at(struct ComicReaderDirectoryImageLoader *self, size_t index, char *name)
+{
+	/* append to grow the array, then move into sorted position */
+	strarray_append(
+		&self->child_filenames,
+		&self->child_filenames_length,
+		&self->child_filenames_capacity,
+		name);
+	memmove(
+		&self->child_filenames[index + 1],
+		&self->child_filenames[index],
+		(self->child_filenames_length - index - 1) * sizeof(char *));
+	self->child_filenames[index] = name;
+}
+
+static void remove_child(struct ComicReaderDirectoryImageLoader *self, GFile *file)
+{
+	char *name = g_file_get_basename(file);
+	size_t index = 0;
+	forget_failure(self, name);
+	set_listed_mtime(self, name, -1);
+
+	/* the file is already gone, so try it as an unlisted chapter too */
+	bool exists = impl_find_image(&self->parent, name, &index);
+	if (!exists) {
+		char *chapter = g_strconcat(name, "/", NULL);
+		exists = impl_find_image(&self->parent, chapter, &index);
+		g_free(chapter);
+	}
+	if (exists) {
+		g_mutex_lock(&self->lock);
+		free(self->child_filenames[index]);
+		memmove(
+			&self->child_filenames[index],
+			&self->child_filenames[index + 1],
+			(self->child_filenames_length - index - 1) * sizeof(char *));
+		--self->child_filenames_length;
+		g_mutex_unlock(&self->lock);
+	}
+
+	g_free(name);
+
+	if (exists) {
+		debug_printf("page removed at %zu\n", index);
+		comicreader_image_loader_notify(
+			&self->parent,
+			COMICREADER_IMAGE_LOADER_IMAGE_REMOVED,
+			index);
+	}
+}
+
+static void change_child(struct ComicReaderDirectoryImageLoader *self, GFile *file)
+{
+	char *name = g_file_get_basename(file);
+	size_t index = 0;
+	forget_failure(self, name);
+	set_listed_mtime(self, name, get_mtime(file));
+
+	bool exists = impl_find_image(&self->parent, name, &index);
+
+	g_free(name);
+
+	if (exists) {
+		comicreader_image_loader_notify(
+			&self->parent,
+			COMICREADER_IMAGE_LOADER_IMAGE_CHANGED,
+			index);
+	}
+}
+
+/* index of the first filename not sorting before name, called with lock held */
+static size_t lower_bound(struct ComicReaderDirectoryImageLoader *self, const char *name)
+{
+	size_t lo = 0;
+	size_t hi = self->child_filenames_length;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const char *mid_name = self->child_filenames[mid];
+		if (comicreader_directory_image_loader_compare_names(mid_name, name) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
 static void strarray_append(char ***strarray, size_t *length, size_t *capacity, char *str)
 {
 	if (*length == *capacity) {
@@ -152,7 +1343,50 @@ static void strarray_append(char ***strarray, size_t *length, size_t *capacity,
 	++*length;
 }
 
+int comicreader_directory_image_loader_compare_names(const char *name1, const char *name2)
+{
+	const char *s1 = name1;
+	const char *s2 = name2;
+
+	while (*s1 && *s2) {
+		if (g_ascii_isdigit(*s1) && g_ascii_isdigit(*s2)) {
+			while (*s1 == '0')
+				++s1;
+			while (*s2 == '0')
+				++s2;
+			size_t length1 = 0;
+			size_t length2 = 0;
+			while (g_ascii_isdigit(s1[length1]))
+				++length1;
+			while (g_ascii_isdigit(s2[length2]))
+				++length2;
+			if (length1 != length2)
+				return length1 < length2 ? -1 : 1;
+			int cmp = strncmp(s1, s2, length1);
+			if (cmp != 0)
+				return cmp;
+			s1 += length1;
+			s2 += length2;
+			continue;
+		}
+
+		int c1 = *s1 == '/' ? 1 : (unsigned char)*s1;
+		int c2 = *s2 == '/' ? 1 : (unsigned char)*s2;
+		if (c1 != c2)
+			return c1 - c2;
+		++s1;
+		++s2;
+	}
+
+	if (*s1 || *s2)
+		return *s1 ? 1 : -1;
+	/* equal apart from leading zeros */
+	return strcmp(name1, name2);
+}
+
 static int strcmpp(const void *str1p, const void *str2p)
 {
-	return strcmp(*(const char **)str1p, *(const char **)str2p);
+	return comicreader_directory_image_loader_compare_names(
+		*(const char **)str1p,
+		*(const char **)str2p);
 }
@@ -20,6 +20,27 @@
 
 #pragma once
 
+#include "comicreader-decodescheduler.h"
 #include "comicreader-imageloader.h"
 
-struct ComicReaderImageLoader *comicreader_directory_image_loader_new(GFile *directory);
+/* Lists the pages of a directory made by comicreader_optimize_comic, in
+ * order and with their layout sizes, so that opening it doesn't need to
+ * sort them.  It's ignored if the directory's children no longer match
+ * it, but survives being copied. */
+#define COMICREADER_INDEX_NAME "comicreader-index"
+
+/* Returns NULL if directory can't be listed.  May be called on any thread,
+ * the loader is then used on the main thread.  Huge scans are decoded in
+ * bands on scheduler, which may be NULL, and must outlive the loader. */
+struct ComicReaderImageLoader *comicreader_directory_image_loader_new(
+	GFile *directory,
+	struct ComicReaderDecodeScheduler *scheduler);
+
+/* Lists every chapter straight away, for callers that need all the pages
+ * up front rather than as the reader gets to them. */
+void comicreader_directory_image_loader_list_chapters(struct ComicReaderImageLoader *image_loader);
+
+/* Orders pages the way they're numbered: runs of digits compare by value,
+ * so "page10" follows "page9", and '/' sorts first, so a chapter's pages
+ * sort next to each other. */
+int comicreader_directory_image_loader_compare_names(const char *name1, const char *name2);
@@ -0,0 +1,587 @@
+/* comicreader-filterimageloader.c
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "comicreader-filterimageloader.h"
+#include "comicreader-debug.h"
+
+#include <math.h>
+#include <string.h>
+
+#define MAX_FILTERS 16
+#define MAX_UNSHARP_RADIUS 6
+#define UNSHARP_TAPS (2 * MAX_UNSHARP_RADIUS + 1)
+
+/* see comicreader-upscaleimageloader.c */
+#if defined(__x86_64__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define SIMD_CLONES __attribute__((target_clones("avx2", "default")))
+#endif
+#endif
+#ifndef SIMD_CLONES
+#define SIMD_CLONES
+#endif
+
+/* one straight alpha RGBA pixel */
+typedef float v4f __attribute__((vector_size(16)));
+
+enum FilterKind {
+	FILTER_GRAYSCALE,
+	FILTER_LEVELS,
+	FILTER_CONTRAST,
+	FILTER_UNSHARP,
+};
+
+struct Filter {
+	enum FilterKind kind;
+	/* levels: output value for each input value */
+	float lut[256];
+	/* contrast: factor, unsharp: strength */
+	float amount;
+	/* unsharp: gaussian blur kernel */
+	int radius;
+	float kernel[UNSHARP_TAPS];
+};
+
+struct FilterChain {
+	size_t num_filters;
+	struct Filter filters[MAX_FILTERS];
+};
+
+struct ComicReaderFilterImageLoader {
+	struct ComicReaderImageLoader parent;
+	struct ComicReaderImageLoader *inner_loader;
+	GSettings *settings;
+
+	/* the chain changes on the main thread while images are filtered on
+	 * background threads, which take a copy */
+	GMutex lock;
+	struct FilterChain chain;
+	/* the page-filters value, so that images filtered differently don't
+	 * share a key */
+	char *chain_key;
+};
+
+/* interface implementations */
+static size_t impl_get_num_images(struct ComicReaderImageLoader *image_loader);
+static struct ComicReaderImage *impl_get_image(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index);
+static struct ComicReaderImage *impl_get_preview(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index);
+static bool impl_find_image(
+	struct ComicReaderImageLoader *image_loader,
+	const char *name,
+	size_t *index);
+static GBytes *impl_read_image(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index,
+	char **name);
+static struct ComicReaderImage *impl_decode_image(
+	struct ComicReaderImageLoader *image_loader,
+	const char *name,
+	GBytes *bytes,
+	const char *key);
+static void impl_read_images(
+	struct ComicReaderImageLoader *image_loader,
+	struct ComicReaderReadRequest **requests,
+	size_t num_requests);
+static char *impl_get_image_name(struct ComicReaderImageLoader *image_loader, size_t index);
+static char *impl_get_image_key(struct ComicReaderImageLoader *image_loader, const char *name);
+static void impl_free(struct ComicReaderImageLoader *image_loader);
+
+/* helper functions */
+static void inner_loader_event(
+	void *user_data,
+	enum ComicReaderImageLoaderEvent event,
+	size_t index);
+static void filters_changed(GSettings *settings, const char *key, gpointer user_data);
+static void parse_chain(GVariant *value, struct FilterChain *chain);
+static bool parse_key_chain(const char *key, struct FilterChain *chain);
+static bool parse_filter(const char *name, const double *params, size_t n, struct Filter *filter);
+static struct ComicReaderImage *filter_image(
+	struct ComicReaderFilterImageLoader *self,
+	struct ComicReaderImage *image,
+	const char *key);
+static void apply_point_filters(
+	const struct Filter *filters,
+	size_t num_filters,
+	guchar *pixels,
+	int width,
+	int height,
+	gsize stride);
+static void apply_unsharp(
+	const struct Filter *filter,
+	guchar *pixels,
+	int width,
+	int height,
+	gsize stride);
+static void unpack_row(const guchar *row, v4f *line, int width);
+static void pack_row(const v4f *line, guchar *row, int width);
+
+struct ComicReaderImageLoader *comicreader_filter_image_loader_new(
+	struct ComicReaderImageLoader *inner_loader,
+	GSettings *settings)
+{
+	struct ComicReaderFilterImageLoader *ret;
+	ret = calloc(1, sizeof(struct ComicReaderFilterImageLoader));
+	debug_init("ComicReaderFilterImageLoader", ret);
+
+	ret->parent.free = impl_free;
+	ret->parent.get_num_images = impl_get_num_images;
+	ret->parent.get_image = impl_get_image;
+	ret->parent.get_preview = impl_get_preview;
+	ret->parent.find_image = impl_find_image;
+	if (inner_loader->read_image) {
+		ret->parent.read_image = impl_read_image;
+		ret->parent.decode_image = impl_decode_image;
+	}
+	if (inner_loader->read_images)
+		ret->parent.read_images = impl_read_images;
+	ret->parent.get_image_name = impl_get_image_name;
+	ret->parent.get_image_key = impl_get_image_key;
+
+	ret->inner_loader = inner_loader;
+	comicreader_image_loader_set_listener(inner_loader, inner_loader_event, ret);
+
+	g_mutex_init(&ret->lock);
+	ret->settings = g_object_ref(settings);
+	GVariant *value = g_settings_get_value(settings, "page-filters");
+	parse_chain(value, &ret->chain);
+	ret->chain_key = g_variant_print(value, FALSE);
+	g_variant_unref(value);
+	g_signal_connect(settings, "changed::page-filters", G_CALLBACK(filters_changed), ret);
+
+	g_assert((void *)ret == (void *)&ret->parent);
+	return &ret->parent;
+}
+
+static size_t impl_get_num_images(struct ComicReaderImageLoader *image_loader)
+{
+	struct ComicReaderFilterImageLoader *self =
+		(struct ComicReaderFilterImageLoader *)image_loader;
+
+	return self->inner_loader->get_num_images(self->inner_loader);
+}
+
+static struct ComicReaderImage *impl_get_image(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index)
+{
+	struct ComicReaderFilterImageLoader *self =
+		(struct ComicReaderFilterImageLoader *)image_loader;
+
+	return filter_image(self, self->inner_loader->get_image(self->inner_loader, index), NULL);
+}
+
+/* previews are only glanced at while scrubbing, leave them unfiltered */
+static struct ComicReaderImage *impl_get_preview(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index)
+{
+	struct ComicReaderFilterImageLoader *self =
+		(struct ComicReaderFilterImageLoader *)image_loader;
+
+	return comicreader_image_loader_get_preview(self->inner_loader, index);
+}
+
+static bool impl_find_image(
+	struct ComicReaderImageLoader *image_loader,
+	const char *name,
+	size_t *index)
+{
+	struct ComicReaderFilterImageLoader *self =
+		(struct ComicReaderFilterImageLoader *)image_loader;
+
+	return comicreader_image_loader_find(self->inner_loader, name, index);
+}
+
+static GBytes *impl_read_image(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index,
+	char **name)
+{
+	struct ComicReaderFilterImageLoader *self =
+		(struct ComicReaderFilterImageLoader *)image_loader;
+
+	return self->inner_loader->read_image(self->inner_loader, index, name);
+}
+
+static struct ComicReaderImage *impl_decode_image(
+	struct ComicReaderImageLoader *image_loader,
+	const char *name,
+	GBytes *bytes,
+	const char *key)
+{
+	struct ComicReaderFilterImageLoader *self =
+		(struct ComicReaderFilterImageLoader *)image_loader;
+
+	return filter_image(
+		self,
+		self->inner_loader->decode_image(self->inner_loader, name, bytes, key),
+		key);
+}
+
+static void impl_read_images(
+	struct ComicReaderImageLoader *image_loader,
+	struct ComicReaderReadRequest **requests,
+	size_t num_requests)
+{
+	struct ComicReaderFilterImageLoader *self =
+		(struct ComicReaderFilterImageLoader *)image_loader;
+
+	self->inner_loader->read_images(self->inner_loader, requests, num_requests);
+}
+
+static char *impl_get_image_name(struct ComicReaderImageLoader *image_loader, size_t index)
+{
+	struct ComicReaderFilterImageLoader *self =
+		(struct ComicReaderFilterImageLoader *)image_loader;
+
+	return comicreader_image_loader_get_name(self->inner_loader, index);
+}
+
+static char *impl_get_image_key(struct ComicReaderImageLoader *image_loader, const char *name)
+{
+	struct ComicReaderFilterImageLoader *self =
+		(struct ComicReaderFilterImageLoader *)image_loader;
+
+	char *key = comicreader_image_loader_get_key(self->inner_loader, name);
+	if (!key)
+		return NULL;
+
+	g_mutex_lock(&self->lock);
+	char *ret = g_strdup_printf("%s#filters=%s", key, self->chain_key);
+	g_mutex_unlock(&self->lock);
+	g_free(key);
+	return ret;
+}
+
+static void impl_free(struct ComicReaderImageLoader *image_loader)
+{
+	struct ComicReaderFilterImageLoader *self =
+		(struct ComicReaderFilterImageLoader *)image_loader;
+
+	g_signal_handlers_disconnect_by_data(self->settings, self);
+	g_clear_object(&self->settings);
+	comicreader_image_loader_clear(&self->inner_loader);
+	g_free(self->chain_key);
+	g_mutex_clear(&self->lock);
+	debug_free("ComicReaderFilterImageLoader", self);
+	free(self);
+}
+
+static void inner_loader_event(
+	void *user_data,
+	enum ComicReaderImageLoaderEvent event,
+	size_t index)
+{
+	struct ComicReaderFilterImageLoader *self = user_data;
+
+	comicreader_image_loader_notify(&self->parent, event, index);
+}
+
+static void filters_changed(GSettings *settings, const char *key, gpointer user_data)
+{
+	struct ComicReaderFilterImageLoader *self = user_data;
+
+	struct FilterChain chain;
+	GVariant *value = g_settings_get_value(settings, key);
+	parse_chain(value, &chain);
+	char *chain_key = g_variant_print(value, FALSE);
+	g_variant_unref(value);
+
+	g_mutex_lock(&self->lock);
+	self->chain = chain;
+	g_free(self->chain_key);
+	self->chain_key = chain_key;
+	g_mutex_unlock(&self->lock);
+
+	comicreader_image_loader_notify(&self->parent, COMICREADER_IMAGE_LOADER_ALL_CHANGED, 0);
+}
+
+/* value is an array of filter names with their parameters, applied in
+ * order; see the page-filters key for the list of filters */
+static void parse_chain(GVariant *value, struct FilterChain *chain)
+{
+	chain->num_filters = 0;
+
+	GVariantIter iter;
+	const char *name;
+	GVariant *params;
+	g_variant_iter_init(&iter, value);
+	while (g_variant_iter_next(&iter, "(&s@ad)", &name, &params)) {
+		size_t n;
+		const double *p = g_variant_get_fixed_array(params, &n, sizeof(double));
+		if (chain->num_filters == MAX_FILTERS) {
+			debug_printf("ignoring filter %s, too many filters\n", name);
+		} else if (parse_filter(name, p, n, &chain->filters[chain->num_filters])) {
+			++chain->num_filters;
+		} else {
+			debug_printf("ignoring unknown filter %s\n", name);
+		}
+		g_variant_unref(params);
+	}
+}
+
+/* The chain as it was when key was made, which may differ from the
+ * current one if the settings changed since.  The value follows
+ * "#filters=" in the key, see impl_get_image_key. */
+static bool parse_key_chain(const char *key, struct FilterChain *chain)
+{
+	const char *text = key ? strstr(key, "#filters=") : NULL;
+	if (!text)
+		return false;
+	text += strlen("#filters=");
+
+	/* decorators above this one append their own parts */
+	const char *end = NULL;
+	GVariant *value = g_variant_parse(G_VARIANT_TYPE("a(sad)"), text, NULL, &end, NULL);
+	if (!value)
+		return false;
+	parse_chain(value, chain);
+	g_variant_unref(value);
+	return true;
+}
+
+static bool parse_filter(const char *name, const double *params, size_t n, struct Filter *filter)
+{
+	memset(filter, 0, sizeof(*filter));
+
+	if (strcmp(name, "grayscale") == 0) {
+		filter->kind = FILTER_GRAYSCALE;
+	} else if (strcmp(name, "levels") == 0) {
+		/* black point, white point, gamma */
+		double black = n > 0 ? params[0] : 0;
+		double white = n > 1 ? params[1] : 255;
+		double gamma = n > 2 && params[2] > 0 ? params[2] : 1;
+		if (white <= black)
+			return false;
+		filter->kind = FILTER_LEVELS;
+		for (int i = 0; i < 256; ++i) {
+			double v = CLAMP((i - black) / (white - black), 0, 1);
+			filter->lut[i] = 255 * pow(v, 1 / gamma);
+		}
+	} else if (strcmp(name, "contrast") == 0) {
+		filter->kind = FILTER_CONTRAST;
+		filter->amount = n > 0 ? params[0] : 1;
+	} else if (strcmp(name, "unsharp") == 0) {
+		/* strength, blur radius */
+		double sigma = n > 1 && params[1] > 0 ? params[1] : 1;
+		filter->kind = FILTER_UNSHARP;
+		filter->amount = n > 0 ? params[0] : 0.5;
+		filter->radius = MIN((int)ceil(2 * sigma), MAX_UNSHARP_RADIUS);
+		float sum = 0;
+		for (int t = 0; t <= 2 * filter->radius; ++t) {
+			int d = t - filter->radius;
+			filter->kernel[t] = exp(-d * d / (2 * sigma * sigma));
+			sum += filter->kernel[t];
+		}
+		for (int t = 0; t <= 2 * filter->radius; ++t)
+			filter->kernel[t] /= sum;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+/* key, if not NULL, picks the chain, otherwise the current one is used
+ * called on background thread */
+static struct ComicReaderImage *filter_image(
+	struct ComicReaderFilterImageLoader *self,
+	struct ComicReaderImage *image,
+	const char *key)
+{
+	/* filters are for still pages */
+	if (!image || !image->texture || image->animation)
+		return image;
+
+	struct FilterChain *chain = malloc(sizeof(*chain));
+	if (!parse_key_chain(key, chain)) {
+		g_mutex_lock(&self->lock);
+		*chain = self->chain;
+		g_mutex_unlock(&self->lock);
+	}
+
+	if (chain->num_filters == 0) {
+		free(chain);
+		return image;
+	}
+
+	int width = gdk_texture_get_width(image->texture);
+	int height = gdk_texture_get_height(image->texture);
+	GdkTextureDownloader *downloader = gdk_texture_downloader_new(image->texture);
+	gdk_texture_downloader_set_format(downloader, GDK_MEMORY_R8G8B8A8);
+	gsize stride;
+	GBytes *bytes = gdk_texture_downloader_download_bytes(downloader, &stride);
+	gdk_texture_downloader_free(downloader);
+	gsize size;
+	guchar *pixels = g_bytes_unref_to_data(bytes, &size);
+
+	/* consecutive point filters share a pass over the image, unsharp
+	 * needs neighbouring rows so gets a pass of its own */
+	for (size_t i = 0; i < chain->num_filters;) {
+		size_t end = i;
+		while (end < chain->num_filters && chain->filters[end].kind != FILTER_UNSHARP)
+			++end;
+		if (end > i) {
+			apply_point_filters(chain->filters + i, end - i, pixels, width, height, stride);
+			i = end;
+		} else {
+			apply_unsharp(&chain->filters[i], pixels, width, height, stride);
+			++i;
+		}
+	}
+	free(chain);
+
+	bytes = g_bytes_new_take(pixels, size);
+	g_object_unref(image->texture);
+	image->texture = gdk_memory_texture_new(width, height, GDK_MEMORY_R8G8B8A8, bytes, stride);
+	g_bytes_unref(bytes);
+
+	return image;
+}
+
+SIMD_CLONES
+static void apply_point_filters(
+	const struct Filter *filters,
+	size_t num_filters,
+	guchar *pixels,
+	int width,
+	int height,
+	gsize stride)
+{
+	/* Rec. 601 luma, alpha is left alone */
+	const v4f luma = {0.299f, 0.587f, 0.114f, 0};
+	const v4f midpoint = {127.5f, 127.5f, 127.5f, 0};
+	v4f *line = g_new(v4f, width);
+
+	for (int y = 0; y < height; ++y) {
+		guchar *row = pixels + y * stride;
+		unpack_row(row, line, width);
+
+		for (size_t i = 0; i < num_filters; ++i) {
+			const struct Filter *filter = &filters[i];
+			switch (filter->kind) {
+			case FILTER_GRAYSCALE:
+				for (int x = 0; x < width; ++x) {
+					v4f weighted = line[x] * luma;
+					float l = weighted[0] + weighted[1] + weighted[2];
+					line[x] = (v4f){l, l, l, line[x][3]};
+				}
+				break;
+			case FILTER_LEVELS:
+				for (int x = 0; x < width; ++x) {
+					for (int c = 0; c < 3; ++c) {
+						int v = CLAMP(lrintf(line[x][c]), 0, 255);
+						line[x][c] = filter->lut[v];
+					}
+				}
+				break;
+			case FILTER_CONTRAST: {
+				const v4f factor = {filter->amount, filter->amount, filter->amount, 1};
+				for (int x = 0; x < width; ++x)
+					line[x] = (line[x] - midpoint) * factor + midpoint;
+				break;
+			}
+			case FILTER_UNSHARP:
+			default:
+				g_assert_not_reached();
+			}
+		}
+
+		pack_row(line, row, width);
+	}
+
+	g_free(line);
+}
+
+/* Sharpens by adding back the difference from a gaussian blur.  The blur is
+ * separable: each row is blurred horizontally once, into a ring of the
+ * rows the vertical blur needs.  A row is only overwritten after every
+ * horizontal blur that reads it. */
+SIMD_CLONES
+static void apply_unsharp(
+	const struct Filter *filter,
+	guchar *pixels,
+	int width,
+	int height,
+	gsize stride)
+{
+	int taps = 2 * filter->radius + 1;
+	const v4f amount = {filter->amount, filter->amount, filter->amount, 0};
+	v4f *line = g_new(v4f, width);
+	v4f *ring = g_new(v4f, (gsize)taps * width);
+	int ring_row[UNSHARP_TAPS];
+	for (int t = 0; t < taps; ++t)
+		ring_row[t] = -1;
+	v4f *blur = g_new(v4f, width);
+
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x)
+			blur[x] = (v4f){0, 0, 0, 0};
+
+		for (int t = 0; t < taps; ++t) {
+			int sy = CLAMP(y + t - filter->radius, 0, height - 1);
+			v4f *blurred = ring + (gsize)(sy % taps) * width;
+
+			if (ring_row[sy % taps] != sy) {
+				unpack_row(pixels + sy * stride, line, width);
+				for (int x = 0; x < width; ++x) {
+					v4f sum = {0, 0, 0, 0};
+					for (int u = 0; u < taps; ++u) {
+						int sx = CLAMP(x + u - filter->radius, 0, width - 1);
+						sum += line[sx] * filter->kernel[u];
+					}
+					blurred[x] = sum;
+				}
+				ring_row[sy % taps] = sy;
+			}
+
+			for (int x = 0; x < width; ++x)
+				blur[x] += blurred[x] * filter->kernel[t];
+		}
+
+		guchar *row = pixels + y * stride;
+		unpack_row(row, line, width);
+		for (int x = 0; x < width; ++x)
+			line[x] += (line[x] - blur[x]) * amount;
+		pack_row(line, row, width);
+	}
+
+	g_free(blur);
+	g_free(ring);
+	g_free(line);
+}
+
+static void unpack_row(const guchar *row, v4f *line, int width)
+{
+	for (int x = 0; x < width; ++x)
+		line[x] = (v4f){row[4 * x], row[4 * x + 1], row[4 * x + 2], row[4 * x + 3]};
+}
+
+static void pack_row(const v4f *line, guchar *row, int width)
+{
+	for (int x = 0; x < width; ++x) {
+		for (int c = 0; c < 4; ++c)
+			row[4 * x + c] = CLAMP(lrintf(line[x][c]), 0, 255);
+	}
+}
@@ -0,0 +1,31 @@
+/* comicreader-filterimageloader.h
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "comicreader-imageloader.h"
+
+#include <gio/gio.h>
+
+/* Applies the chain of filters in the page-filters key of settings to
+ * images, reloading them whenever the key changes. */
+struct ComicReaderImageLoader *comicreader_filter_image_loader_new(
+	struct ComicReaderImageLoader *inner_loader,
+	GSettings *settings);
@@ -19,19 +19,45 @@
  */
 
 #include "comicreader-imagedisplay.h"
+#include "comicreader-animation.h"
+#include "comicreader-application.h"
 #include "comicreader-debug.h"
+#include "comicreader-slicer.h"
 
 struct _ComicReaderImageDisplay {
 	GtkWidget parent_instance;
 
 	double scale_factor;
 	struct ComicReaderImage *image;
+	/* plays image->animation while shown */
+	ComicReaderAnimation *animation;
+	guint animation_tick;
+	/* decodes the visible part of image->sliced */
+	ComicReaderSlicer *slicer;
+	GtkAdjustment *slicer_vadjustment;
+	/* shows image->error, rebuilt only when the image, size, colour or
+	 * font changes */
+	GskRenderNode *error_node;
+	int error_node_width;
+	int error_node_height;
+	GdkRGBA error_node_color;
 };
 
 G_DEFINE_FINAL_TYPE(ComicReaderImageDisplay, comicreader_imagedisplay, GTK_TYPE_WIDGET)
 
 static void comicreader_imagedisplay_update_size_request(ComicReaderImageDisplay *self);
+static void start_animation(ComicReaderImageDisplay *self);
+static void stop_animation(ComicReaderImageDisplay *self);
+static gboolean animation_tick(GtkWidget *widget, GdkFrameClock *frame_clock, gpointer data);
+static struct ComicReaderDecodeScheduler *get_scheduler(ComicReaderImageDisplay *self);
+static void start_slicer(ComicReaderImageDisplay *self);
+static void stop_slicer(ComicReaderImageDisplay *self);
+static void update_visible_slices(ComicReaderImageDisplay *self);
+static GskRenderNode *get_error_node(ComicReaderImageDisplay *self);
 static void comicreader_imagedisplay_snapshot(GtkWidget *widget, GtkSnapshot *snapshot);
+static void comicreader_imagedisplay_system_setting_changed(
+	GtkWidget *widget,
+	GtkSystemSetting setting);
 static void comicreader_imagedisplay_dispose(GObject *object);
 
 static void comicreader_imagedisplay_class_init(ComicReaderImageDisplayClass *klass)
@@ -41,6 +67,7 @@ static void comicreader_imagedisplay_class_init(ComicReaderImageDisplayClass *kl
 
 	GtkWidgetClass *widget_class = GTK_WIDGET_CLASS(klass);
 	widget_class->snapshot = comicreader_imagedisplay_snapshot;
+	widget_class->system_setting_changed = comicreader_imagedisplay_system_setting_changed;
 }
 
 static void comicreader_imagedisplay_init(ComicReaderImageDisplay *self)
@@ -69,47 +96,228 @@ void comicreader_imagedisplay_set_image(
 	ComicReaderImageDisplay *self,
 	struct ComicReaderImage *image)
 {
+	stop_animation(self);
+	stop_slicer(self);
 	comicreader_image_clear(&self->image);
+	g_clear_pointer(&self->error_node, gsk_render_node_unref);
 	self->image = image;
+	if (image && image->error)
+		debug_printf("cannot show %s: %s\n", image->name ? image->name : "page",
+			     image->error);
+	start_animation(self);
+	start_slicer(self);
 	comicreader_imagedisplay_update_size_request(self);
 }
 
+static void start_animation(ComicReaderImageDisplay *self)
+{
+	if (!self->image || self->image->error || !self->image->animation)
+		return;
+
+	/* the first frame is shown still until then */
+	struct ComicReaderDecodeScheduler *scheduler = get_scheduler(self);
+	if (!scheduler)
+		return;
+
+	self->animation = comicreader_animation_new(
+		self->image->animation,
+		self->image->texture,
+		scheduler);
+	g_signal_connect_swapped(
+		self->animation,
+		"invalidate-contents",
+		G_CALLBACK(gtk_widget_queue_draw),
+		self);
+	self->animation_tick =
+		gtk_widget_add_tick_callback(GTK_WIDGET(self), animation_tick, NULL, NULL);
+}
+
+static void stop_animation(ComicReaderImageDisplay *self)
+{
+	if (self->animation_tick) {
+		gtk_widget_remove_tick_callback(GTK_WIDGET(self), self->animation_tick);
+		self->animation_tick = 0;
+	}
+	if (self->animation) {
+		g_signal_handlers_disconnect_by_data(self->animation, self);
+		g_clear_object(&self->animation);
+	}
+}
+
+static gboolean animation_tick(GtkWidget *widget, GdkFrameClock *frame_clock, gpointer data)
+{
+	ComicReaderImageDisplay *self = COMICREADER_IMAGEDISPLAY(widget);
+	gint64 frame_time = gdk_frame_clock_get_frame_time(frame_clock);
+	if (comicreader_animation_advance(self->animation, frame_time))
+		return G_SOURCE_CONTINUE;
+
+	/* the last frame stays shown without being ticked */
+	self->animation_tick = 0;
+	return G_SOURCE_REMOVE;
+}
+
+/* the application's, or NULL before the display is in a window */
+static struct ComicReaderDecodeScheduler *get_scheduler(ComicReaderImageDisplay *self)
+{
+	GtkRoot *root = gtk_widget_get_root(GTK_WIDGET(self));
+	if (!root || !GTK_IS_WINDOW(root))
+		return NULL;
+
+	GtkApplication *app = gtk_window_get_application(GTK_WINDOW(root));
+	if (!app || !COMICREADER_IS_APPLICATION(app))
+		return NULL;
+	return comicreader_application_get_scheduler(COMICREADER_APPLICATION(app));
+}
+
+static void start_slicer(ComicReaderImageDisplay *self)
+{
+	if (!self->image || self->image->error || !self->image->sliced)
+		return;
+
+	struct ComicReaderDecodeScheduler *scheduler = get_scheduler(self);
+	if (!scheduler)
+		return;
+
+	self->slicer = comicreader_slicer_new(
+		self->image->sliced,
+		self->image->width,
+		self->image->height,
+		scheduler);
+	g_signal_connect_swapped(
+		self->slicer,
+		"invalidate-contents",
+		G_CALLBACK(gtk_widget_queue_draw),
+		self);
+
+	/* scrolling moves the page without redrawing it, but uncovers
+	 * slices that need decoding */
+	GtkWidget *parent = gtk_widget_get_parent(GTK_WIDGET(self));
+	if (parent && GTK_IS_SCROLLABLE(parent)) {
+		self->slicer_vadjustment =
+			g_object_ref(gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(parent)));
+		g_signal_connect_swapped(
+			self->slicer_vadjustment,
+			"value-changed",
+			G_CALLBACK(update_visible_slices),
+			self);
+	}
+}
+
+static void stop_slicer(ComicReaderImageDisplay *self)
+{
+	if (self->slicer_vadjustment) {
+		g_signal_handlers_disconnect_by_data(self->slicer_vadjustment, self);
+		g_clear_object(&self->slicer_vadjustment);
+	}
+	if (self->slicer) {
+		g_signal_handlers_disconnect_by_data(self->slicer, self);
+		comicreader_slicer_stop(self->slicer);
+		g_clear_object(&self->slicer);
+	}
+}
+
+static void update_visible_slices(ComicReaderImageDisplay *self)
+{
+	double top = 0;
+	double bottom = self->image->height;
+	if (self->slicer_vadjustment) {
+		double value = gtk_adjustment_get_value(self->slicer_vadjustment);
+		double page_size = gtk_adjustment_get_page_size(self->slicer_vadjustment);
+		top = value / self->scale_factor;
+		bottom = (value + page_size) / self->scale_factor;
+	}
+	comicreader_slicer_set_visible(self->slicer, top, bottom);
+}
+
 static void comicreader_imagedisplay_update_size_request(ComicReaderImageDisplay *self)
 {
 	double width = 1;
 	double height = 1;
 	if (self->image && !self->image->error) {
-		width = gdk_texture_get_width(self->image->texture) * self->scale_factor;
-		height = gdk_texture_get_height(self->image->texture) * self->scale_factor;
+		width = comicreader_image_get_width(self->image) * self->scale_factor;
+		height = comicreader_image_get_height(self->image) * self->scale_factor;
 	}
 	gtk_widget_set_size_request(GTK_WIDGET(self), width, height);
 	gtk_widget_queue_draw(GTK_WIDGET(self));
 }
 
+/* the error message centred in the widget, in the current text colour so
+ * that it follows the dark style */
+static GskRenderNode *get_error_node(ComicReaderImageDisplay *self)
+{
+	GtkWidget *widget = GTK_WIDGET(self);
+	int width = gtk_widget_get_width(widget);
+	int height = gtk_widget_get_height(widget);
+	GdkRGBA color;
+	gtk_widget_get_color(widget, &color);
+	if (self->error_node && self->error_node_width == width &&
+	    self->error_node_height == height && gdk_rgba_equal(&self->error_node_color, &color))
+		return self->error_node;
+
+	PangoLayout *layout = gtk_widget_create_pango_layout(widget, self->image->error);
+	pango_layout_set_width(layout, width * PANGO_SCALE);
+	pango_layout_set_wrap(layout, PANGO_WRAP_WORD_CHAR);
+	pango_layout_set_alignment(layout, PANGO_ALIGN_CENTER);
+	int text_height;
+	pango_layout_get_pixel_size(layout, NULL, &text_height);
+
+	GtkSnapshot *snapshot = gtk_snapshot_new();
+	gtk_snapshot_translate(snapshot, &GRAPHENE_POINT_INIT(0, (height - text_height) / 2.0));
+	gtk_snapshot_append_layout(snapshot, layout, &color);
+	g_object_unref(layout);
+
+	g_clear_pointer(&self->error_node, gsk_render_node_unref);
+	self->error_node = gtk_snapshot_free_to_node(snapshot);
+	self->error_node_width = width;
+	self->error_node_height = height;
+	self->error_node_color = color;
+	return self->error_node;
+}
+
 static void comicreader_imagedisplay_snapshot(GtkWidget *widget, GtkSnapshot *snapshot)
 {
 	ComicReaderImageDisplay *self = COMICREADER_IMAGEDISPLAY(widget);
 
 	if (self->image) {
 		if (self->image->error) {
-			fprintf(stderr, "%s\n", self->image->error);  /* TODO: display error */
+			GskRenderNode *node = get_error_node(self);
+			if (node)
+				gtk_snapshot_append_node(snapshot, node);
 			return;
 		}
-		double width = gdk_texture_get_width(self->image->texture) * self->scale_factor;
-		double height = gdk_texture_get_height(self->image->texture) * self->scale_factor;
-		gdk_paintable_snapshot(
-			GDK_PAINTABLE(self->image->texture),
-			snapshot,
-			width,
-			height);
+		double width = comicreader_image_get_width(self->image) * self->scale_factor;
+		double height = comicreader_image_get_height(self->image) * self->scale_factor;
+		GdkPaintable *paintable = GDK_PAINTABLE(self->image->texture);
+		if (self->animation)
+			paintable = GDK_PAINTABLE(self->animation);
+		if (self->slicer) {
+			update_visible_slices(self);
+			paintable = GDK_PAINTABLE(self->slicer);
+		}
+		gdk_paintable_snapshot(paintable, snapshot, width, height);
 	}
 }
 
+/* fonts and their rendering are baked into the error message too */
+static void comicreader_imagedisplay_system_setting_changed(
+	GtkWidget *widget,
+	GtkSystemSetting setting)
+{
+	ComicReaderImageDisplay *self = COMICREADER_IMAGEDISPLAY(widget);
+	g_clear_pointer(&self->error_node, gsk_render_node_unref);
+
+	GTK_WIDGET_CLASS(comicreader_imagedisplay_parent_class)
+		->system_setting_changed(widget, setting);
+}
+
 static void comicreader_imagedisplay_dispose(GObject *object)
 {
 	ComicReaderImageDisplay *self = COMICREADER_IMAGEDISPLAY(object);
 
+	stop_animation(self);
+	stop_slicer(self);
 	comicreader_image_clear(&self->image);
+	g_clear_pointer(&self->error_node, gsk_render_node_unref);
 
 	debug_free("ComicReaderImageDisplay", self);
 	G_OBJECT_CLASS(comicreader_imagedisplay_parent_class)->dispose(object);
@@ -20,8 +20,16 @@
 
 #include "comicreader-imageloader.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 
+/* how far apart the channels of a pixel may be for it to count as gray,
+ * enough to absorb the chroma noise of colour JPEGs of black and white
+ * pages */
+#define GRAY_TOLERANCE 2
+
+static size_t bytes_per_pixel(GdkMemoryFormat format);
+
 void comicreader_image_clear(struct ComicReaderImage **image)
 {
 	if (*image) {
@@ -30,6 +38,8 @@ void comicreader_image_clear(struct ComicReaderImage **image)
 		if ((*image)->error)
 			free((*image)->error);
 		g_clear_object(&(*image)->texture);
+		g_clear_pointer(&(*image)->animation, g_bytes_unref);
+		g_clear_pointer(&(*image)->sliced, g_bytes_unref);
 		free(*image);
 		*image = NULL;
 	}
@@ -49,10 +59,179 @@ struct ComicReaderImage *comicreader_image_dup(struct ComicReaderImage *image)
 		g_object_ref(image->texture);
 		image2->texture = image->texture;
 	}
+	image2->width = image->width;
+	image2->height = image->height;
+	if (image->animation)
+		image2->animation = g_bytes_ref(image->animation);
+	if (image->sliced)
+		image2->sliced = g_bytes_ref(image->sliced);
 
 	return image2;
 }
 
+void comicreader_image_set_error(struct ComicReaderImage *image, const GError *error)
+{
+	size_t sz = snprintf(NULL, 0, "%s (%i)", error->message, error->code) + 1;
+	free(image->error);
+	image->error = calloc(sz, sizeof(char));
+	snprintf(image->error, sz, "%s (%i)", error->message, error->code);
+}
+
+int comicreader_image_get_width(struct ComicReaderImage *image)
+{
+	if (image->width)
+		return image->width;
+	return gdk_texture_get_width(image->texture);
+}
+
+int comicreader_image_get_height(struct ComicReaderImage *image)
+{
+	if (image->height)
+		return image->height;
+	return gdk_texture_get_height(image->texture);
+}
+
+void comicreader_image_compact(struct ComicReaderImage *image)
+{
+	if (!image->texture || image->animation)
+		return;
+
+	GdkTexture *texture = image->texture;
+	GdkMemoryFormat format = gdk_texture_get_format(texture);
+	if (format == GDK_MEMORY_G8)
+		return;
+	bool has_alpha = bytes_per_pixel(format) > 3;
+
+	int width = gdk_texture_get_width(texture);
+	int height = gdk_texture_get_height(texture);
+	GdkTextureDownloader *downloader = gdk_texture_downloader_new(texture);
+	gdk_texture_downloader_set_format(downloader, GDK_MEMORY_R8G8B8A8);
+	gsize stride;
+	GBytes *bytes = gdk_texture_downloader_download_bytes(downloader, &stride);
+	gdk_texture_downloader_free(downloader);
+	const guchar *data = g_bytes_get_data(bytes, NULL);
+
+	/* stop looking as soon as neither format fits */
+	bool opaque = true;
+	bool gray = true;
+	for (int y = 0; y < height && opaque && (gray || has_alpha); ++y) {
+		const guchar *row = data + y * stride;
+		for (int x = 0; x < width; ++x) {
+			const guchar *px = row + x * 4;
+			if (px[3] != 255) {
+				opaque = false;
+				break;
+			}
+			if (abs(px[0] - px[1]) > GRAY_TOLERANCE || abs(px[2] - px[1]) > GRAY_TOLERANCE)
+				gray = false;
+		}
+	}
+
+	if (!opaque || (!gray && !has_alpha)) {
+		g_bytes_unref(bytes);
+		return;
+	}
+
+	size_t out_stride = (size_t)width * (gray ? 1 : 3);
+	guchar *out = malloc(out_stride * height);
+	for (int y = 0; y < height; ++y) {
+		const guchar *row = data + y * stride;
+		guchar *out_row = out + y * out_stride;
+		for (int x = 0; x < width; ++x) {
+			const guchar *px = row + x * 4;
+			if (gray) {
+				out_row[x] = (px[0] + 2 * px[1] + px[2] + 2) / 4;
+			} else {
+				out_row[x * 3] = px[0];
+				out_row[x * 3 + 1] = px[1];
+				out_row[x * 3 + 2] = px[2];
+			}
+		}
+	}
+	g_bytes_unref(bytes);
+
+	GBytes *out_bytes = g_bytes_new_take(out, out_stride * height);
+	image->texture = gdk_memory_texture_new(
+		width,
+		height,
+		gray ? GDK_MEMORY_G8 : GDK_MEMORY_R8G8B8,
+		out_bytes,
+		out_stride);
+	g_bytes_unref(out_bytes);
+	g_object_unref(texture);
+}
+
+size_t comicreader_image_get_size(struct ComicReaderImage *image)
+{
+	size_t size = 0;
+	if (image->texture)
+		size = (size_t)gdk_texture_get_width(image->texture) *
+		       gdk_texture_get_height(image->texture) *
+		       bytes_per_pixel(gdk_texture_get_format(image->texture));
+	if (image->animation)
+		size += g_bytes_get_size(image->animation);
+	if (image->sliced)
+		size += g_bytes_get_size(image->sliced);
+	return size;
+}
+
+GdkTexture *comicreader_texture_scale(GdkTexture *texture, int width, int height)
+{
+	GdkTextureDownloader *downloader = gdk_texture_downloader_new(texture);
+	/* the layout GdkPixbuf expects */
+	gdk_texture_downloader_set_format(downloader, GDK_MEMORY_R8G8B8A8);
+	gsize stride;
+	GBytes *bytes = gdk_texture_downloader_download_bytes(downloader, &stride);
+	gdk_texture_downloader_free(downloader);
+
+	GdkPixbuf *pixbuf = gdk_pixbuf_new_from_bytes(
+		bytes,
+		GDK_COLORSPACE_RGB,
+		TRUE,
+		8,
+		gdk_texture_get_width(texture),
+		gdk_texture_get_height(texture),
+		stride);
+	g_bytes_unref(bytes);
+	GdkPixbuf *scaled = gdk_pixbuf_scale_simple(pixbuf, width, height, GDK_INTERP_BILINEAR);
+	g_object_unref(pixbuf);
+
+	GdkTexture *ret = gdk_texture_new_for_pixbuf(scaled);
+	g_object_unref(scaled);
+	return ret;
+}
+
+/* as stored in a GdkMemoryTexture */
+static size_t bytes_per_pixel(GdkMemoryFormat format)
+{
+	switch (format) {
+	case GDK_MEMORY_G8:
+		return 1;
+	case GDK_MEMORY_G8A8:
+	case GDK_MEMORY_G8A8_PREMULTIPLIED:
+	case GDK_MEMORY_G16:
+		return 2;
+	case GDK_MEMORY_R8G8B8:
+	case GDK_MEMORY_B8G8R8:
+		return 3;
+	case GDK_MEMORY_R16G16B16:
+	case GDK_MEMORY_R16G16B16_FLOAT:
+		return 6;
+	case GDK_MEMORY_R16G16B16A16:
+	case GDK_MEMORY_R16G16B16A16_PREMULTIPLIED:
+	case GDK_MEMORY_R16G16B16A16_FLOAT:
+	case GDK_MEMORY_R16G16B16A16_FLOAT_PREMULTIPLIED:
+		return 8;
+	case GDK_MEMORY_R32G32B32_FLOAT:
+		return 12;
+	case GDK_MEMORY_R32G32B32A32_FLOAT:
+	case GDK_MEMORY_R32G32B32A32_FLOAT_PREMULTIPLIED:
+		return 16;
+	default:
+		return 4;
+	}
+}
+
 void comicreader_image_loader_clear(struct ComicReaderImageLoader **image_loader)
 {
 	if (*image_loader) {
@@ -60,3 +239,113 @@ void comicreader_image_loader_clear(struct ComicReaderImageLoader **image_loader
 		*image_loader = NULL;
 	}
 }
+
+struct ComicReaderImage *comicreader_image_loader_get_preview(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index)
+{
+	if (!image_loader->get_preview)
+		return NULL;
+	return image_loader->get_preview(image_loader, index);
+}
+
+void comicreader_image_loader_set_pinned(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index,
+	bool pinned)
+{
+	if (image_loader->set_pinned)
+		image_loader->set_pinned(image_loader, index, pinned);
+}
+
+void comicreader_image_loader_prefetch(struct ComicReaderImageLoader *image_loader, size_t index)
+{
+	if (image_loader->prefetch)
+		image_loader->prefetch(image_loader, index);
+}
+
+bool comicreader_image_loader_find(
+	struct ComicReaderImageLoader *image_loader,
+	const char *name,
+	size_t *index)
+{
+	if (!image_loader->find_image)
+		return false;
+	return image_loader->find_image(image_loader, name, index);
+}
+
+char *comicreader_image_loader_get_name(struct ComicReaderImageLoader *image_loader, size_t index)
+{
+	if (!image_loader->get_image_name)
+		return NULL;
+	return image_loader->get_image_name(image_loader, index);
+}
+
+char *comicreader_image_loader_get_key(
+	struct ComicReaderImageLoader *image_loader,
+	const char *name)
+{
+	if (!image_loader->get_image_key)
+		return NULL;
+	return image_loader->get_image_key(image_loader, name);
+}
+
+void comicreader_image_loader_set_focused(
+	struct ComicReaderImageLoader *image_loader,
+	bool focused)
+{
+	if (image_loader->set_focused)
+		image_loader->set_focused(image_loader, focused);
+}
+
+bool comicreader_image_loader_get_cache_stats(
+	struct ComicReaderImageLoader *image_loader,
+	struct ComicReaderCacheStats *stats)
+{
+	if (!image_loader->get_cache_stats)
+		return false;
+	memset(stats, 0, sizeof(*stats));
+	image_loader->get_cache_stats(image_loader, stats);
+	return true;
+}
+
+void comicreader_image_loader_set_listener(
+	struct ComicReaderImageLoader *image_loader,
+	ComicReaderImageLoaderListener listener,
+	void *user_data)
+{
+	image_loader->listener = listener;
+	image_loader->listener_data = user_data;
+}
+
+void comicreader_image_loader_notify(
+	struct ComicReaderImageLoader *image_loader,
+	enum ComicReaderImageLoaderEvent event,
+	size_t index)
+{
+	if (image_loader->listener)
+		image_loader->listener(image_loader->listener_data, event, index);
+}
+
+bool comicreader_image_loader_update_index(
+	enum ComicReaderImageLoaderEvent event,
+	size_t index,
+	size_t *idx)
+{
+	switch (event) {
+	case COMICREADER_IMAGE_LOADER_IMAGE_INSERTED:
+		if (*idx >= index)
+			++*idx;
+		return true;
+	case COMICREADER_IMAGE_LOADER_IMAGE_REMOVED:
+		if (*idx == index)
+			return false;
+		if (*idx > index)
+			--*idx;
+		return true;
+	case COMICREADER_IMAGE_LOADER_PREVIEW_READY:
+	case COMICREADER_IMAGE_LOADER_IMAGE_CHANGED:
+	default:
+		return true;
+	}
+}
@@ -21,20 +21,187 @@
 #pragma once
 
 #include <gdk/gdk.h>
+#include <stdbool.h>
 
 struct ComicReaderImage {
 	char *name;
 	char *error;
 	GdkTexture *texture;
+	/* size to lay the image out at, 0 to use the texture's size */
+	int width;
+	int height;
+	/* the encoded image if it has several frames, texture is then its
+	 * first frame */
+	GBytes *animation;
+	/* the encoded image if it's too large to decode whole, texture is
+	 * then NULL and width and height give its size */
+	GBytes *sliced;
+	/* microseconds the request for this image spent reading and decoding
+	 * it, 0 if it was cached; not copied by comicreader_image_dup */
+	gint64 read_time;
+	gint64 decode_time;
+};
+
+enum ComicReaderImageLoaderEvent {
+	COMICREADER_IMAGE_LOADER_PREVIEW_READY,
+	/* an image was inserted at index, moving later images up by one */
+	COMICREADER_IMAGE_LOADER_IMAGE_INSERTED,
+	/* the image at index was removed, moving later images down by one */
+	COMICREADER_IMAGE_LOADER_IMAGE_REMOVED,
+	/* the image at index was modified and should be reloaded */
+	COMICREADER_IMAGE_LOADER_IMAGE_CHANGED,
+	/* every image decodes differently now, e.g. because a filter was
+	 * reconfigured, though the files themselves are unchanged; index is 0 */
+	COMICREADER_IMAGE_LOADER_ALL_CHANGED,
+};
+
+/* what a loader keeps in memory, for diagnostics */
+struct ComicReaderCacheStats {
+	size_t decoded;
+	size_t decoded_capacity;
+	size_t decoded_bytes;
+	size_t previews;
+	size_t previews_capacity;
+	size_t compressed_bytes;
+	size_t compressed_budget;
+	size_t packed;
+	size_t packed_bytes;
+	size_t packed_budget;
+	size_t reads_in_flight;
+	size_t decodes_in_flight;
+	/* shared with other loaders */
+	size_t shared_bytes;
+	size_t shared_budget;
+};
+
+typedef void (*ComicReaderImageLoaderListener)(
+	void *user_data,
+	enum ComicReaderImageLoaderEvent event,
+	size_t index);
+
+/* one file of a read_images batch, done is called on an arbitrary thread
+ * with bytes and name set as read_image would return them */
+struct ComicReaderReadRequest {
+	size_t index;
+	GBytes *bytes;
+	char *name;
+	void (*done)(struct ComicReaderReadRequest *request);
 };
 
 struct ComicReaderImageLoader {
 	size_t (*get_num_images)(struct ComicReaderImageLoader *self);
 	struct ComicReaderImage *(*get_image)(struct ComicReaderImageLoader *self, size_t index);
 	void (*free)(struct ComicReaderImageLoader *self);
+
+	/* optional, may be NULL */
+	struct ComicReaderImage *(*get_preview)(struct ComicReaderImageLoader *self, size_t index);
+	void (*set_pinned)(struct ComicReaderImageLoader *self, size_t index, bool pinned);
+	void (*prefetch)(struct ComicReaderImageLoader *self, size_t index);
+	bool (*find_image)(struct ComicReaderImageLoader *self, const char *name, size_t *index);
+
+	/* optional, splits get_image into a cheap to cache I/O stage and a
+	 * decode stage; read_image returns NULL on failure.  key, if not NULL,
+	 * is what get_image_key returned for name, and settings are taken
+	 * from it rather than their current value so the result matches it */
+	GBytes *(*read_image)(struct ComicReaderImageLoader *self, size_t index, char **name);
+	struct ComicReaderImage *(*decode_image)(
+		struct ComicReaderImageLoader *self,
+		const char *name,
+		GBytes *bytes,
+		const char *key);
+	/* optional, only when read_image is set; reads several images with as
+	 * few system calls as possible and returns without waiting */
+	void (*read_images)(
+		struct ComicReaderImageLoader *self,
+		struct ComicReaderReadRequest **requests,
+		size_t num_requests);
+
+	/* optional, name the decoded form of images independently of the
+	 * loader so that loaders for the same comic can share them */
+	char *(*get_image_name)(struct ComicReaderImageLoader *self, size_t index);
+	char *(*get_image_key)(struct ComicReaderImageLoader *self, const char *name);
+	/* optional, whether the loader serves the focused window */
+	void (*set_focused)(struct ComicReaderImageLoader *self, bool focused);
+	/* optional */
+	void (*get_cache_stats)(
+		struct ComicReaderImageLoader *self,
+		struct ComicReaderCacheStats *stats);
+
+	ComicReaderImageLoaderListener listener;
+	void *listener_data;
 };
 
 void comicreader_image_clear(struct ComicReaderImage **image);
 struct ComicReaderImage *comicreader_image_dup(struct ComicReaderImage *image);
+void comicreader_image_set_error(struct ComicReaderImage *image, const GError *error);
+int comicreader_image_get_width(struct ComicReaderImage *image);
+int comicreader_image_get_height(struct ComicReaderImage *image);
+/* Replaces the texture with a G8 or R8G8B8 copy if it's opaque and gray or
+ * opaque, which takes a quarter or three quarters of the memory. */
+void comicreader_image_compact(struct ComicReaderImage *image);
+/* bytes the image keeps in memory */
+size_t comicreader_image_get_size(struct ComicReaderImage *image);
+
+/* Returns a copy of texture resized to width by height. */
+GdkTexture *comicreader_texture_scale(GdkTexture *texture, int width, int height);
 
 void comicreader_image_loader_clear(struct ComicReaderImageLoader **image_loader);
+
+/* Returns a low resolution version of the image at index, or NULL if none
+ * is available yet.  Loaders that load previews asynchronously emit
+ * COMICREADER_IMAGE_LOADER_PREVIEW_READY once a later call will succeed. */
+struct ComicReaderImage *comicreader_image_loader_get_preview(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index);
+
+/* Pinned images are kept cached regardless of the current position. */
+void comicreader_image_loader_set_pinned(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index,
+	bool pinned);
+
+/* Hints that the image at index and its neighbours will be requested soon. */
+void comicreader_image_loader_prefetch(struct ComicReaderImageLoader *image_loader, size_t index);
+
+/* Looks up the index of the image with the given name. */
+bool comicreader_image_loader_find(
+	struct ComicReaderImageLoader *image_loader,
+	const char *name,
+	size_t *index);
+
+/* Returns the name of the image at index, to be freed with free(), or NULL. */
+char *comicreader_image_loader_get_name(struct ComicReaderImageLoader *image_loader, size_t index);
+
+/* Returns a string, to be freed with g_free(), that identifies the decoded
+ * form of the image with the given name: two images with the same key look
+ * the same, even if they come from different loaders.  Returns NULL if the
+ * loader can't tell. */
+char *comicreader_image_loader_get_key(
+	struct ComicReaderImageLoader *image_loader,
+	const char *name);
+
+/* Loaders serving the focused window get to decode first. */
+void comicreader_image_loader_set_focused(
+	struct ComicReaderImageLoader *image_loader,
+	bool focused);
+
+/* Returns false if the loader doesn't cache anything. */
+bool comicreader_image_loader_get_cache_stats(
+	struct ComicReaderImageLoader *image_loader,
+	struct ComicReaderCacheStats *stats);
+
+void comicreader_image_loader_set_listener(
+	struct ComicReaderImageLoader *image_loader,
+	ComicReaderImageLoaderListener listener,
+	void *user_data);
+void comicreader_image_loader_notify(
+	struct ComicReaderImageLoader *image_loader,
+	enum ComicReaderImageLoaderEvent event,
+	size_t index);
+
+/* Adjusts *idx for an IMAGE_INSERTED or IMAGE_REMOVED event at index.
+ * Returns false if *idx referred to the removed image. */
+bool comicreader_image_loader_update_index(
+	enum ComicReaderImageLoaderEvent event,
+	size_t index,
+	size_t *idx);
@@ -0,0 +1,743 @@
+/* comicreader-library.c
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "comicreader-library.h"
+#include "comicreader-bulkreader.h"
+#include "comicreader-debug.h"
+#include "comicreader-directoryimageloader.h"
+#include "comicreader-qos.h"
+
+#include <sqlite3.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* height, in pixels, that covers are stored at */
+#define COVER_HEIGHT 256
+#define COVER_QUALITY "85"
+
+#define SCHEMA \
+	"CREATE TABLE IF NOT EXISTS directories (" \
+	"  path TEXT PRIMARY KEY," \
+	"  mtime INTEGER NOT NULL," \
+	"  generation INTEGER NOT NULL);" \
+	"CREATE TABLE IF NOT EXISTS children (" \
+	"  parent TEXT NOT NULL," \
+	"  path TEXT NOT NULL," \
+	"  PRIMARY KEY (parent, path));" \
+	"CREATE TABLE IF NOT EXISTS comics (" \
+	"  path TEXT PRIMARY KEY," \
+	"  page_count INTEGER NOT NULL," \
+	"  cover BLOB," \
+	"  generation INTEGER NOT NULL);"
+
+struct ComicReaderLibrary {
+	/* serialized, shared by the main thread and cover loads */
+	sqlite3 *db;
+	char *db_path;
+	GPtrArray *listeners;
+
+	GThread *scan_thread;
+	struct Scan *scan;
+	/* roots to scan again once the current scan finishes */
+	char **pending_roots;
+};
+
+struct Listener {
+	ComicReaderLibraryListener listener;
+	void *user_data;
+};
+
+struct Scan {
+	struct ComicReaderLibrary *library;
+	char **roots;
+	GAsyncQueue *results;
+	/* reads covers for every worker, so that they're issued together */
+	struct ComicReaderBulkReader *reader;
+	/* set when the library is freed mid scan */
+	gint cancelled;
+};
+
+/* a directory as it was at the last scan */
+struct KnownDirectory {
+	gint64 mtime;
+	GPtrArray *children;
+};
+
+/* one directory to list, filled in by a scan worker */
+struct ScanJob {
+	char *path;
+	/* NULL if this directory wasn't indexed before */
+	const struct KnownDirectory *known;
+
+	bool ok;
+	bool unchanged;
+	gint64 mtime;
+	GPtrArray *subdirectories;
+	int page_count;
+	GBytes *cover;
+};
+
+/* a cover read in bulk, which the scan worker waits on */
+struct CoverRead {
+	struct ComicReaderBulkRead read;
+	GMutex lock;
+	GCond cond;
+	bool done;
+};
+
+/* helper functions */
+static sqlite3 *open_db(const char *path);
+static void exec(sqlite3 *db, const char *sql);
+static void notify_listeners(struct ComicReaderLibrary *self);
+static void start_scan(struct ComicReaderLibrary *self, char **roots);
+static gpointer scan_thread(gpointer data);
+static gboolean finish_scan(gpointer data);
+static GHashTable *load_known_directories(sqlite3 *db);
+static void free_known_directory(void *p);
+static void scan_directory(gpointer data, gpointer user_data);
+static bool is_image_name(const char *name);
+static GBytes *read_cover(struct Scan *scan, const char *path);
+static void cover_read_done(struct ComicReaderBulkRead *read);
+static GBytes *make_cover(GBytes *bytes, const char *path);
+static void store_job(sqlite3 *db, struct ScanJob *job, gint64 generation);
+static void free_job(struct ScanJob *job);
+static void load_cover_in_thread(
+	GTask *task,
+	gpointer source_object,
+	gpointer task_data,
+	GCancellable *cancellable);
+
+struct ComicReaderLibrary *comicreader_library_new(const char *db_path)
+{
+	struct ComicReaderLibrary *ret;
+	ret = calloc(1, sizeof(struct ComicReaderLibrary));
+	debug_init("ComicReaderLibrary", ret);
+
+	char *dir = g_path_get_dirname(db_path);
+	g_mkdir_with_parents(dir, 0700);
+	g_free(dir);
+
+	ret->db_path = strdup(db_path);
+	ret->db = open_db(db_path);
+	/* readers never wait for a scan to commit */
+	exec(ret->db, "PRAGMA journal_mode=WAL;");
+	exec(ret->db, SCHEMA);
+	ret->listeners = g_ptr_array_new_with_free_func(free);
+
+	return ret;
+}
+
+void comicreader_library_free(struct ComicReaderLibrary *self)
+{
+	if (self->scan_thread) {
+		g_atomic_int_set(&self->scan->cancelled, 1);
+		g_thread_join(self->scan_thread);
+		g_idle_remove_by_data(self->scan);
+		g_strfreev(self->scan->roots);
+		free(self->scan);
+	}
+	g_strfreev(self->pending_roots);
+
+	g_ptr_array_unref(self->listeners);
+	sqlite3_close(self->db);
+	free(self->db_path);
+	debug_free("ComicReaderLibrary", self);
+	free(self);
+}
+
+void comicreader_library_scan(struct ComicReaderLibrary *self, const char *const *roots)
+{
+	if (self->scan_thread) {
+		g_strfreev(self->pending_roots);
+		self->pending_roots = g_strdupv((char **)roots);
+		return;
+	}
+
+	start_scan(self, g_strdupv((char **)roots));
+}
+
+void comicreader_library_add_listener(
+	struct ComicReaderLibrary *self,
+	ComicReaderLibraryListener listener,
+	void *user_data)
+{
+	struct Listener *l = malloc(sizeof(*l));
+	l->listener = listener;
+	l->user_data = user_data;
+	g_ptr_array_add(self->listeners, l);
+}
+
+void comicreader_library_remove_listener(
+	struct ComicReaderLibrary *self,
+	ComicReaderLibraryListener listener,
+	void *user_data)
+{
+	for (guint i = 0; i < self->listeners->len; ++i) {
+		struct Listener *l = g_ptr_array_index(self->listeners, i);
+		if (l->listener == listener && l->user_data == user_data) {
+			g_ptr_array_remove_index(self->listeners, i);
+			return;
+		}
+	}
+}
+
+GtkStringList *comicreader_library_list_comics(struct ComicReaderLibrary *self)
+{
+	GtkStringList *ret = gtk_string_list_new(NULL);
+
+	sqlite3_stmt *stmt;
+	sqlite3_prepare_v2(self->db, "SELECT path FROM comics ORDER BY path;", -1, &stmt, NULL);
+	while (sqlite3_step(stmt) == SQLITE_ROW)
+		gtk_string_list_append(ret, (const char *)sqlite3_column_text(stmt, 0));
+	sqlite3_finalize(stmt);
+
+	return ret;
+}
+
+int comicreader_library_get_page_count(struct ComicReaderLibrary *self, const char *path)
+{
+	int ret = 0;
+
+	sqlite3_stmt *stmt;
+	sqlite3_prepare_v2(
+		self->db,
+		"SELECT page_count FROM comics WHERE path = ?;",
+		-1,
+		&stmt,
+		NULL);
+	sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		ret = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	return ret;
+}
+
+void comicreader_library_load_cover_async(
+	struct ComicReaderLibrary *self,
+	const char *path,
+	GCancellable *cancellable,
+	GAsyncReadyCallback callback,
+	gpointer user_data)
+{
+	GTask *task = g_task_new(NULL, cancellable, callback, user_data);
+	g_task_set_source_tag(task, comicreader_library_load_cover_async);
+	g_task_set_task_data(task, g_strdup(path), g_free);
+	g_object_set_data(G_OBJECT(task), "library", self);
+	g_task_run_in_thread(task, load_cover_in_thread);
+	g_object_unref(task);
+}
+
+GdkTexture *comicreader_library_load_cover_finish(
+	struct ComicReaderLibrary *self,
+	GAsyncResult *result,
+	GError **error)
+{
+	return g_task_propagate_pointer(G_TASK(result), error);
+}
+
+static sqlite3 *open_db(const char *path)
+{
+	sqlite3 *db;
+	int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX;
+	if (sqlite3_open_v2(path, &db, flags, NULL) != SQLITE_OK)
+		abort_printf("cannot open %s: %s\n", path, sqlite3_errmsg(db));
+	sqlite3_busy_timeout(db, 5000);
+	return db;
+}
+
+static void exec(sqlite3 *db, const char *sql)
+{
+	char *error = NULL;
+	if (sqlite3_exec(db, sql, NULL, NULL, &error) != SQLITE_OK) {
+		debug_printf("sqlite: %s\n", error);
+		sqlite3_free(error);
+	}
+}
+
+static void notify_listeners(struct ComicReaderLibrary *self)
+{
+	for (guint i = 0; i < self->listeners->len; ++i) {
+		struct Listener *l = g_ptr_array_index(self->listeners, i);
+		l->listener(l->user_data);
+	}
+}
+
+static void start_scan(struct ComicReaderLibrary *self, char **roots)
+{
+	struct Scan *scan = calloc(1, sizeof(*scan));
+	scan->library = self;
+	scan->roots = roots;
+	self->scan = scan;
+	self->scan_thread = g_thread_new("library-scan", scan_thread, scan);
+}
+
+/* Lists directories in parallel on a pool of workers, while this thread
+ * writes what they find to the index in a single transaction.  Rows that
+ * weren't visited belong to directories that no longer exist. */
+static gpointer scan_thread(gpointer data)
+{
+	struct Scan *scan = data;
+	/* nobody is waiting on the index, so it only gets spare CPU and disk */
+	comicreader_qos_apply(COMICREADER_QOS_IDLE);
+	sqlite3 *db = open_db(scan->library->db_path);
+	gint64 start = g_get_monotonic_time();
+
+	exec(db, "BEGIN;");
+	GHashTable *known = load_known_directories(db);
+
+	gint64 generation = 1;
+	sqlite3_stmt *stmt;
+	sqlite3_prepare_v2(db, "SELECT MAX(generation) FROM directories;", -1, &stmt, NULL);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		generation = sqlite3_column_int64(stmt, 0) + 1;
+	sqlite3_finalize(stmt);
+
+	/* listing is mostly waiting on the disk, so use plenty of workers,
+	 * exclusive ones as they're made idle */
+	scan->results = g_async_queue_new();
+	scan->reader = comicreader_bulk_reader_new(COMICREADER_QOS_IDLE);
+	GThreadPool *pool = g_thread_pool_new(
+		scan_directory,
+		scan,
+		2 * g_get_num_processors(),
+		TRUE,
+		NULL);
+
+	size_t outstanding = 0;
+	for (char **root = scan->roots; *root; ++root) {
+		struct ScanJob *job = calloc(1, sizeof(*job));
+		job->path = g_strdup(*root);
+		job->known = g_hash_table_lookup(known, job->path);
+		g_thread_pool_push(pool, job, NULL);
+		++outstanding;
+	}
+
+	size_t num_directories = 0;
+	while (outstanding > 0) {
+		struct ScanJob *job = g_async_queue_pop(scan->results);
+		--outstanding;
+		++num_directories;
+
+		if (job->ok) {
+			store_job(db, job, generation);
+			for (guint i = 0; i < job->subdirectories->len; ++i) {
+				struct ScanJob *child = calloc(1, sizeof(*child));
+				child->path = g_strdup(g_ptr_array_index(job->subdirectories, i));
+				child->known = g_hash_table_lookup(known, child->path);
+				g_thread_pool_push(pool, child, NULL);
+				++outstanding;
+			}
+		}
+		free_job(job);
+	}
+
+	g_thread_pool_free(pool, FALSE, TRUE);
+	g_clear_pointer(&scan->reader, comicreader_bulk_reader_free);
+	g_async_queue_unref(scan->results);
+	scan->results = NULL;
+
+	/* keep the last complete index rather than a partial one */
+	if (g_atomic_int_get(&scan->cancelled)) {
+		exec(db, "ROLLBACK;");
+		g_hash_table_unref(known);
+		sqlite3_close(db);
+		return NULL;
+	}
+
+	sqlite3_prepare_v2(db, "DELETE FROM directories WHERE generation != ?1;", -1, &stmt, NULL);
+	sqlite3_bind_int64(stmt, 1, generation);
+	sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+	sqlite3_prepare_v2(db, "DELETE FROM comics WHERE generation != ?1;", -1, &stmt, NULL);
+	sqlite3_bind_int64(stmt, 1, generation);
+	sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+	exec(db, "DELETE FROM children WHERE parent NOT IN (SELECT path FROM directories);");
+	exec(db, "COMMIT;");
+
+	g_hash_table_unref(known);
+	sqlite3_close(db);
+
+	debug_printf(
+		"library scan of %zu directories took %" G_GINT64_FORMAT " ms\n",
+		num_directories,
+		(g_get_monotonic_time() - start) / 1000);
+
+	g_idle_add(finish_scan, scan);
+	return NULL;
+}
+
+static gboolean finish_scan(gpointer data)
+{
+	struct Scan *scan = data;
+	struct ComicReaderLibrary *self = scan->library;
+
+	g_thread_join(self->scan_thread);
+	self->scan_thread = NULL;
+	self->scan = NULL;
+	g_strfreev(scan->roots);
+	free(scan);
+
+	notify_listeners(self);
+
+	if (self->pending_roots) {
+		char **roots = self->pending_roots;
+		self->pending_roots = NULL;
+		start_scan(self, roots);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+static GHashTable *load_known_directories(sqlite3 *db)
+{
+	GHashTable *ret = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_known_directory);
+
+	sqlite3_stmt *stmt;
+	sqlite3_prepare_v2(db, "SELECT path, mtime FROM directories;", -1, &stmt, NULL);
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		struct KnownDirectory *dir = calloc(1, sizeof(*dir));
+		dir->mtime = sqlite3_column_int64(stmt, 1);
+		dir->children = g_ptr_array_new_with_free_func(g_free);
+		g_hash_table_insert(ret, g_strdup((const char *)sqlite3_column_text(stmt, 0)), dir);
+	}
+	sqlite3_finalize(stmt);
+
+	sqlite3_prepare_v2(db, "SELECT parent, path FROM children;", -1, &stmt, NULL);
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		struct KnownDirectory *dir =
+			g_hash_table_lookup(ret, (const char *)sqlite3_column_text(stmt, 0));
+		if (dir)
+			g_ptr_array_add(
+				dir->children,
+				g_strdup((const char *)sqlite3_column_text(stmt, 1)));
+	}
+	sqlite3_finalize(stmt);
+
+	return ret;
+}
+
+static void free_known_directory(void *p)
+{
+	struct KnownDirectory *dir = p;
+	g_ptr_array_unref(dir->children);
+	free(dir);
+}
+
+/* called on background thread */
+static void scan_directory(gpointer data, gpointer user_data)
+{
+	struct ScanJob *job = data;
+	struct Scan *scan = user_data;
+	GAsyncQueue *results = scan->results;
+
+	comicreader_qos_apply(COMICREADER_QOS_IDLE);
+	comicreader_qos_wait_while_interacting();
+
+	struct stat st;
+	if (g_atomic_int_get(&scan->cancelled) || stat(job->path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		g_async_queue_push(results, job);
+		return;
+	}
+	job->ok = true;
+	job->mtime = st.st_mtim.tv_sec * G_GINT64_CONSTANT(1000000000) + st.st_mtim.tv_nsec;
+	job->subdirectories = g_ptr_array_new_with_free_func(g_free);
+
+	/* an unchanged directory has the same entries, only its
+	 * subdirectories need a look */
+	if (job->known && job->known->mtime == job->mtime) {
+		job->unchanged = true;
+		for (guint i = 0; i < job->known->children->len; ++i) {
+			g_ptr_array_add(
+				job->subdirectories,
+				g_strdup(g_ptr_array_index(job->known->children, i)));
+		}
+		g_async_queue_push(results, job);
+		return;
+	}
+
+	GDir *dir = g_dir_open(job->path, 0, NULL);
+	if (!dir) {
+		job->ok = false;
+		g_async_queue_push(results, job);
+		return;
+	}
+
+	char *first_image = NULL;
+	const char *name;
+	while ((name = g_dir_read_name(dir))) {
+		if (name[0] == '.')
+			continue;
+		/* symlinked folders aren't followed, they could lead back up */
+		char *path = g_build_filename(job->path, name, NULL);
+		struct stat entry_st;
+		if (lstat(path, &entry_st) == 0 && S_ISDIR(entry_st.st_mode)) {
+			g_ptr_array_add(job->subdirectories, path);
+			continue;
+		}
+		g_free(path);
+
+		if (!is_image_name(name))
+			continue;
+		++job->page_count;
+		/* the cover is the page the reader opens on */
+		if (!first_image ||
+		    comicreader_directory_image_loader_compare_names(name, first_image) < 0) {
+			g_free(first_image);
+			first_image = g_strdup(name);
+		}
+	}
+	g_dir_close(dir);
+
+	if (first_image) {
+		char *path = g_build_filename(job->path, first_image, NULL);
+		GBytes *bytes = read_cover(scan, path);
+		if (bytes) {
+			job->cover = make_cover(bytes, path);
+			g_bytes_unref(bytes);
+		}
+		g_free(path);
+		g_free(first_image);
+	}
+
+	g_async_queue_push(results, job);
+}
+
+static bool is_image_name(const char *name)
+{
+	char *content_type = g_content_type_guess(name, NULL, 0, NULL);
+	bool ret = g_str_has_prefix(content_type, "image/");
+	g_free(content_type);
+	return ret;
+}
+
+/* Reads the file at path through the scan's bulk reader, or returns NULL.
+ * called on background thread */
+static GBytes *read_cover(struct Scan *scan, const char *path)
+{
+	struct CoverRead cover = {0};
+	cover.read.path = (char *)path;
+	cover.read.done = cover_read_done;
+	g_mutex_init(&cover.lock);
+	g_cond_init(&cover.cond);
+
+	struct ComicReaderBulkRead *reads[] = {&cover.read};
+	comicreader_bulk_reader_submit(scan->reader, reads, 1);
+	g_mutex_lock(&cover.lock);
+	while (!cover.done)
+		g_cond_wait(&cover.cond, &cover.lock);
+	g_mutex_unlock(&cover.lock);
+
+	g_mutex_clear(&cover.lock);
+	g_cond_clear(&cover.cond);
+	if (!cover.read.bytes)
+		debug_printf("cannot read cover %s\n", path);
+	return cover.read.bytes;
+}
+
+/* called on background thread */
+static void cover_read_done(struct ComicReaderBulkRead *read)
+{
+	struct CoverRead *cover = (struct CoverRead *)read;
+	g_mutex_lock(&cover->lock);
+	cover->done = true;
+	g_cond_signal(&cover->cond);
+	g_mutex_unlock(&cover->lock);
+}
+
+/* called on background thread */
+static GBytes *make_cover(GBytes *bytes, const char *path)
+{
+	GError *error = NULL;
+	GInputStream *stream = g_memory_input_stream_new_from_bytes(bytes);
+	GdkPixbuf *pixbuf =
+		gdk_pixbuf_new_from_stream_at_scale(stream, -1, COVER_HEIGHT, TRUE, NULL, &error);
+	g_object_unref(stream);
+	if (!pixbuf) {
+		debug_printf("no cover for %s: %s\n", path, error->message);
+		g_clear_error(&error);
+		return NULL;
+	}
+
+	char *buffer = NULL;
+	gsize size = 0;
+	bool saved;
+	if (gdk_pixbuf_get_has_alpha(pixbuf))
+		saved = gdk_pixbuf_save_to_buffer(pixbuf, &buffer, &size, "png", &error, NULL);
+	else
+		saved = gdk_pixbuf_save_to_buffer(
+			pixbuf,
+			&buffer,
+			&size,
+			"jpeg",
+			&error,
+			"quality",
+			COVER_QUALITY,
+			NULL);
+	g_object_unref(pixbuf);
+
+	if (!saved) {
+		debug_printf("cannot encode cover for %s: %s\n", path, error->message);
+		g_clear_error(&error);
+		return NULL;
+	}
+
+	return g_bytes_new_take(buffer, size);
+}
+
+static void store_job(sqlite3 *db, struct ScanJob *job, gint64 generation)
+{
+	sqlite3_stmt *stmt;
+
+	if (job->unchanged) {
+		sqlite3_prepare_v2(
+			db,
+			"UPDATE directories SET generation = ?1 WHERE path = ?2;",
+			-1,
+			&stmt,
+			NULL);
+		sqlite3_bind_int64(stmt, 1, generation);
+		sqlite3_bind_text(stmt, 2, job->path, -1, SQLITE_STATIC);
+		sqlite3_step(stmt);
+		sqlite3_finalize(stmt);
+
+		sqlite3_prepare_v2(
+			db,
+			"UPDATE comics SET generation = ?1 WHERE path = ?2;",
+			-1,
+			&stmt,
+			NULL);
+		sqlite3_bind_int64(stmt, 1, generation);
+		sqlite3_bind_text(stmt, 2, job->path, -1, SQLITE_STATIC);
+		sqlite3_step(stmt);
+		sqlite3_finalize(stmt);
+		return;
+	}
+
+	sqlite3_prepare_v2(
+		db,
+		"INSERT OR REPLACE INTO directories (path, mtime, generation) VALUES (?1, ?2, ?3);",
+		-1,
+		&stmt,
+		NULL);
+	sqlite3_bind_text(stmt, 1, job->path, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, job->mtime);
+	sqlite3_bind_int64(stmt, 3, generation);
+	sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+
+	sqlite3_prepare_v2(db, "DELETE FROM children WHERE parent = ?1;", -1, &stmt, NULL);
+	sqlite3_bind_text(stmt, 1, job->path, -1, SQLITE_STATIC);
+	sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+
+	sqlite3_prepare_v2(
+		db,
+		"INSERT INTO children (parent, path) VALUES (?1, ?2);",
+		-1,
+		&stmt,
+		NULL);
+	for (guint i = 0; i < job->subdirectories->len; ++i) {
+		sqlite3_bind_text(stmt, 1, job->path, -1, SQLITE_STATIC);
+		sqlite3_bind_text(
+			stmt,
+			2,
+			g_ptr_array_index(job->subdirectories, i),
+			-1,
+			SQLITE_STATIC);
+		sqlite3_step(stmt);
+		sqlite3_reset(stmt);
+	}
+	sqlite3_finalize(stmt);
+
+	if (job->page_count == 0) {
+		sqlite3_prepare_v2(db, "DELETE FROM comics WHERE path = ?1;", -1, &stmt, NULL);
+		sqlite3_bind_text(stmt, 1, job->path, -1, SQLITE_STATIC);
+		sqlite3_step(stmt);
+		sqlite3_finalize(stmt);
+		return;
+	}
+
+	sqlite3_prepare_v2(
+		db,
+		"INSERT OR REPLACE INTO comics (path, page_count, cover, generation) "
+		"VALUES (?1, ?2, ?3, ?4);",
+		-1,
+		&stmt,
+		NULL);
+	sqlite3_bind_text(stmt, 1, job->path, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 2, job->page_count);
+	if (job->cover) {
+		gsize size;
+		const void *cover = g_bytes_get_data(job->cover, &size);
+		sqlite3_bind_blob(stmt, 3, cover, size, SQLITE_STATIC);
+	} else {
+		sqlite3_bind_null(stmt, 3);
+	}
+	sqlite3_bind_int64(stmt, 4, generation);
+	sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+}
+
+static void free_job(struct ScanJob *job)
+{
+	g_free(job->path);
+	if (job->subdirectories)
+		g_ptr_array_unref(job->subdirectories);
+	if (job->cover)
+		g_bytes_unref(job->cover);
+	free(job);
+}
+
+/* called on background thread */
+static void load_cover_in_thread(
+	GTask *task,
+	gpointer source_object,
+	gpointer task_data,
+	GCancellable *cancellable)
+{
+	struct ComicReaderLibrary *self = g_object_get_data(G_OBJECT(task), "library");
+	const char *path = task_data;
+
+	if (g_task_return_error_if_cancelled(task))
+		return;
+
+	GBytes *bytes = NULL;
+	sqlite3_stmt *stmt;
+	sqlite3_prepare_v2(self->db, "SELECT cover FROM comics WHERE path = ?;", -1, &stmt, NULL);
+	sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) == SQLITE_BLOB)
+		bytes = g_bytes_new(sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0));
+	sqlite3_finalize(stmt);
+
+	if (!bytes) {
+		g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "No cover for %s", path);
+		return;
+	}
+
+	GError *error = NULL;
+	GdkTexture *texture = gdk_texture_new_from_bytes(bytes, &error);
+	g_bytes_unref(bytes);
+	if (texture)
+		g_task_return_pointer(task, texture, g_object_unref);
+	else
+		g_task_return_error(task, error);
+}
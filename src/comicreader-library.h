@@ -0,0 +1,63 @@
+/* comicreader-library.h
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gtk/gtk.h>
+
+/* An index of every comic under the library roots: one row per directory
+ * holding images, with its page count and a cover thumbnail.  Scans run
+ * on background threads; everything else only reads the index. */
+struct ComicReaderLibrary;
+
+typedef void (*ComicReaderLibraryListener)(void *user_data);
+
+struct ComicReaderLibrary *comicreader_library_new(const char *db_path);
+void comicreader_library_free(struct ComicReaderLibrary *self);
+
+/* Brings the index up to date with roots, only listing directories whose
+ * modification time changed.  Listeners are called once the new index is
+ * ready. */
+void comicreader_library_scan(struct ComicReaderLibrary *self, const char *const *roots);
+
+void comicreader_library_add_listener(
+	struct ComicReaderLibrary *self,
+	ComicReaderLibraryListener listener,
+	void *user_data);
+void comicreader_library_remove_listener(
+	struct ComicReaderLibrary *self,
+	ComicReaderLibraryListener listener,
+	void *user_data);
+
+/* Returns the paths of every indexed comic, in order. */
+GtkStringList *comicreader_library_list_comics(struct ComicReaderLibrary *self);
+int comicreader_library_get_page_count(struct ComicReaderLibrary *self, const char *path);
+
+/* Decodes the cover of the comic at path on a background thread. */
+void comicreader_library_load_cover_async(
+	struct ComicReaderLibrary *self,
+	const char *path,
+	GCancellable *cancellable,
+	GAsyncReadyCallback callback,
+	gpointer user_data);
+GdkTexture *comicreader_library_load_cover_finish(
+	struct ComicReaderLibrary *self,
+	GAsyncResult *result,
+	GError **error);
@@ -0,0 +1,231 @@
+/* comicreader-libraryview.c
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "comicreader-libraryview.h"
+#include "comicreader-debug.h"
+
+#define COVER_WIDTH 120
+#define COVER_HEIGHT 180
+
+struct _ComicReaderLibraryView {
+	GtkWidget parent_instance;
+
+	GtkWidget *scrolled_window;
+	GtkGridView *grid_view;
+	struct ComicReaderLibrary *library;
+};
+
+enum {
+	SIGNAL_COMIC_ACTIVATED,
+	NUM_SIGNALS,
+};
+
+static guint signals[NUM_SIGNALS];
+
+G_DEFINE_FINAL_TYPE(ComicReaderLibraryView, comicreader_libraryview, GTK_TYPE_WIDGET)
+
+static void library_changed(void *user_data);
+static void setup_item(GtkSignalListItemFactory *factory, GtkListItem *item, gpointer data);
+static void bind_item(GtkSignalListItemFactory *factory, GtkListItem *item, gpointer data);
+static void unbind_item(GtkSignalListItemFactory *factory, GtkListItem *item, gpointer data);
+static void cover_loaded(GObject *source_object, GAsyncResult *result, gpointer data);
+static void activate(GtkGridView *grid_view, guint position, gpointer data);
+static void comicreader_libraryview_dispose(GObject *object);
+
+static void comicreader_libraryview_class_init(ComicReaderLibraryViewClass *klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS(klass);
+	object_class->dispose = comicreader_libraryview_dispose;
+
+	GtkWidgetClass *widget_class = GTK_WIDGET_CLASS(klass);
+	gtk_widget_class_set_layout_manager_type(widget_class, GTK_TYPE_BIN_LAYOUT);
+
+	signals[SIGNAL_COMIC_ACTIVATED] = g_signal_new(
+		"comic-activated",
+		G_TYPE_FROM_CLASS(klass),
+		G_SIGNAL_RUN_LAST,
+		0,
+		NULL,
+		NULL,
+		NULL,
+		G_TYPE_NONE,
+		1,
+		G_TYPE_STRING);
+}
+
+static void comicreader_libraryview_init(ComicReaderLibraryView *self)
+{
+	debug_init("ComicReaderLibraryView", self);
+
+	GtkListItemFactory *factory = gtk_signal_list_item_factory_new();
+	g_signal_connect(factory, "setup", G_CALLBACK(setup_item), self);
+	g_signal_connect(factory, "bind", G_CALLBACK(bind_item), self);
+	g_signal_connect(factory, "unbind", G_CALLBACK(unbind_item), self);
+
+	self->grid_view = GTK_GRID_VIEW(gtk_grid_view_new(NULL, factory));
+	gtk_grid_view_set_single_click_activate(self->grid_view, TRUE);
+	gtk_grid_view_set_max_columns(self->grid_view, 16);
+	g_signal_connect(self->grid_view, "activate", G_CALLBACK(activate), self);
+
+	self->scrolled_window = gtk_scrolled_window_new();
+	gtk_scrolled_window_set_child(
+		GTK_SCROLLED_WINDOW(self->scrolled_window),
+		GTK_WIDGET(self->grid_view));
+	gtk_widget_set_parent(self->scrolled_window, GTK_WIDGET(self));
+}
+
+void comicreader_libraryview_set_library(
+	ComicReaderLibraryView *self,
+	struct ComicReaderLibrary *library)
+{
+	if (self->library == library)
+		return;
+
+	if (self->library)
+		comicreader_library_remove_listener(self->library, library_changed, self);
+	self->library = library;
+	if (library)
+		comicreader_library_add_listener(library, library_changed, self);
+
+	library_changed(self);
+}
+
+static void library_changed(void *user_data)
+{
+	ComicReaderLibraryView *self = COMICREADER_LIBRARYVIEW(user_data);
+
+	GtkSelectionModel *model = NULL;
+	if (self->library) {
+		GtkStringList *comics = comicreader_library_list_comics(self->library);
+		model = GTK_SELECTION_MODEL(gtk_no_selection_new(G_LIST_MODEL(comics)));
+	}
+	gtk_grid_view_set_model(self->grid_view, model);
+	g_clear_object(&model);
+}
+
+static void setup_item(GtkSignalListItemFactory *factory, GtkListItem *item, gpointer data)
+{
+	GtkWidget *box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 4);
+	gtk_widget_set_margin_start(box, 6);
+	gtk_widget_set_margin_end(box, 6);
+	gtk_widget_set_margin_top(box, 6);
+	gtk_widget_set_margin_bottom(box, 6);
+
+	GtkWidget *picture = gtk_picture_new();
+	gtk_picture_set_content_fit(GTK_PICTURE(picture), GTK_CONTENT_FIT_CONTAIN);
+	gtk_widget_set_size_request(picture, COVER_WIDTH, COVER_HEIGHT);
+	gtk_box_append(GTK_BOX(box), picture);
+
+	GtkWidget *title = gtk_label_new(NULL);
+	gtk_label_set_ellipsize(GTK_LABEL(title), PANGO_ELLIPSIZE_END);
+	gtk_label_set_max_width_chars(GTK_LABEL(title), 16);
+	gtk_box_append(GTK_BOX(box), title);
+
+	GtkWidget *pages = gtk_label_new(NULL);
+	gtk_widget_add_css_class(pages, "dim-label");
+	gtk_widget_add_css_class(pages, "caption");
+	gtk_box_append(GTK_BOX(box), pages);
+
+	gtk_list_item_set_child(item, box);
+}
+
+static void bind_item(GtkSignalListItemFactory *factory, GtkListItem *item, gpointer data)
+{
+	ComicReaderLibraryView *self = COMICREADER_LIBRARYVIEW(data);
+	const char *path = gtk_string_object_get_string(gtk_list_item_get_item(item));
+
+	GtkWidget *box = gtk_list_item_get_child(item);
+	GtkWidget *picture = gtk_widget_get_first_child(box);
+	GtkWidget *title = gtk_widget_get_next_sibling(picture);
+	GtkWidget *pages = gtk_widget_get_next_sibling(title);
+
+	char *basename = g_path_get_basename(path);
+	gtk_label_set_text(GTK_LABEL(title), basename);
+	gtk_widget_set_tooltip_text(box, path);
+	g_free(basename);
+
+	char *page_count = g_strdup_printf(
+		"%i pages",
+		comicreader_library_get_page_count(self->library, path));
+	gtk_label_set_text(GTK_LABEL(pages), page_count);
+	g_free(page_count);
+
+	/* covers decode off the UI thread, dropped if the item scrolls away */
+	gtk_picture_set_paintable(GTK_PICTURE(picture), NULL);
+	GCancellable *cancellable = g_cancellable_new();
+	g_object_set_data_full(G_OBJECT(item), "cover-cancellable", cancellable, g_object_unref);
+	comicreader_library_load_cover_async(
+		self->library,
+		path,
+		cancellable,
+		cover_loaded,
+		g_object_ref(picture));
+}
+
+static void unbind_item(GtkSignalListItemFactory *factory, GtkListItem *item, gpointer data)
+{
+	GCancellable *cancellable = g_object_get_data(G_OBJECT(item), "cover-cancellable");
+	if (cancellable)
+		g_cancellable_cancel(cancellable);
+	g_object_set_data(G_OBJECT(item), "cover-cancellable", NULL);
+}
+
+static void cover_loaded(GObject *source_object, GAsyncResult *result, gpointer data)
+{
+	GtkPicture *picture = GTK_PICTURE(data);
+
+	GError *error = NULL;
+	GdkTexture *texture = comicreader_library_load_cover_finish(NULL, result, &error);
+	if (texture) {
+		gtk_picture_set_paintable(picture, GDK_PAINTABLE(texture));
+		g_object_unref(texture);
+	} else {
+		if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			debug_printf("cover: %s\n", error->message);
+		g_clear_error(&error);
+	}
+
+	g_object_unref(picture);
+}
+
+static void activate(GtkGridView *grid_view, guint position, gpointer data)
+{
+	ComicReaderLibraryView *self = COMICREADER_LIBRARYVIEW(data);
+
+	GListModel *model = G_LIST_MODEL(gtk_grid_view_get_model(grid_view));
+	GtkStringObject *item = g_list_model_get_item(model, position);
+	g_signal_emit(
+		self,
+		signals[SIGNAL_COMIC_ACTIVATED],
+		0,
+		gtk_string_object_get_string(item));
+	g_object_unref(item);
+}
+
+static void comicreader_libraryview_dispose(GObject *object)
+{
+	ComicReaderLibraryView *self = COMICREADER_LIBRARYVIEW(object);
+
+	comicreader_libraryview_set_library(self, NULL);
+	g_clear_pointer(&self->scrolled_window, gtk_widget_unparent);
+
+	debug_free("ComicReaderLibraryView", self);
+	G_OBJECT_CLASS(comicreader_libraryview_parent_class)->dispose(object);
+}
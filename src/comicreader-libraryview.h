@@ -0,0 +1,44 @@
+/* comicreader-libraryview.h
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gtk/gtk.h>
+
+#include "comicreader-library.h"
+
+G_BEGIN_DECLS
+
+#define COMICREADER_TYPE_LIBRARYVIEW (comicreader_libraryview_get_type())
+
+G_DECLARE_FINAL_TYPE(
+	ComicReaderLibraryView,
+	comicreader_libraryview,
+	COMICREADER,
+	LIBRARYVIEW,
+	GtkWidget)
+
+G_END_DECLS
+
+/* Shows a grid of the library's comics.  Emits "comic-activated" with the
+ * path of the comic the user picked. */
+void comicreader_libraryview_set_library(
+	ComicReaderLibraryView *self,
+	struct ComicReaderLibrary *library);
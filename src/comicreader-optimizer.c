@@ -0,0 +1,260 @@
+/* comicreader-optimizer.c
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "comicreader-optimizer.h"
+#include "comicreader-debug.h"
+#include "comicreader-directoryimageloader.h"
+#include "comicreader-qoi.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+struct OptimizedPage {
+	/* NULL if the page couldn't be written */
+	char *name;
+	/* to lay it out at */
+	int width;
+	int height;
+};
+
+struct Optimizer {
+	struct ComicReaderImageLoader *loader;
+	GFile *output;
+	int height;
+	/* of the page numbers in file names */
+	int digits;
+	struct OptimizedPage *pages;
+};
+
+static void optimize_page(gpointer data, gpointer user_data);
+static GBytes *read_original(
+	struct Optimizer *self,
+	size_t index,
+	struct ComicReaderImage *image,
+	const char **extension);
+static bool write_page(GFile *output, const char *name, GBytes *bytes, GError **error);
+static bool write_index(struct Optimizer *self, size_t num_pages, GError **error);
+static const char *get_extension(const char *name);
+
+bool comicreader_optimize_comic(
+	struct ComicReaderImageLoader *loader,
+	GFile *output,
+	int height)
+{
+	GError *error = NULL;
+	if (!g_file_make_directory_with_parents(output, NULL, &error) &&
+	    !g_error_matches(error, G_IO_ERROR, G_IO_ERROR_EXISTS)) {
+		fprintf(stderr,
+			"Cannot create %s: %s\n",
+			g_file_peek_path(output),
+			error->message);
+		g_error_free(error);
+		return false;
+	}
+	g_clear_error(&error);
+
+	size_t num_pages = loader->get_num_images(loader);
+	struct Optimizer self = {
+		.loader = loader,
+		.output = output,
+		.height = height,
+		.digits = MAX(4, snprintf(NULL, 0, "%zu", num_pages)),
+		.pages = calloc(num_pages, sizeof(struct OptimizedPage)),
+	};
+
+	/* pages are independent, so every core gets one until they run out */
+	GThreadPool *pool =
+		g_thread_pool_new(optimize_page, &self, g_get_num_processors(), TRUE, NULL);
+	for (size_t i = 0; i < num_pages; ++i)
+		g_thread_pool_push(pool, GSIZE_TO_POINTER(i + 1), NULL);
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	size_t written = 0;
+	for (size_t i = 0; i < num_pages; ++i) {
+		if (self.pages[i].name)
+			++written;
+	}
+
+	bool ret = write_index(&self, num_pages, &error);
+	if (!ret) {
+		fprintf(stderr, "Cannot write index: %s\n", error->message);
+		g_error_free(error);
+	}
+	ret = ret && written == num_pages;
+	printf("Wrote %zu of %zu pages to %s\n", written, num_pages, g_file_peek_path(output));
+
+	for (size_t i = 0; i < num_pages; ++i)
+		g_free(self.pages[i].name);
+	free(self.pages);
+	return ret;
+}
+
+/* called on background thread, data is the page index plus one */
+static void optimize_page(gpointer data, gpointer user_data)
+{
+	struct Optimizer *self = user_data;
+	size_t index = GPOINTER_TO_SIZE(data) - 1;
+
+	struct ComicReaderImage *image = self->loader->get_image(self->loader, index);
+	if (image->error) {
+		fprintf(stderr, "Page %zu (%s): %s\n", index + 1, image->name, image->error);
+		comicreader_image_clear(&image);
+		return;
+	}
+
+	/* animations would lose their other frames, and pages too tall to
+	 * decode whole are read a slice at a time, so both stay as they are */
+	GBytes *bytes = NULL;
+	const char *extension = NULL;
+	int width = comicreader_image_get_width(image);
+	int height = comicreader_image_get_height(image);
+	if (image->animation || image->sliced) {
+		bytes = g_bytes_ref(image->animation ? image->animation : image->sliced);
+		extension = get_extension(image->name);
+	} else if (image->height && gdk_texture_get_height(image->texture) > image->height) {
+		/* upscaling is redone when the page is read, storing its result
+		 * losslessly would only make the page many times larger */
+		bytes = read_original(self, index, image, &extension);
+	}
+
+	if (!bytes) {
+		GdkTexture *texture = g_object_ref(image->texture);
+		width = gdk_texture_get_width(texture);
+		height = gdk_texture_get_height(texture);
+		/* nor is an upscaled page that can't be read as it was kept at
+		 * more than its layout size */
+		int max_height = self->height;
+		if (image->height && image->height < max_height)
+			max_height = image->height;
+		if (height > max_height) {
+			double scale = (double)max_height / height;
+			int scaled_width = MAX(1, (int)lround(width * scale));
+			GdkTexture *scaled =
+				comicreader_texture_scale(texture, scaled_width, max_height);
+			g_object_unref(texture);
+			texture = scaled;
+			width = scaled_width;
+			height = max_height;
+		}
+		bytes = comicreader_qoi_encode(texture);
+		g_object_unref(texture);
+		extension = ".qoi";
+	}
+
+	/* numbered, so that sorting them keeps the comic's order */
+	char *name = g_strdup_printf("%0*zu%s", self->digits, index + 1, extension);
+	GError *error = NULL;
+	if (write_page(self->output, name, bytes, &error)) {
+		debug_printf("wrote %s as %s\n", image->name, name);
+		self->pages[index].name = name;
+		self->pages[index].width = width;
+		self->pages[index].height = height;
+	} else {
+		fprintf(stderr, "Page %zu (%s): %s\n", index + 1, image->name, error->message);
+		g_error_free(error);
+		g_free(name);
+	}
+
+	g_bytes_unref(bytes);
+	comicreader_image_clear(&image);
+}
+
+/* Returns the page as it was before the loader decoded it, or NULL if the
+ * loader can't read it. */
+static GBytes *read_original(
+	struct Optimizer *self,
+	size_t index,
+	struct ComicReaderImage *image,
+	const char **extension)
+{
+	if (!self->loader->read_image)
+		return NULL;
+
+	char *name = NULL;
+	GBytes *bytes = self->loader->read_image(self->loader, index, &name);
+	/* the page changed since it was decoded */
+	if (bytes && (!name || strcmp(name, image->name) != 0)) {
+		g_bytes_unref(bytes);
+		bytes = NULL;
+	}
+	free(name);
+
+	if (bytes)
+		*extension = get_extension(image->name);
+	return bytes;
+}
+
+static bool write_page(GFile *output, const char *name, GBytes *bytes, GError **error)
+{
+	GFile *file = g_file_get_child(output, name);
+	gsize size;
+	const void *data = g_bytes_get_data(bytes, &size);
+	bool ret = g_file_replace_contents(
+		file,
+		data,
+		size,
+		NULL,
+		FALSE,
+		G_FILE_CREATE_NONE,
+		NULL,
+		NULL,
+		error);
+	g_object_unref(file);
+	return ret;
+}
+
+static bool write_index(struct Optimizer *self, size_t num_pages, GError **error)
+{
+	GString *index = g_string_new("comicreader-index 2\n");
+	for (size_t i = 0; i < num_pages; ++i) {
+		struct OptimizedPage *page = &self->pages[i];
+		if (page->name)
+			g_string_append_printf(
+				index,
+				"%i %i %s\n",
+				page->width,
+				page->height,
+				page->name);
+	}
+
+	GFile *file = g_file_get_child(self->output, COMICREADER_INDEX_NAME);
+	bool ret = g_file_replace_contents(
+		file,
+		index->str,
+		index->len,
+		NULL,
+		FALSE,
+		G_FILE_CREATE_NONE,
+		NULL,
+		NULL,
+		error);
+	g_object_unref(file);
+	g_string_free(index, TRUE);
+	return ret;
+}
+
+/* including the dot, or "" if name has none */
+static const char *get_extension(const char *name)
+{
+	const char *basename = strrchr(name, '/');
+	const char *dot = strrchr(basename ? basename : name, '.');
+	return dot ? dot : "";
+}
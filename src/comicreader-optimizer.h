@@ -0,0 +1,35 @@
+/* comicreader-optimizer.h
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "comicreader-imageloader.h"
+
+/* Writes every page of loader into output, creating it if need be, as a
+ * directory that's quicker to read than the original: pages taller than
+ * height are shrunk to it and stored as QOI, pages that would only be
+ * upscaled are copied as they are, and an index lists them with the size
+ * to lay each out at so they needn't be sorted or measured again.  Pages
+ * are converted on every core.
+ * Returns false, having printed why to stderr, if any page failed. */
+bool comicreader_optimize_comic(
+	struct ComicReaderImageLoader *loader,
+	GFile *output,
+	int height);
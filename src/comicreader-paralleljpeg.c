@@ -0,0 +1,442 @@
+/* comicreader-paralleljpeg.c
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "comicreader-paralleljpeg.h"
+#include "comicreader-debug.h"
+
+/* jpeglib.h needs FILE declared first */
+#include <stdio.h>
+
+#include <jpeglib.h>
+#include <setjmp.h>
+#include <stdbool.h>
+#include <string.h>
+
+/* smaller images decode quickly enough on one thread */
+#define MIN_PIXELS (24 * 1000 * 1000)
+#define MAX_BANDS 8
+/* in MCU rows, so that each band is worth a thread */
+#define MIN_BAND_MCU_ROWS 32
+
+struct JpegError {
+	struct jpeg_error_mgr parent;
+	jmp_buf jump;
+};
+
+/* where the parts of a single scan JPEG are, as offsets into it */
+struct JpegLayout {
+	gsize sof;
+	gsize scan_start;
+	/* the EOI marker */
+	gsize scan_end;
+	/* of each RSTn marker, in order */
+	GArray *restarts;
+};
+
+/* the bands of one image, which the caller waits on */
+struct BandGroup {
+	GMutex lock;
+	GCond cond;
+};
+
+struct Band {
+	struct ComicReaderDecodeTask task;
+	struct BandGroup *group;
+	/* the whole image, or a smaller JPEG cut out of it at restart markers */
+	const guchar *data;
+	gsize size;
+	guchar *cut;
+	J_COLOR_SPACE color_space;
+	/* decoded and thrown away before the rows wanted */
+	int skip;
+	int rows;
+	guchar *dest;
+	size_t stride;
+	bool ok;
+	/* set under the group's lock once a worker has decoded it */
+	bool done;
+};
+
+static bool get_layout(const guchar *data, gsize size, struct JpegLayout *layout);
+static void cut_band(
+	const guchar *data,
+	const struct JpegLayout *layout,
+	size_t first_segment,
+	size_t end_segment,
+	int height,
+	struct Band *band);
+static void decode_band_task(struct ComicReaderDecodeTask *task);
+static void decode_band(struct Band *band);
+static void jpeg_error_exit(j_common_ptr cinfo);
+
+GdkTexture *comicreader_parallel_jpeg_decode(
+	GBytes *bytes,
+	struct ComicReaderDecodeScheduler *scheduler)
+{
+	gsize size;
+	const guchar *data = g_bytes_get_data(bytes, &size);
+	if (size < 2 || data[0] != 0xff || data[1] != 0xd8)
+		return NULL;
+	/* idle work gets a single worker, which is the caller */
+	enum ComicReaderQos qos = comicreader_qos_get_applied();
+	if (!scheduler || qos == COMICREADER_QOS_IDLE)
+		return NULL;
+
+	struct jpeg_decompress_struct cinfo;
+	struct JpegError error;
+	cinfo.err = jpeg_std_error(&error.parent);
+	error.parent.error_exit = jpeg_error_exit;
+	if (setjmp(error.jump)) {
+		jpeg_destroy_decompress(&cinfo);
+		return NULL;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, data, size);
+	jpeg_read_header(&cinfo, TRUE);
+	int width = cinfo.image_width;
+	int height = cinfo.image_height;
+	J_COLOR_SPACE jpeg_color_space = cinfo.jpeg_color_space;
+	bool progressive = jpeg_has_multiple_scans(&cinfo);
+	/* a lone component isn't interleaved, so its MCUs are single blocks */
+	int mcu_width = DCTSIZE;
+	int mcu_height = DCTSIZE;
+	if (cinfo.num_components > 1) {
+		mcu_width *= cinfo.max_h_samp_factor;
+		mcu_height *= cinfo.max_v_samp_factor;
+	}
+	unsigned int restart_interval = cinfo.restart_interval;
+	jpeg_destroy_decompress(&cinfo);
+
+	/* progressive images have to be entropy decoded whole before any row
+	 * comes out, so bands would only repeat that work */
+	if ((gint64)width * height < MIN_PIXELS || progressive)
+		return NULL;
+
+	J_COLOR_SPACE color_space;
+	GdkMemoryFormat format;
+	size_t channels;
+	switch (jpeg_color_space) {
+	case JCS_GRAYSCALE:
+		color_space = JCS_GRAYSCALE;
+		format = GDK_MEMORY_G8;
+		channels = 1;
+		break;
+	case JCS_YCbCr:
+	case JCS_RGB:
+		color_space = JCS_RGB;
+		format = GDK_MEMORY_R8G8B8;
+		channels = 3;
+		break;
+	default:
+		return NULL;
+	}
+
+	int mcu_rows = (height + mcu_height - 1) / mcu_height;
+	int mcus_per_row = (width + mcu_width - 1) / mcu_width;
+
+	/* when restart intervals line up with MCU rows, a group of whole rows
+	 * and whole intervals can be cut out as a JPEG of its own; otherwise
+	 * each band skips the rows above it, which still entropy decodes them
+	 * but spares the IDCT and colour conversion */
+	struct JpegLayout layout = {0};
+	int rows_per_group = 1;
+	size_t segments_per_group = 0;
+	if (restart_interval > 0 && (mcus_per_row % restart_interval == 0 ||
+				     restart_interval % mcus_per_row == 0)) {
+		if (restart_interval <= (unsigned int)mcus_per_row)
+			segments_per_group = mcus_per_row / restart_interval;
+		else
+			segments_per_group = 1;
+		rows_per_group = MAX(1, (int)restart_interval / mcus_per_row);
+	}
+	int num_groups = (mcu_rows + rows_per_group - 1) / rows_per_group;
+	if (segments_per_group > 0 && get_layout(data, size, &layout) &&
+	    layout.restarts->len + 1 != (size_t)num_groups * segments_per_group)
+		segments_per_group = 0;
+	bool cut = segments_per_group > 0 && layout.restarts;
+	if (!cut) {
+		rows_per_group = 1;
+		num_groups = mcu_rows;
+	}
+
+	int num_bands = MIN((int)g_get_num_processors(), mcu_rows / MIN_BAND_MCU_ROWS);
+	num_bands = MIN(num_bands, MIN(num_groups, MAX_BANDS));
+	if (num_bands < 2) {
+		if (layout.restarts)
+			g_array_unref(layout.restarts);
+		return NULL;
+	}
+#ifndef LIBJPEG_TURBO_VERSION
+	/* without jpeg_skip_scanlines every band would decode everything */
+	if (!cut) {
+		if (layout.restarts)
+			g_array_unref(layout.restarts);
+		return NULL;
+	}
+#endif
+
+	size_t stride = (size_t)width * channels;
+	guchar *pixels = g_try_malloc(stride * height);
+	if (!pixels) {
+		if (layout.restarts)
+			g_array_unref(layout.restarts);
+		return NULL;
+	}
+
+	struct BandGroup group;
+	g_mutex_init(&group.lock);
+	g_cond_init(&group.cond);
+	struct Band bands[MAX_BANDS] = {0};
+	for (int i = 0; i < num_bands; ++i) {
+		struct Band *band = &bands[i];
+		band->task.run = decode_band_task;
+		band->task.qos = qos;
+		band->group = &group;
+		int first_group = num_groups * i / num_bands;
+		int end_group = num_groups * (i + 1) / num_bands;
+		int first_row = first_group * rows_per_group;
+		int end_row = MIN(end_group * rows_per_group, mcu_rows);
+		int top = first_row * mcu_height;
+		band->color_space = color_space;
+		band->rows = MIN(end_row * mcu_height, height) - top;
+		band->dest = pixels + top * stride;
+		band->stride = stride;
+		if (cut) {
+			/* one more group either side, for chroma upsampling to
+			 * blend across the edges just as decoding it whole does */
+			int cut_first = MAX(first_group - 1, 0);
+			int cut_end = MIN(end_group + 1, num_groups);
+			int cut_top = cut_first * rows_per_group * mcu_height;
+			cut_band(
+				data,
+				&layout,
+				cut_first * segments_per_group,
+				cut_end * segments_per_group,
+				MIN(cut_end * rows_per_group * mcu_height, height) - cut_top,
+				band);
+			band->skip = top - cut_top;
+		} else {
+			band->data = data;
+			band->size = size;
+			band->skip = top;
+		}
+	}
+	if (layout.restarts)
+		g_array_unref(layout.restarts);
+
+	debug_printf(
+		"decoding %ix%i JPEG in %i bands%s\n",
+		width,
+		height,
+		num_bands,
+		cut ? " at restart markers" : "");
+	/* the first band is the caller's own, as is any other that no worker
+	 * is free to start by the time the caller gets to it */
+	for (int i = 1; i < num_bands; ++i)
+		comicreader_decode_scheduler_push(scheduler, &bands[i].task);
+	decode_band(&bands[0]);
+	bands[0].done = true;
+	for (int i = 1; i < num_bands; ++i) {
+		if (comicreader_decode_scheduler_cancel(scheduler, &bands[i].task)) {
+			decode_band(&bands[i]);
+			bands[i].done = true;
+		}
+	}
+
+	bool ok = true;
+	g_mutex_lock(&group.lock);
+	for (int i = 0; i < num_bands; ++i) {
+		while (!bands[i].done)
+			g_cond_wait(&group.cond, &group.lock);
+		ok = ok && bands[i].ok;
+		g_free(bands[i].cut);
+	}
+	g_mutex_unlock(&group.lock);
+	g_mutex_clear(&group.lock);
+	g_cond_clear(&group.cond);
+	if (!ok) {
+		g_free(pixels);
+		return NULL;
+	}
+
+	GBytes *pixel_bytes = g_bytes_new_take(pixels, stride * height);
+	GdkTexture *texture = gdk_memory_texture_new(width, height, format, pixel_bytes, stride);
+	g_bytes_unref(pixel_bytes);
+	return texture;
+}
+
+/* Finds the frame header, the entropy coded data and the restart markers
+ * in it.  Returns false unless the image is a single baseline scan. */
+static bool get_layout(const guchar *data, gsize size, struct JpegLayout *layout)
+{
+	gsize pos = 2;
+	layout->sof = 0;
+	layout->scan_start = 0;
+	while (pos + 4 <= size && !layout->scan_start) {
+		if (data[pos] != 0xff)
+			return false;
+		guchar marker = data[pos + 1];
+		if (marker == 0xff) {
+			/* fill byte */
+			++pos;
+			continue;
+		}
+		gsize length = data[pos + 2] << 8 | data[pos + 3];
+		if (marker == 0xc0 || marker == 0xc1)
+			layout->sof = pos;
+		else if (marker >= 0xc2 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 &&
+			 marker != 0xcc)
+			return false;
+		else if (marker == 0xda)
+			layout->scan_start = pos + 2 + length;
+		pos += 2 + length;
+	}
+	if (!layout->sof || !layout->scan_start || layout->scan_start > size)
+		return false;
+
+	layout->restarts = g_array_new(FALSE, FALSE, sizeof(gsize));
+	pos = layout->scan_start;
+	for (;;) {
+		const guchar *ff = memchr(data + pos, 0xff, size - pos);
+		if (!ff || ff + 1 >= data + size)
+			break;
+		pos = ff - data;
+		guchar marker = data[pos + 1];
+		if (marker >= 0xd0 && marker <= 0xd7) {
+			g_array_append_val(layout->restarts, pos);
+			pos += 2;
+		} else if (marker == 0x00) {
+			/* a stuffed 0xff data byte */
+			pos += 2;
+		} else if (marker == 0xff) {
+			++pos;
+		} else if (marker == 0xd9) {
+			layout->scan_end = pos;
+			return true;
+		} else {
+			/* another scan, or a DNL marker */
+			break;
+		}
+	}
+
+	g_array_unref(layout->restarts);
+	layout->restarts = NULL;
+	return false;
+}
+
+/* Makes band a JPEG of the restart intervals first_segment up to
+ * end_segment, which are height rows: the headers with that height, then
+ * the intervals, their markers renumbered from RST0 as a decoder expects. */
+static void cut_band(
+	const guchar *data,
+	const struct JpegLayout *layout,
+	size_t first_segment,
+	size_t end_segment,
+	int height,
+	struct Band *band)
+{
+	const gsize *restarts = (const gsize *)layout->restarts->data;
+	size_t num_segments = layout->restarts->len + 1;
+	gsize start = first_segment == 0 ? layout->scan_start : restarts[first_segment - 1] + 2;
+	gsize end = end_segment == num_segments ? layout->scan_end : restarts[end_segment - 1];
+
+	gsize size = layout->scan_start + (end - start) + 2;
+	guchar *cut = g_malloc(size);
+	memcpy(cut, data, layout->scan_start);
+	/* the frame height follows the marker, length and sample precision */
+	cut[layout->sof + 5] = height >> 8;
+	cut[layout->sof + 6] = height & 0xff;
+
+	gsize pos = layout->scan_start;
+	for (size_t i = first_segment; i < end_segment; ++i) {
+		gsize segment_start = i == 0 ? layout->scan_start : restarts[i - 1] + 2;
+		gsize segment_end = i + 1 == num_segments ? layout->scan_end : restarts[i];
+		memcpy(cut + pos, data + segment_start, segment_end - segment_start);
+		pos += segment_end - segment_start;
+		if (i + 1 < end_segment) {
+			cut[pos++] = 0xff;
+			cut[pos++] = 0xd0 + ((i - first_segment) & 7);
+		}
+	}
+	cut[pos++] = 0xff;
+	cut[pos++] = 0xd9;
+
+	band->cut = cut;
+	band->data = cut;
+	band->size = pos;
+}
+
+/* called on background thread */
+static void decode_band_task(struct ComicReaderDecodeTask *task)
+{
+	struct Band *band = (struct Band *)task;
+	decode_band(band);
+
+	g_mutex_lock(&band->group->lock);
+	band->done = true;
+	g_cond_broadcast(&band->group->cond);
+	g_mutex_unlock(&band->group->lock);
+}
+
+/* called on background thread */
+static void decode_band(struct Band *band)
+{
+	struct jpeg_decompress_struct cinfo;
+	struct JpegError error;
+	cinfo.err = jpeg_std_error(&error.parent);
+	error.parent.error_exit = jpeg_error_exit;
+	if (setjmp(error.jump)) {
+		jpeg_destroy_decompress(&cinfo);
+		return;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, band->data, band->size);
+	jpeg_read_header(&cinfo, TRUE);
+	cinfo.out_color_space = band->color_space;
+	jpeg_start_decompress(&cinfo);
+
+	JDIMENSION end = band->skip + band->rows;
+#ifdef LIBJPEG_TURBO_VERSION
+	jpeg_skip_scanlines(&cinfo, band->skip);
+#endif
+	while (cinfo.output_scanline < end) {
+		/* rows above the band are decoded into its first row */
+		JDIMENSION row = cinfo.output_scanline < (JDIMENSION)band->skip
+					 ? 0
+					 : cinfo.output_scanline - band->skip;
+		JSAMPROW dest = band->dest + row * band->stride;
+		jpeg_read_scanlines(&cinfo, &dest, 1);
+	}
+
+	jpeg_abort_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	band->ok = true;
+}
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+	struct JpegError *error = (struct JpegError *)cinfo->err;
+	char message[JMSG_LENGTH_MAX];
+	cinfo->err->format_message(cinfo, message);
+	debug_printf("jpeg: %s\n", message);
+	longjmp(error->jump, 1);
+}
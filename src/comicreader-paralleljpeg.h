@@ -0,0 +1,36 @@
+/* comicreader-paralleljpeg.h
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gdk/gdk.h>
+
+#include "comicreader-decodescheduler.h"
+
+/* Decodes a large baseline JPEG in bands of rows, into a GDK_MEMORY_R8G8B8
+ * or, for grayscale, GDK_MEMORY_G8 texture.  The bands are pushed to
+ * scheduler in the calling worker's class, and the caller decodes any no
+ * other worker has started, so they share the scheduler's threads rather
+ * than starting more.  Returns NULL for images small enough that one thread
+ * will do, for those it can't split, which are left to the usual loader,
+ * and when scheduler is NULL or the caller only gets idle time. */
+GdkTexture *comicreader_parallel_jpeg_decode(
+	GBytes *bytes,
+	struct ComicReaderDecodeScheduler *scheduler);
@@ -0,0 +1,448 @@
+/* comicreader-pdfimageloader.c
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "config.h"
+
+#include "comicreader-pdfimageloader.h"
+#include "comicreader-debug.h"
+
+#include <math.h>
+#include <poppler.h>
+
+/* height, in pixels, that previews are rendered at */
+#define PREVIEW_HEIGHT 256
+#define DEFAULT_DPI 150
+/* pages are rendered at most this much larger than their print size */
+#define MAX_SCALE (600.0 / 72.0)
+/* an image covering this much of the page is taken to be the whole page */
+#define FULL_PAGE_COVERAGE 0.98
+/* height of the render the first extracted image of a document is checked
+ * against, and how far apart, on average out of 255, they may be */
+#define CHECK_HEIGHT 32
+#define CHECK_TOLERANCE 24
+
+struct ComicReaderPdfImageLoader {
+	struct ComicReaderImageLoader parent;
+	GFile *file;
+	GBytes *bytes;
+	size_t num_pages;
+	int target_height;
+	/* whether images extracted from pages are drawn as they're stored: 0
+	 * until the first is checked, then 1 or -1 for the whole document, as
+	 * a scan is usually placed the same way throughout; access atomically */
+	int extracted_match;
+
+	/* Poppler documents aren't thread safe, so each page is rendered with
+	 * a document nobody else is using; there end up as many as there were
+	 * concurrent renders */
+	GAsyncQueue *documents;
+};
+
+/* interface implementations */
+static size_t impl_get_num_images(struct ComicReaderImageLoader *image_loader);
+static bool impl_find_image(
+	struct ComicReaderImageLoader *image_loader,
+	const char *name,
+	size_t *index);
+static struct ComicReaderImage *impl_get_image(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index);
+static struct ComicReaderImage *impl_get_preview(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index);
+static char *impl_get_image_name(struct ComicReaderImageLoader *image_loader, size_t index);
+static char *impl_get_image_key(struct ComicReaderImageLoader *image_loader, const char *name);
+static void impl_free(struct ComicReaderImageLoader *image_loader);
+
+/* helper functions */
+static PopplerDocument *take_document(struct ComicReaderPdfImageLoader *self, GError **error);
+static void return_document(struct ComicReaderPdfImageLoader *self, PopplerDocument *document);
+static struct ComicReaderImage *render_page(
+	struct ComicReaderPdfImageLoader *self,
+	size_t index,
+	int target_height);
+static GdkTexture *extract_full_page_image(
+	struct ComicReaderPdfImageLoader *self,
+	PopplerPage *page,
+	int width,
+	int height);
+static bool matches_page(PopplerPage *page, cairo_surface_t *image);
+static GdkTexture *render_to_texture(PopplerPage *page, double scale);
+static GdkTexture *texture_for_surface(cairo_surface_t *surface);
+static char *page_name(size_t index);
+
+struct ComicReaderImageLoader *comicreader_pdf_image_loader_new(GFile *file, int target_height)
+{
+	GError *error = NULL;
+	GBytes *bytes = g_file_load_bytes(file, NULL, NULL, &error);
+	PopplerDocument *document = NULL;
+	if (bytes)
+		document = poppler_document_new_from_bytes(bytes, NULL, &error);
+	if (!document) {
+		debug_printf("cannot open pdf: %s\n", error->message);
+		g_clear_error(&error);
+		if (bytes)
+			g_bytes_unref(bytes);
+		g_object_unref(file);
+		return NULL;
+	}
+
+	struct ComicReaderPdfImageLoader *ret;
+	ret = calloc(1, sizeof(struct ComicReaderPdfImageLoader));
+	debug_init("ComicReaderPdfImageLoader", ret);
+
+	ret->parent.free = impl_free;
+	ret->parent.get_num_images = impl_get_num_images;
+	ret->parent.get_image = impl_get_image;
+	ret->parent.get_preview = impl_get_preview;
+	ret->parent.find_image = impl_find_image;
+	ret->parent.get_image_name = impl_get_image_name;
+	ret->parent.get_image_key = impl_get_image_key;
+
+	ret->file = file;
+	ret->bytes = bytes;
+	ret->num_pages = poppler_document_get_n_pages(document);
+	ret->target_height = target_height;
+	ret->documents = g_async_queue_new_full(g_object_unref);
+	g_async_queue_push(ret->documents, document);
+
+	g_assert((void *)ret == (void *)&ret->parent);
+	return &ret->parent;
+}
+
+static size_t impl_get_num_images(struct ComicReaderImageLoader *image_loader)
+{
+	struct ComicReaderPdfImageLoader *self = (struct ComicReaderPdfImageLoader *)image_loader;
+
+	return self->num_pages;
+}
+
+static bool impl_find_image(
+	struct ComicReaderImageLoader *image_loader,
+	const char *name,
+	size_t *index)
+{
+	struct ComicReaderPdfImageLoader *self = (struct ComicReaderPdfImageLoader *)image_loader;
+
+	size_t page;
+	if (sscanf(name, "Page %zu", &page) != 1 || page == 0 || page > self->num_pages)
+		return false;
+
+	*index = page - 1;
+	return true;
+}
+
+/* called on any thread */
+static struct ComicReaderImage *impl_get_image(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index)
+{
+	struct ComicReaderPdfImageLoader *self = (struct ComicReaderPdfImageLoader *)image_loader;
+
+	return render_page(self, index, self->target_height);
+}
+
+/* called on any thread */
+static struct ComicReaderImage *impl_get_preview(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index)
+{
+	struct ComicReaderPdfImageLoader *self = (struct ComicReaderPdfImageLoader *)image_loader;
+
+	return render_page(self, index, PREVIEW_HEIGHT);
+}
+
+static char *impl_get_image_name(struct ComicReaderImageLoader *image_loader, size_t index)
+{
+	struct ComicReaderPdfImageLoader *self = (struct ComicReaderPdfImageLoader *)image_loader;
+
+	if (index >= self->num_pages)
+		return NULL;
+	return page_name(index);
+}
+
+/* pages render differently for displays of different heights */
+static char *impl_get_image_key(struct ComicReaderImageLoader *image_loader, const char *name)
+{
+	struct ComicReaderPdfImageLoader *self = (struct ComicReaderPdfImageLoader *)image_loader;
+
+	char *uri = g_file_get_uri(self->file);
+	char *ret = g_strdup_printf("%s#%s@%i", uri, name, self->target_height);
+	g_free(uri);
+	return ret;
+}
+
+static void impl_free(struct ComicReaderImageLoader *image_loader)
+{
+	struct ComicReaderPdfImageLoader *self = (struct ComicReaderPdfImageLoader *)image_loader;
+
+	g_async_queue_unref(self->documents);
+	g_bytes_unref(self->bytes);
+	g_clear_object(&self->file);
+	debug_free("ComicReaderPdfImageLoader", self);
+	free(image_loader);
+}
+
+/* called on any thread */
+static PopplerDocument *take_document(struct ComicReaderPdfImageLoader *self, GError **error)
+{
+	PopplerDocument *document = g_async_queue_try_pop(self->documents);
+	if (document)
+		return document;
+
+	/* every document shares the file's bytes, only the parsed state is
+	 * per document */
+	return poppler_document_new_from_bytes(self->bytes, NULL, error);
+}
+
+/* called on any thread */
+static void return_document(struct ComicReaderPdfImageLoader *self, PopplerDocument *document)
+{
+	g_async_queue_push(self->documents, document);
+}
+
+/* called on any thread */
+static struct ComicReaderImage *render_page(
+	struct ComicReaderPdfImageLoader *self,
+	size_t index,
+	int target_height)
+{
+	struct ComicReaderImage *ret = calloc(1, sizeof(struct ComicReaderImage));
+	ret->name = page_name(index);
+
+	GError *error = NULL;
+	PopplerDocument *document = take_document(self, &error);
+	if (!document) {
+		comicreader_image_set_error(ret, error);
+		g_error_free(error);
+		return ret;
+	}
+
+	PopplerPage *page = poppler_document_get_page(document, index);
+	if (!page) {
+		ret->error = strdup("No such page");
+		return_document(self, document);
+		return ret;
+	}
+
+	double width, height;
+	poppler_page_get_size(page, &width, &height);
+	double scale = target_height > 0 ? target_height / height : DEFAULT_DPI / 72.0;
+	scale = MIN(scale, MAX_SCALE);
+
+	/* a scanned page is usually stored as it was scanned, which beats
+	 * any rendering of it; it's laid out like a rendered page so that
+	 * every page of the document has the same scale */
+	int layout_width = MAX(1, (int)ceil(width * scale));
+	int layout_height = MAX(1, (int)ceil(height * scale));
+	if (target_height != PREVIEW_HEIGHT) {
+		ret->texture = extract_full_page_image(
+			self,
+			page,
+			target_height > 0 ? layout_width : 0,
+			target_height > 0 ? layout_height : 0);
+	}
+	if (ret->texture) {
+		ret->width = layout_width;
+		ret->height = layout_height;
+	} else {
+		ret->texture = render_to_texture(page, scale);
+	}
+
+	g_object_unref(page);
+	return_document(self, document);
+
+	if (!ret->texture)
+		ret->error = strdup("Cannot render page");
+	return ret;
+}
+
+/* Returns the page's image if the page is just one image, drawn upright
+ * and unflipped, or NULL.  It's shrunk to width by height if it's larger,
+ * or kept at its own resolution if they're 0. */
+static GdkTexture *extract_full_page_image(
+	struct ComicReaderPdfImageLoader *self,
+	PopplerPage *page,
+	int width,
+	int height)
+{
+	if (g_atomic_int_get(&self->extracted_match) < 0)
+		return NULL;
+
+	double page_width, page_height;
+	poppler_page_get_size(page, &page_width, &page_height);
+
+	GList *mappings = poppler_page_get_image_mapping(page);
+	cairo_surface_t *surface = NULL;
+	if (mappings && !mappings->next) {
+		PopplerImageMapping *mapping = mappings->data;
+		double area_width = fabs(mapping->area.x2 - mapping->area.x1);
+		double area_height = fabs(mapping->area.y2 - mapping->area.y1);
+		if (area_width * area_height >= FULL_PAGE_COVERAGE * page_width * page_height)
+			surface = poppler_page_get_image(page, mapping->image_id);
+	}
+	poppler_page_free_image_mapping(mappings);
+	if (!surface)
+		return NULL;
+
+	/* turned sideways, by its placement or the page's /Rotate, or not
+	 * filling the page evenly */
+	int image_width = cairo_image_surface_get_width(surface);
+	int image_height = cairo_image_surface_get_height(surface);
+	if (image_width <= 0 || image_height <= 0 ||
+	    fabs((double)image_width / image_height - page_width / page_height) > 0.02) {
+		cairo_surface_destroy(surface);
+		return NULL;
+	}
+
+	if (g_atomic_int_get(&self->extracted_match) == 0) {
+		bool match = matches_page(page, surface);
+		debug_printf("extracted pages %s\n", match ? "match" : "don't match");
+		g_atomic_int_set(&self->extracted_match, match ? 1 : -1);
+		if (!match) {
+			cairo_surface_destroy(surface);
+			return NULL;
+		}
+	}
+
+	GdkTexture *ret = texture_for_surface(surface);
+	cairo_surface_destroy(surface);
+	if (ret && height > 0 && gdk_texture_get_height(ret) > height) {
+		GdkTexture *scaled = comicreader_texture_scale(ret, width, height);
+		g_object_unref(ret);
+		ret = scaled;
+	}
+
+	return ret;
+}
+
+/* Poppler doesn't tell how the image is placed, which may flip it or turn
+ * it upside down, nor does it apply the page's /Rotate, so the image is
+ * compared with a small rendering of the page instead. */
+static bool matches_page(PopplerPage *page, cairo_surface_t *image)
+{
+	double page_width, page_height;
+	poppler_page_get_size(page, &page_width, &page_height);
+	int image_width = cairo_image_surface_get_width(image);
+	int image_height = cairo_image_surface_get_height(image);
+
+	double scale = CHECK_HEIGHT / page_height;
+	int width = MAX(1, (int)ceil(page_width * scale));
+	int height = CHECK_HEIGHT;
+	cairo_surface_t *rendered = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+	cairo_t *cr = cairo_create(rendered);
+	cairo_set_source_rgb(cr, 1, 1, 1);
+	cairo_paint(cr);
+	cairo_scale(cr, scale, scale);
+	poppler_page_render(page, cr);
+	cairo_destroy(cr);
+
+	cairo_surface_t *scaled = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+	cr = cairo_create(scaled);
+	cairo_set_source_rgb(cr, 1, 1, 1);
+	cairo_paint(cr);
+	cairo_scale(cr, (double)width / image_width, (double)height / image_height);
+	cairo_set_source_surface(cr, image, 0, 0);
+	cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_GOOD);
+	cairo_paint(cr);
+	cairo_destroy(cr);
+
+	cairo_surface_flush(rendered);
+	cairo_surface_flush(scaled);
+	const guchar *a = cairo_image_surface_get_data(rendered);
+	const guchar *b = cairo_image_surface_get_data(scaled);
+	int stride = cairo_image_surface_get_stride(rendered);
+	guint64 difference = 0;
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width * 4; ++x) {
+			/* the fourth byte of RGB24 is unused */
+			if (x % 4 != 3)
+				difference += abs(a[y * stride + x] - b[y * stride + x]);
+		}
+	}
+	cairo_surface_destroy(rendered);
+	cairo_surface_destroy(scaled);
+
+	return difference <= (guint64)CHECK_TOLERANCE * width * height * 3;
+}
+
+static GdkTexture *render_to_texture(PopplerPage *page, double scale)
+{
+	double page_width, page_height;
+	poppler_page_get_size(page, &page_width, &page_height);
+	int width = MAX(1, (int)ceil(page_width * scale));
+	int height = MAX(1, (int)ceil(page_height * scale));
+
+	cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+	cairo_t *cr = cairo_create(surface);
+	cairo_set_source_rgb(cr, 1, 1, 1);
+	cairo_paint(cr);
+	cairo_scale(cr, scale, scale);
+	poppler_page_render(page, cr);
+	cairo_destroy(cr);
+
+	GdkTexture *ret = texture_for_surface(surface);
+	cairo_surface_destroy(surface);
+	return ret;
+}
+
+/* cairo's ARGB32 is GDK_MEMORY_DEFAULT */
+static GdkTexture *texture_for_surface(cairo_surface_t *surface)
+{
+	if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS ||
+	    cairo_surface_get_type(surface) != CAIRO_SURFACE_TYPE_IMAGE)
+		return NULL;
+
+	int width = cairo_image_surface_get_width(surface);
+	int height = cairo_image_surface_get_height(surface);
+
+	/* other formats, usually RGB24 for opaque images, are converted by
+	 * painting them */
+	if (cairo_image_surface_get_format(surface) != CAIRO_FORMAT_ARGB32) {
+		cairo_surface_t *argb = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+		cairo_t *cr = cairo_create(argb);
+		cairo_set_source_surface(cr, surface, 0, 0);
+		cairo_paint(cr);
+		cairo_destroy(cr);
+		GdkTexture *ret = texture_for_surface(argb);
+		cairo_surface_destroy(argb);
+		return ret;
+	}
+
+	cairo_surface_flush(surface);
+	int stride = cairo_image_surface_get_stride(surface);
+	GBytes *bytes = g_bytes_new_with_free_func(
+		cairo_image_surface_get_data(surface),
+		(gsize)stride * height,
+		(GDestroyNotify)cairo_surface_destroy,
+		cairo_surface_reference(surface));
+
+	GdkTexture *ret = gdk_memory_texture_new(width, height, GDK_MEMORY_DEFAULT, bytes, stride);
+	g_bytes_unref(bytes);
+	return ret;
+}
+
+static char *page_name(size_t index)
+{
+	size_t sz = snprintf(NULL, 0, "Page %zu", index + 1) + 1;
+	char *ret = calloc(sz, sizeof(char));
+	snprintf(ret, sz, "Page %zu", index + 1);
+	return ret;
+}
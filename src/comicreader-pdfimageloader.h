@@ -0,0 +1,38 @@
+/* comicreader-pdfimageloader.h
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "comicreader-imageloader.h"
+
+/* Pages of the PDF in file, rendered to be target_height pixels tall, or
+ * at 150 dpi if target_height is 0.  Returns NULL if file can't be opened,
+ * which it never can when built without poppler; config.h must come first. */
+#ifdef HAVE_POPPLER
+struct ComicReaderImageLoader *comicreader_pdf_image_loader_new(GFile *file, int target_height);
+#else
+static inline struct ComicReaderImageLoader *comicreader_pdf_image_loader_new(
+	GFile *file,
+	int target_height)
+{
+	g_object_unref(file);
+	return NULL;
+}
+#endif
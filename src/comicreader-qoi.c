@@ -0,0 +1,235 @@
+/* comicreader-qoi.c
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "comicreader-qoi.h"
+#include "comicreader-debug.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+#define QOI_MASK_2 0xc0
+
+#define QOI_HEADER_SIZE 14
+#define QOI_PADDING_SIZE 8
+/* the most one pixel can take, ending a run and then as QOI_OP_RGBA */
+#define QOI_MAX_PIXEL_SIZE 6
+
+/* GDK_MEMORY_R8G8B8A8 */
+union Pixel {
+	struct {
+		uint8_t r;
+		uint8_t g;
+		uint8_t b;
+		uint8_t a;
+	} rgba;
+	uint32_t v;
+};
+
+static unsigned int pixel_hash(union Pixel px)
+{
+	return (px.rgba.r * 3 + px.rgba.g * 5 + px.rgba.b * 7 + px.rgba.a * 11) % 64;
+}
+
+static void write_32(uint8_t *out, uint32_t value)
+{
+	out[0] = value >> 24;
+	out[1] = value >> 16;
+	out[2] = value >> 8;
+	out[3] = value;
+}
+
+static uint32_t read_32(const uint8_t *in)
+{
+	return (uint32_t)in[0] << 24 | (uint32_t)in[1] << 16 | (uint32_t)in[2] << 8 | in[3];
+}
+
+GBytes *comicreader_qoi_encode(GdkTexture *texture)
+{
+	int width = gdk_texture_get_width(texture);
+	int height = gdk_texture_get_height(texture);
+	size_t num_pixels = (size_t)width * height;
+	if (num_pixels == 0)
+		return NULL;
+
+	union Pixel *pixels = malloc(num_pixels * sizeof(*pixels));
+	GdkTextureDownloader *downloader = gdk_texture_downloader_new(texture);
+	gdk_texture_downloader_set_format(downloader, GDK_MEMORY_R8G8B8A8);
+	gdk_texture_downloader_download_into(
+		downloader,
+		(guchar *)pixels,
+		(size_t)width * sizeof(*pixels));
+	gdk_texture_downloader_free(downloader);
+
+	/* pages are mostly flat colour, so start small and grow */
+	size_t capacity = QOI_HEADER_SIZE + num_pixels + QOI_PADDING_SIZE;
+	uint8_t *out = malloc(capacity);
+	size_t p = 0;
+
+	memcpy(out, "qoif", 4);
+	write_32(out + 4, width);
+	write_32(out + 8, height);
+	out[12] = 4;
+	out[13] = 0;
+	p = QOI_HEADER_SIZE;
+
+	union Pixel index[64] = {0};
+	union Pixel prev = {.rgba = {0, 0, 0, 255}};
+	unsigned int run = 0;
+
+	for (size_t i = 0; i < num_pixels; ++i) {
+		if (capacity - p < QOI_MAX_PIXEL_SIZE + QOI_PADDING_SIZE) {
+			capacity *= 2;
+			out = realloc(out, capacity);
+		}
+
+		union Pixel px = pixels[i];
+		if (px.v == prev.v) {
+			++run;
+			if (run == 62 || i == num_pixels - 1) {
+				out[p++] = QOI_OP_RUN | (run - 1);
+				run = 0;
+			}
+			continue;
+		}
+
+		if (run > 0) {
+			out[p++] = QOI_OP_RUN | (run - 1);
+			run = 0;
+		}
+
+		unsigned int hash = pixel_hash(px);
+		if (index[hash].v == px.v) {
+			out[p++] = QOI_OP_INDEX | hash;
+		} else if (px.rgba.a == prev.rgba.a) {
+			index[hash] = px;
+			int8_t vr = px.rgba.r - prev.rgba.r;
+			int8_t vg = px.rgba.g - prev.rgba.g;
+			int8_t vb = px.rgba.b - prev.rgba.b;
+			int8_t vg_r = vr - vg;
+			int8_t vg_b = vb - vg;
+
+			if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+				out[p++] = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+			} else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 &&
+				   vg_b < 8) {
+				out[p++] = QOI_OP_LUMA | (vg + 32);
+				out[p++] = (vg_r + 8) << 4 | (vg_b + 8);
+			} else {
+				out[p++] = QOI_OP_RGB;
+				out[p++] = px.rgba.r;
+				out[p++] = px.rgba.g;
+				out[p++] = px.rgba.b;
+			}
+		} else {
+			index[hash] = px;
+			out[p++] = QOI_OP_RGBA;
+			out[p++] = px.rgba.r;
+			out[p++] = px.rgba.g;
+			out[p++] = px.rgba.b;
+			out[p++] = px.rgba.a;
+		}
+		prev = px;
+	}
+	free(pixels);
+
+	memset(out + p, 0, QOI_PADDING_SIZE - 1);
+	p += QOI_PADDING_SIZE - 1;
+	out[p++] = 1;
+
+	return g_bytes_new_take(realloc(out, p), p);
+}
+
+GdkTexture *comicreader_qoi_decode(GBytes *bytes)
+{
+	size_t size;
+	const uint8_t *in = g_bytes_get_data(bytes, &size);
+	if (size < QOI_HEADER_SIZE + QOI_PADDING_SIZE || memcmp(in, "qoif", 4) != 0 || in[12] != 4)
+		return NULL;
+
+	uint32_t width = read_32(in + 4);
+	uint32_t height = read_32(in + 8);
+	if (width == 0 || height == 0 || width > G_MAXINT / sizeof(union Pixel) ||
+	    height > G_MAXSIZE / sizeof(union Pixel) / width)
+		return NULL;
+
+	size_t num_pixels = (size_t)width * height;
+	union Pixel *pixels = malloc(num_pixels * sizeof(*pixels));
+	union Pixel index[64] = {0};
+	union Pixel px = {.rgba = {0, 0, 0, 255}};
+	unsigned int run = 0;
+	size_t p = QOI_HEADER_SIZE;
+	/* the padding means every op can be read whole without checking */
+	size_t end = size - QOI_PADDING_SIZE;
+
+	for (size_t i = 0; i < num_pixels; ++i) {
+		if (run > 0) {
+			--run;
+		} else if (p < end) {
+			uint8_t b1 = in[p++];
+			if (b1 == QOI_OP_RGB) {
+				px.rgba.r = in[p++];
+				px.rgba.g = in[p++];
+				px.rgba.b = in[p++];
+			} else if (b1 == QOI_OP_RGBA) {
+				px.rgba.r = in[p++];
+				px.rgba.g = in[p++];
+				px.rgba.b = in[p++];
+				px.rgba.a = in[p++];
+			} else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+				px = index[b1];
+			} else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+				px.rgba.r += ((b1 >> 4) & 0x03) - 2;
+				px.rgba.g += ((b1 >> 2) & 0x03) - 2;
+				px.rgba.b += (b1 & 0x03) - 2;
+			} else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+				uint8_t b2 = in[p++];
+				int vg = (b1 & 0x3f) - 32;
+				px.rgba.r += vg - 8 + ((b2 >> 4) & 0x0f);
+				px.rgba.g += vg;
+				px.rgba.b += vg - 8 + (b2 & 0x0f);
+			} else {
+				run = b1 & 0x3f;
+			}
+			index[pixel_hash(px)] = px;
+		} else {
+			debug_printf("truncated QOI image\n");
+			free(pixels);
+			return NULL;
+		}
+		pixels[i] = px;
+	}
+
+	GBytes *pixel_bytes = g_bytes_new_take(pixels, num_pixels * sizeof(*pixels));
+	GdkTexture *texture = gdk_memory_texture_new(
+		width,
+		height,
+		GDK_MEMORY_R8G8B8A8,
+		pixel_bytes,
+		(size_t)width * sizeof(*pixels));
+	g_bytes_unref(pixel_bytes);
+
+	return texture;
+}
@@ -0,0 +1,32 @@
+/* comicreader-qoi.h
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gdk/gdk.h>
+
+/* Lossless compression in the QOI format ("Quite OK Image"), which
+ * re-encodes and expands decoded pages several times faster than their
+ * original JPEG or PNG can be decoded.  Textures are stored as straight
+ * 8 bit RGBA like any other QOI image, converted if need be. */
+GBytes *comicreader_qoi_encode(GdkTexture *texture);
+
+/* Returns NULL if bytes aren't an image from comicreader_qoi_encode. */
+GdkTexture *comicreader_qoi_decode(GBytes *bytes);
@@ -0,0 +1,165 @@
+/* comicreader-qos.c
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define _GNU_SOURCE
+
+#include "comicreader-qos.h"
+#include "comicreader-debug.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* from linux/ioprio.h, which isn't always installed */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_NONE 0
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+#endif
+
+/* about a third of the CPU time of a nice 0 thread when both are busy */
+#define NORMAL_NICE 5
+#define IDLE_NICE 19
+/* in case an interaction is never marked as over */
+#define MAX_PAUSE_US (2 * G_USEC_PER_SEC)
+
+static GMutex interaction_lock;
+static GCond interaction_cond;
+static bool interacting;
+
+#ifdef __linux__
+/* the I/O priority of a class, where none follows the thread's nice value
+ * like the main thread's does */
+static int get_ioprio(enum ComicReaderQos qos)
+{
+	switch (qos) {
+	case COMICREADER_QOS_HIGH:
+		return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_NONE, 0);
+	case COMICREADER_QOS_NORMAL:
+		return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 7);
+	case COMICREADER_QOS_IDLE:
+	default:
+		return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+	}
+}
+#endif
+
+/* the class applied to each thread, plus one so that unset is 0 */
+static GPrivate applied_qos;
+
+void comicreader_qos_apply(enum ComicReaderQos qos)
+{
+	if (GPOINTER_TO_INT(g_private_get(&applied_qos)) == (int)qos + 1)
+		return;
+	g_private_set(&applied_qos, GINT_TO_POINTER((int)qos + 1));
+
+#ifdef __linux__
+	/* nice values and I/O priorities are per thread on Linux */
+	pid_t tid = syscall(SYS_gettid);
+	int nice = 0;
+	switch (qos) {
+	case COMICREADER_QOS_HIGH:
+		/* threads start out like this */
+		return;
+	case COMICREADER_QOS_NORMAL:
+		nice = NORMAL_NICE;
+		break;
+	case COMICREADER_QOS_IDLE:
+	default:
+		nice = IDLE_NICE;
+		struct sched_param param = {0};
+		if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0)
+			debug_printf("cannot use SCHED_IDLE\n");
+		break;
+	}
+
+	if (setpriority(PRIO_PROCESS, tid, nice) != 0)
+		debug_printf("cannot set nice to %i: %s\n", nice, strerror(errno));
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, get_ioprio(qos)) != 0)
+		debug_printf("cannot set I/O priority: %s\n", strerror(errno));
+#endif
+}
+
+enum ComicReaderQos comicreader_qos_get_applied(void)
+{
+	int applied = GPOINTER_TO_INT(g_private_get(&applied_qos));
+	return applied ? applied - 1 : COMICREADER_QOS_HIGH;
+}
+
+int comicreader_qos_begin_task(enum ComicReaderQos qos)
+{
+#ifdef __linux__
+	pid_t tid = syscall(SYS_gettid);
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, get_ioprio(qos)) != 0)
+		debug_printf("cannot set I/O priority: %s\n", strerror(errno));
+	return tid;
+#else
+	return 0;
+#endif
+}
+
+void comicreader_qos_end_task(void)
+{
+#ifdef __linux__
+	pid_t tid = syscall(SYS_gettid);
+	syscall(SYS_ioprio_set,
+		IOPRIO_WHO_PROCESS,
+		tid,
+		get_ioprio(COMICREADER_QOS_HIGH));
+#endif
+}
+
+void comicreader_qos_raise(int thread, enum ComicReaderQos qos)
+{
+#ifdef __linux__
+	if (thread == 0)
+		return;
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, thread, get_ioprio(qos)) != 0)
+		debug_printf("cannot raise I/O priority: %s\n", strerror(errno));
+#endif
+}
+
+void comicreader_qos_set_interacting(bool value)
+{
+	g_mutex_lock(&interaction_lock);
+	interacting = value;
+	if (!value)
+		g_cond_broadcast(&interaction_cond);
+	g_mutex_unlock(&interaction_lock);
+}
+
+void comicreader_qos_wait_while_interacting(void)
+{
+	gint64 end_time = g_get_monotonic_time() + MAX_PAUSE_US;
+
+	g_mutex_lock(&interaction_lock);
+	while (interacting) {
+		if (!g_cond_wait_until(&interaction_cond, &interaction_lock, end_time))
+			break;
+	}
+	g_mutex_unlock(&interaction_lock);
+}
@@ -0,0 +1,60 @@
+/* comicreader-qos.h
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+#include <stdbool.h>
+
+/* How urgently a thread's work is needed, which sets its CPU and I/O
+ * priority so that background work doesn't hold up input and drawing. */
+enum ComicReaderQos {
+	/* the page being shown, as urgent as the main thread */
+	COMICREADER_QOS_HIGH,
+	/* pages the reader is likely to turn to */
+	COMICREADER_QOS_NORMAL,
+	/* anything nobody is waiting on: packing and library scans, which
+	 * only get CPU time and disk access nothing else wants */
+	COMICREADER_QOS_IDLE,
+};
+
+/* Gives the calling thread qos.  A thread can't raise its priority again
+ * without privileges, so this is for threads that stay in one class, such
+ * as those of an exclusive GThreadPool.  Does nothing on other systems
+ * than Linux. */
+void comicreader_qos_apply(enum ComicReaderQos qos);
+/* The class last applied to the calling thread, COMICREADER_QOS_HIGH for
+ * threads that have never had one. */
+enum ComicReaderQos comicreader_qos_get_applied(void);
+
+/* For shared workers, which run tasks of more than one class: gives the calling
+ * thread the I/O priority of qos until _end_task, leaving its CPU priority
+ * alone since that couldn't be raised again.  Returns an id for
+ * comicreader_qos_raise, 0 where threads can't be told apart. */
+int comicreader_qos_begin_task(enum ComicReaderQos qos);
+void comicreader_qos_end_task(void);
+/* Raises the I/O priority of the task running on thread to qos, e.g. while
+ * somebody is waiting for it. */
+void comicreader_qos_raise(int thread, enum ComicReaderQos qos);
+
+/* While the reader is interacting, e.g. turning pages, idle work waits
+ * between tasks rather than competing with it. */
+void comicreader_qos_set_interacting(bool interacting);
+void comicreader_qos_wait_while_interacting(void);
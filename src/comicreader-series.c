@@ -0,0 +1,138 @@
+/* comicreader-series.c
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "comicreader-series.h"
+#include "comicreader-debug.h"
+#include "comicreader-directoryimageloader.h"
+
+#include <stdbool.h>
+
+static void find_next_in_thread(
+	GTask *task,
+	gpointer source_object,
+	gpointer task_data,
+	GCancellable *cancellable);
+static bool is_volume(GFileInfo *info);
+
+void comicreader_series_find_next_async(
+	GFile *comic,
+	GCancellable *cancellable,
+	GAsyncReadyCallback callback,
+	gpointer user_data)
+{
+	GTask *task = g_task_new(NULL, cancellable, callback, user_data);
+	g_task_set_source_tag(task, comicreader_series_find_next_async);
+	g_task_set_task_data(task, g_object_ref(comic), g_object_unref);
+	g_task_run_in_thread(task, find_next_in_thread);
+	g_object_unref(task);
+}
+
+GFile *comicreader_series_find_next_finish(GAsyncResult *result, GError **error)
+{
+	return g_task_propagate_pointer(G_TASK(result), error);
+}
+
+/* called on background thread */
+static void find_next_in_thread(
+	GTask *task,
+	gpointer source_object,
+	gpointer task_data,
+	GCancellable *cancellable)
+{
+	GFile *comic = task_data;
+
+	GFile *parent = g_file_get_parent(comic);
+	if (!parent) {
+		g_task_return_pointer(task, NULL, NULL);
+		return;
+	}
+
+	GError *error = NULL;
+	GFileEnumerator *direnum = g_file_enumerate_children(
+		parent,
+		G_FILE_ATTRIBUTE_STANDARD_NAME ","
+		G_FILE_ATTRIBUTE_STANDARD_TYPE ","
+		G_FILE_ATTRIBUTE_STANDARD_IS_HIDDEN ","
+		G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE,
+		G_FILE_QUERY_INFO_NONE,
+		cancellable,
+		&error);
+	if (!direnum) {
+		g_object_unref(parent);
+		g_task_return_error(task, error);
+		return;
+	}
+
+	/* "Vol 10" comes after "Vol 9", in the same order as pages */
+	char *basename = g_file_get_basename(comic);
+	char *next_name = NULL;
+	for (;;) {
+		GFileInfo *info;
+		if (!g_file_enumerator_iterate(direnum, &info, NULL, cancellable, &error))
+			break;
+		if (!info)
+			break;
+		if (!is_volume(info))
+			continue;
+
+		const char *name = g_file_info_get_name(info);
+		if (comicreader_directory_image_loader_compare_names(name, basename) > 0 &&
+		    (!next_name ||
+		     comicreader_directory_image_loader_compare_names(name, next_name) < 0)) {
+			g_free(next_name);
+			next_name = g_strdup(name);
+		}
+	}
+	g_object_unref(direnum);
+	g_free(basename);
+
+	if (error) {
+		g_free(next_name);
+		g_object_unref(parent);
+		g_task_return_error(task, error);
+		return;
+	}
+
+	GFile *next = NULL;
+	if (next_name) {
+		debug_printf("next volume: %s\n", next_name);
+		next = g_file_get_child(parent, next_name);
+		g_free(next_name);
+	}
+	g_object_unref(parent);
+	g_task_return_pointer(task, next, g_object_unref);
+}
+
+static bool is_volume(GFileInfo *info)
+{
+	if (g_file_info_get_is_hidden(info))
+		return false;
+
+	switch (g_file_info_get_file_type(info)) {
+	case G_FILE_TYPE_DIRECTORY:
+		return true;
+	case G_FILE_TYPE_REGULAR: {
+		const char *content_type = g_file_info_get_content_type(info);
+		return content_type && g_content_type_is_a(content_type, "application/pdf");
+	}
+	default:
+		return false;
+	}
+}
@@ -0,0 +1,35 @@
+/* comicreader-series.h
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+/* Finds the volume that follows comic in its series: the next directory or
+ * PDF beside it, in file name order with numbers compared by value.  The
+ * parent directory is listed on a background thread. */
+void comicreader_series_find_next_async(
+	GFile *comic,
+	GCancellable *cancellable,
+	GAsyncReadyCallback callback,
+	gpointer user_data);
+
+/* Returns NULL without setting error if comic is the last volume. */
+GFile *comicreader_series_find_next_finish(GAsyncResult *result, GError **error);
@@ -0,0 +1,588 @@
+/* comicreader-slicer.c
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "comicreader-slicer.h"
+#include "comicreader-debug.h"
+
+#include <jpeglib.h>
+#include <math.h>
+#include <png.h>
+#include <setjmp.h>
+#include <string.h>
+
+/* taller images are decoded in slices, most GPUs can't hold them anyway */
+#define MAX_WHOLE_HEIGHT 8192
+#define SLICE_HEIGHT 1024
+/* slices kept either side of the visible ones, for smooth scrolling */
+#define SLICE_MARGIN 1
+/* a slice that fails this often is corrupt, and left blank */
+#define MAX_SLICE_ATTEMPTS 2
+
+enum SliceFormat {
+	SLICE_FORMAT_JPEG,
+	SLICE_FORMAT_PNG,
+};
+
+struct Slice {
+	GdkTexture *texture;
+	/* queued or being decoded */
+	struct SliceJob *job;
+	/* decodes that failed */
+	int failures;
+};
+
+struct SliceJob {
+	struct ComicReaderDecodeTask task;
+	/* keeps the slicer alive until the slice is back */
+	ComicReaderSlicer *self;
+	size_t index;
+	int top;
+	int rows;
+	/* NULL if it couldn't be decoded */
+	GdkTexture *texture;
+};
+
+struct JpegError {
+	struct jpeg_error_mgr parent;
+	jmp_buf jump;
+};
+
+struct PngSource {
+	const guchar *data;
+	gsize size;
+	gsize pos;
+};
+
+/* An image being decoded from the top, which the next slice resumes from
+ * if it's further down, so that scrolling down doesn't decode every row
+ * above each slice again. */
+struct SliceDecoder {
+	enum SliceFormat format;
+	/* the next row it decodes */
+	int row;
+	int width;
+	size_t stride;
+	GdkMemoryFormat memory_format;
+	/* rows above a slice are decoded into this */
+	guchar *skipped_row;
+
+	struct jpeg_decompress_struct cinfo;
+	struct JpegError error;
+
+	png_structp png;
+	png_infop info;
+	struct PngSource source;
+};
+
+struct _ComicReaderSlicer {
+	GObject parent_instance;
+
+	struct ComicReaderDecodeScheduler *scheduler;
+	GBytes *bytes;
+	enum SliceFormat format;
+	int width;
+	int height;
+	struct Slice *slices;
+	size_t num_slices;
+	/* visible slices, inclusive */
+	size_t first_visible;
+	size_t last_visible;
+	bool stopped;
+
+	/* slices of one image are decoded one at a time, as each would
+	 * otherwise decode the rows above it again */
+	GMutex decode_lock;
+	struct SliceDecoder *decoder;
+};
+
+static void comicreader_slicer_paintable_init(GdkPaintableInterface *iface);
+
+G_DEFINE_FINAL_TYPE_WITH_CODE(
+	ComicReaderSlicer,
+	comicreader_slicer,
+	G_TYPE_OBJECT,
+	G_IMPLEMENT_INTERFACE(GDK_TYPE_PAINTABLE, comicreader_slicer_paintable_init))
+
+static void comicreader_slicer_snapshot(
+	GdkPaintable *paintable,
+	GdkSnapshot *snapshot,
+	double width,
+	double height);
+static int comicreader_slicer_get_intrinsic_width(GdkPaintable *paintable);
+static int comicreader_slicer_get_intrinsic_height(GdkPaintable *paintable);
+static void comicreader_slicer_dispose(GObject *object);
+static bool is_wanted(ComicReaderSlicer *self, size_t index);
+static bool is_visible(ComicReaderSlicer *self, size_t index);
+static void queue_slice(ComicReaderSlicer *self, size_t index);
+static void cancel_slice(ComicReaderSlicer *self, size_t index);
+static void decode_slice(struct ComicReaderDecodeTask *task);
+static gboolean slice_decoded(void *p);
+static void free_job(struct SliceJob *job);
+static bool probe_jpeg(const guchar *data, gsize size, int *width, int *height);
+static bool probe_png(const guchar *data, gsize size, int *width, int *height);
+static struct SliceDecoder *decoder_new(GBytes *bytes, enum SliceFormat format);
+static bool start_jpeg(struct SliceDecoder *decoder, const guchar *data, gsize size);
+static bool start_png(struct SliceDecoder *decoder);
+static GdkTexture *decoder_read(struct SliceDecoder *decoder, int top, int rows);
+static bool read_jpeg_rows(struct SliceDecoder *decoder, int top, int rows, guchar *pixels);
+static bool read_png_rows(struct SliceDecoder *decoder, int top, int rows, guchar *pixels);
+static void decoder_free(struct SliceDecoder *decoder);
+static void jpeg_error_exit(j_common_ptr cinfo);
+static void png_read_bytes(png_structp png, png_bytep out, size_t length);
+
+static void comicreader_slicer_class_init(ComicReaderSlicerClass *klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS(klass);
+	object_class->dispose = comicreader_slicer_dispose;
+}
+
+static void comicreader_slicer_paintable_init(GdkPaintableInterface *iface)
+{
+	iface->snapshot = comicreader_slicer_snapshot;
+	iface->get_intrinsic_width = comicreader_slicer_get_intrinsic_width;
+	iface->get_intrinsic_height = comicreader_slicer_get_intrinsic_height;
+}
+
+static void comicreader_slicer_init(ComicReaderSlicer *self)
+{
+	debug_init("ComicReaderSlicer", self);
+	g_mutex_init(&self->decode_lock);
+}
+
+bool comicreader_slicer_probe(GBytes *bytes, int *width, int *height)
+{
+	gsize size;
+	const guchar *data = g_bytes_get_data(bytes, &size);
+
+	bool sliceable = probe_jpeg(data, size, width, height) ||
+			 probe_png(data, size, width, height);
+	return sliceable && *height > MAX_WHOLE_HEIGHT;
+}
+
+ComicReaderSlicer *comicreader_slicer_new(
+	GBytes *bytes,
+	int width,
+	int height,
+	struct ComicReaderDecodeScheduler *scheduler)
+{
+	ComicReaderSlicer *self = g_object_new(COMICREADER_TYPE_SLICER, NULL);
+
+	gsize size;
+	const guchar *data = g_bytes_get_data(bytes, &size);
+	self->format = size >= 2 && data[0] == 0xff && data[1] == 0xd8 ? SLICE_FORMAT_JPEG
+								       : SLICE_FORMAT_PNG;
+	self->scheduler = scheduler;
+	self->bytes = g_bytes_ref(bytes);
+	self->width = width;
+	self->height = height;
+	self->num_slices = (height + SLICE_HEIGHT - 1) / SLICE_HEIGHT;
+	self->slices = calloc(self->num_slices, sizeof(struct Slice));
+
+	return self;
+}
+
+void comicreader_slicer_set_visible(ComicReaderSlicer *self, double top, double bottom)
+{
+	top = CLAMP(top, 0, self->height - 1);
+	bottom = CLAMP(bottom, top, self->height - 1);
+	self->first_visible = (size_t)top / SLICE_HEIGHT;
+	self->last_visible = (size_t)bottom / SLICE_HEIGHT;
+
+	/* the visible slices first, then those just past them */
+	for (size_t i = self->first_visible; i <= self->last_visible; ++i)
+		queue_slice(self, i);
+	for (size_t d = 1; d <= SLICE_MARGIN; ++d) {
+		if (self->last_visible + d < self->num_slices)
+			queue_slice(self, self->last_visible + d);
+		if (self->first_visible >= d)
+			queue_slice(self, self->first_visible - d);
+	}
+
+	for (size_t i = 0; i < self->num_slices; ++i) {
+		if (!is_wanted(self, i)) {
+			g_clear_object(&self->slices[i].texture);
+			cancel_slice(self, i);
+		}
+	}
+}
+
+void comicreader_slicer_stop(ComicReaderSlicer *self)
+{
+	self->stopped = true;
+	for (size_t i = 0; i < self->num_slices; ++i)
+		cancel_slice(self, i);
+}
+
+static void comicreader_slicer_snapshot(
+	GdkPaintable *paintable,
+	GdkSnapshot *snapshot,
+	double width,
+	double height)
+{
+	ComicReaderSlicer *self = COMICREADER_SLICER(paintable);
+	double scale = height / self->height;
+
+	for (size_t i = 0; i < self->num_slices; ++i) {
+		GdkTexture *texture = self->slices[i].texture;
+		if (!texture)
+			continue;
+
+		/* round the edges so that neighbouring slices meet without a seam */
+		double top = round(i * SLICE_HEIGHT * scale);
+		double bottom = round((i * SLICE_HEIGHT + gdk_texture_get_height(texture)) * scale);
+		gtk_snapshot_save(GTK_SNAPSHOT(snapshot));
+		gtk_snapshot_translate(GTK_SNAPSHOT(snapshot), &GRAPHENE_POINT_INIT(0, top));
+		gdk_paintable_snapshot(GDK_PAINTABLE(texture), snapshot, width, bottom - top);
+		gtk_snapshot_restore(GTK_SNAPSHOT(snapshot));
+	}
+}
+
+static int comicreader_slicer_get_intrinsic_width(GdkPaintable *paintable)
+{
+	return COMICREADER_SLICER(paintable)->width;
+}
+
+static int comicreader_slicer_get_intrinsic_height(GdkPaintable *paintable)
+{
+	return COMICREADER_SLICER(paintable)->height;
+}
+
+static void comicreader_slicer_dispose(GObject *object)
+{
+	ComicReaderSlicer *self = COMICREADER_SLICER(object);
+
+	/* every job holds a reference, so none are left */
+	for (size_t i = 0; i < self->num_slices; ++i)
+		g_clear_object(&self->slices[i].texture);
+	g_clear_pointer(&self->slices, free);
+	self->num_slices = 0;
+	g_clear_pointer(&self->decoder, decoder_free);
+	g_clear_pointer(&self->bytes, g_bytes_unref);
+
+	debug_free("ComicReaderSlicer", self);
+	G_OBJECT_CLASS(comicreader_slicer_parent_class)->dispose(object);
+}
+
+static bool is_wanted(ComicReaderSlicer *self, size_t index)
+{
+	return index + SLICE_MARGIN >= self->first_visible &&
+	       index <= self->last_visible + SLICE_MARGIN;
+}
+
+static bool is_visible(ComicReaderSlicer *self, size_t index)
+{
+	return index >= self->first_visible && index <= self->last_visible;
+}
+
+static void queue_slice(ComicReaderSlicer *self, size_t index)
+{
+	struct Slice *slice = &self->slices[index];
+	/* a slice queued as a neighbour has since scrolled into view */
+	if (slice->job && is_visible(self, index))
+		comicreader_decode_scheduler_promote(self->scheduler, &slice->job->task);
+	if (slice->texture || slice->job || slice->failures >= MAX_SLICE_ATTEMPTS)
+		return;
+
+	struct SliceJob *job = calloc(1, sizeof(*job));
+	job->task.run = decode_slice;
+	job->task.owner = self;
+	job->task.qos = is_visible(self, index) ? COMICREADER_QOS_HIGH : COMICREADER_QOS_NORMAL;
+	job->self = g_object_ref(self);
+	job->index = index;
+	job->top = index * SLICE_HEIGHT;
+	job->rows = MIN(SLICE_HEIGHT, self->height - job->top);
+	slice->job = job;
+
+	comicreader_decode_scheduler_push(self->scheduler, &job->task);
+}
+
+/* Takes the slice's job off the queue, if it hasn't started.  One that
+ * has is dropped once it's back. */
+static void cancel_slice(ComicReaderSlicer *self, size_t index)
+{
+	struct SliceJob *job = self->slices[index].job;
+	if (!job || !comicreader_decode_scheduler_cancel(self->scheduler, &job->task))
+		return;
+
+	self->slices[index].job = NULL;
+	free_job(job);
+}
+
+/* called on background thread */
+static void decode_slice(struct ComicReaderDecodeTask *task)
+{
+	struct SliceJob *job = (struct SliceJob *)task;
+	ComicReaderSlicer *self = job->self;
+
+	g_mutex_lock(&self->decode_lock);
+	if (self->decoder && self->decoder->row > job->top)
+		g_clear_pointer(&self->decoder, decoder_free);
+	if (!self->decoder)
+		self->decoder = decoder_new(self->bytes, self->format);
+	if (self->decoder) {
+		job->texture = decoder_read(self->decoder, job->top, job->rows);
+		if (!job->texture)
+			g_clear_pointer(&self->decoder, decoder_free);
+	}
+	g_mutex_unlock(&self->decode_lock);
+
+	g_idle_add(slice_decoded, job);
+}
+
+static gboolean slice_decoded(void *p)
+{
+	struct SliceJob *job = p;
+	ComicReaderSlicer *self = job->self;
+	struct Slice *slice = &self->slices[job->index];
+	slice->job = NULL;
+
+	/* the slices are gone once stopped */
+	if (self->stopped) {
+		free_job(job);
+		return G_SOURCE_REMOVE;
+	}
+
+	if (!job->texture) {
+		debug_printf(
+			"slice %zu: cannot decode rows %i to %i\n",
+			job->index,
+			job->top,
+			job->top + job->rows);
+		++slice->failures;
+		if (is_wanted(self, job->index))
+			queue_slice(self, job->index);
+		free_job(job);
+		return G_SOURCE_REMOVE;
+	}
+
+	/* scrolled away while decoding */
+	if (is_wanted(self, job->index)) {
+		g_clear_object(&slice->texture);
+		slice->texture = g_steal_pointer(&job->texture);
+		gdk_paintable_invalidate_contents(GDK_PAINTABLE(self));
+	}
+
+	free_job(job);
+	return G_SOURCE_REMOVE;
+}
+
+static void free_job(struct SliceJob *job)
+{
+	g_clear_object(&job->texture);
+	g_object_unref(job->self);
+	free(job);
+}
+
+static bool probe_jpeg(const guchar *data, gsize size, int *width, int *height)
+{
+	if (size < 2 || data[0] != 0xff || data[1] != 0xd8)
+		return false;
+
+	struct jpeg_decompress_struct cinfo;
+	struct JpegError error;
+	cinfo.err = jpeg_std_error(&error.parent);
+	error.parent.error_exit = jpeg_error_exit;
+	if (setjmp(error.jump)) {
+		jpeg_destroy_decompress(&cinfo);
+		return false;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, data, size);
+	jpeg_read_header(&cinfo, TRUE);
+	/* CMYK would need converting by hand */
+	bool ret = cinfo.jpeg_color_space == JCS_GRAYSCALE ||
+		   cinfo.jpeg_color_space == JCS_YCbCr || cinfo.jpeg_color_space == JCS_RGB;
+	*width = cinfo.image_width;
+	*height = cinfo.image_height;
+	jpeg_destroy_decompress(&cinfo);
+
+	return ret;
+}
+
+/* interlaced images can't be decoded a few rows at a time */
+static bool probe_png(const guchar *data, gsize size, int *width, int *height)
+{
+	if (size < 29 || png_sig_cmp(data, 0, 8) != 0 || memcmp(data + 12, "IHDR", 4) != 0)
+		return false;
+
+	*width = png_get_uint_32(data + 16);
+	*height = png_get_uint_32(data + 20);
+	return data[28] == PNG_INTERLACE_NONE;
+}
+
+/* Returns a decoder at the top of the image, or NULL if it can't be read.
+ * called on background thread */
+static struct SliceDecoder *decoder_new(GBytes *bytes, enum SliceFormat format)
+{
+	struct SliceDecoder *decoder = calloc(1, sizeof(*decoder));
+	decoder->format = format;
+
+	gsize size;
+	const guchar *data = g_bytes_get_data(bytes, &size);
+	bool started;
+	if (format == SLICE_FORMAT_JPEG) {
+		started = start_jpeg(decoder, data, size);
+	} else {
+		decoder->source.data = data;
+		decoder->source.size = size;
+		started = start_png(decoder);
+	}
+
+	if (!started) {
+		decoder_free(decoder);
+		return NULL;
+	}
+	decoder->skipped_row = g_malloc(decoder->stride);
+	return decoder;
+}
+
+/* called on background thread */
+static bool start_jpeg(struct SliceDecoder *decoder, const guchar *data, gsize size)
+{
+	decoder->cinfo.err = jpeg_std_error(&decoder->error.parent);
+	decoder->error.parent.error_exit = jpeg_error_exit;
+	if (setjmp(decoder->error.jump))
+		return false;
+
+	jpeg_create_decompress(&decoder->cinfo);
+	jpeg_mem_src(&decoder->cinfo, data, size);
+	jpeg_read_header(&decoder->cinfo, TRUE);
+	decoder->cinfo.out_color_space = JCS_RGB;
+	jpeg_start_decompress(&decoder->cinfo);
+
+	decoder->width = decoder->cinfo.output_width;
+	decoder->stride = (size_t)decoder->width * 3;
+	decoder->memory_format = GDK_MEMORY_R8G8B8;
+	return true;
+}
+
+/* called on background thread */
+static bool start_png(struct SliceDecoder *decoder)
+{
+	decoder->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	decoder->info = png_create_info_struct(decoder->png);
+	if (setjmp(png_jmpbuf(decoder->png)))
+		return false;
+
+	png_set_read_fn(decoder->png, &decoder->source, png_read_bytes);
+	png_read_info(decoder->png, decoder->info);
+	png_set_expand(decoder->png);
+	png_set_strip_16(decoder->png);
+	png_set_gray_to_rgb(decoder->png);
+	png_set_add_alpha(decoder->png, 0xff, PNG_FILLER_AFTER);
+	png_read_update_info(decoder->png, decoder->info);
+
+	decoder->width = png_get_image_width(decoder->png, decoder->info);
+	decoder->stride = (size_t)decoder->width * 4;
+	decoder->memory_format = GDK_MEMORY_R8G8B8A8;
+	return true;
+}
+
+/* Decodes rows top to top + rows, which mustn't be above decoder->row.
+ * Returns NULL if they can't be, after which the decoder is unusable.
+ * called on background thread */
+static GdkTexture *decoder_read(struct SliceDecoder *decoder, int top, int rows)
+{
+	guchar *pixels = g_malloc(decoder->stride * rows);
+	bool ok = decoder->format == SLICE_FORMAT_JPEG
+			  ? read_jpeg_rows(decoder, top, rows, pixels)
+			  : read_png_rows(decoder, top, rows, pixels);
+	if (!ok) {
+		g_free(pixels);
+		return NULL;
+	}
+
+	GBytes *slice = g_bytes_new_take(pixels, decoder->stride * rows);
+	GdkTexture *texture = gdk_memory_texture_new(
+		decoder->width,
+		rows,
+		decoder->memory_format,
+		slice,
+		decoder->stride);
+	g_bytes_unref(slice);
+	return texture;
+}
+
+/* The rows skipped still have to be entropy decoded, but skipping them
+ * spares the IDCT and colour conversion.
+ * called on background thread */
+static bool read_jpeg_rows(struct SliceDecoder *decoder, int top, int rows, guchar *pixels)
+{
+	struct jpeg_decompress_struct *cinfo = &decoder->cinfo;
+	if (setjmp(decoder->error.jump))
+		return false;
+
+#ifdef LIBJPEG_TURBO_VERSION
+	if (cinfo->output_scanline < (JDIMENSION)top)
+		jpeg_skip_scanlines(cinfo, top - cinfo->output_scanline);
+#endif
+	while (cinfo->output_scanline < (JDIMENSION)(top + rows)) {
+		JSAMPROW dest = cinfo->output_scanline < (JDIMENSION)top
+					? decoder->skipped_row
+					: pixels + (cinfo->output_scanline - top) * decoder->stride;
+		jpeg_read_scanlines(cinfo, &dest, 1);
+	}
+	decoder->row = cinfo->output_scanline;
+	return true;
+}
+
+/* called on background thread */
+static bool read_png_rows(struct SliceDecoder *decoder, int top, int rows, guchar *pixels)
+{
+	if (setjmp(png_jmpbuf(decoder->png)))
+		return false;
+
+	while (decoder->row < top + rows) {
+		guchar *dest = decoder->row < top ? decoder->skipped_row
+						  : pixels + (decoder->row - top) * decoder->stride;
+		png_read_row(decoder->png, dest, NULL);
+		++decoder->row;
+	}
+	return true;
+}
+
+static void decoder_free(struct SliceDecoder *decoder)
+{
+	if (decoder->format == SLICE_FORMAT_JPEG)
+		jpeg_destroy_decompress(&decoder->cinfo);
+	else
+		png_destroy_read_struct(&decoder->png, &decoder->info, NULL);
+	g_free(decoder->skipped_row);
+	free(decoder);
+}
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+	struct JpegError *error = (struct JpegError *)cinfo->err;
+	char message[JMSG_LENGTH_MAX];
+	cinfo->err->format_message(cinfo, message);
+	debug_printf("jpeg: %s\n", message);
+	longjmp(error->jump, 1);
+}
+
+static void png_read_bytes(png_structp png, png_bytep out, size_t length)
+{
+	struct PngSource *source = png_get_io_ptr(png);
+	if (length > source->size - source->pos)
+		png_error(png, "truncated image");
+	memcpy(out, source->data + source->pos, length);
+	source->pos += length;
+}
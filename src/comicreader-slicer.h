@@ -0,0 +1,54 @@
+/* comicreader-slicer.h
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gtk/gtk.h>
+#include <stdbool.h>
+
+#include "comicreader-decodescheduler.h"
+
+G_BEGIN_DECLS
+
+#define COMICREADER_TYPE_SLICER (comicreader_slicer_get_type())
+
+G_DECLARE_FINAL_TYPE(ComicReaderSlicer, comicreader_slicer, COMICREADER, SLICER, GObject)
+
+G_END_DECLS
+
+/* Returns true if bytes hold an image too tall to decode whole that can be
+ * decoded a few rows at a time, setting its size. */
+bool comicreader_slicer_probe(GBytes *bytes, int *width, int *height);
+
+/* A paintable for an image probed above, decoded in horizontal slices by
+ * scheduler as they become visible, the visible ones first.  Only the
+ * visible slices and their neighbours are kept. */
+ComicReaderSlicer *comicreader_slicer_new(
+	GBytes *bytes,
+	int width,
+	int height,
+	struct ComicReaderDecodeScheduler *scheduler);
+
+/* Sets the rows, in image pixels, that are on screen. */
+void comicreader_slicer_set_visible(ComicReaderSlicer *self, double top, double bottom);
+
+/* Drops queued slices, for when the image is no longer shown.  Slices
+ * being decoded keep the slicer alive until they're done. */
+void comicreader_slicer_stop(ComicReaderSlicer *self);
@@ -0,0 +1,426 @@
+/* comicreader-upscaleimageloader.c
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "comicreader-upscaleimageloader.h"
+#include "comicreader-debug.h"
+
+#include <math.h>
+
+/* Lanczos-3, each output pixel is a weighted sum of 6x6 input pixels */
+#define LANCZOS_A 3
+#define TAPS (2 * LANCZOS_A)
+
+/* smaller upscales aren't noticeably sharper than the draw time filter */
+#define MIN_UPSCALE 1.25
+#define MAX_UPSCALE 4.0
+
+/* on x86-64 glibc picks the AVX2 version at load time when the CPU has it,
+ * other architectures rely on their baseline SIMD (NEON on aarch64) */
+#if defined(__x86_64__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define SIMD_CLONES __attribute__((target_clones("avx2", "default")))
+#endif
+#endif
+#ifndef SIMD_CLONES
+#define SIMD_CLONES
+#endif
+
+/* one premultiplied RGBA pixel */
+typedef float v4f __attribute__((vector_size(16)));
+
+struct ComicReaderUpscaleImageLoader {
+	struct ComicReaderImageLoader parent;
+	struct ComicReaderImageLoader *inner_loader;
+	int target_height;
+};
+
+/* the input pixels, clamped to the image, that make up one output pixel */
+struct Contribution {
+	int index[TAPS];
+	float weight[TAPS];
+};
+
+/* interface implementations */
+static size_t impl_get_num_images(struct ComicReaderImageLoader *image_loader);
+static struct ComicReaderImage *impl_get_image(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index);
+static struct ComicReaderImage *impl_get_preview(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index);
+static bool impl_find_image(
+	struct ComicReaderImageLoader *image_loader,
+	const char *name,
+	size_t *index);
+static GBytes *impl_read_image(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index,
+	char **name);
+static struct ComicReaderImage *impl_decode_image(
+	struct ComicReaderImageLoader *image_loader,
+	const char *name,
+	GBytes *bytes,
+	const char *key);
+static void impl_read_images(
+	struct ComicReaderImageLoader *image_loader,
+	struct ComicReaderReadRequest **requests,
+	size_t num_requests);
+static char *impl_get_image_name(struct ComicReaderImageLoader *image_loader, size_t index);
+static char *impl_get_image_key(struct ComicReaderImageLoader *image_loader, const char *name);
+static void impl_free(struct ComicReaderImageLoader *image_loader);
+
+/* helper functions */
+static void inner_loader_event(
+	void *user_data,
+	enum ComicReaderImageLoaderEvent event,
+	size_t index);
+static struct ComicReaderImage *upscale_image(
+	struct ComicReaderUpscaleImageLoader *self,
+	struct ComicReaderImage *image);
+static GdkTexture *upscale_texture(GdkTexture *texture, int width, int height);
+static struct Contribution *get_contributions(int src_size, int dst_size);
+static float lanczos(float x);
+static void resample(
+	const guchar *src,
+	int src_width,
+	int src_height,
+	gsize src_stride,
+	guchar *dst,
+	int dst_width,
+	int dst_height,
+	gsize dst_stride);
+
+struct ComicReaderImageLoader *comicreader_upscale_image_loader_new(
+	struct ComicReaderImageLoader *inner_loader,
+	int target_height)
+{
+	struct ComicReaderUpscaleImageLoader *ret;
+	ret = calloc(1, sizeof(struct ComicReaderUpscaleImageLoader));
+	debug_init("ComicReaderUpscaleImageLoader", ret);
+
+	ret->parent.free = impl_free;
+	ret->parent.get_num_images = impl_get_num_images;
+	ret->parent.get_image = impl_get_image;
+	ret->parent.get_preview = impl_get_preview;
+	ret->parent.find_image = impl_find_image;
+	if (inner_loader->read_image) {
+		ret->parent.read_image = impl_read_image;
+		ret->parent.decode_image = impl_decode_image;
+	}
+	if (inner_loader->read_images)
+		ret->parent.read_images = impl_read_images;
+	ret->parent.get_image_name = impl_get_image_name;
+	ret->parent.get_image_key = impl_get_image_key;
+
+	ret->inner_loader = inner_loader;
+	ret->target_height = target_height;
+	comicreader_image_loader_set_listener(inner_loader, inner_loader_event, ret);
+
+	g_assert((void *)ret == (void *)&ret->parent);
+	return &ret->parent;
+}
+
+static size_t impl_get_num_images(struct ComicReaderImageLoader *image_loader)
+{
+	struct ComicReaderUpscaleImageLoader *self =
+		(struct ComicReaderUpscaleImageLoader *)image_loader;
+
+	return self->inner_loader->get_num_images(self->inner_loader);
+}
+
+static struct ComicReaderImage *impl_get_image(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index)
+{
+	struct ComicReaderUpscaleImageLoader *self =
+		(struct ComicReaderUpscaleImageLoader *)image_loader;
+
+	return upscale_image(self, self->inner_loader->get_image(self->inner_loader, index));
+}
+
+/* previews are shown small, there's nothing to gain from upscaling them */
+static struct ComicReaderImage *impl_get_preview(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index)
+{
+	struct ComicReaderUpscaleImageLoader *self =
+		(struct ComicReaderUpscaleImageLoader *)image_loader;
+
+	return comicreader_image_loader_get_preview(self->inner_loader, index);
+}
+
+static bool impl_find_image(
+	struct ComicReaderImageLoader *image_loader,
+	const char *name,
+	size_t *index)
+{
+	struct ComicReaderUpscaleImageLoader *self =
+		(struct ComicReaderUpscaleImageLoader *)image_loader;
+
+	return comicreader_image_loader_find(self->inner_loader, name, index);
+}
+
+static GBytes *impl_read_image(
+	struct ComicReaderImageLoader *image_loader,
+	size_t index,
+	char **name)
+{
+	struct ComicReaderUpscaleImageLoader *self =
+		(struct ComicReaderUpscaleImageLoader *)image_loader;
+
+	return self->inner_loader->read_image(self->inner_loader, index, name);
+}
+
+static struct ComicReaderImage *impl_decode_image(
+	struct ComicReaderImageLoader *image_loader,
+	const char *name,
+	GBytes *bytes,
+	const char *key)
+{
+	struct ComicReaderUpscaleImageLoader *self =
+		(struct ComicReaderUpscaleImageLoader *)image_loader;
+
+	return upscale_image(
+		self,
+		self->inner_loader->decode_image(self->inner_loader, name, bytes, key));
+}
+
+static void impl_read_images(
+	struct ComicReaderImageLoader *image_loader,
+	struct ComicReaderReadRequest **requests,
+	size_t num_requests)
+{
+	struct ComicReaderUpscaleImageLoader *self =
+		(struct ComicReaderUpscaleImageLoader *)image_loader;
+
+	self->inner_loader->read_images(self->inner_loader, requests, num_requests);
+}
+
+static char *impl_get_image_name(struct ComicReaderImageLoader *image_loader, size_t index)
+{
+	struct ComicReaderUpscaleImageLoader *self =
+		(struct ComicReaderUpscaleImageLoader *)image_loader;
+
+	return comicreader_image_loader_get_name(self->inner_loader, index);
+}
+
+static char *impl_get_image_key(struct ComicReaderImageLoader *image_loader, const char *name)
+{
+	struct ComicReaderUpscaleImageLoader *self =
+		(struct ComicReaderUpscaleImageLoader *)image_loader;
+
+	char *key = comicreader_image_loader_get_key(self->inner_loader, name);
+	if (!key)
+		return NULL;
+
+	char *ret = g_strdup_printf("%s#upscale=%i", key, self->target_height);
+	g_free(key);
+	return ret;
+}
+
+static void impl_free(struct ComicReaderImageLoader *image_loader)
+{
+	struct ComicReaderUpscaleImageLoader *self =
+		(struct ComicReaderUpscaleImageLoader *)image_loader;
+
+	comicreader_image_loader_clear(&self->inner_loader);
+	debug_free("ComicReaderUpscaleImageLoader", self);
+	free(self);
+}
+
+static void inner_loader_event(
+	void *user_data,
+	enum ComicReaderImageLoaderEvent event,
+	size_t index)
+{
+	struct ComicReaderUpscaleImageLoader *self = user_data;
+
+	comicreader_image_loader_notify(&self->parent, event, index);
+}
+
+/* called on background thread */
+static struct ComicReaderImage *upscale_image(
+	struct ComicReaderUpscaleImageLoader *self,
+	struct ComicReaderImage *image)
+{
+	/* animations are decoded frame by frame when shown */
+	if (!image || !image->texture || image->animation)
+		return image;
+
+	int width = comicreader_image_get_width(image);
+	int height = comicreader_image_get_height(image);
+	double factor = MIN((double)self->target_height / height, MAX_UPSCALE);
+	if (factor < MIN_UPSCALE)
+		return image;
+
+	int dst_width = lround(width * factor);
+	int dst_height = lround(height * factor);
+	debug_printf(
+		"upscaling %s from %ix%i to %ix%i\n",
+		image->name,
+		width,
+		height,
+		dst_width,
+		dst_height);
+
+	GdkTexture *texture = upscale_texture(image->texture, dst_width, dst_height);
+	g_object_unref(image->texture);
+	image->texture = texture;
+	/* keep laying the page out at its original size */
+	image->width = width;
+	image->height = height;
+
+	return image;
+}
+
+static GdkTexture *upscale_texture(GdkTexture *texture, int width, int height)
+{
+	GdkTextureDownloader *downloader = gdk_texture_downloader_new(texture);
+	/* premultiplied, so that transparent pixels don't bleed their colour */
+	gdk_texture_downloader_set_format(downloader, GDK_MEMORY_R8G8B8A8_PREMULTIPLIED);
+	gsize src_stride;
+	GBytes *src_bytes = gdk_texture_downloader_download_bytes(downloader, &src_stride);
+	gdk_texture_downloader_free(downloader);
+
+	gsize dst_stride = (gsize)width * 4;
+	guchar *dst = g_malloc_n(height, dst_stride);
+	resample(
+		g_bytes_get_data(src_bytes, NULL),
+		gdk_texture_get_width(texture),
+		gdk_texture_get_height(texture),
+		src_stride,
+		dst,
+		width,
+		height,
+		dst_stride);
+	g_bytes_unref(src_bytes);
+
+	GBytes *dst_bytes = g_bytes_new_take(dst, height * dst_stride);
+	GdkTexture *ret = gdk_memory_texture_new(
+		width,
+		height,
+		GDK_MEMORY_R8G8B8A8_PREMULTIPLIED,
+		dst_bytes,
+		dst_stride);
+	g_bytes_unref(dst_bytes);
+
+	return ret;
+}
+
+static struct Contribution *get_contributions(int src_size, int dst_size)
+{
+	struct Contribution *ret = g_new(struct Contribution, dst_size);
+	float scale = (float)dst_size / src_size;
+
+	for (int i = 0; i < dst_size; ++i) {
+		float center = (i + 0.5f) / scale - 0.5f;
+		int first = (int)floorf(center) - (LANCZOS_A - 1);
+		float sum = 0;
+		for (int t = 0; t < TAPS; ++t) {
+			ret[i].index[t] = CLAMP(first + t, 0, src_size - 1);
+			ret[i].weight[t] = lanczos(center - (first + t));
+			sum += ret[i].weight[t];
+		}
+		for (int t = 0; t < TAPS; ++t)
+			ret[i].weight[t] /= sum;
+	}
+
+	return ret;
+}
+
+static float lanczos(float x)
+{
+	if (x == 0)
+		return 1;
+	if (fabsf(x) >= LANCZOS_A)
+		return 0;
+	float px = G_PI * x;
+	return LANCZOS_A * sinf(px) * sinf(px / LANCZOS_A) / (px * px);
+}
+
+/* Separable resampling: each source row is resampled horizontally once,
+ * into a ring of the last TAPS rows, then output rows are blended from
+ * the ring.  Both passes operate on whole pixels as vectors. */
+SIMD_CLONES
+static void resample(
+	const guchar *src,
+	int src_width,
+	int src_height,
+	gsize src_stride,
+	guchar *dst,
+	int dst_width,
+	int dst_height,
+	gsize dst_stride)
+{
+	struct Contribution *cx = get_contributions(src_width, dst_width);
+	struct Contribution *cy = get_contributions(src_height, dst_height);
+
+	v4f *line = g_new(v4f, src_width);
+	v4f *ring = g_new(v4f, (gsize)TAPS * dst_width);
+	int ring_row[TAPS];
+	for (int t = 0; t < TAPS; ++t)
+		ring_row[t] = -1;
+	v4f *acc = g_new(v4f, dst_width);
+
+	for (int y = 0; y < dst_height; ++y) {
+		for (int x = 0; x < dst_width; ++x)
+			acc[x] = (v4f){0, 0, 0, 0};
+
+		for (int t = 0; t < TAPS; ++t) {
+			int sy = cy[y].index[t];
+			v4f *row = ring + (gsize)(sy % TAPS) * dst_width;
+
+			if (ring_row[sy % TAPS] != sy) {
+				const guchar *in = src + sy * src_stride;
+				for (int x = 0; x < src_width; ++x) {
+					line[x] = (v4f){in[4 * x], in[4 * x + 1], in[4 * x + 2],
+							in[4 * x + 3]};
+				}
+				for (int x = 0; x < dst_width; ++x) {
+					v4f sum = {0, 0, 0, 0};
+					for (int u = 0; u < TAPS; ++u)
+						sum += line[cx[x].index[u]] * cx[x].weight[u];
+					row[x] = sum;
+				}
+				ring_row[sy % TAPS] = sy;
+			}
+
+			float weight = cy[y].weight[t];
+			for (int x = 0; x < dst_width; ++x)
+				acc[x] += row[x] * weight;
+		}
+
+		/* Lanczos rings around edges, clamp back into range and keep
+		 * the colour channels premultiplied */
+		guchar *out = dst + y * dst_stride;
+		for (int x = 0; x < dst_width; ++x) {
+			float a = CLAMP(acc[x][3], 0.0f, 255.0f);
+			for (int c = 0; c < 3; ++c)
+				out[4 * x + c] = lrintf(CLAMP(acc[x][c], 0.0f, a));
+			out[4 * x + 3] = lrintf(a);
+		}
+	}
+
+	g_free(acc);
+	g_free(ring);
+	g_free(line);
+	g_free(cy);
+	g_free(cx);
+}
@@ -0,0 +1,30 @@
+/* comicreader-upscaleimageloader.h
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "comicreader-imageloader.h"
+
+/* Upscales images shorter than target_height to that height, so that low
+ * resolution scans are resampled once rather than filtered on every frame.
+ * Intended to sit beneath a background loader, as upscaling is slow. */
+struct ComicReaderImageLoader *comicreader_upscale_image_loader_new(
+	struct ComicReaderImageLoader *inner_loader,
+	int target_height);
@@ -20,12 +20,43 @@
 
 #include "config.h"
 
-#include "comicreader-backgroundimageloader.h"
+#include "comicreader-application.h"
 #include "comicreader-debug.h"
-#include "comicreader-directoryimageloader.h"
 #include "comicreader-imagedisplay.h"
+#include "comicreader-libraryview.h"
+#include "comicreader-qos.h"
+#include "comicreader-series.h"
 #include "comicreader-window.h"
 
+/* how long the page scale must rest before the full page is loaded */
+#define SCRUB_SETTLE_MS 300
+
+/* page turns closer together than this come from a held key, which only
+ * flips through previews until it stops repeating for TURN_SETTLE_MS */
+#define TURN_REPEAT_US (100 * 1000)
+#define TURN_SETTLE_MS 150
+
+/* series mode starts loading the next volume this many pages before the
+ * end of the current one */
+#define SERIES_LOOKAHEAD 3
+
+/* frames averaged by the performance HUD */
+#define HUD_FRAMES 64
+#define HUD_REFRESH_MS 500
+/* longer gaps between frames are idle time, not slow frames */
+#define HUD_MAX_FRAME_INTERVAL (100 * 1000)
+
+/* when each phase of the last page turn ended, in monotonic microseconds */
+struct HudPageTurn {
+	gint64 start;
+	gint64 read_time;
+	gint64 decode_time;
+	gint64 loaded;
+	gint64 painted;
+	gint64 presented;
+	gint64 frame;
+};
+
 struct _ComicReaderWindow {
 	AdwApplicationWindow parent_instance;
 
@@ -36,15 +67,64 @@ struct _ComicReaderWindow {
 	GtkStack *stack;
 	GtkScrolledWindow *scrolled_image;
 	ComicReaderImageDisplay *displayed_image;
+	GtkAdjustment *page_adjustment;
+	GtkWidget *preview_box;
+	GtkPicture *preview_picture;
+	GtkLabel *preview_label;
+	ComicReaderLibraryView *library_view;
+	GtkLabel *hud_label;
 
 	/* Private fields */
 	GSimpleAction *open_directory_action;
+	GSimpleAction *open_pdf_action;
 	GSimpleAction *close_comic_action;
+	GSimpleAction *show_library_action;
+	GSimpleAction *add_library_folder_action;
+	GSimpleAction *toggle_hud_action;
 	GSimpleAction *prev_page_action;
 	GSimpleAction *next_page_action;
+	GFile *comic;
 	struct ComicReaderImageLoader *image_loader;
 	size_t image_idx;
 
+	/* Session restore state */
+	gulong restore_scroll_handler;
+	double restore_scroll_x;
+	double restore_scroll_y;
+
+	guint deferred_ui_source;
+
+	/* Page scale state */
+	gulong page_adjustment_handler;
+	guint scrub_settle_source;
+	size_t scrub_idx;
+	size_t jump_origin;
+	bool has_jump_origin;
+
+	/* Page turns requested since the last frame */
+	guint turn_tick;
+	size_t turn_idx;
+	gint64 turn_input_time;
+	gint64 last_turn_time;
+
+	/* Series mode, the volume after this one once it's near the end;
+	 * the cancellable is set while it's searched for or loaded */
+	GCancellable *next_volume_cancellable;
+	GFile *next_volume;
+	struct ComicReaderImageLoader *next_volume_loader;
+	bool next_volume_searched;
+	/* the last page was turned before the next volume was ready */
+	bool next_volume_wanted;
+
+	/* Performance HUD state, only tracked while it's shown */
+	gulong hud_paint_handler;
+	guint hud_refresh_source;
+	gint64 hud_frame_costs[HUD_FRAMES];
+	gint64 hud_frame_intervals[HUD_FRAMES];
+	size_t hud_num_frames;
+	gint64 hud_last_frame_time;
+	struct HudPageTurn hud_turn;
+
 	/* GestureZoom state */
 	double start_scale;
 	double scale_fixed_x;
@@ -59,21 +139,68 @@ static void comicreader_window_update_title(ComicReaderWindow *self);
 static void key_released(ComicReaderWindow *self, guint kval, guint kcode, GdkModifierType state);
 static void open_directory(ComicReaderWindow *self);
 static void open_directory_callback(GObject *gobject, GAsyncResult *result, gpointer data);
+static void open_pdf(ComicReaderWindow *self);
+static void open_pdf_callback(GObject *gobject, GAsyncResult *result, gpointer data);
+static void show_library(ComicReaderWindow *self);
+static void add_library_folder(ComicReaderWindow *self);
+static void add_library_folder_callback(GObject *gobject, GAsyncResult *result, gpointer data);
+static void comic_activated(ComicReaderWindow *self, const char *path);
+static gboolean build_deferred_ui(gpointer data);
 static void close_comic(ComicReaderWindow *self);
-static void set_image_loader(ComicReaderWindow *self, struct ComicReaderImageLoader *loader);
+static gboolean close_request(ComicReaderWindow *self);
+static void set_image_loader(
+	ComicReaderWindow *self,
+	GFile *comic,
+	struct ComicReaderImageLoader *loader,
+	size_t img_idx);
+static void restore_scroll(ComicReaderWindow *self);
+static void cancel_restore_scroll(ComicReaderWindow *self);
 static void set_image_idx(ComicReaderWindow *self, size_t img_idx);
 static void next_page(ComicReaderWindow *self);
 static void prev_page(ComicReaderWindow *self);
+static void turn_page(ComicReaderWindow *self, bool forward);
+static gboolean turn_tick(GtkWidget *widget, GdkFrameClock *frame_clock, gpointer data);
+static gboolean turn_settled(gpointer data);
+static void cancel_page_turn(ComicReaderWindow *self);
+static bool series_mode_enabled(ComicReaderWindow *self);
+static void prepare_next_volume(ComicReaderWindow *self);
+static void next_volume_found(GObject *source_object, GAsyncResult *result, gpointer data);
+static void next_volume_loaded(GObject *source_object, GAsyncResult *result, gpointer data);
+static bool open_next_volume(ComicReaderWindow *self);
+static void clear_next_volume(ComicReaderWindow *self);
+static void jump_to_page(ComicReaderWindow *self, size_t img_idx);
+static void sync_page_adjustment(ComicReaderWindow *self);
+static void page_adjustment_changed(ComicReaderWindow *self);
+static void update_preview(ComicReaderWindow *self);
+static gboolean scrub_settled(gpointer data);
+static void stop_scrubbing(ComicReaderWindow *self);
+static void image_loader_event(
+	void *user_data,
+	enum ComicReaderImageLoaderEvent event,
+	size_t index);
+static void images_moved(
+	ComicReaderWindow *self,
+	enum ComicReaderImageLoaderEvent event,
+	size_t index);
 static void scale_begin(GtkGesture *gesture, GdkEventSequence *sequence, ComicReaderWindow *self);
 static void scale_changed(ComicReaderWindow *self, gdouble scale);
 static void reset_scale_state(ComicReaderWindow *self);
 static void scale_end(ComicReaderWindow *self, GdkEventSequence *sequence);
 static void scale_cancel(ComicReaderWindow *self, GdkEventSequence *sequence);
+static void active_changed(ComicReaderWindow *self);
+static void toggle_hud(GSimpleAction *action, GVariant *state, ComicReaderWindow *self);
+static void hud_after_paint(GdkFrameClock *frame_clock, ComicReaderWindow *self);
+static void hud_page_turned(
+	ComicReaderWindow *self,
+	struct ComicReaderImage *image,
+	gint64 start);
+static gboolean hud_refresh(gpointer data);
 static void comicreader_window_dispose(GObject *object);
 
 static void comicreader_window_class_init(ComicReaderWindowClass *klass)
 {
 	g_type_ensure(COMICREADER_TYPE_IMAGEDISPLAY);
+	g_type_ensure(COMICREADER_TYPE_LIBRARYVIEW);
 
 	GObjectClass *object_class = G_OBJECT_CLASS(klass);
 	object_class->dispose = comicreader_window_dispose;
@@ -88,6 +215,12 @@ static void comicreader_window_class_init(ComicReaderWindowClass *klass)
 	gtk_widget_class_bind_template_child(widget_class, ComicReaderWindow, stack);
 	gtk_widget_class_bind_template_child(widget_class, ComicReaderWindow, scrolled_image);
 	gtk_widget_class_bind_template_child(widget_class, ComicReaderWindow, displayed_image);
+	gtk_widget_class_bind_template_child(widget_class, ComicReaderWindow, page_adjustment);
+	gtk_widget_class_bind_template_child(widget_class, ComicReaderWindow, preview_box);
+	gtk_widget_class_bind_template_child(widget_class, ComicReaderWindow, preview_picture);
+	gtk_widget_class_bind_template_child(widget_class, ComicReaderWindow, preview_label);
+	gtk_widget_class_bind_template_child(widget_class, ComicReaderWindow, library_view);
+	gtk_widget_class_bind_template_child(widget_class, ComicReaderWindow, hud_label);
 }
 
 static void comicreader_window_init(ComicReaderWindow *self)
@@ -103,6 +236,13 @@ static void comicreader_window_init(ComicReaderWindow *self)
 		G_CALLBACK(open_directory),
 		self);
 
+	self->open_pdf_action = g_simple_action_new("open-pdf", NULL);
+	g_action_map_add_action(G_ACTION_MAP(self), G_ACTION(self->open_pdf_action));
+	g_signal_connect_swapped(self->open_pdf_action, "activate", G_CALLBACK(open_pdf), self);
+#ifndef HAVE_POPPLER
+	g_simple_action_set_enabled(self->open_pdf_action, FALSE);
+#endif
+
 	self->close_comic_action = g_simple_action_new("close-comic", NULL);
 	g_action_map_add_action(G_ACTION_MAP(self), G_ACTION(self->close_comic_action));
 	g_signal_connect_swapped(
@@ -112,6 +252,33 @@ static void comicreader_window_init(ComicReaderWindow *self)
 		self);
 	g_simple_action_set_enabled(self->close_comic_action, false);
 
+	self->show_library_action = g_simple_action_new("show-library", NULL);
+	g_action_map_add_action(G_ACTION_MAP(self), G_ACTION(self->show_library_action));
+	g_signal_connect_swapped(
+		self->show_library_action,
+		"activate",
+		G_CALLBACK(show_library),
+		self);
+
+	self->add_library_folder_action = g_simple_action_new("add-library-folder", NULL);
+	g_action_map_add_action(G_ACTION_MAP(self), G_ACTION(self->add_library_folder_action));
+	g_signal_connect_swapped(
+		self->add_library_folder_action,
+		"activate",
+		G_CALLBACK(add_library_folder),
+		self);
+
+	self->toggle_hud_action =
+		g_simple_action_new_stateful("toggle-hud", NULL, g_variant_new_boolean(false));
+	g_action_map_add_action(G_ACTION_MAP(self), G_ACTION(self->toggle_hud_action));
+	g_signal_connect(self->toggle_hud_action, "change-state", G_CALLBACK(toggle_hud), self);
+
+	g_signal_connect_swapped(
+		self->library_view,
+		"comic-activated",
+		G_CALLBACK(comic_activated),
+		self);
+
 	self->next_page_action = g_simple_action_new("comic-next-page", NULL);
 	g_action_map_add_action(G_ACTION_MAP(self), G_ACTION(self->next_page_action));
 	g_signal_connect_swapped(self->next_page_action, "activate", G_CALLBACK(next_page), self);
@@ -131,8 +298,40 @@ static void comicreader_window_init(ComicReaderWindow *self)
 	g_signal_connect_swapped(gesture, "cancel", G_CALLBACK(scale_cancel), self);
 	gtk_widget_add_controller(GTK_WIDGET(self->scrolled_image), GTK_EVENT_CONTROLLER(gesture));
 
+	self->page_adjustment_handler = g_signal_connect_swapped(
+		self->page_adjustment,
+		"value-changed",
+		G_CALLBACK(page_adjustment_changed),
+		self);
+
+	g_signal_connect(self, "close-request", G_CALLBACK(close_request), NULL);
+	g_signal_connect(self, "notify::is-active", G_CALLBACK(active_changed), NULL);
+
 	gtk_window_set_title(GTK_WINDOW(self), "Comic Reader");
 	comicreader_window_update_title(self);
+
+	/* low priority idles run after the first frame has been drawn */
+	self->deferred_ui_source = g_idle_add_full(
+		G_PRIORITY_LOW,
+		build_deferred_ui,
+		self,
+		NULL);
+}
+
+static gboolean build_deferred_ui(gpointer data)
+{
+	ComicReaderWindow *self = COMICREADER_WINDOW(data);
+
+	self->deferred_ui_source = 0;
+
+	GtkBuilder *builder = gtk_builder_new_from_resource(
+		"/name/mbekkema/ComicReader/comicreader-help-overlay.ui");
+	GtkShortcutsWindow *help_overlay =
+		GTK_SHORTCUTS_WINDOW(gtk_builder_get_object(builder, "help_overlay"));
+	gtk_application_window_set_help_overlay(GTK_APPLICATION_WINDOW(self), help_overlay);
+	g_clear_object(&builder);
+
+	return G_SOURCE_REMOVE;
 }
 
 static void comicreader_window_update_title(ComicReaderWindow *self)
@@ -204,22 +403,418 @@ static void open_directory_callback(GObject *gobject, GAsyncResult *result, gpoi
 		abort_printf("Error: %i %s\n", error->code, error->message);
 	}
 
-	struct ComicReaderImageLoader *loader = comicreader_directory_image_loader_new(directory);
-	loader = comicreader_background_image_loader_new(loader);
-	set_image_loader(self, loader);
+	ComicReaderApplication *app =
+		COMICREADER_APPLICATION(gtk_window_get_application(GTK_WINDOW(self)));
+	size_t page = 0;
+	struct ComicReaderImageLoader *loader =
+		comicreader_application_load_comic(app, directory, NULL, &page);
+	if (loader)
+		set_image_loader(self, directory, loader, page);
+	g_clear_object(&directory);
+}
+
+static void open_pdf(ComicReaderWindow *self)
+{
+	GtkFileFilter *filter = gtk_file_filter_new();
+	gtk_file_filter_set_name(filter, "PDF Documents");
+	gtk_file_filter_add_mime_type(filter, "application/pdf");
+
+	GtkFileDialog *file_dialog = gtk_file_dialog_new();
+	gtk_file_dialog_set_default_filter(file_dialog, filter);
+	g_object_unref(filter);
+	gtk_file_dialog_open(file_dialog, GTK_WINDOW(self), NULL, open_pdf_callback, self);
+}
+
+static void open_pdf_callback(GObject *gobject, GAsyncResult *result, gpointer data)
+{
+	ComicReaderWindow *self = COMICREADER_WINDOW(data);
+	GtkFileDialog *file_dialog = GTK_FILE_DIALOG(gobject);
+
+	GFile *file = gtk_file_dialog_open_finish(file_dialog, result, NULL);
+	g_clear_object(&file_dialog);
+	if (!file)
+		return;
+
+	ComicReaderApplication *app =
+		COMICREADER_APPLICATION(gtk_window_get_application(GTK_WINDOW(self)));
+	size_t page = 0;
+	struct ComicReaderImageLoader *loader =
+		comicreader_application_load_comic(app, file, NULL, &page);
+	if (loader)
+		set_image_loader(self, file, loader, page);
+	g_clear_object(&file);
+}
+
+static void show_library(ComicReaderWindow *self)
+{
+	ComicReaderApplication *app =
+		COMICREADER_APPLICATION(gtk_window_get_application(GTK_WINDOW(self)));
+	comicreader_libraryview_set_library(
+		self->library_view,
+		comicreader_application_get_library(app));
+
+	set_image_loader(self, NULL, NULL, 0);
+	gtk_stack_set_visible_child_full(
+		self->stack,
+		"library",
+		GTK_STACK_TRANSITION_TYPE_SLIDE_RIGHT);
+}
+
+static void add_library_folder(ComicReaderWindow *self)
+{
+	GtkFileDialog *file_dialog = gtk_file_dialog_new();
+	gtk_file_dialog_select_folder(
+		file_dialog,
+		GTK_WINDOW(self),
+		NULL,
+		add_library_folder_callback,
+		self);
+}
+
+static void add_library_folder_callback(GObject *gobject, GAsyncResult *result, gpointer data)
+{
+	ComicReaderWindow *self = COMICREADER_WINDOW(data);
+	GtkFileDialog *file_dialog = GTK_FILE_DIALOG(gobject);
+
+	GFile *directory = gtk_file_dialog_select_folder_finish(file_dialog, result, NULL);
+	g_clear_object(&file_dialog);
+	if (!directory)
+		return;
+
+	char *path = g_file_get_path(directory);
+	g_clear_object(&directory);
+	if (!path)
+		return;
+
+	/* the application rescans when the roots change */
+	ComicReaderApplication *app =
+		COMICREADER_APPLICATION(gtk_window_get_application(GTK_WINDOW(self)));
+	GSettings *settings = comicreader_application_get_settings(app);
+	char **roots = g_settings_get_strv(settings, "library-roots");
+	if (!g_strv_contains((const char *const *)roots, path)) {
+		GStrvBuilder *builder = g_strv_builder_new();
+		g_strv_builder_addv(builder, (const char **)roots);
+		g_strv_builder_add(builder, path);
+		char **new_roots = g_strv_builder_end(builder);
+		g_settings_set_strv(settings, "library-roots", (const char *const *)new_roots);
+		g_strfreev(new_roots);
+		g_strv_builder_unref(builder);
+	}
+	g_strfreev(roots);
+	g_free(path);
+
+	show_library(self);
+}
+
+static void comic_activated(ComicReaderWindow *self, const char *path)
+{
+	ComicReaderApplication *app =
+		COMICREADER_APPLICATION(gtk_window_get_application(GTK_WINDOW(self)));
+	GFile *directory = g_file_new_for_path(path);
+	size_t page = 0;
+	struct ComicReaderImageLoader *loader =
+		comicreader_application_load_comic(app, directory, NULL, &page);
+	if (loader)
+		set_image_loader(self, directory, loader, page);
+	g_clear_object(&directory);
 }
 
 static void close_comic(ComicReaderWindow *self)
 {
-	set_image_loader(self, NULL);
+	set_image_loader(self, NULL, NULL, 0);
+}
+
+static void active_changed(ComicReaderWindow *self)
+{
+	if (self->image_loader)
+		comicreader_image_loader_set_focused(
+			self->image_loader,
+			gtk_window_is_active(GTK_WINDOW(self)));
+}
+
+/* The HUD hooks into the frame clock only while shown, so it costs
+ * nothing otherwise. */
+static void toggle_hud(GSimpleAction *action, GVariant *state, ComicReaderWindow *self)
+{
+	bool visible = g_variant_get_boolean(state);
+	g_simple_action_set_state(action, state);
+	gtk_widget_set_visible(GTK_WIDGET(self->hud_label), visible);
+
+	GdkFrameClock *frame_clock = gtk_widget_get_frame_clock(GTK_WIDGET(self));
+	if (visible && !self->hud_paint_handler && frame_clock) {
+		self->hud_num_frames = 0;
+		self->hud_last_frame_time = 0;
+		memset(&self->hud_turn, 0, sizeof(self->hud_turn));
+		self->hud_paint_handler = g_signal_connect(
+			frame_clock,
+			"after-paint",
+			G_CALLBACK(hud_after_paint),
+			self);
+		self->hud_refresh_source = g_timeout_add(HUD_REFRESH_MS, hud_refresh, self);
+		hud_refresh(self);
+	} else if (!visible && self->hud_paint_handler) {
+		g_clear_signal_handler(&self->hud_paint_handler, frame_clock);
+		g_clear_handle_id(&self->hud_refresh_source, g_source_remove);
+	}
+}
+
+static void hud_after_paint(GdkFrameClock *frame_clock, ComicReaderWindow *self)
+{
+	gint64 now = g_get_monotonic_time();
+	gint64 frame_time = gdk_frame_clock_get_frame_time(frame_clock);
+
+	size_t slot = self->hud_num_frames++ % HUD_FRAMES;
+	self->hud_frame_costs[slot] = now - frame_time;
+	self->hud_frame_intervals[slot] = 0;
+	if (self->hud_last_frame_time &&
+	    frame_time - self->hud_last_frame_time <= HUD_MAX_FRAME_INTERVAL)
+		self->hud_frame_intervals[slot] = frame_time - self->hud_last_frame_time;
+	self->hud_last_frame_time = frame_time;
+
+	/* the first frame after a page turn shows the new page */
+	struct HudPageTurn *turn = &self->hud_turn;
+	if (turn->loaded && !turn->painted) {
+		turn->painted = now;
+		turn->frame = gdk_frame_clock_get_frame_counter(frame_clock);
+	} else if (turn->painted && !turn->presented) {
+		GdkFrameTimings *timings = gdk_frame_clock_get_timings(frame_clock, turn->frame);
+		if (!timings) {
+			turn->presented = turn->painted;
+		} else if (gdk_frame_timings_get_complete(timings)) {
+			/* not every backend reports when frames reach the screen */
+			turn->presented = gdk_frame_timings_get_presentation_time(timings);
+			if (!turn->presented)
+				turn->presented = turn->painted;
+			hud_refresh(self);
+		}
+	}
+}
+
+static void hud_page_turned(
+	ComicReaderWindow *self,
+	struct ComicReaderImage *image,
+	gint64 start)
+{
+	struct HudPageTurn *turn = &self->hud_turn;
+	memset(turn, 0, sizeof(*turn));
+	turn->start = start;
+	turn->loaded = g_get_monotonic_time();
+	if (image) {
+		turn->read_time = image->read_time;
+		turn->decode_time = image->decode_time;
+	}
+}
+
+static gboolean hud_refresh(gpointer data)
+{
+	ComicReaderWindow *self = COMICREADER_WINDOW(data);
+	GString *text = g_string_new(NULL);
+
+	size_t num_frames = MIN(self->hud_num_frames, HUD_FRAMES);
+	gint64 cost_sum = 0;
+	gint64 cost_max = 0;
+	gint64 interval_sum = 0;
+	size_t num_intervals = 0;
+	for (size_t i = 0; i < num_frames; ++i) {
+		cost_sum += self->hud_frame_costs[i];
+		cost_max = MAX(cost_max, self->hud_frame_costs[i]);
+		if (self->hud_frame_intervals[i]) {
+			interval_sum += self->hud_frame_intervals[i];
+			++num_intervals;
+		}
+	}
+	g_string_append_printf(
+		text,
+		"frame    %5.1f ms avg %5.1f ms max",
+		num_frames ? cost_sum / 1000.0 / num_frames : 0.0,
+		cost_max / 1000.0);
+	if (num_intervals)
+		g_string_append_printf(text, "  %3.0f fps", 1e6 * num_intervals / interval_sum);
+
+	/* latency from input until the page reached the screen, split into
+	 * reading and decoding it, then laying out, snapshotting and
+	 * presenting the frame */
+	struct HudPageTurn *turn = &self->hud_turn;
+	if (turn->presented) {
+		gint64 load_time = turn->loaded - turn->start;
+		gint64 other_time = MAX(0, load_time - turn->read_time - turn->decode_time);
+		g_string_append_printf(
+			text,
+			"\nturn     %5.1f ms\n"
+			"  read   %5.1f ms\n"
+			"  decode %5.1f ms\n"
+			"  other  %5.1f ms\n"
+			"  paint  %5.1f ms\n"
+			"  show   %5.1f ms",
+			(turn->presented - turn->start) / 1000.0,
+			turn->read_time / 1000.0,
+			turn->decode_time / 1000.0,
+			other_time / 1000.0,
+			(turn->painted - turn->loaded) / 1000.0,
+			MAX(0, turn->presented - turn->painted) / 1000.0);
+	}
+
+	struct ComicReaderCacheStats stats;
+	if (self->image_loader && comicreader_image_loader_get_cache_stats(self->image_loader, &stats)) {
+		g_string_append_printf(
+			text,
+			"\npages    %zu/%zu decoded, %zu MiB, %zu/%zu previews\n"
+			"read     %zu/%zu MiB, %zu reading, %zu decoding\n"
+			"packed   %zu pages, %zu/%zu MiB\n"
+			"shared   %zu/%zu MiB",
+			stats.decoded,
+			stats.decoded_capacity,
+			stats.decoded_bytes >> 20,
+			stats.previews,
+			stats.previews_capacity,
+			stats.compressed_bytes >> 20,
+			stats.compressed_budget >> 20,
+			stats.reads_in_flight,
+			stats.decodes_in_flight,
+			stats.packed,
+			stats.packed_bytes >> 20,
+			stats.packed_budget >> 20,
+			stats.shared_bytes >> 20,
+			stats.shared_budget >> 20);
+	}
+
+	gtk_label_set_text(self->hud_label, text->str);
+	g_string_free(text, TRUE);
+
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean close_request(ComicReaderWindow *self)
+{
+	GtkApplication *app = gtk_window_get_application(GTK_WINDOW(self));
+	if (app) {
+		GSettings *settings =
+			comicreader_application_get_settings(COMICREADER_APPLICATION(app));
+		comicreader_window_save_session(self, settings);
+	}
+
+	return FALSE;
+}
+
+void comicreader_window_open_comic(
+	ComicReaderWindow *self,
+	GFile *comic,
+	struct ComicReaderImageLoader *loader,
+	size_t page)
+{
+	set_image_loader(self, comic, loader, page);
+}
+
+GFile *comicreader_window_get_comic(ComicReaderWindow *self)
+{
+	return self->comic;
+}
+
+struct ComicReaderImageLoader *comicreader_window_get_image_loader(ComicReaderWindow *self)
+{
+	return self->image_loader;
+}
+
+size_t comicreader_window_get_page(ComicReaderWindow *self)
+{
+	return self->image_idx;
+}
+
+void comicreader_window_go_to_page(ComicReaderWindow *self, size_t page)
+{
+	if (self->image_loader)
+		jump_to_page(self, page);
+}
+
+void comicreader_window_restore_view(
+	ComicReaderWindow *self,
+	double zoom,
+	double scroll_x,
+	double scroll_y)
+{
+	comicreader_imagedisplay_set_scale(self->displayed_image, CLAMP(zoom, 0.1, 5.0));
+
+	/* the scroll position can only be applied once the page is laid out */
+	cancel_restore_scroll(self);
+	self->restore_scroll_x = scroll_x;
+	self->restore_scroll_y = scroll_y;
+	self->restore_scroll_handler = g_signal_connect_swapped(
+		gtk_scrolled_window_get_vadjustment(self->scrolled_image),
+		"changed",
+		G_CALLBACK(restore_scroll),
+		self);
+}
+
+void comicreader_window_save_session(ComicReaderWindow *self, GSettings *settings)
+{
+	char *uri = NULL;
+	if (self->comic)
+		uri = g_file_get_uri(self->comic);
+
+	GtkAdjustment *hadj = gtk_scrolled_window_get_hadjustment(self->scrolled_image);
+	GtkAdjustment *vadj = gtk_scrolled_window_get_vadjustment(self->scrolled_image);
+
+	g_settings_set_string(settings, "last-comic", uri ? uri : "");
+	g_settings_set_uint(settings, "last-page", self->image_idx);
+	g_settings_set_double(
+		settings,
+		"zoom",
+		comicreader_imagedisplay_get_scale(self->displayed_image));
+	g_settings_set_double(settings, "scroll-x", gtk_adjustment_get_value(hadj));
+	g_settings_set_double(settings, "scroll-y", gtk_adjustment_get_value(vadj));
+
+	g_free(uri);
+}
+
+static void restore_scroll(ComicReaderWindow *self)
+{
+	GtkAdjustment *hadj = gtk_scrolled_window_get_hadjustment(self->scrolled_image);
+	GtkAdjustment *vadj = gtk_scrolled_window_get_vadjustment(self->scrolled_image);
+
+	int height = 0;
+	gtk_widget_get_size_request(GTK_WIDGET(self->displayed_image), NULL, &height);
+	if (gtk_adjustment_get_upper(vadj) < height)
+		return;
+
+	gtk_adjustment_set_value(hadj, self->restore_scroll_x);
+	gtk_adjustment_set_value(vadj, self->restore_scroll_y);
+	cancel_restore_scroll(self);
+}
+
+static void cancel_restore_scroll(ComicReaderWindow *self)
+{
+	if (self->restore_scroll_handler) {
+		g_signal_handler_disconnect(
+			gtk_scrolled_window_get_vadjustment(self->scrolled_image),
+			self->restore_scroll_handler);
+		self->restore_scroll_handler = 0;
+	}
 }
 
-static void set_image_loader(ComicReaderWindow *self, struct ComicReaderImageLoader *loader)
+static void set_image_loader(
+	ComicReaderWindow *self,
+	GFile *comic,
+	struct ComicReaderImageLoader *loader,
+	size_t img_idx)
 {
+	stop_scrubbing(self);
+	cancel_page_turn(self);
+	cancel_restore_scroll(self);
+	clear_next_volume(self);
 	comicreader_image_loader_clear(&self->image_loader);
+	g_clear_object(&self->comic);
 	self->image_loader = loader;
+	if (comic)
+		self->comic = g_object_ref(comic);
+	self->has_jump_origin = false;
+	if (loader) {
+		comicreader_image_loader_set_listener(loader, image_loader_event, self);
+		comicreader_image_loader_set_focused(
+			loader,
+			gtk_window_is_active(GTK_WINDOW(self)));
+	}
 
-	set_image_idx(self, 0);
+	set_image_idx(self, img_idx);
 	comicreader_imagedisplay_set_scale(self->displayed_image, 1);
 	if (loader) {
 		gtk_stack_set_visible_child_full(
@@ -238,31 +833,376 @@ static void set_image_loader(ComicReaderWindow *self, struct ComicReaderImageLoa
 
 static void set_image_idx(ComicReaderWindow *self, size_t img_idx)
 {
+	gint64 start = self->hud_paint_handler ? g_get_monotonic_time() : 0;
+	if (start && self->turn_input_time)
+		start = self->turn_input_time;
+	self->turn_input_time = 0;
+
 	struct ComicReaderImage *image = NULL;
 	if (self->image_loader) {
 		img_idx = img_idx % self->image_loader->get_num_images(self->image_loader);
 		image = self->image_loader->get_image(self->image_loader, img_idx);
 	}
+	if (start)
+		hud_page_turned(self, image, start);
 	comicreader_imagedisplay_set_image(self->displayed_image, image);
 	self->image_idx = img_idx;
 	comicreader_window_update_title(self);
+	sync_page_adjustment(self);
+	prepare_next_volume(self);
+	/* the page is in, background work can have the CPU back */
+	comicreader_qos_set_interacting(false);
 }
 
 static void next_page(ComicReaderWindow *self)
 {
-	set_image_idx(self, self->image_idx + 1);
+	turn_page(self, true);
 }
 
 static void prev_page(ComicReaderWindow *self)
 {
+	turn_page(self, false);
+}
+
+/* Page turns only take effect on the next frame, so that however many
+ * arrive in between cost at most one page load. */
+static void turn_page(ComicReaderWindow *self, bool forward)
+{
+	if (!self->image_loader)
+		return;
+	size_t num_images = self->image_loader->get_num_images(self->image_loader);
+	if (num_images == 0)
+		return;
+
+	/* continue from the page being previewed, if any */
 	size_t idx = self->image_idx;
-	if (idx == 0) {
-		idx = self->image_loader->get_num_images(self->image_loader) - 1;
-	} else {
-		--idx;
+	if (self->turn_tick)
+		idx = self->turn_idx;
+	else if (self->scrub_settle_source)
+		idx = self->scrub_idx;
+
+	/* in series mode the last page leads on to the next volume, or
+	 * stays put until it's loaded */
+	if (forward && idx == num_images - 1 && series_mode_enabled(self)) {
+		if (!open_next_volume(self)) {
+			self->next_volume_wanted = true;
+			prepare_next_volume(self);
+		}
+		return;
+	}
+	self->next_volume_wanted = false;
+
+	if (forward)
+		idx = (idx + 1) % num_images;
+	else
+		idx = (idx == 0 ? num_images : idx) - 1;
+	self->turn_idx = idx;
+	comicreader_qos_set_interacting(true);
+
+	if (!self->turn_tick) {
+		if (self->hud_paint_handler)
+			self->turn_input_time = g_get_monotonic_time();
+		self->turn_tick = gtk_widget_add_tick_callback(GTK_WIDGET(self), turn_tick, NULL, NULL);
+	}
+}
+
+static gboolean turn_tick(GtkWidget *widget, GdkFrameClock *frame_clock, gpointer data)
+{
+	ComicReaderWindow *self = COMICREADER_WINDOW(widget);
+
+	self->turn_tick = 0;
+	gint64 now = gdk_frame_clock_get_frame_time(frame_clock);
+	bool repeating = now - self->last_turn_time < TURN_REPEAT_US;
+	self->last_turn_time = now;
+
+	if (!repeating && !self->scrub_settle_source) {
+		set_image_idx(self, self->turn_idx);
+		return G_SOURCE_REMOVE;
+	}
+
+	/* the skipped pages are never requested, so the loader can drop any
+	 * decodes it queued for them once the page is finally loaded */
+	self->turn_input_time = 0;
+	self->scrub_idx = self->turn_idx;
+	update_preview(self);
+	g_clear_handle_id(&self->scrub_settle_source, g_source_remove);
+	self->scrub_settle_source = g_timeout_add(TURN_SETTLE_MS, turn_settled, self);
+
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean turn_settled(gpointer data)
+{
+	ComicReaderWindow *self = COMICREADER_WINDOW(data);
+
+	self->scrub_settle_source = 0;
+	stop_scrubbing(self);
+	set_image_idx(self, self->scrub_idx);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void cancel_page_turn(ComicReaderWindow *self)
+{
+	if (self->turn_tick) {
+		gtk_widget_remove_tick_callback(GTK_WIDGET(self), self->turn_tick);
+		self->turn_tick = 0;
+	}
+	self->turn_input_time = 0;
+}
+
+static bool series_mode_enabled(ComicReaderWindow *self)
+{
+	GtkApplication *app = gtk_window_get_application(GTK_WINDOW(self));
+	if (!app)
+		return false;
+
+	GSettings *settings = comicreader_application_get_settings(COMICREADER_APPLICATION(app));
+	return g_settings_get_boolean(settings, "series-mode");
+}
+
+/* Near the end of a volume, looks for the next one and loads it like any
+ * other comic, so its first pages are decoded by the time they're needed.
+ * Its loader isn't focused, so it only decodes when this one is idle. */
+static void prepare_next_volume(ComicReaderWindow *self)
+{
+	if (!self->comic || !self->image_loader || self->next_volume_searched)
+		return;
+	size_t num_images = self->image_loader->get_num_images(self->image_loader);
+	if (self->image_idx + SERIES_LOOKAHEAD < num_images || !series_mode_enabled(self))
+		return;
+
+	self->next_volume_searched = true;
+	self->next_volume_cancellable = g_cancellable_new();
+	comicreader_series_find_next_async(
+		self->comic,
+		self->next_volume_cancellable,
+		next_volume_found,
+		self);
+}
+
+static void next_volume_found(GObject *source_object, GAsyncResult *result, gpointer data)
+{
+	GError *error = NULL;
+	GFile *next = comicreader_series_find_next_finish(result, &error);
+	if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		/* the window may be gone */
+		g_error_free(error);
+		return;
+	}
+
+	ComicReaderWindow *self = COMICREADER_WINDOW(data);
+	if (error) {
+		debug_printf("cannot find next volume: %s\n", error->message);
+		g_error_free(error);
+	}
+	GtkApplication *app = gtk_window_get_application(GTK_WINDOW(self));
+	if (!next || !app) {
+		g_clear_object(&self->next_volume_cancellable);
+		g_clear_object(&next);
+		return;
+	}
+
+	/* listing a large volume takes a while, keep it off this thread */
+	self->next_volume = next;
+	comicreader_application_load_comic_async(
+		COMICREADER_APPLICATION(app),
+		next,
+		self->next_volume_cancellable,
+		next_volume_loaded,
+		self);
+}
+
+static void next_volume_loaded(GObject *source_object, GAsyncResult *result, gpointer data)
+{
+	GError *error = NULL;
+	struct ComicReaderImageLoader *loader = comicreader_application_load_comic_finish(
+		COMICREADER_APPLICATION(source_object),
+		result,
+		&error);
+	if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		/* the window may be gone */
+		g_error_free(error);
+		return;
+	}
+
+	ComicReaderWindow *self = COMICREADER_WINDOW(data);
+	g_clear_object(&self->next_volume_cancellable);
+	if (!loader) {
+		/* a volume that can't be opened ends the series */
+		debug_printf("cannot load next volume: %s\n", error->message);
+		g_error_free(error);
+		g_clear_object(&self->next_volume);
+		return;
 	}
+	self->next_volume_loader = loader;
+
+	/* the reader got to the end while it was loading */
+	size_t num_images = self->image_loader->get_num_images(self->image_loader);
+	if (self->next_volume_wanted && self->image_idx == num_images - 1 && !self->turn_tick &&
+	    !self->scrub_settle_source)
+		open_next_volume(self);
+}
+
+static bool open_next_volume(ComicReaderWindow *self)
+{
+	if (!self->next_volume_loader)
+		return false;
+
+	GFile *comic = self->next_volume;
+	struct ComicReaderImageLoader *loader = self->next_volume_loader;
+	self->next_volume = NULL;
+	self->next_volume_loader = NULL;
+	set_image_loader(self, comic, loader, 0);
+	g_object_unref(comic);
+
+	return true;
+}
+
+static void clear_next_volume(ComicReaderWindow *self)
+{
+	if (self->next_volume_cancellable) {
+		g_cancellable_cancel(self->next_volume_cancellable);
+		g_clear_object(&self->next_volume_cancellable);
+	}
+	comicreader_image_loader_clear(&self->next_volume_loader);
+	g_clear_object(&self->next_volume);
+	self->next_volume_searched = false;
+	self->next_volume_wanted = false;
+}
+
+static void jump_to_page(ComicReaderWindow *self, size_t img_idx)
+{
+	if (img_idx == self->image_idx)
+		return;
+
+	/* keep the page we came from cached so jumping back is instant */
+	if (self->has_jump_origin)
+		comicreader_image_loader_set_pinned(self->image_loader, self->jump_origin, false);
+	self->jump_origin = self->image_idx;
+	self->has_jump_origin = true;
+	comicreader_image_loader_set_pinned(self->image_loader, self->jump_origin, true);
+
+	set_image_idx(self, img_idx);
+}
+
+static void sync_page_adjustment(ComicReaderWindow *self)
+{
+	size_t num_images = 1;
+	if (self->image_loader)
+		num_images = self->image_loader->get_num_images(self->image_loader);
+
+	g_signal_handler_block(self->page_adjustment, self->page_adjustment_handler);
+	gtk_adjustment_set_upper(self->page_adjustment, MAX(1, num_images));
+	gtk_adjustment_set_value(self->page_adjustment, self->image_idx + 1);
+	g_signal_handler_unblock(self->page_adjustment, self->page_adjustment_handler);
+}
+
+static void page_adjustment_changed(ComicReaderWindow *self)
+{
+	if (!self->image_loader)
+		return;
 
-	set_image_idx(self, idx);
+	double value = round(gtk_adjustment_get_value(self->page_adjustment));
+	self->scrub_idx = (size_t)fmax(1, value) - 1;
+	comicreader_qos_set_interacting(true);
+	update_preview(self);
+
+	/* only load the full page once the user settles on it */
+	g_clear_handle_id(&self->scrub_settle_source, g_source_remove);
+	self->scrub_settle_source = g_timeout_add(SCRUB_SETTLE_MS, scrub_settled, self);
+}
+
+static void update_preview(ComicReaderWindow *self)
+{
+	struct ComicReaderImage *preview =
+		comicreader_image_loader_get_preview(self->image_loader, self->scrub_idx);
+	GdkPaintable *paintable = NULL;
+	if (preview && preview->texture)
+		paintable = GDK_PAINTABLE(preview->texture);
+	gtk_picture_set_paintable(self->preview_picture, paintable);
+	comicreader_image_clear(&preview);
+
+	char label[64];
+	snprintf(
+		label,
+		sizeof(label) / sizeof(label[0]),
+		"Page %zu of %zu",
+		self->scrub_idx + 1,
+		self->image_loader->get_num_images(self->image_loader));
+	gtk_label_set_text(self->preview_label, label);
+	gtk_widget_set_visible(self->preview_box, true);
+}
+
+static gboolean scrub_settled(gpointer data)
+{
+	ComicReaderWindow *self = COMICREADER_WINDOW(data);
+
+	self->scrub_settle_source = 0;
+	stop_scrubbing(self);
+	jump_to_page(self, self->scrub_idx);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void stop_scrubbing(ComicReaderWindow *self)
+{
+	g_clear_handle_id(&self->scrub_settle_source, g_source_remove);
+	gtk_widget_set_visible(self->preview_box, false);
+	gtk_picture_set_paintable(self->preview_picture, NULL);
+}
+
+static void image_loader_event(
+	void *user_data,
+	enum ComicReaderImageLoaderEvent event,
+	size_t index)
+{
+	ComicReaderWindow *self = COMICREADER_WINDOW(user_data);
+
+	switch (event) {
+	case COMICREADER_IMAGE_LOADER_PREVIEW_READY:
+		if (self->scrub_settle_source && index == self->scrub_idx)
+			update_preview(self);
+		break;
+	case COMICREADER_IMAGE_LOADER_IMAGE_INSERTED:
+	case COMICREADER_IMAGE_LOADER_IMAGE_REMOVED:
+		images_moved(self, event, index);
+		break;
+	case COMICREADER_IMAGE_LOADER_IMAGE_CHANGED:
+		if (index == self->image_idx)
+			set_image_idx(self, self->image_idx);
+		break;
+	case COMICREADER_IMAGE_LOADER_ALL_CHANGED:
+		set_image_idx(self, self->image_idx);
+		break;
+	default:
+		break;
+	}
+}
+
+static void images_moved(
+	ComicReaderWindow *self,
+	enum ComicReaderImageLoaderEvent event,
+	size_t index)
+{
+	if (self->image_loader->get_num_images(self->image_loader) == 0) {
+		close_comic(self);
+		return;
+	}
+
+	if (self->has_jump_origin)
+		self->has_jump_origin =
+			comicreader_image_loader_update_index(event, index, &self->jump_origin);
+	comicreader_image_loader_update_index(event, index, &self->scrub_idx);
+	comicreader_image_loader_update_index(event, index, &self->turn_idx);
+
+	/* the displayed page keeps its texture unless it was the one removed */
+	if (comicreader_image_loader_update_index(event, index, &self->image_idx)) {
+		comicreader_window_update_title(self);
+		sync_page_adjustment(self);
+	} else {
+		set_image_idx(self, self->image_idx);
+	}
 }
 
 static void scale_begin(GtkGesture *gesture, GdkEventSequence *sequence, ComicReaderWindow *self)
@@ -333,10 +1273,26 @@ static void comicreader_window_dispose(GObject *object)
 	ComicReaderWindow *self = COMICREADER_WINDOW(object);
 
 	g_clear_object(&self->open_directory_action);
+	g_clear_object(&self->open_pdf_action);
 	g_clear_object(&self->close_comic_action);
+	g_clear_object(&self->show_library_action);
+	g_clear_object(&self->add_library_folder_action);
+	g_clear_object(&self->toggle_hud_action);
+	GdkFrameClock *frame_clock = gtk_widget_get_frame_clock(GTK_WIDGET(self));
+	if (frame_clock)
+		g_clear_signal_handler(&self->hud_paint_handler, frame_clock);
+	g_clear_handle_id(&self->hud_refresh_source, g_source_remove);
 	g_clear_object(&self->prev_page_action);
 	g_clear_object(&self->next_page_action);
+	if (self->scrub_settle_source || self->turn_tick)
+		comicreader_qos_set_interacting(false);
+	g_clear_handle_id(&self->scrub_settle_source, g_source_remove);
+	cancel_page_turn(self);
+	clear_next_volume(self);
+	g_clear_handle_id(&self->deferred_ui_source, g_source_remove);
+	cancel_restore_scroll(self);
 	comicreader_image_loader_clear(&self->image_loader);
+	g_clear_object(&self->comic);
 
 	debug_free("ComicReaderWindow", self);
 	G_OBJECT_CLASS(comicreader_window_parent_class)->dispose(object);
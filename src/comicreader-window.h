@@ -22,6 +22,8 @@
 
 #include <adwaita.h>
 
+#include "comicreader-imageloader.h"
+
 G_BEGIN_DECLS
 
 #define COMICREADER_TYPE_WINDOW (comicreader_window_get_type())
@@ -33,4 +35,21 @@ G_DECLARE_FINAL_TYPE(
 	WINDOW,
 	AdwApplicationWindow)
 
+void comicreader_window_open_comic(
+	ComicReaderWindow *self,
+	GFile *comic,
+	struct ComicReaderImageLoader *loader,
+	size_t page);
+GFile *comicreader_window_get_comic(ComicReaderWindow *self);
+struct ComicReaderImageLoader *comicreader_window_get_image_loader(ComicReaderWindow *self);
+/* the index of the page being shown */
+size_t comicreader_window_get_page(ComicReaderWindow *self);
+void comicreader_window_go_to_page(ComicReaderWindow *self, size_t page);
+void comicreader_window_restore_view(
+	ComicReaderWindow *self,
+	double zoom,
+	double scroll_x,
+	double scroll_y);
+void comicreader_window_save_session(ComicReaderWindow *self, GSettings *settings);
+
 G_END_DECLS
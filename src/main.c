@@ -33,7 +33,7 @@ int main(int argc, char *argv[])
 	bind_textdomain_codeset(GETTEXT_PACKAGE, "UTF-8");
 	textdomain(GETTEXT_PACKAGE);
 
-	app = comicreader_application_new("name.mbekkema.ComicReader", G_APPLICATION_DEFAULT_FLAGS);
+	app = comicreader_application_new("name.mbekkema.ComicReader", G_APPLICATION_HANDLES_OPEN);
 	ret = g_application_run(G_APPLICATION(app), argc, argv);
 
 	return ret;
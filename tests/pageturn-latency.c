@@ -0,0 +1,365 @@
+/* pageturn-latency.c
+ *
+ * Copyright 2024 Matthew Harm Bekkema
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* Opens a generated comic in a ComicReaderWindow on a broadway display,
+ * turns pages through its actions in a few patterns, and fails if the 95th
+ * percentile time from an action to the first frame painted with its page
+ * is over the limit.  Takes the path of gtk4-broadwayd. */
+
+#include "comicreader-application.h"
+#include "comicreader-window.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* what meson counts as a skipped test */
+#define EXIT_SKIP 77
+
+#define NUM_PAGES 30
+#define PAGE_WIDTH 1200
+#define PAGE_HEIGHT 1800
+/* longer than the window takes a turn to be part of a quick succession,
+ * so that every turn loads its page rather than previewing it */
+#define TURN_GAP_MS 250
+/* for the first page and its neighbours to load */
+#define SETTLE_MS 1000
+#define TIMEOUT_US (10 * G_USEC_PER_SEC)
+/* overridden by COMICREADER_MAX_P95_MS */
+#define DEFAULT_MAX_P95_MS 100
+#define BROADWAY_PORT_BASE 18080
+
+struct Measurement {
+	ComicReaderWindow *window;
+	/* the page the turn in progress ends on, and when it was asked for */
+	size_t expected;
+	gint64 start;
+	bool waiting;
+	/* microseconds, one per turn */
+	GArray *latencies;
+};
+
+static bool start_broadway(const char *broadwayd, GPid *pid);
+static int run_test(ComicReaderApplication *app, GFile *comic);
+static GFile *make_comic(void);
+static void delete_comic(GFile *comic);
+static gboolean wake_up(gpointer data);
+static bool wait_until(bool (*done)(void *data), void *data, gint64 timeout);
+static bool is_mapped(void *data);
+static bool turn_done(void *data);
+static bool never(void *data);
+static void after_paint(GdkFrameClock *frame_clock, gpointer data);
+static bool turn(struct Measurement *m, bool forward, int times);
+static int compare_latencies(const void *a, const void *b);
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s GTK4-BROADWAYD\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	GPid broadway_pid;
+	if (!start_broadway(argv[1], &broadway_pid))
+		return EXIT_SKIP;
+
+	GFile *comic = make_comic();
+	ComicReaderApplication *app = comicreader_application_new(
+		"name.mbekkema.ComicReader.PageTurnLatency",
+		G_APPLICATION_NON_UNIQUE | G_APPLICATION_HANDLES_OPEN);
+	int ret = run_test(app, comic);
+
+	g_object_unref(app);
+	delete_comic(comic);
+	g_object_unref(comic);
+	kill(broadway_pid, SIGTERM);
+	g_spawn_close_pid(broadway_pid);
+	return ret;
+}
+
+static int run_test(ComicReaderApplication *app, GFile *comic)
+{
+	GError *error = NULL;
+	if (!g_application_register(G_APPLICATION(app), NULL, &error)) {
+		fprintf(stderr, "cannot register: %s\n", error->message);
+		g_error_free(error);
+		return EXIT_FAILURE;
+	}
+
+	/* opens it in a new window, like the command line would */
+	g_application_open(G_APPLICATION(app), &comic, 1, "");
+	GtkWindow *window = gtk_application_get_active_window(GTK_APPLICATION(app));
+	if (!window || !COMICREADER_IS_WINDOW(window)) {
+		fprintf(stderr, "no window was opened\n");
+		return EXIT_FAILURE;
+	}
+	if (!wait_until(is_mapped, window, TIMEOUT_US)) {
+		fprintf(stderr, "the window was never shown\n");
+		gtk_window_destroy(window);
+		return EXIT_FAILURE;
+	}
+	wait_until(never, NULL, SETTLE_MS * 1000);
+
+	struct Measurement m = {
+		.window = COMICREADER_WINDOW(window),
+		.latencies = g_array_new(FALSE, FALSE, sizeof(gint64)),
+	};
+	GdkFrameClock *frame_clock = gtk_widget_get_frame_clock(GTK_WIDGET(window));
+	gulong handler = g_signal_connect(frame_clock, "after-paint", G_CALLBACK(after_paint), &m);
+
+	/* reading forwards, going back, flicking between two pages, and
+	 * several presses within one frame */
+	bool ok = true;
+	for (int i = 0; ok && i < 12; ++i)
+		ok = turn(&m, true, 1);
+	for (int i = 0; ok && i < 8; ++i)
+		ok = turn(&m, false, 1);
+	for (int i = 0; ok && i < 10; ++i)
+		ok = turn(&m, i % 2 == 0, 1);
+	for (int i = 0; ok && i < 6; ++i)
+		ok = turn(&m, true, 3);
+	g_signal_handler_disconnect(frame_clock, handler);
+
+	int ret = EXIT_FAILURE;
+	if (ok) {
+		gint64 *latencies = (gint64 *)m.latencies->data;
+		size_t n = m.latencies->len;
+		qsort(latencies, n, sizeof(gint64), compare_latencies);
+		gint64 p95 = latencies[(n * 95 + 99) / 100 - 1];
+		const char *max_env = g_getenv("COMICREADER_MAX_P95_MS");
+		gint64 max_p95 = max_env ? g_ascii_strtoll(max_env, NULL, 10) : DEFAULT_MAX_P95_MS;
+
+		printf(
+			"%zu page turns: median %.1f ms, 95th percentile %.1f ms, "
+			"slowest %.1f ms\n",
+			n,
+			latencies[n / 2] / 1000.0,
+			p95 / 1000.0,
+			latencies[n - 1] / 1000.0);
+		if (p95 <= max_p95 * 1000) {
+			ret = EXIT_SUCCESS;
+		} else {
+			fprintf(
+				stderr,
+				"95th percentile is over the limit of %" G_GINT64_FORMAT " ms\n",
+				max_p95);
+		}
+	}
+	g_array_unref(m.latencies);
+
+	gtk_window_destroy(window);
+	return ret;
+}
+
+/* Starts a broadway server of our own and points GDK at it. */
+static bool start_broadway(const char *broadwayd, GPid *pid)
+{
+	int display = 50 + getpid() % 50;
+	char *display_name = g_strdup_printf(":%i", display);
+	char *port = g_strdup_printf("%i", BROADWAY_PORT_BASE + display);
+	const char *argv[] = {broadwayd, "--port", port, display_name, NULL};
+
+	GError *error = NULL;
+	bool ret = g_spawn_async(
+		NULL,
+		(char **)argv,
+		NULL,
+		G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_STDOUT_TO_DEV_NULL,
+		NULL,
+		NULL,
+		pid,
+		&error);
+	if (!ret) {
+		fprintf(stderr, "cannot start %s: %s\n", broadwayd, error->message);
+		g_error_free(error);
+		g_free(port);
+		g_free(display_name);
+		return false;
+	}
+
+	/* it opens its client socket before it listens on the port */
+	GSocketClient *client = g_socket_client_new();
+	gint64 deadline = g_get_monotonic_time() + TIMEOUT_US;
+	ret = false;
+	while (!ret && g_get_monotonic_time() < deadline) {
+		GSocketConnection *connection = g_socket_client_connect_to_host(
+			client,
+			"127.0.0.1",
+			BROADWAY_PORT_BASE + display,
+			NULL,
+			NULL);
+		if (connection) {
+			g_object_unref(connection);
+			ret = true;
+		} else {
+			g_usleep(50 * 1000);
+		}
+	}
+	g_object_unref(client);
+
+	g_setenv("GDK_BACKEND", "broadway", TRUE);
+	g_setenv("BROADWAY_DISPLAY", display_name, TRUE);
+	if (!ret || !gtk_init_check()) {
+		fprintf(stderr, "cannot connect to %s\n", broadwayd);
+		kill(*pid, SIGTERM);
+		g_spawn_close_pid(*pid);
+		ret = false;
+	}
+
+	g_free(port);
+	g_free(display_name);
+	return ret;
+}
+
+/* A directory of PNG pages that each look different, so that no two decode
+ * to the same thing. */
+static GFile *make_comic(void)
+{
+	char *path = g_dir_make_tmp("comicreader-latency-XXXXXX", NULL);
+	g_assert(path);
+
+	size_t stride = PAGE_WIDTH * 3;
+	guchar *pixels = g_malloc(stride * PAGE_HEIGHT);
+	for (int page = 0; page < NUM_PAGES; ++page) {
+		for (int y = 0; y < PAGE_HEIGHT; ++y) {
+			guchar *row = pixels + y * stride;
+			for (int x = 0; x < PAGE_WIDTH; ++x) {
+				bool ink = ((x / (8 + page)) ^ (y / (12 + page))) & 1;
+				row[x * 3] = ink ? 20 : 240 - page;
+				row[x * 3 + 1] = ink ? 20 : 230 - (x * 16 / PAGE_WIDTH);
+				row[x * 3 + 2] = ink ? 20 : 220 - (y * 16 / PAGE_HEIGHT);
+			}
+		}
+		GBytes *bytes = g_bytes_new(pixels, stride * PAGE_HEIGHT);
+		GdkTexture *texture = gdk_memory_texture_new(
+			PAGE_WIDTH,
+			PAGE_HEIGHT,
+			GDK_MEMORY_R8G8B8,
+			bytes,
+			stride);
+		g_bytes_unref(bytes);
+
+		char name[32];
+		snprintf(name, sizeof(name), "page%02i.png", page + 1);
+		char *filename = g_build_filename(path, name, NULL);
+		g_assert(gdk_texture_save_to_png(texture, filename));
+		g_free(filename);
+		g_object_unref(texture);
+	}
+	g_free(pixels);
+
+	GFile *ret = g_file_new_for_path(path);
+	g_free(path);
+	return ret;
+}
+
+static void delete_comic(GFile *comic)
+{
+	GFileEnumerator *direnum =
+		g_file_enumerate_children(comic, G_FILE_ATTRIBUTE_STANDARD_NAME, 0, NULL, NULL);
+	if (direnum) {
+		GFile *child;
+		while (g_file_enumerator_iterate(direnum, NULL, &child, NULL, NULL) && child)
+			g_file_delete(child, NULL, NULL);
+		g_object_unref(direnum);
+	}
+	g_file_delete(comic, NULL, NULL);
+}
+
+static gboolean wake_up(gpointer data)
+{
+	return G_SOURCE_CONTINUE;
+}
+
+/* Runs the main loop until done returns true, or timeout microseconds have
+ * passed, in which case it returns false. */
+static bool wait_until(bool (*done)(void *data), void *data, gint64 timeout)
+{
+	gint64 deadline = g_get_monotonic_time() + timeout;
+	guint source = g_timeout_add(10, wake_up, NULL);
+	bool ret;
+	while (!(ret = done(data)) && g_get_monotonic_time() < deadline)
+		g_main_context_iteration(NULL, TRUE);
+	g_source_remove(source);
+	return ret;
+}
+
+static bool is_mapped(void *data)
+{
+	return gtk_widget_get_mapped(GTK_WIDGET(data));
+}
+
+static bool turn_done(void *data)
+{
+	struct Measurement *m = data;
+	return !m->waiting;
+}
+
+static bool never(void *data)
+{
+	return false;
+}
+
+/* the page is on screen once a frame has been painted with it */
+static void after_paint(GdkFrameClock *frame_clock, gpointer data)
+{
+	struct Measurement *m = data;
+	if (!m->waiting || comicreader_window_get_page(m->window) != m->expected)
+		return;
+
+	gint64 latency = g_get_monotonic_time() - m->start;
+	g_array_append_val(m->latencies, latency);
+	m->waiting = false;
+}
+
+/* Activates the next or previous page action times times in a row, waits
+ * for the page they lead to, then leaves a gap before the next turn. */
+static bool turn(struct Measurement *m, bool forward, int times)
+{
+	size_t page = comicreader_window_get_page(m->window);
+	if (forward)
+		m->expected = (page + times) % NUM_PAGES;
+	else
+		m->expected = (page + NUM_PAGES - times) % NUM_PAGES;
+
+	m->start = g_get_monotonic_time();
+	m->waiting = true;
+	for (int i = 0; i < times; ++i) {
+		g_action_group_activate_action(
+			G_ACTION_GROUP(m->window),
+			forward ? "comic-next-page" : "comic-prev-page",
+			NULL);
+	}
+
+	if (!wait_until(turn_done, m, TIMEOUT_US)) {
+		fprintf(stderr, "page %zu was never shown\n", m->expected + 1);
+		return false;
+	}
+	wait_until(never, NULL, TURN_GAP_MS * 1000);
+	return true;
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+	gint64 latency_a = *(const gint64 *)a;
+	gint64 latency_b = *(const gint64 *)b;
+	return (latency_a > latency_b) - (latency_a < latency_b);
+}